@@ -0,0 +1,31 @@
+/* batch.h - many images through one pipeline, reading ahead of the workers */
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stddef.h> /* for size_t */
+
+/* threads reading images ahead of the workers, when 0 is asked for */
+#define BATCH_READERS 2
+
+/* frames of image buffers in flight for each worker */
+#define BATCH_FRAMES 2
+
+/* totals of a batch_run */
+struct batch_stats {
+    size_t nimages;     /* written */
+    size_t nfailed;     /* not read, run or written */
+    size_t bytes;       /* of pixels read, as image32_t buffers */
+    double seconds;     /* wall clock, from the first read to the last write */
+    double occupancy[3]; /* busy share of the read, compute and write threads */
+};
+
+/* forward declaration */
+struct pipeline;
+
+/* function prototypes */
+int batch_run(const struct pipeline *pipe, const char *list,
+                const char *outdir, size_t nreaders, size_t nworkers,
+                struct batch_stats *stats);
+void batch_print_stats(const struct batch_stats *stats);
+
+#endif
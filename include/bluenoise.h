@@ -0,0 +1,25 @@
+/* bluenoise.h - a tileable void-and-cluster threshold texture */
+#ifndef BLUENOISE_H
+#define BLUENOISE_H
+
+#include <stddef.h> /* for size_t */
+#include <inttypes.h> /* for uint16_t */
+
+/* side of the texture, its ranks are 0 .. BLUENOISE_SIZE - 1 */
+#define BLUENOISE_DIM 64
+#define BLUENOISE_SIZE (BLUENOISE_DIM * BLUENOISE_DIM)
+
+/* directory of the cache, named after the program, in $XDG_CACHE_HOME or
+ * ~/.cache */
+#define BLUENOISE_CACHEDIR "sadx64"
+
+/* file name of the cached texture, in BLUENOISE_CACHEDIR */
+#define BLUENOISE_CACHE "bluenoise-64.bin"
+
+/* function prototypes */
+const uint16_t *bluenoise_texture(void);
+void bluenoise_generate(uint16_t *ranks);
+int bluenoise_load(const char *path, uint16_t *ranks);
+int bluenoise_save(const char *path, const uint16_t *ranks);
+
+#endif
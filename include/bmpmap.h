@@ -0,0 +1,71 @@
+/* bmpmap.h - read only, memory mapped bmp files */
+#ifndef BMPMAP_H
+#define BMPMAP_H
+
+#include <stddef.h> /* for size_t */
+#include <inttypes.h> /* for uint8_t */
+#include <stdio.h> /* for FILE */
+
+/* compression types of the info header */
+#define BMP_RGB 0
+#define BMP_BITFIELDS 3
+#define BMP_ALPHABITFIELDS 6
+
+/* forward declarations */
+struct image;
+struct image32_t;
+
+/**
+ * A bmp file mapped into memory, its headers checked and parsed in place.
+ * The pixel array is a view into the mapping: rows of rowbytes bytes,
+ * stride bytes apart, in file order, which is the bottom row first unless
+ * the file is top-down.
+ * 8 bit pixels index the palette, 16 and 32 bit ones are split by masks
+ * (the defaults of BMP_RGB if the file gives none) and 24 bit ones are
+ * b, g, r bytes. Decoding gives b, g, r bytes whatever the file holds.
+ * NOTE: include bmp.h first, for the header structs
+ */
+struct bmp_map {
+    const uint8_t *data;    /* the whole file */
+    size_t size;
+    struct bmp_fheader bfh;
+    struct bmp_iheader bih;
+    const uint8_t *pixels;  /* the first row of the pixel array */
+    size_t width;           /* in pixels */
+    size_t height;          /* in rows */
+    size_t rowbytes;        /* bytes of pixels in a row */
+    size_t stride;          /* bytes from a row to the next, a multiple of 4 */
+    size_t stride32;        /* the w of an image32_t of it, 3 bytes a pixel */
+    unsigned bpp;           /* 8, 16, 24 or 32 */
+    int topdown;            /* the file holds the top row first */
+    uint32_t masks[3];      /* of r, g and b */
+    unsigned shifts[3];     /* of the lowest bit of each mask */
+    unsigned bits[3];       /* set in each mask, at most 8 are kept */
+    uint8_t palette[256][3]; /* b, g, r of each index, black if unused */
+};
+
+/**
+ * returns the pixels of row y, counting from the bottom of the image
+ * whatever the order of the file
+ */
+static inline const uint8_t *
+bmp_map_row(const struct bmp_map *map, size_t y)
+{
+    if (map->topdown)
+        y = map->height - 1 - y;
+    return map->pixels + y * map->stride;
+}
+
+/* function prototypes */
+int bmp_map_open(struct bmp_map *map, const char *path);
+int bmp_map_wrap(struct bmp_map *map, const uint8_t *data, size_t size);
+int bmp_map_read(struct bmp_map *map, FILE *in, uint8_t *buf, size_t have,
+                size_t cap);
+void bmp_map_close(struct bmp_map *map);
+void bmp_map_decode_row(const struct bmp_map *map, size_t y, uint8_t *dest);
+int bmp_map_decode(const struct bmp_map *map, struct image *dest);
+int bmp_map_to32(const struct bmp_map *map, struct image32_t *dest);
+int bmp_map_rows_to32(const struct bmp_map *map, size_t y,
+                struct image32_t *dest);
+
+#endif
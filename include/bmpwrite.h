@@ -0,0 +1,27 @@
+/* bmpwrite.h - bmp files written from images, their headers synthesised */
+#ifndef BMPWRITE_H
+#define BMPWRITE_H
+
+#include <stddef.h> /* for size_t */
+#include <inttypes.h> /* for uint8_t, uint32_t */
+
+/* bytes of the headers of a plain 24 bit bmp, file and info header */
+#define BMP_HEADER_SIZE 54
+
+/* pixels per metre the headers give when nothing else is known, 72 dpi */
+#define BMP_DEFAULT_PPM 2835
+
+/* forward declarations */
+struct image;
+struct image32_t;
+
+/* function prototypes */
+int bmp_header(uint8_t *header, size_t width, size_t height, int topdown,
+                uint32_t xppm, uint32_t yppm);
+int bmp_write(const char *path, const struct image *image);
+int bmp_write32(const char *path, const uint8_t *header, size_t size,
+                const struct image32_t *image, size_t width);
+void bmp_row_from32(uint8_t *dest, const uint8_t *row, size_t w,
+                size_t width);
+
+#endif
@@ -0,0 +1,42 @@
+/* convolve.h - separable blurs and gradients of images and frames */
+#ifndef CONVOLVE_H
+#define CONVOLVE_H
+
+#include <stddef.h> /* for size_t */
+#include <inttypes.h> /* for uint8_t */
+
+/* largest radius of a blur, a Gaussian reaches 3 sigma */
+#define CONVOLVE_MAXRADIUS 127
+
+/* bytes of intermediate rows a band works on, about one L2 cache */
+#define CONVOLVE_BAND_BYTES (256 * 1024)
+
+/* the argument of box_blur_band */
+struct box_rows {
+    size_t width;   /* in pixels */
+    size_t radius;
+};
+
+/* forward declarations */
+struct image32_t;
+struct saru_bytemat;
+struct workpool;
+
+/* function prototypes */
+int box_blur32(struct image32_t *dest, const struct image32_t *src,
+                size_t width, size_t radius, struct workpool *pool);
+int gaussian_blur32(struct image32_t *dest, const struct image32_t *src,
+                size_t width, double sigma, struct workpool *pool);
+int sobel32(struct image32_t *dest, const struct image32_t *src,
+                size_t width, struct workpool *pool);
+int box_blur_frame(struct saru_bytemat *dest, const struct saru_bytemat *src,
+                size_t radius, struct workpool *pool);
+int gaussian_blur_frame(struct saru_bytemat *dest,
+                const struct saru_bytemat *src, double sigma,
+                struct workpool *pool);
+int sobel_frame(struct saru_bytemat *dest, const struct saru_bytemat *src,
+                struct workpool *pool);
+void box_blur_band(uint8_t *dest, const uint8_t *src, size_t nsrc,
+                size_t y0, size_t y1, size_t stride, void *arg);
+
+#endif
@@ -0,0 +1,23 @@
+/* diffusion.h - error diffusion dithering */
+#ifndef DIFFUSION_H
+#define DIFFUSION_H
+
+#include <stddef.h> /* for size_t */
+
+/* forward declarations */
+struct image32_t;
+struct palette;
+struct workpool;
+
+enum diffusion_kernel {
+    DIFFUSE_FLOYD_STEINBERG, /* 4 taps over 2 rows, /16 */
+    DIFFUSE_ATKINSON,        /* 6 taps over 3 rows, /8, 1/4 of the error lost */
+    DIFFUSE_SIERRA           /* 10 taps over 3 rows, /32 */
+};
+
+/* function prototypes */
+int error_diffusion(struct image32_t *image, size_t width,
+                enum diffusion_kernel kernel, unsigned levels,
+                struct palette *pal, struct workpool *pool);
+
+#endif
@@ -0,0 +1,66 @@
+/* dither.h - vectorised ordered dithering of byte rows */
+#ifndef DITHER_H
+#define DITHER_H
+
+#include <stddef.h> /* for size_t */
+#include <inttypes.h> /* for uint8_t, int32_t */
+
+/**
+ * length of a threshold pattern in bytes
+ * 16 RGB24 pixels repeat every 48 bytes, kept twice for 32 byte vectors
+ */
+#define DITHER_PERIOD 48
+#define DITHER_SPAN (2 * DITHER_PERIOD)
+
+/* largest Bayer matrix, all sizes 2x2 through 16x16 are tabulated */
+#define DITHER_MAXDIM 16
+
+/**
+ * side of the blue noise texture (see bluenoise.h), a row of it repeats
+ * every DITHER_NOISESPAN bytes, a multiple of DITHER_SPAN
+ */
+#define DITHER_NOISEDIM 64
+#define DITHER_NOISESPAN (3 * DITHER_NOISEDIM)
+
+/**
+ * entry (x, y) of a 2^k x 2^k Bayer matrix, 0 <= k <= 4, as a constant
+ * expression: bit pair i of x and y picks a 2x2 entry weighted by 4^(k-1-i)
+ */
+#define BAYER_PAIR(x, y, i) ( 2 * ((((x) ^ (y)) >> (i)) & 1) + (((y) >> (i)) & 1) )
+#define BAYER_WEIGHT(k, i) ( (1 << (2 * (k))) >> (2 * (i) + 2) )
+#define BAYER(k, x, y) ( BAYER_PAIR(x, y, 0) * BAYER_WEIGHT(k, 0) + \
+                         BAYER_PAIR(x, y, 1) * BAYER_WEIGHT(k, 1) + \
+                         BAYER_PAIR(x, y, 2) * BAYER_WEIGHT(k, 2) + \
+                         BAYER_PAIR(x, y, 3) * BAYER_WEIGHT(k, 3) )
+
+/* byte order of the rows handed to dither_row */
+enum dither_order {
+    DITHER_RGB24,   /* plain 3 byte pixels */
+    DITHER_PACKED32 /* image32_t buffers, 4 bytes swapped per int32 */
+};
+
+/* an ordered dithering pass, one threshold row per matrix row */
+struct dither_job {
+    uint8_t patterns[DITHER_NOISEDIM][DITHER_NOISESPAN];
+    size_t dim;    /* rows of patterns in use */
+    size_t period; /* bytes of a pattern row in use */
+    unsigned levels;
+};
+
+/* function prototypes */
+int dither_levels_valid(unsigned levels);
+int dither_dim_valid(size_t dim);
+int dither_pattern(uint8_t *pattern, size_t dim, size_t y, unsigned levels,
+                enum dither_order order);
+int dither_noise_pattern(uint8_t *pattern, size_t y, unsigned levels,
+                enum dither_order order);
+void dither_row(uint8_t *row, size_t nbytes, const uint8_t *pattern,
+                size_t period, unsigned levels);
+int dither_job_init(struct dither_job *job, size_t dim, unsigned levels,
+                enum dither_order order);
+int dither_job_noise(struct dither_job *job, unsigned levels,
+                enum dither_order order);
+void dither_span(uint8_t *span, size_t nbytes, size_t x, size_t y,
+                void *arg);
+
+#endif
@@ -0,0 +1,63 @@
+/* image.h - strided, aligned image buffers, interleaved or planar */
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <stddef.h> /* for size_t */
+#include <inttypes.h> /* for uint8_t */
+
+/* forward declaration */
+struct image32_t;
+
+/* rows of an allocated image start on this boundary (one cache line) */
+#define IMAGE_ALIGN 64
+#define IMAGE_MAXCHANNELS 4
+
+enum image_layout {
+    IMAGE_INTERLEAVED, /* c0 c1 c2 c0 c1 c2 ... in a single plane */
+    IMAGE_PLANAR       /* one plane of samples per channel */
+};
+
+/**
+ * 8 bit samples, channels per pixel, either interleaved or planar.
+ * A view shares the samples of another image, so only its plane pointers
+ * differ: rows of a view are stride bytes apart but only start on an
+ * IMAGE_ALIGN boundary when its x offset lands on one.
+ */
+struct image {
+    uint8_t *planes[IMAGE_MAXCHANNELS]; /* interleaved uses planes[0] only */
+    size_t width;  /* in pixels */
+    size_t height; /* in rows */
+    size_t stride; /* bytes from a row to the next, the same in every plane */
+    unsigned channels;
+    enum image_layout layout;
+    void *base;    /* the allocation, NULL for a view */
+};
+
+/* function prototypes */
+int image_create(struct image *image, size_t width, size_t height,
+                unsigned channels, enum image_layout layout);
+void image_destroy(struct image *image);
+int image_view(struct image *view, const struct image *image, size_t x,
+                size_t y, size_t width, size_t height);
+int image_convert(struct image *dest, const struct image *src);
+int image_from32(struct image *dest, const struct image32_t *src,
+                size_t width, enum image_layout layout);
+int image_to32(struct image32_t *dest, const struct image *src);
+
+/**
+ * returns row y of the given plane, plane is 0 for an interleaved image
+ */
+static inline uint8_t *
+image_row(const struct image *image, unsigned plane, size_t y)
+{
+    return image->planes[plane] + y * image->stride;
+}
+
+/* number of samples in a row of a single plane */
+#define IMAGE_ROWLEN(imagep) ( (imagep)->layout == IMAGE_INTERLEAVED \
+                               ? (imagep)->width * (imagep)->channels \
+                               : (imagep)->width )
+#define IMAGE_NPLANES(imagep) ( (imagep)->layout == IMAGE_INTERLEAVED \
+                                ? 1u : (imagep)->channels )
+
+#endif
@@ -2,7 +2,32 @@
 #ifndef IMAGEIO_H
 #define IMAGEIO_H
 
+#include <stdio.h> /* for FILE */
+
+/* forward declaration */
+struct image32_t;
+
+/* an image file opened once, see imageio.c */
+struct imagefile;
+
 /* function prototypes */
+struct imagefile *imagefile_open(const char *src);
+struct imagefile *imagefile_fopen(FILE *in);
+void imagefile_close(struct imagefile *file);
+int imagefile_topfirst(const struct imagefile *file);
+int imagefile_sequential(const struct imagefile *file);
+int imagefile_size(const struct imagefile *file, size_t *width,
+                size_t *height);
+int imagefile_read(struct imagefile *file, struct image32_t *dest);
+int imagefile_read_rows(struct imagefile *file, size_t y,
+                struct image32_t *dest);
+int imagefile_write(const struct imagefile *file,
+                const struct image32_t *image, const char *dest);
+FILE *imagefile_create(const struct imagefile *file, const char *dest);
+int imagefile_start(const struct imagefile *file, FILE *out);
+int imagefile_write_rows(const struct imagefile *file, FILE *out, size_t y,
+                const struct image32_t *image);
+
 int get_image_size(const char *src, size_t *width, size_t *height);
 int32_t * allocate_image_buf(size_t size);
 int read_image(const char *src, int32_t *dest, size_t size);
@@ -13,5 +38,7 @@ void free_image_buf(int32_t *image);
 
 int pack(int32_t *dest, int8_t *src, size_t size);
 int unpack(int8_t *dest, int32_t *src, size_t size);
+int pack_inplace(int32_t *buf, size_t size);
+int unpack_inplace(int32_t *buf, size_t size);
 
 #endif
@@ -5,6 +5,9 @@
 #include <stddef.h> /* for size_t */
 #include <inttypes.h> /* for int32_t */
 
+/* forward declaration */
+struct workpool;
+
 #define uchar unsigned char
 #define PXLSIZE 4
 
@@ -22,6 +25,15 @@ struct image32_t {
 
 /* function prototypes */
 int ordered_dithering(struct image32_t *image);
+int ordered_dithering_n(struct image32_t *image, size_t dim, unsigned levels);
+int ordered_dithering_tiled(struct image32_t *image, size_t dim, 
+                unsigned levels, struct workpool *pool);
+int blue_noise_dithering(struct image32_t *image, unsigned levels,
+                struct workpool *pool);
+int invert_image(struct image32_t *image, struct workpool *pool);
+void invert_span(uint8_t *span, size_t nbytes, size_t x, size_t y,
+                void *arg);
+void gray_span(uint8_t *span, size_t nbytes, size_t x, size_t y, void *arg);
 void bayer_sqrmat(int32_t *mat, size_t dim);
 int pixel_at(const struct image32_t *image, size_t x, size_t y);
 int setpixel(struct image32_t *image, int32_t pixel, size_t x, size_t y);
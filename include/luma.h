@@ -0,0 +1,43 @@
+/* luma.h - vectorised RGB to luma (and chroma) planes for motion search */
+#ifndef LUMA_H
+#define LUMA_H
+
+#include <stddef.h> /* for size_t */
+#include <inttypes.h> /* for uint8_t */
+
+/* forward declarations */
+struct image32_t;
+struct workpool;
+
+/**
+ * luma weights, full range in 1/256: BT.601 (77, 150, 29) for SD sources
+ * and BT.709 (54, 183, 19) for HD ones
+ */
+enum luma_matrix {
+    LUMA_BT601,
+    LUMA_BT709
+};
+
+/**
+ * A plane of one byte per pixel, rows back to back without padding: the
+ * layout of a saru_bytemat, so plane.buf may be wrapped with
+ * SBM_WRAP(name, plane.buf, plane.wid, plane.hgt) and handed to c_sad.
+ */
+struct luma_plane {
+    uint8_t *buf;
+    size_t wid;
+    size_t hgt;
+};
+
+#define LUMA_CHROMA_DIM(n) ( ((n) + 1) / 2 )
+
+/* function prototypes */
+void luma_row(uint8_t *dest, const uint8_t *row, size_t width,
+                enum luma_matrix matrix);
+int luma_from32(struct luma_plane *dest, const struct image32_t *src,
+                size_t width, enum luma_matrix matrix, struct workpool *pool);
+int chroma_from32(struct luma_plane *cb, struct luma_plane *cr,
+                const struct image32_t *src, size_t width,
+                enum luma_matrix matrix);
+
+#endif
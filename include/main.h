@@ -25,8 +25,14 @@
 #define ERR_MALLOC_NULL "malloc returned null"
 #define DEFAULT_PROGNAME "sadx64"
     
-#define OPTSTR "vi:o:f:h"
-#define USAGE_FMT  "Usage: %s [-v] [-i inputfile] [-o outputfile] [-h]\n"
+#define OPTSTR "vi:o:f:m:b:h"
+#define USAGE_FMT  "Usage: %s [-v] [-i inputfile|-] [-o outputfile|-] [-f flags] [-m megabytes] [-b dir|manifest] [-h]\n"
+
+/* ceiling of an image read from stdin or written to stdout without -m */
+#define DEFAULT_MEMLIMIT ((size_t)64 << 20)
+
+/* bits of -f, in hex */
+#define FLAG_BLUENOISE 0x1 /* dither with blue noise instead of Bayer 8x8 */
 
 /* datatypes */
 typedef struct {
@@ -37,6 +43,8 @@ typedef struct {
     char         *dest;
     FILE         *input;
     FILE         *output;
+    size_t        memlimit; /* bytes, -m; 0 reads the whole image */
+    char         *batch;    /* -b, a directory or manifest of images */
 } options_t;
 
 /* function prototypes */
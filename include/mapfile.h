@@ -0,0 +1,12 @@
+/* mapfile.h - whole files mapped read only */
+#ifndef MAPFILE_H
+#define MAPFILE_H
+
+#include <stddef.h> /* for size_t */
+#include <inttypes.h> /* for uint8_t */
+
+/* function prototypes */
+const uint8_t *mapfile_open(const char *path, size_t *size);
+void mapfile_close(const uint8_t *data, size_t size);
+
+#endif
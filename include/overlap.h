@@ -0,0 +1,68 @@
+/* overlap.h - read, compute and write stages overlapped on their own threads */
+#ifndef OVERLAP_H
+#define OVERLAP_H
+
+#include <stddef.h> /* for size_t */
+
+enum overlap_stage {
+    OVERLAP_READ,
+    OVERLAP_COMPUTE,
+    OVERLAP_WRITE,
+    OVERLAP_NSTAGES
+};
+
+/* forward declaration */
+struct image32_t;
+
+/**
+ * A buffer an item of the sequence goes through the stages in. Frames are
+ * recycled from the write stage back to the read stage, so their images
+ * keep the memory of the items before them (see overlap_reserve).
+ */
+struct overlap_frame {
+    size_t index;           /* of the item it holds */
+    struct image32_t *in;   /* as read */
+    struct image32_t *out;  /* as computed, unless computed in place */
+    size_t incap;           /* bytes allocated at in->buf */
+    size_t outcap;
+    void *data;             /* state of the item, set by the read stage */
+    int failed;             /* a stage failed, the next ones skip it */
+};
+
+/* a stage function, returns 1 if successful, -1 otherwise */
+typedef int (*overlap_fn)(void *arg, struct overlap_frame *frame);
+
+/**
+ * the stages, each run by nthreads[stage] threads (1 if 0) and given arg;
+ * release, if set, is called on every frame after the write stage, failed
+ * or not, to free its data; with stop set, the first item a stage fails on
+ * ends the run, and the items after it go through no more stages
+ */
+struct overlap {
+    overlap_fn fns[OVERLAP_NSTAGES];
+    size_t nthreads[OVERLAP_NSTAGES];
+    overlap_fn release;
+    size_t nframes;         /* frames in flight, at least one per thread */
+    int stop;               /* stop at the first failed item */
+    void *arg;
+};
+
+/* what a run did, and how busy each of its stages was */
+struct overlap_stats {
+    size_t nitems;          /* through every stage */
+    size_t nfailed;         /* including one that stopped the run */
+    double seconds;         /* wall clock */
+    double busy[OVERLAP_NSTAGES];   /* seconds in the stage functions */
+    size_t nthreads[OVERLAP_NSTAGES];
+};
+
+/* function prototypes */
+int overlap_run(const struct overlap *ov, size_t nitems,
+                struct overlap_stats *stats);
+int overlap_reserve(struct image32_t *image, size_t *cap, size_t w,
+                size_t h);
+double overlap_occupancy(const struct overlap_stats *stats,
+                enum overlap_stage stage);
+void overlap_print_stats(const char *name, const struct overlap_stats *stats);
+
+#endif
@@ -0,0 +1,80 @@
+/* palette.h - colour palettes with a cached nearest-colour table */
+#ifndef PALETTE_H
+#define PALETTE_H
+
+#include <stddef.h> /* for size_t */
+#include <inttypes.h> /* for int32_t, uint32_t */
+
+/* forward declaration */
+struct image32_t;
+struct workpool;
+
+#define PAL_MAXSIZE 256
+#define PAL_SCANMAX 16 /* palettes up to this size are scanned, not searched */
+#define PAL_LUTBITS 5 /* bits per channel used to address the table */
+#define PAL_LUTDIM (1 << PAL_LUTBITS)
+#define PAL_LUTSIZE (PAL_LUTDIM * PAL_LUTDIM * PAL_LUTDIM)
+#define PAL_AMBIGUOUS 0x80000000u /* lut entry refers to a candidate list */
+
+/**
+ * how colours are compared, the high byte of a colour taken as red like
+ * R_FROM_PXL: plain squared distance between the bytes, or between the
+ * colours linearised from sRGB, or in the OKLab perceptual space
+ */
+enum pal_metric {
+    PAL_METRIC_RGB,
+    PAL_METRIC_LINEAR,
+    PAL_METRIC_OKLAB
+};
+
+/* node of the k-d tree over the palette colours */
+struct pal_kdnode {
+    int16_t left, right; /* child nodes, -1 if none */
+    uint8_t idx;         /* palette index of the colour split on */
+    uint8_t axis;        /* channel split on */
+};
+
+struct palette {
+    int32_t colors[PAL_MAXSIZE]; /* same format as the pixels of image32_t */
+    size_t n;
+    uint32_t id;      /* tells palettes apart in the per-thread caches */
+    enum pal_metric metric;
+    int32_t comps[3][PAL_MAXSIZE]; /* colors in the space of the metric,
+                                    * one array per coordinate
+                                    */
+    float fcomps[3][PAL_MAXSIZE];  /* the same as floats for vector scans,
+                                    * unused entries are far from any colour
+                                    */
+    struct pal_kdnode tree[PAL_MAXSIZE];
+    int16_t root;
+    uint32_t *lut;    /* one entry per RGB cell, NULL until the first lookup
+                       * entry: palette index, or PAL_AMBIGUOUS | offset 
+                       *        into cands for cells that straddle a
+                       *        boundary between two palette colours
+                       */
+    uint16_t *cands;  /* per ambiguous cell: count, then palette indices */
+    size_t ncands;
+};
+
+/* function prototypes */
+struct palette *palette_create(const int32_t *colors, size_t n);
+void palette_destroy(struct palette *pal);
+int palette_prepare(struct palette *pal);
+int palette_set_metric(struct palette *pal, enum pal_metric metric);
+size_t palette_index(struct palette *pal, int32_t color);
+int32_t palette_closest(struct palette *pal, int32_t color);
+size_t palette_nearest(const struct palette *pal, int32_t color);
+int palette_map(struct image32_t *image, struct palette *pal);
+void palette_map_span(uint8_t *span, size_t nbytes, size_t x, size_t y,
+                void *arg);
+
+/* palette generation, palettegen.c */
+struct palette *palette_median_cut(const struct image32_t *image, size_t n);
+struct palette *palette_kmeans(const struct image32_t *image, size_t n,
+                size_t iterations, struct workpool *pool);
+
+#define PAL_CELL(color) ( ((((color) >> 16) & 0xFF) >> (8 - PAL_LUTBITS)) \
+        << (2 * PAL_LUTBITS) | ((((color) >> 8) & 0xFF) >> (8 - PAL_LUTBITS)) \
+        << PAL_LUTBITS | (((color) & 0xFF) >> (8 - PAL_LUTBITS)) )
+
+#endif
@@ -0,0 +1,62 @@
+/* pipeline.h - image stages fused into one pass over row bands */
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <stddef.h> /* for size_t */
+#include <inttypes.h> /* for uint8_t */
+
+#define PIPELINE_MAXSTAGES 16
+#define PIPELINE_MAXRADIUS 8
+
+/**
+ * bytes of rows a band works on, about one L2 cache: every stage of the
+ * pipeline runs over a band before the next band is started
+ */
+#define PIPELINE_BAND_BYTES (256 * 1024)
+
+/* forward declarations */
+struct image32_t;
+struct palette;
+struct workpool;
+
+/* opaque, see pipeline.c */
+struct pipeline;
+
+/**
+ * a point-wise stage, in place on nbytes bytes of packed row y that start
+ * at byte x of the row (the same signature as a tile function)
+ */
+typedef void (*stage_point_fn)(uint8_t *row, size_t nbytes, size_t x,
+                size_t y, void *arg);
+
+/**
+ * a neighbourhood stage of radius r, writes packed row y to dest from
+ * rows[0] .. rows[2r], its input rows y - r .. y + r with the rows past
+ * the top and bottom of the image repeating the edge rows
+ */
+typedef void (*stage_filter_fn)(uint8_t *dest, const uint8_t *const *rows,
+                size_t nbytes, size_t y, void *arg);
+
+/* function prototypes */
+struct pipeline *pipeline_create(void);
+void pipeline_destroy(struct pipeline *pipe);
+int pipeline_add_point(struct pipeline *pipe, stage_point_fn fn, void *arg);
+int pipeline_add_filter(struct pipeline *pipe, stage_filter_fn fn,
+                size_t radius, void *arg);
+int pipeline_add_gray(struct pipeline *pipe);
+int pipeline_add_invert(struct pipeline *pipe);
+int pipeline_add_dither(struct pipeline *pipe, size_t dim, unsigned levels);
+int pipeline_add_noise_dither(struct pipeline *pipe, unsigned levels);
+int pipeline_add_palette(struct pipeline *pipe, struct palette *pal);
+int pipeline_add_box_blur(struct pipeline *pipe, size_t width, size_t radius);
+size_t pipeline_halo(const struct pipeline *pipe);
+size_t pipeline_scratch(const struct pipeline *pipe, size_t w,
+                size_t nthreads);
+int pipeline_run(const struct pipeline *pipe, const struct image32_t *src,
+                struct image32_t *dest, struct workpool *pool);
+int pipeline_run_rows(const struct pipeline *pipe,
+                const struct image32_t *src, size_t sy,
+                struct image32_t *dest, size_t dy, size_t h,
+                struct workpool *pool);
+
+#endif
@@ -0,0 +1,55 @@
+/* pnm.h - memory mapped PGM (P5) and PPM (P6) files */
+#ifndef PNM_H
+#define PNM_H
+
+#include <stddef.h> /* for size_t */
+#include <inttypes.h> /* for uint8_t */
+#include <stdio.h> /* for FILE */
+
+/* longest header pnm_header writes */
+#define PNM_HEADER_MAX 64
+
+/* forward declarations */
+struct image;
+struct image32_t;
+struct luma_plane;
+
+/**
+ * A binary pgm or ppm file of 8 bit samples mapped into memory, its
+ * header parsed in place. The raster is a view into the mapping: rows of
+ * stride bytes back to back, the top row first, gray samples or r, g, b.
+ */
+struct pnm_map {
+    const uint8_t *data;    /* the whole file */
+    size_t size;
+    const uint8_t *pixels;  /* the top row of the raster */
+    size_t width;           /* in pixels */
+    size_t height;          /* in rows */
+    size_t stride;          /* width * channels */
+    unsigned channels;      /* 1 for P5, 3 for P6 */
+    unsigned maxval;        /* of a sample, at most 255 */
+};
+
+/* returns row y of the raster, counting from the top */
+static inline const uint8_t *
+pnm_map_row(const struct pnm_map *map, size_t y)
+{
+    return map->pixels + y * map->stride;
+}
+
+/* function prototypes */
+int pnm_map_open(struct pnm_map *map, const char *path);
+int pnm_map_wrap(struct pnm_map *map, const uint8_t *data, size_t size);
+int pnm_map_read(struct pnm_map *map, FILE *in, uint8_t *buf, size_t have,
+                size_t cap);
+void pnm_map_close(struct pnm_map *map);
+int pnm_map_image(const struct pnm_map *map, struct image *view);
+int pnm_map_plane(const struct pnm_map *map, struct luma_plane *plane);
+int pnm_map_rows_to32(const struct pnm_map *map, size_t y,
+                struct image32_t *dest);
+int pnm_header(char *buf, unsigned channels, size_t width, size_t height);
+void pnm_row_from32(uint8_t *dest, const uint8_t *row, size_t width,
+                unsigned channels);
+int pnm_write(const char *path, const struct image *image);
+
+#endif
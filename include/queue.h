@@ -0,0 +1,17 @@
+/* queue.h - a bounded, blocking queue of pointers between threads */
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include <stddef.h> /* for size_t */
+
+/* opaque, see queue.c */
+struct queue;
+
+/* function prototypes */
+struct queue *queue_create(size_t capacity);
+void queue_destroy(struct queue *queue);
+int queue_push(struct queue *queue, void *item);
+void *queue_pop(struct queue *queue);
+void queue_close(struct queue *queue);
+
+#endif
@@ -0,0 +1,34 @@
+/* raw.h - memory mapped raw planar files */
+#ifndef RAW_H
+#define RAW_H
+
+#include <stddef.h> /* for size_t */
+#include <inttypes.h> /* for uint8_t */
+
+/* forward declarations */
+struct image;
+struct luma_plane;
+
+/**
+ * A raw planar file mapped into memory: channels planes of width x height
+ * 8 bit samples back to back, rows without padding, the top row first.
+ * Such files carry no header, so the caller gives the geometry.
+ */
+struct raw_map {
+    const uint8_t *data;    /* the whole file */
+    size_t size;
+    size_t width;           /* in pixels */
+    size_t height;          /* in rows */
+    unsigned channels;
+};
+
+/* function prototypes */
+int raw_map_open(struct raw_map *map, const char *path, size_t width,
+                size_t height, unsigned channels);
+void raw_map_close(struct raw_map *map);
+int raw_map_image(const struct raw_map *map, struct image *view);
+int raw_map_plane(const struct raw_map *map, unsigned channel,
+                struct luma_plane *plane);
+int raw_write(const char *path, const struct image *image);
+
+#endif
@@ -0,0 +1,29 @@
+/* resample.h - separable image scaling with cached filter banks */
+#ifndef RESAMPLE_H
+#define RESAMPLE_H
+
+#include <stddef.h> /* for size_t */
+
+/* filter banks kept for reuse, the least recently used one goes first */
+#define RESAMPLE_CACHE_SLOTS 8
+
+/* fixed point weights, 1 << RESAMPLE_BITS is a weight of one */
+#define RESAMPLE_BITS 14
+
+/* forward declarations */
+struct image32_t;
+struct workpool;
+
+enum resample_filter {
+    RESAMPLE_BOX,      /* mean of the source pixels a pixel covers */
+    RESAMPLE_BILINEAR, /* triangle, widened to the scale when shrinking */
+    RESAMPLE_LANCZOS3  /* windowed sinc of three lobes, sharpest */
+};
+
+/* function prototypes */
+int resample32(struct image32_t *dest, size_t dwidth,
+                const struct image32_t *src, size_t swidth,
+                enum resample_filter filter, struct workpool *pool);
+void resample_cache_clear(void);
+
+#endif
@@ -3,6 +3,7 @@
 #define SAD_H
 
 #include <stddef.h> /* for size_t */
+#include <stdint.h> /* for uint32_t, int32_t */
 
 /* forward declaration */
 struct saru_bytemat;
@@ -14,7 +15,34 @@ struct sad_result{
   size_t fcol;
 };
 
+/* hash index of every block position of a reference frame */
+struct sad_hashidx {
+  size_t fwid, fhgt;   /* reference frame dimensions */
+  size_t bwid, bhgt;   /* block (template) dimensions */
+  size_t pwid, phgt;   /* block positions per row and per column */
+  size_t rows;         /* frame rows hashed so far */
+  size_t nbuckets;     /* always a power of two */
+  uint32_t apow, bpow; /* rolling hash multipliers to the block size */
+  uint32_t *hashes;    /* hash of each block position, row-major */
+  int32_t *head;       /* first position in each bucket, -1 if empty */
+  int32_t *tail;       /* last position in each bucket, -1 if empty */
+  int32_t *next;       /* next position in the same bucket, -1 at the end */
+  uint32_t *rowhash;   /* window hashes of the last bhgt rows (a ring) */
+  uint32_t *colhash;   /* running vertical hash for each column */
+};
+
 /* interface */
 struct sad_result c_sad(struct saru_bytemat *template, struct saru_bytemat *frame);
 
+int sad_hashidx_init(struct sad_hashidx *idx, size_t fwid, size_t fhgt,
+                     size_t bwid, size_t bhgt);
+int sad_hashidx_addrows(struct sad_hashidx *idx, const unsigned char *rows,
+                        size_t nrows);
+int sad_hashidx_build(struct sad_hashidx *idx, struct saru_bytemat *frame,
+                      size_t bwid, size_t bhgt);
+void sad_hashidx_free(struct sad_hashidx *idx);
+struct sad_result hash_sad(struct saru_bytemat *template,
+                           struct saru_bytemat *frame,
+                           const struct sad_hashidx *idx);
+
 #endif
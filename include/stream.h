@@ -0,0 +1,27 @@
+/* stream.h - images run through a pipeline a band of rows at a time */
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stddef.h> /* for size_t */
+#include <stdio.h> /* for FILE */
+
+/* bands in flight: one read, one run and one written at once */
+#define STREAM_FRAMES 3
+
+/* forward declarations */
+struct imagefile;
+struct overlap_stats;
+struct pipeline;
+struct workpool;
+
+/* function prototypes */
+size_t stream_band(const struct pipeline *pipe, size_t w, size_t ceiling,
+                struct workpool *pool);
+int stream_image(const struct pipeline *pipe, struct imagefile *file,
+                const char *dest, size_t ceiling, struct workpool *pool,
+                struct overlap_stats *stats);
+int stream_file(const struct pipeline *pipe, struct imagefile *file,
+                FILE *out, size_t ceiling, struct workpool *pool,
+                struct overlap_stats *stats);
+
+#endif
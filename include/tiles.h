@@ -0,0 +1,31 @@
+/* tiles.h - cache sized tiles of an image, run on a worker pool */
+#ifndef TILES_H
+#define TILES_H
+
+#include <stddef.h> /* for size_t */
+#include <inttypes.h> /* for uint8_t */
+
+/**
+ * a tile is TILE_WIDTH bytes (a multiple of the Bayer and blue noise 
+ * pattern periods, so every tile starts in the same threshold phase as the
+ * row it is cut from) by TILE_HEIGHT rows, about 48 KiB in all
+ */
+#define TILE_WIDTH (48 * 64)
+#define TILE_HEIGHT 16
+
+/* forward declarations */
+struct image32_t;
+struct workpool;
+
+/**
+ * processes nbytes bytes of row y that start at byte x of the row;
+ * called once per row of every tile
+ */
+typedef void (*tile_fn)(uint8_t *span, size_t nbytes, size_t x, size_t y,
+                void *arg);
+
+/* function prototypes */
+int tiles_run(struct image32_t *image, tile_fn fn, void *arg, 
+                struct workpool *pool);
+
+#endif
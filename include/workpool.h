@@ -0,0 +1,20 @@
+/* workpool.h - a fixed pool of worker threads */
+#ifndef WORKPOOL_H
+#define WORKPOOL_H
+
+#include <stddef.h> /* for size_t */
+
+/* opaque, see workpool.c */
+struct workpool;
+
+/* runs task number task of a job, arg is shared by every task */
+typedef void (*workpool_fn)(void *arg, size_t task);
+
+/* function prototypes */
+struct workpool *workpool_create(size_t nthreads);
+void workpool_destroy(struct workpool *pool);
+size_t workpool_size(const struct workpool *pool);
+int workpool_run(struct workpool *pool, size_t ntasks, workpool_fn fn, 
+                void *arg);
+
+#endif
@@ -0,0 +1,378 @@
+/* batch.c - many images through one pipeline, reading ahead of the workers */
+#define _POSIX_C_SOURCE 200809L /* for opendir, getline, strdup */
+#include <ctype.h> /* for tolower */
+#include <dirent.h> /* for opendir, readdir, closedir */
+#include <errno.h> /* for errno */
+#include <stdatomic.h> /* for atomic_size_t */
+#include <stdint.h> /* for int32_t */
+#include <stdio.h> /* for FILE, fopen, getline, fprintf */
+#include <stdlib.h> /* for malloc, realloc, free, qsort */
+#include <string.h> /* for strcmp, strerror, strlen, strrchr */
+#include <sys/stat.h> /* for stat, S_ISDIR */
+#include <unistd.h> /* for sysconf */
+#include "../include/batch.h"
+#include "../include/imageio.h"
+#include "../include/imageproc.h"
+#include "../include/overlap.h"
+#include "../include/pipeline.h"
+
+extern int errno; /* these functions set errno on errors */
+
+struct job {
+    char *src;
+    char *dest;
+};
+
+/* a batch_run call, shared by its threads */
+struct batch {
+    const struct pipeline *pipe;
+    struct job *jobs;
+    size_t njobs;
+    atomic_size_t bytes;
+};
+
+/* static function prototypes */
+static int load_jobs(struct batch *batch, const char *list,
+                const char *outdir);
+static int load_dir(struct batch *batch, const char *dir, const char *outdir);
+static int load_manifest(struct batch *batch, const char *path,
+                const char *outdir);
+static int add_job(struct batch *batch, const char *src, const char *dest,
+                const char *outdir);
+static void free_jobs(struct batch *batch);
+static int cmp_names(const void *a, const void *b);
+static int isimage_name(const char *name);
+static int read_image_job(void *arg, struct overlap_frame *frame);
+static int run_image_job(void *arg, struct overlap_frame *frame);
+static int write_image_job(void *arg, struct overlap_frame *frame);
+static int close_image_job(void *arg, struct overlap_frame *frame);
+static void fail(const char *path, const char *what);
+
+/**
+ * Runs pipe over every image of list and writes the results. list is a
+ * directory, whose .bmp, .ppm, .pgm and .pnm files are written under the same names to outdir,
+ * or a manifest of lines "src dest" (a lone src is written to outdir;
+ * blank lines and lines starting with # are skipped).
+ * Reading, running and writing images are overlapped (see overlap_run):
+ * nreaders threads (BATCH_READERS if 0) map and read images ahead of
+ * nworkers threads (one per online CPU if 0) that each run pipe over an
+ * image at a time, and as many threads as read write the results. No
+ * process is started per image, and frames of image buffers are reused
+ * from image to image, at most BATCH_FRAMES per worker.
+ * Returns 1 if every image was written, -1 otherwise (errno EIO if some
+ * images failed, each reported on stderr); stats, if not NULL, are filled
+ * in either way.
+ */
+int
+batch_run(const struct pipeline *pipe, const char *list, const char *outdir,
+          size_t nreaders, size_t nworkers, struct batch_stats *stats)
+{
+    if (!pipe || !list) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (!nreaders)
+        nreaders = BATCH_READERS;
+    if (!nworkers) {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        nworkers = ncpu > 0 ? (size_t)ncpu : 1;
+    }
+
+    struct batch batch = { .pipe = pipe };
+    if (load_jobs(&batch, list, outdir) < 0)
+        return -1;
+    atomic_init(&batch.bytes, 0);
+
+    const struct overlap ov = {
+        .fns = { read_image_job, run_image_job, write_image_job },
+        .nthreads = { nreaders, nworkers, nreaders },
+        .release = close_image_job,
+        .nframes = BATCH_FRAMES * nworkers + 2 * nreaders,
+        .arg = &batch
+    };
+    struct overlap_stats ostats;
+    int res = overlap_run(&ov, batch.njobs, &ostats);
+    const int err = errno;
+
+    if (stats) {
+        stats->nimages = ostats.nitems;
+        stats->nfailed = batch.njobs - ostats.nitems;
+        stats->bytes = atomic_load(&batch.bytes);
+        stats->seconds = ostats.seconds;
+        for (size_t s = 0; s < OVERLAP_NSTAGES; ++s)
+            stats->occupancy[s] = overlap_occupancy(&ostats,
+                                                    (enum overlap_stage)s);
+    }
+    free_jobs(&batch);
+    errno = err;
+    return res;
+}
+
+/**
+ * prints the totals of a batch_run, its throughput and how busy each of
+ * its stages was to stdout
+ */
+void
+batch_print_stats(const struct batch_stats *stats)
+{
+    if (!stats)
+        return;
+    const double secs = stats->seconds > 0 ? stats->seconds : 1e-9;
+    printf("batch: %zu images, %zu failed, %.1f MB in %.3f s: "
+           "%.1f images/s, %.1f MB/s\n", stats->nimages, stats->nfailed,
+           stats->bytes / 1e6, stats->seconds, stats->nimages / secs,
+           stats->bytes / 1e6 / secs);
+    printf("batch: read %.0f%%, compute %.0f%%, write %.0f%% busy\n",
+           100 * stats->occupancy[0], 100 * stats->occupancy[1],
+           100 * stats->occupancy[2]);
+}
+
+/**
+ * static functions start here
+ */
+
+/* the jobs of a directory or a manifest */
+static int
+load_jobs(struct batch *batch, const char *list, const char *outdir)
+{
+    struct stat st;
+    if (stat(list, &st) < 0)
+        return -1;
+    return S_ISDIR(st.st_mode) ? load_dir(batch, list, outdir)
+                               : load_manifest(batch, list, outdir);
+}
+
+/* the image files of dir, in name order so runs are repeatable */
+static int
+load_dir(struct batch *batch, const char *dir, const char *outdir)
+{
+    if (!outdir) {
+        errno = EINVAL;
+        return -1;
+    }
+    DIR *d = opendir(dir);
+    if (!d)
+        return -1;
+
+    char **names = NULL;
+    size_t n = 0, cap = 0;
+    struct dirent *ent;
+    int ok = 1;
+    while (ok && (ent = readdir(d))) {
+        if (!isimage_name(ent->d_name))
+            continue;
+        if (n == cap) {
+            cap = cap ? 2 * cap : 64;
+            char **grown = realloc(names, cap * sizeof(*names));
+            ok = grown != NULL;
+            names = ok ? grown : names;
+        }
+        ok = ok && (names[n] = strdup(ent->d_name)) != NULL;
+        n += (size_t)ok;
+    }
+    closedir(d);
+
+    /* an empty directory leaves names NULL */
+    if (n)
+        qsort(names, n, sizeof(*names), cmp_names);
+    for (size_t i = 0; ok && i < n; ++i) {
+        char *src = malloc(strlen(dir) + strlen(names[i]) + 2);
+        ok = src != NULL;
+        if (ok) {
+            sprintf(src, "%s/%s", dir, names[i]);
+            ok = add_job(batch, src, NULL, outdir) == 1;
+        }
+        free(src);
+    }
+    for (size_t i = 0; i < n; ++i)
+        free(names[i]);
+    free(names);
+    if (!ok) {
+        free_jobs(batch);
+        errno = ENOMEM;
+        return -1;
+    }
+    return 1;
+}
+
+/* the lines "src [dest]" of the manifest at path */
+static int
+load_manifest(struct batch *batch, const char *path, const char *outdir)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return -1;
+
+    char *line = NULL;
+    size_t len = 0;
+    int ok = 1;
+    while (ok && getline(&line, &len, fp) != -1) {
+        char *src = strtok(line, " \t\r\n");
+        if (!src || *src == '#')
+            continue;
+        char *dest = strtok(NULL, " \t\r\n");
+        ok = add_job(batch, src, dest, outdir) == 1;
+    }
+    free(line);
+    fclose(fp);
+    if (!ok) {
+        free_jobs(batch);
+        return -1;
+    }
+    return 1;
+}
+
+/* appends a job, dest NULL being src's name under outdir */
+static int
+add_job(struct batch *batch, const char *src, const char *dest,
+        const char *outdir)
+{
+    if (!dest && !outdir) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (!(batch->njobs & (batch->njobs - 1))) { /* grows at powers of 2 */
+        size_t cap = batch->njobs ? 2 * batch->njobs : 1;
+        struct job *grown = realloc(batch->jobs, cap * sizeof(*grown));
+        if (!grown) {
+            errno = ENOMEM;
+            return -1;
+        }
+        batch->jobs = grown;
+    }
+
+    struct job *job = &batch->jobs[batch->njobs];
+    job->src = strdup(src);
+    if (dest) {
+        job->dest = strdup(dest);
+    } else {
+        const char *base = strrchr(src, '/');
+        base = base ? base + 1 : src;
+        if ((job->dest = malloc(strlen(outdir) + strlen(base) + 2)))
+            sprintf(job->dest, "%s/%s", outdir, base);
+    }
+    if (!job->src || !job->dest) {
+        free(job->src);
+        free(job->dest);
+        errno = ENOMEM;
+        return -1;
+    }
+    batch->njobs++;
+    return 1;
+}
+
+static void
+free_jobs(struct batch *batch)
+{
+    for (size_t i = 0; i < batch->njobs; ++i) {
+        free(batch->jobs[i].src);
+        free(batch->jobs[i].dest);
+    }
+    free(batch->jobs);
+    batch->jobs = NULL;
+    batch->njobs = 0;
+}
+
+static int
+cmp_names(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* 1 if name ends in .bmp, .ppm, .pgm or .pnm, in any case */
+static int
+isimage_name(const char *name)
+{
+    static const char *const exts[] = { "bmp", "ppm", "pgm", "pnm" };
+    const size_t len = strlen(name);
+    if (len <= 4 || name[len - 4] != '.')
+        return 0;
+    for (size_t i = 0; i < sizeof(exts) / sizeof(exts[0]); ++i)
+        if (tolower((unsigned char)name[len - 3]) == exts[i][0]
+            && tolower((unsigned char)name[len - 2]) == exts[i][1]
+            && tolower((unsigned char)name[len - 1]) == exts[i][2])
+            return 1;
+    return 0;
+}
+
+/**
+ * the read stage: maps and reads the image of a job into the frame, so
+ * its pages are faulted in here rather than by a worker
+ */
+static int
+read_image_job(void *arg, struct overlap_frame *frame)
+{
+    const struct batch *batch = arg;
+    const struct job *job = &batch->jobs[frame->index];
+    struct imagefile *file = imagefile_open(job->src);
+    if (!file) {
+        fail(job->src, "open");
+        return -1;
+    }
+    frame->data = file;
+
+    size_t w, h;
+    imagefile_size(file, &w, &h);
+    if (overlap_reserve(frame->in, &frame->incap, w, h) < 0
+        || imagefile_read(file, frame->in) < 0) {
+        fail(job->src, "read");
+        return -1;
+    }
+    return 1;
+}
+
+/**
+ * the compute stage: runs the pipeline over an image on this thread
+ * alone, the workers running as many images at once
+ */
+static int
+run_image_job(void *arg, struct overlap_frame *frame)
+{
+    const struct batch *batch = arg;
+    struct image32_t *out = frame->in;
+    if (pipeline_halo(batch->pipe)) {
+        out = frame->out;
+        if (overlap_reserve(out, &frame->outcap, frame->in->w,
+                            frame->in->h) < 0) {
+            fail(batch->jobs[frame->index].src, "pipeline");
+            return -1;
+        }
+    }
+    if (pipeline_run(batch->pipe, frame->in, out, NULL) < 0) {
+        fail(batch->jobs[frame->index].src, "pipeline");
+        return -1;
+    }
+    return 1;
+}
+
+/* the write stage, with the headers of the image read */
+static int
+write_image_job(void *arg, struct overlap_frame *frame)
+{
+    struct batch *batch = arg;
+    const struct image32_t *out = pipeline_halo(batch->pipe) ? frame->out
+                                                             : frame->in;
+    if (imagefile_write(frame->data, out, batch->jobs[frame->index].dest)
+        < 0) {
+        fail(batch->jobs[frame->index].dest, "write");
+        return -1;
+    }
+    atomic_fetch_add(&batch->bytes, out->w * out->h);
+    return 1;
+}
+
+/* unmaps the image of a frame once it is written or has failed */
+static int
+close_image_job(void *arg, struct overlap_frame *frame)
+{
+    (void)arg;
+    imagefile_close(frame->data);
+    return 1;
+}
+
+/* reports a failed image */
+static void
+fail(const char *path, const char *what)
+{
+    fprintf(stderr, "%s: %s: %s\n", path, what, strerror(errno));
+}
@@ -0,0 +1,286 @@
+/* bluenoise.c - a tileable void-and-cluster threshold texture */
+#include <errno.h> /* for errno */
+#include <math.h> /* for exp */
+#include <pthread.h> /* for pthread_once */
+#include <stdint.h> /* for uint8_t, uint16_t, uint32_t */
+#include <stdio.h> /* for FILE, fopen, snprintf, rename */
+#include <stdlib.h> /* for getenv */
+#include <string.h> /* for memcpy, memcmp, strcat */
+#include <sys/stat.h> /* for mkdir */
+#include <unistd.h> /* for getpid */
+#include "../include/bluenoise.h"
+
+extern int errno; /* these functions set errno on errors */
+
+#define SIGMA 1.5 /* of the Gaussian that measures how clustered a pixel is */
+#define INITIAL (BLUENOISE_SIZE / 10) /* pixels set in the initial pattern */
+#define MAGIC "sadx64bn" /* first 8 bytes of a cache file */
+#define MAGICLEN 8
+
+static pthread_once_t texture_once = PTHREAD_ONCE_INIT;
+static uint16_t texture[BLUENOISE_SIZE];
+
+/* static function prototypes */
+static void init_texture(void);
+static int cache_path(char *path, size_t len);
+static int is_permutation(const uint16_t *ranks);
+static void toggle(float *energy, const float *kernel, size_t p,
+                float sign);
+static size_t extreme(const float *energy, const uint8_t *bits,
+                uint8_t set);
+
+/**
+ * Returns the texture, BLUENOISE_DIM rows of BLUENOISE_DIM ranks. The
+ * first call reads it from the cache file, or generates it and writes the
+ * cache file when there is none; later calls only return it.
+ */
+const uint16_t *
+bluenoise_texture(void)
+{
+    pthread_once(&texture_once, init_texture);
+    return texture;
+}
+
+/**
+ * Ranks every pixel of a toroidal BLUENOISE_DIM square with Ulichney's
+ * void-and-cluster method: the pixels of rank below k are spread as evenly
+ * as possible for every k, so thresholding by rank leaves no low frequency
+ * structure and the texture tiles without seams. Deterministic.
+ */
+void
+bluenoise_generate(uint16_t *ranks)
+{
+    float kernel[BLUENOISE_SIZE], energy[BLUENOISE_SIZE];
+    float proto_energy[BLUENOISE_SIZE];
+    uint8_t bits[BLUENOISE_SIZE], proto[BLUENOISE_SIZE];
+
+    /* Gaussian of the wrapped distance, indexed by the offset dy, dx */
+    for (size_t dy = 0; dy < BLUENOISE_DIM; ++dy)
+        for (size_t dx = 0; dx < BLUENOISE_DIM; ++dx) {
+            double y = dy < BLUENOISE_DIM - dy ? dy : BLUENOISE_DIM - dy;
+            double x = dx < BLUENOISE_DIM - dx ? dx : BLUENOISE_DIM - dx;
+            kernel[dy * BLUENOISE_DIM + dx] =
+                (float)exp(-(x * x + y * y) / (2 * SIGMA * SIGMA));
+        }
+
+    /* a random initial pattern, from a fixed seed so the texture (and the
+     * cache file) is the same on every machine */
+    memset(bits, 0, sizeof(bits));
+    memset(energy, 0, sizeof(energy));
+    uint32_t seed = 1;
+    for (size_t n = 0; n < INITIAL; ) {
+        seed = seed * 1664525u + 1013904223u;
+        size_t p = (seed >> 8) % BLUENOISE_SIZE;
+        if (!bits[p]) {
+            bits[p] = 1;
+            toggle(energy, kernel, p, 1);
+            ++n;
+        }
+    }
+
+    /* moves the tightest cluster into the largest void until it is the
+     * largest void itself */
+    for (size_t i = 0; i < BLUENOISE_SIZE; ++i) {
+        size_t cluster = extreme(energy, bits, 1);
+        bits[cluster] = 0;
+        toggle(energy, kernel, cluster, -1);
+        size_t gap = extreme(energy, bits, 0);
+        bits[gap] = 1;
+        toggle(energy, kernel, gap, 1);
+        if (gap == cluster)
+            break;
+    }
+    memcpy(proto, bits, sizeof(bits));
+    memcpy(proto_energy, energy, sizeof(energy));
+
+    /* the prototype's pixels, tightest clusters get the highest ranks */
+    for (size_t rank = INITIAL; rank-- > 0; ) {
+        size_t cluster = extreme(energy, bits, 1);
+        bits[cluster] = 0;
+        toggle(energy, kernel, cluster, -1);
+        ranks[cluster] = (uint16_t)rank;
+    }
+
+    /**
+     * the rest fill the largest voids in turn; past half full this is also
+     * the tightest cluster of the unset pixels, as their energy is the
+     * total minus that of the set ones
+     */
+    memcpy(bits, proto, sizeof(bits));
+    memcpy(energy, proto_energy, sizeof(energy));
+    for (size_t rank = INITIAL; rank < BLUENOISE_SIZE; ++rank) {
+        size_t gap = extreme(energy, bits, 0);
+        bits[gap] = 1;
+        toggle(energy, kernel, gap, 1);
+        ranks[gap] = (uint16_t)rank;
+    }
+}
+
+/**
+ * Reads a texture written by bluenoise_save from path into ranks.
+ * Returns 1 if successful, -1 otherwise (errno EINVAL for a damaged file).
+ */
+int
+bluenoise_load(const char *path, uint16_t *ranks)
+{
+    if (!path || !ranks) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
+        return -1;
+
+    uint8_t buf[MAGICLEN + 2 * BLUENOISE_SIZE];
+    size_t n = fread(buf, 1, sizeof(buf), fp);
+    int extra = fgetc(fp) != EOF;
+    fclose(fp);
+    if (n != sizeof(buf) || extra || memcmp(buf, MAGIC, MAGICLEN)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    uint16_t tmp[BLUENOISE_SIZE];
+    for (size_t i = 0; i < BLUENOISE_SIZE; ++i)
+        tmp[i] = (uint16_t)(buf[MAGICLEN + 2 * i]
+                            | buf[MAGICLEN + 2 * i + 1] << 8);
+    if (!is_permutation(tmp)) {
+        errno = EINVAL;
+        return -1;
+    }
+    memcpy(ranks, tmp, sizeof(tmp));
+    return 1;
+}
+
+/**
+ * Writes ranks to path, little endian after a magic number. The file is
+ * written next to path and renamed over it, so readers never see half of
+ * it.
+ * Returns 1 if successful, -1 otherwise.
+ */
+int
+bluenoise_save(const char *path, const uint16_t *ranks)
+{
+    if (!path || !ranks) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    char tmp[4096];
+    if (snprintf(tmp, sizeof(tmp), "%s.%ld.tmp", path, (long)getpid())
+            >= (int)sizeof(tmp)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    uint8_t buf[MAGICLEN + 2 * BLUENOISE_SIZE];
+    memcpy(buf, MAGIC, MAGICLEN);
+    for (size_t i = 0; i < BLUENOISE_SIZE; ++i) {
+        buf[MAGICLEN + 2 * i] = (uint8_t)ranks[i];
+        buf[MAGICLEN + 2 * i + 1] = (uint8_t)(ranks[i] >> 8);
+    }
+
+    FILE *fp = fopen(tmp, "wb");
+    if (!fp)
+        return -1;
+    int ok = fwrite(buf, 1, sizeof(buf), fp) == sizeof(buf);
+    ok = fclose(fp) == 0 && ok;
+    if (!ok || rename(tmp, path) < 0) {
+        remove(tmp);
+        return -1;
+    }
+    return 1;
+}
+
+/**
+ * static functions start here
+ */
+
+/* loads the cached texture, or generates and caches it */
+static void
+init_texture(void)
+{
+    char path[4096];
+    int cached = cache_path(path, sizeof(path)) > 0;
+    if (cached && bluenoise_load(path, texture) > 0)
+        return;
+
+    bluenoise_generate(texture);
+    if (cached)
+        bluenoise_save(path, texture); /* the next run generates it again */
+}
+
+/**
+ * writes the path of the cache file to path, creating its directory
+ * returns 1 if successful, -1 if there is nowhere to put it
+ */
+static int
+cache_path(char *path, size_t len)
+{
+    const char *xdg = getenv("XDG_CACHE_HOME"), *home = getenv("HOME");
+    int n;
+    if (xdg && *xdg)
+        n = snprintf(path, len, "%s", xdg);
+    else if (home && *home)
+        n = snprintf(path, len, "%s/.cache", home);
+    else
+        return -1;
+    if (n < 0
+        || (size_t)n + sizeof("/" BLUENOISE_CACHEDIR "/" BLUENOISE_CACHE) > len)
+        return -1;
+
+    /* the cache directory itself may not exist yet either */
+    mkdir(path, 0755);
+    strcat(path, "/" BLUENOISE_CACHEDIR);
+    if (mkdir(path, 0755) < 0 && errno != EEXIST)
+        return -1;
+    strcat(path, "/" BLUENOISE_CACHE);
+    return 1;
+}
+
+/* every rank appears exactly once */
+static int
+is_permutation(const uint16_t *ranks)
+{
+    uint8_t seen[BLUENOISE_SIZE] = { 0 };
+    for (size_t i = 0; i < BLUENOISE_SIZE; ++i) {
+        if (ranks[i] >= BLUENOISE_SIZE || seen[ranks[i]])
+            return 0;
+        seen[ranks[i]] = 1;
+    }
+    return 1;
+}
+
+/* adds sign times the kernel centred on pixel p to every pixel's energy */
+static void
+toggle(float *energy, const float *kernel, size_t p, float sign)
+{
+    const size_t py = p / BLUENOISE_DIM, px = p % BLUENOISE_DIM;
+    const size_t mask = BLUENOISE_DIM - 1;
+    for (size_t y = 0; y < BLUENOISE_DIM; ++y) {
+        const float *k = kernel + ((y - py) & mask) * BLUENOISE_DIM;
+        float *e = energy + y * BLUENOISE_DIM;
+        for (size_t x = 0; x < BLUENOISE_DIM; ++x)
+            e[x] += sign * k[(x - px) & mask];
+    }
+}
+
+/**
+ * the set pixel of highest energy (set = 1, the tightest cluster) or the
+ * unset pixel of lowest energy (set = 0, the largest void), the first one
+ * in raster order on ties
+ */
+static size_t
+extreme(const float *energy, const uint8_t *bits, uint8_t set)
+{
+    size_t res = BLUENOISE_SIZE;
+    for (size_t p = 0; p < BLUENOISE_SIZE; ++p) {
+        if (bits[p] != set)
+            continue;
+        if (res == BLUENOISE_SIZE
+                || (set ? energy[p] > energy[res] : energy[p] < energy[res]))
+            res = p;
+    }
+    return res;
+}
@@ -0,0 +1,412 @@
+/* bmpmap.c - read only, memory mapped bmp files */
+#include <assert.h> /* for assert */
+#include <errno.h> /* for errno */
+#include <stdint.h> /* for uint8_t, uint16_t, uint32_t, SIZE_MAX */
+#include <stdio.h> /* for FILE, fread */
+#include <string.h> /* for memcpy, memset */
+#include "../include/bmp.h"
+#include "../include/bmpmap.h"
+#include "../include/image.h"
+#include "../include/imageproc.h"
+#include "../include/mapfile.h"
+
+extern int errno; /* these functions set errno on errors */
+
+/* static function prototypes */
+static uint16_t le16(const uint8_t *p);
+static uint32_t le32(const uint8_t *p);
+static int parse_headers(struct bmp_map *map);
+static int parse_masks(struct bmp_map *map, const uint8_t *p);
+static int parse_palette(struct bmp_map *map, const uint8_t *p);
+static void decode_masked(const struct bmp_map *map, uint8_t *dest,
+                const uint8_t *src);
+
+/**
+ * Maps the bmp file at path read only (see mapfile_open) and checks its
+ * headers against the size of the file, so every row of the pixel array
+ * can be read without further checks. Nothing is copied.
+ * Returns 1 if successful, -1 otherwise (errno EINVAL if the file is not
+ * an uncompressed 8, 16, 24 or 32 bit bmp).
+ */
+int
+bmp_map_open(struct bmp_map *map, const char *path)
+{
+    if (!map || !path) {
+        errno = EINVAL;
+        return -1;
+    }
+    memset(map, 0, sizeof(*map));
+
+    size_t size;
+    const uint8_t *data = mapfile_open(path, &size);
+    if (!data)
+        return -1;
+    if (bmp_map_wrap(map, data, size) < 0) {
+        mapfile_close(data, size);
+        errno = EINVAL;
+        return -1;
+    }
+    return 1;
+}
+
+/**
+ * Parses the bmp file already mapped at data, of size bytes, as
+ * bmp_map_open; map owns the mapping if successful, else it is the
+ * caller's still.
+ * Returns 1 if successful, -1 otherwise (errno EINVAL).
+ */
+int
+bmp_map_wrap(struct bmp_map *map, const uint8_t *data, size_t size)
+{
+    if (!map || !data) {
+        errno = EINVAL;
+        return -1;
+    }
+    memset(map, 0, sizeof(*map));
+    map->data = data;
+    map->size = size;
+    if (size < BFHEADER_SIZE + BIHEADER_SIZE || parse_headers(map) < 0
+        || map->stride > (size - map->bfh.offset) / map->height) {
+        memset(map, 0, sizeof(*map));
+        errno = EINVAL;
+        return -1;
+    }
+    map->pixels = data + map->bfh.offset;
+    return 1;
+}
+
+/**
+ * Reads the headers of a bmp from in, a stream that need not be seekable,
+ * into buf, which holds cap bytes and whose first have bytes have been
+ * read already, up to the first byte of the pixel array, and parses them
+ * as bmp_map_open would. map views buf and has no pixels: the rows are
+ * still to be read from in, stride bytes each in file order.
+ * Returns 1 if successful, -1 otherwise (errno EINVAL if the headers are
+ * not those of a bmp bmp_map_open takes or do not fit in cap).
+ */
+int
+bmp_map_read(struct bmp_map *map, FILE *in, uint8_t *buf, size_t have,
+             size_t cap)
+{
+    if (!map || !in || !buf || have > BFHEADER_SIZE
+        || cap < BFHEADER_SIZE + BIHEADER_SIZE) {
+        errno = EINVAL;
+        return -1;
+    }
+    memset(map, 0, sizeof(*map));
+
+    if (fread(buf + have, 1, BFHEADER_SIZE - have, in)
+        != BFHEADER_SIZE - have) {
+        errno = EINVAL;
+        return -1;
+    }
+    const size_t offset = le32(buf + 10);
+    if (offset < BFHEADER_SIZE + BIHEADER_SIZE || offset > cap
+        || fread(buf + BFHEADER_SIZE, 1, offset - BFHEADER_SIZE, in)
+           != offset - BFHEADER_SIZE) {
+        errno = EINVAL;
+        return -1;
+    }
+    map->data = buf;
+    map->size = offset;
+    if (parse_headers(map) < 0) {
+        memset(map, 0, sizeof(*map));
+        errno = EINVAL;
+        return -1;
+    }
+    return 1;
+}
+
+/**
+ * unmaps a file of bmp_map_open, views of its rows must not be used
+ * afterwards
+ */
+void
+bmp_map_close(struct bmp_map *map)
+{
+    if (!map)
+        return;
+    mapfile_close(map->data, map->size);
+    memset(map, 0, sizeof(*map));
+}
+
+/**
+ * Decodes row y of map, counting from the bottom, into the width b, g, r
+ * pixels at dest.
+ */
+void
+bmp_map_decode_row(const struct bmp_map *map, size_t y, uint8_t *dest)
+{
+    assert(map && dest && y < map->height && "Is validated by the caller.");
+
+    const uint8_t *src = bmp_map_row(map, y);
+    switch (map->bpp) {
+    case 8:
+        for (size_t x = 0; x < map->width; ++x)
+            memcpy(dest + 3 * x, map->palette[src[x]], 3);
+        break;
+    case 24:
+        memcpy(dest, src, map->rowbytes);
+        break;
+    case 32:
+        /* the masks of an uncompressed file, the common case */
+        if (map->masks[0] == 0xFF0000 && map->masks[1] == 0xFF00
+            && map->masks[2] == 0xFF) {
+            for (size_t x = 0; x < map->width; ++x) {
+                dest[3 * x] = src[4 * x];
+                dest[3 * x + 1] = src[4 * x + 1];
+                dest[3 * x + 2] = src[4 * x + 2];
+            }
+            break;
+        }
+        /* fall through */
+    default:
+        decode_masked(map, dest, src);
+    }
+}
+
+/**
+ * Decodes the pixel array of map into the new interleaved image dest, 3
+ * channels of b, g, r, in a single pass. The rows of dest are aligned and
+ * hold no file padding; the bottom row is row 0 whatever the order of the
+ * file, as in an image_from32 image.
+ * Returns 1 if successful, -1 otherwise.
+ */
+int
+bmp_map_decode(const struct bmp_map *map, struct image *dest)
+{
+    if (!map || !map->data || !dest) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (image_create(dest, map->width, map->height, 3, IMAGE_INTERLEAVED) < 0)
+        return -1;
+    for (size_t y = 0; y < map->height; ++y)
+        bmp_map_decode_row(map, y, image_row(dest, 0, y));
+    return 1;
+}
+
+/**
+ * Copies the pixel array into the packed image dest, whose w must be the
+ * stride32 of the map and h its height, in a single pass: each int32
+ * takes 4 bytes of 24 bit rows, the first in its top byte (see pack).
+ * Returns 1 if successful, -1 otherwise.
+ */
+int
+bmp_map_to32(const struct bmp_map *map, struct image32_t *dest)
+{
+    if (!map || !dest || dest->h != map->height) {
+        errno = EINVAL;
+        return -1;
+    }
+    return bmp_map_rows_to32(map, 0, dest);
+}
+
+/**
+ * Copies dest->h rows from row y, counting from the bottom, into the
+ * packed image dest, whose w must be the stride32 of the map, as
+ * bmp_map_to32. Rows are decoded first unless the file already holds 24
+ * bit rows bottom up, and their padding is zeroed.
+ * Returns 1 if successful, -1 otherwise.
+ */
+int
+bmp_map_rows_to32(const struct bmp_map *map, size_t y,
+                  struct image32_t *dest)
+{
+    if (!map || !map->data || !dest || !dest->buf || dest->w != map->stride32
+        || y > map->height || dest->h > map->height - y) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    uint32_t *words = (uint32_t *)dest->buf;
+    if (map->bpp == 24 && !map->topdown) {
+        const size_t nwords = map->stride / 4 * dest->h;
+        const uint8_t *src = bmp_map_row(map, y);
+        for (size_t i = 0; i < nwords; ++i) {
+            uint32_t word;
+            memcpy(&word, src + 4 * i, 4); /* the pixels need not be aligned */
+            words[i] = __builtin_bswap32(word);
+        }
+        return 1;
+    }
+
+    /* decode a row in place, then swap it while it is still in cache */
+    const size_t nwords = map->stride32 / 4;
+    for (size_t i = 0; i < dest->h; ++i) {
+        uint8_t *row = (uint8_t *)(words + i * nwords);
+        bmp_map_decode_row(map, y + i, row);
+        memset(row + 3 * map->width, 0, map->stride32 - 3 * map->width);
+        for (size_t j = i * nwords; j < (i + 1) * nwords; ++j)
+            words[j] = __builtin_bswap32(words[j]);
+    }
+    return 1;
+}
+
+/**
+ * static functions start here
+ */
+
+/* bmp fields are little endian, whatever the host */
+static uint16_t
+le16(const uint8_t *p)
+{
+    return (uint16_t)(p[0] | p[1] << 8);
+}
+
+static uint32_t
+le32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16
+           | (uint32_t)p[3] << 24;
+}
+
+/* fills in the headers and the sizes of rows, -1 on bad headers */
+static int
+parse_headers(struct bmp_map *map)
+{
+    const uint8_t *p = map->data;
+    struct bmp_fheader *bfh = &map->bfh;
+    struct bmp_iheader *bih = &map->bih;
+
+    bfh->ftype = le16(p);
+    bfh->fsize = le32(p + 2);
+    bfh->reserved1 = le16(p + 6);
+    bfh->reserved2 = le16(p + 8);
+    bfh->offset = le32(p + 10);
+
+    p += BFHEADER_SIZE;
+    bih->size = le32(p);
+    bih->imageWidth = le32(p + 4);
+    bih->imageHeight = le32(p + 8);
+    bih->planes = le16(p + 12);
+    bih->bitsPerPxl = le16(p + 14);
+    bih->compressionType = le32(p + 16);
+    bih->imageSize = le32(p + 20);
+    bih->XpxlsPerMeter = le32(p + 24);
+    bih->YPxlsPerMeter = le32(p + 28);
+    bih->colorsUsed = le32(p + 32);
+    bih->colorsImportant = le32(p + 36);
+
+    /* V4 and V5 headers only add fields after these */
+    if (bfh->ftype != 0x4D42 || bih->size < BIHEADER_SIZE
+        || bih->size > map->size - BFHEADER_SIZE
+        || bfh->offset < BFHEADER_SIZE + bih->size || bfh->offset > map->size
+        || bih->planes != 1)
+        return -1;
+
+    map->bpp = bih->bitsPerPxl;
+    if (bih->compressionType == BMP_RGB) {
+        if (map->bpp != 8 && map->bpp != 16 && map->bpp != 24
+            && map->bpp != 32)
+            return -1;
+    } else if (bih->compressionType == BMP_BITFIELDS
+               || bih->compressionType == BMP_ALPHABITFIELDS) {
+        if (map->bpp != 16 && map->bpp != 32)
+            return -1;
+    } else {
+        return -1;
+    }
+
+    /* a negative height is a top-down file */
+    const uint32_t height = bih->imageHeight;
+    map->topdown = height > INT32_MAX;
+    if (map->topdown && height == (uint32_t)INT32_MAX + 1)
+        return -1;
+    map->height = map->topdown ? (size_t)(~height + 1) : height;
+    map->width = bih->imageWidth;
+    if (!map->width || !map->height || map->width > INT32_MAX)
+        return -1;
+
+    if (parse_masks(map, p) < 0 || parse_palette(map, p) < 0)
+        return -1;
+
+    map->rowbytes = map->width * map->bpp / 8;
+    map->stride = (map->rowbytes + 3) & ~(size_t)3;
+    map->stride32 = (map->width * 3 + 3) & ~(size_t)3;
+    return 1;
+}
+
+/**
+ * finds the masks of 16 and 32 bit pixels, p at the info header: in the
+ * header from V2 on, else after it; -1 if they do not fit
+ */
+static int
+parse_masks(struct bmp_map *map, const uint8_t *p)
+{
+    const struct bmp_iheader *bih = &map->bih;
+    if (map->bpp != 16 && map->bpp != 32)
+        return 1;
+
+    if (bih->compressionType == BMP_RGB) {
+        map->masks[0] = map->bpp == 16 ? 0x7C00 : 0xFF0000;
+        map->masks[1] = map->bpp == 16 ? 0x3E0 : 0xFF00;
+        map->masks[2] = map->bpp == 16 ? 0x1F : 0xFF;
+    } else {
+        const uint8_t *m = p + BIHEADER_SIZE;
+        if (bih->size < BIHEADER_SIZE + 12
+            && map->bfh.offset < BFHEADER_SIZE + bih->size + 12)
+            return -1;
+        for (size_t c = 0; c < 3; ++c)
+            map->masks[c] = le32(m + 4 * c);
+    }
+
+    for (size_t c = 0; c < 3; ++c) {
+        const uint32_t mask = map->masks[c];
+        if (map->bpp == 16 && mask > 0xFFFF)
+            return -1;
+        if (!mask) {
+            map->shifts[c] = map->bits[c] = 0;
+            continue;
+        }
+        map->shifts[c] = (unsigned)__builtin_ctz(mask);
+        map->bits[c] = 32 - (unsigned)__builtin_clz(mask) - map->shifts[c];
+        /* only the top 8 bits of a wider field are kept */
+        if (map->bits[c] > 8) {
+            map->shifts[c] += map->bits[c] - 8;
+            map->bits[c] = 8;
+        }
+    }
+    return 1;
+}
+
+/**
+ * copies the palette of an 8 bit file, which follows the info header p,
+ * -1 if it does not fit
+ */
+static int
+parse_palette(struct bmp_map *map, const uint8_t *p)
+{
+    memset(map->palette, 0, sizeof(map->palette));
+    if (map->bpp != 8)
+        return 1;
+
+    const size_t ncolors = map->bih.colorsUsed ? map->bih.colorsUsed : 256;
+    if (ncolors > 256
+        || ncolors * 4 > map->bfh.offset - BFHEADER_SIZE - map->bih.size)
+        return -1;
+    const uint8_t *entry = p + map->bih.size;
+    for (size_t i = 0; i < ncolors; ++i, entry += 4)
+        memcpy(map->palette[i], entry, 3); /* b, g, r, reserved */
+    return 1;
+}
+
+/**
+ * decodes a row of 16 or 32 bit pixels through the masks, fields of fewer
+ * than 8 bits stretched to the full range
+ */
+static void
+decode_masked(const struct bmp_map *map, uint8_t *dest, const uint8_t *src)
+{
+    const unsigned step = map->bpp / 8;
+    for (size_t x = 0; x < map->width; ++x, src += step, dest += 3) {
+        const uint32_t pixel = step == 2 ? le16(src) : le32(src);
+        /* b, g, r bytes from the masks of r, g, b */
+        for (size_t c = 0; c < 3; ++c) {
+            const uint32_t max = (1u << map->bits[c]) - 1;
+            const uint32_t v = (pixel & map->masks[c]) >> map->shifts[c];
+            dest[2 - c] = (uint8_t)(map->bits[c] >= 8 ? v
+                                    : max ? (v * 255 + max / 2) / max : 0);
+        }
+    }
+}
@@ -0,0 +1,296 @@
+/* bmpwrite.c - bmp files written from images, their headers synthesised */
+#define _POSIX_C_SOURCE 200809L /* for writev, sysconf */
+#include <assert.h> /* for assert */
+#include <errno.h> /* for errno */
+#include <fcntl.h> /* for open */
+#include <stdint.h> /* for uint8_t, uint32_t, INT32_MAX */
+#include <stdlib.h> /* for malloc, free */
+#include <string.h> /* for memset */
+#include <sys/uio.h> /* for writev, struct iovec */
+#include <unistd.h> /* for close, sysconf */
+#include "../include/bmpwrite.h"
+#include "../include/image.h"
+#include "../include/imageproc.h"
+
+extern int errno; /* these functions set errno on errors */
+
+/* bytes of rows converted at a time when they cannot be written as is */
+#define BMP_BAND_BYTES (64 * 1024)
+
+/* iovecs handed to a writev, fewer if the system takes fewer */
+#define BMP_IOVS 1024
+
+/* a packed image and its width in pixels, the source of convert_32 */
+struct packed {
+    const struct image32_t *image;
+    size_t width;
+};
+
+/* static function prototypes */
+static int create(const char *path);
+static int iov_max(void);
+static int write_all(int fd, struct iovec *iov, int n);
+static int write_converted(int fd, const uint8_t *header, size_t size,
+                size_t stride, size_t height, void (*convert)(uint8_t *,
+                size_t, const void *), const void *src);
+static void convert_image(uint8_t *dest, size_t y, const void *src);
+static void convert_32(uint8_t *dest, size_t y, const void *src);
+
+/**
+ * Writes the headers of a plain 24 bit bmp of width x height pixels, of
+ * xppm and yppm pixels per metre, to header, which must hold
+ * BMP_HEADER_SIZE bytes; the pixel array is to follow them, bottom row
+ * first unless topdown.
+ * Returns BMP_HEADER_SIZE if successful, -1 otherwise (errno EINVAL if
+ * the image is too large for the headers).
+ */
+int
+bmp_header(uint8_t *header, size_t width, size_t height, int topdown,
+           uint32_t xppm, uint32_t yppm)
+{
+    if (!header || !width || !height || width > INT32_MAX / 3
+        || height > INT32_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+    const size_t stride = (width * 3 + 3) & ~(size_t)3;
+    if (height > (UINT32_MAX - BMP_HEADER_SIZE) / stride) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* a negative height is a top-down file */
+    const size_t imagesize = stride * height;
+    const uint32_t fields[] = {
+        (uint32_t)(BMP_HEADER_SIZE + imagesize), 0, BMP_HEADER_SIZE,
+        BMP_HEADER_SIZE - 14, (uint32_t)width,
+        topdown ? ~(uint32_t)height + 1 : (uint32_t)height,
+        1 | 24 << 16, 0 /* BMP_RGB */, (uint32_t)imagesize, xppm, yppm, 0, 0
+    };
+    header[0] = 'B';
+    header[1] = 'M';
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); ++i)
+        for (size_t b = 0; b < 4; ++b) /* little endian */
+            header[2 + 4 * i + b] = (uint8_t)(fields[i] >> (8 * b));
+    return BMP_HEADER_SIZE;
+}
+
+/**
+ * Writes image to a new 24 bit bmp at path, its headers made from the
+ * size of image alone. image holds b, g, r samples with row 0 at the
+ * bottom, as bmp_map_decode gives them, or gray ones in a single channel.
+ * Interleaved b, g, r rows are written straight from image, the row
+ * padding from a block of zeros, in a few writev calls that begin with
+ * the headers; other images are converted a band of rows at a time.
+ * Returns 1 if successful, -1 otherwise.
+ */
+int
+bmp_write(const char *path, const struct image *image)
+{
+    uint8_t header[BMP_HEADER_SIZE];
+    if (!path || !image || !image->planes[0]
+        || (image->channels != 1 && image->channels != 3)
+        || bmp_header(header, image->width, image->height, 0,
+                      BMP_DEFAULT_PPM, BMP_DEFAULT_PPM) < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    const size_t rowbytes = image->width * 3;
+    const size_t stride = (rowbytes + 3) & ~(size_t)3;
+
+    const int fd = create(path);
+    if (fd < 0)
+        return -1;
+    if (image->channels != 3 || image->layout != IMAGE_INTERLEAVED) {
+        int res = write_converted(fd, header, sizeof(header), stride,
+                                  image->height, convert_image, image);
+        if (close(fd) != 0)
+            res = -1;
+        return res;
+    }
+
+    static const uint8_t zeros[3];
+    struct iovec iov[BMP_IOVS];
+    const int max = iov_max();
+    int n = 0, ok = 1;
+    iov[n++] = (struct iovec){ header, sizeof(header) };
+    for (size_t y = 0; ok && y < image->height; ++y) {
+        iov[n++] = (struct iovec){ image_row(image, 0, y), rowbytes };
+        if (stride > rowbytes)
+            iov[n++] = (struct iovec){ (void *)zeros, stride - rowbytes };
+        if (n > max - 2 || y == image->height - 1) {
+            ok = write_all(fd, iov, n) == 1;
+            n = 0;
+        }
+    }
+    if (close(fd) != 0 || !ok)
+        return -1;
+    return 1;
+}
+
+/**
+ * Writes the packed image, width pixels wide, to a new 24 bit bmp at
+ * path after the size bytes of header, the headers of a 24 bit bottom up
+ * bmp of its size and whatever is to sit before its pixels. If header is
+ * NULL they are made from width and image->h alone, so no source file is
+ * needed. Rows are byte swapped into file order a band at a time (see
+ * bmp_row_from32) and the first band goes out with the headers in a
+ * single writev.
+ * Returns 1 if successful, -1 otherwise.
+ */
+int
+bmp_write32(const char *path, const uint8_t *header, size_t size,
+            const struct image32_t *image, size_t width)
+{
+    uint8_t made[BMP_HEADER_SIZE];
+    if (!path || !image || !image->buf
+        || image->w != ((width * 3 + 3) & ~(size_t)3)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (!header) {
+        if (bmp_header(made, width, image->h, 0, BMP_DEFAULT_PPM,
+                       BMP_DEFAULT_PPM) < 0)
+            return -1;
+        header = made;
+        size = sizeof(made);
+    }
+
+    const int fd = create(path);
+    if (fd < 0)
+        return -1;
+    const struct packed src = { image, width };
+    int res = write_converted(fd, header, size, image->w, image->h,
+                              convert_32, &src);
+    if (close(fd) != 0)
+        res = -1;
+    return res;
+}
+
+/**
+ * Converts a row of a packed image, width pixels and w bytes long, to the
+ * w bytes of a 24 bit bmp row: the int32 are swapped back into file order
+ * and the padding is written as zeros, whatever the image holds there.
+ * NOTE: row must start on an int32 boundary
+ */
+void
+bmp_row_from32(uint8_t *dest, const uint8_t *row, size_t w, size_t width)
+{
+    assert(dest && row && width * 3 <= w && "Is validated by the caller.");
+
+    const uint32_t *words = (const uint32_t *)row;
+    for (size_t i = 0; i < w / 4; ++i) {
+        const uint32_t v = __builtin_bswap32(words[i]);
+        memcpy(dest + 4 * i, &v, 4);
+    }
+    memset(dest + width * 3, 0, w - width * 3);
+}
+
+/**
+ * static functions start here
+ */
+
+/* creates the file at path for writing, truncating it */
+static int
+create(const char *path)
+{
+    return open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+}
+
+/* the iovecs a writev may take, at most BMP_IOVS */
+static int
+iov_max(void)
+{
+    const long max = sysconf(_SC_IOV_MAX);
+    return max <= 0 || max > BMP_IOVS ? BMP_IOVS : (int)max;
+}
+
+/* writes all of the n buffers of iov, over as many calls as it takes */
+static int
+write_all(int fd, struct iovec *iov, int n)
+{
+    assert(iov && "Is validated by the caller.");
+
+    while (n > 0) {
+        ssize_t done = writev(fd, iov, n);
+        if (done < 0 && errno == EINTR)
+            continue;
+        if (done < 0)
+            return -1;
+        /* skip what went out, resuming a buffer written in part */
+        while (n > 0 && (size_t)done >= iov->iov_len) {
+            done -= (ssize_t)iov->iov_len;
+            ++iov;
+            --n;
+        }
+        if (n > 0) {
+            iov->iov_base = (uint8_t *)iov->iov_base + done;
+            iov->iov_len -= (size_t)done;
+        }
+    }
+    return 1;
+}
+
+/**
+ * writes the size bytes of header and then the height rows convert makes
+ * of src, stride bytes each with their padding, a band of them at a time;
+ * the headers go out with the first band
+ */
+static int
+write_converted(int fd, const uint8_t *header, size_t size, size_t stride,
+                size_t height, void (*convert)(uint8_t *, size_t,
+                const void *), const void *src)
+{
+    assert(header && convert && src && "Is validated by the caller.");
+
+    const size_t rows = stride < BMP_BAND_BYTES ? BMP_BAND_BYTES / stride : 1;
+    const size_t nrows = rows < height ? rows : height;
+    uint8_t *band = malloc(nrows * stride);
+    if (!band) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    int ok = 1;
+    struct iovec iov[2] = { { (void *)header, size } };
+    for (size_t y = 0; ok && y < height; y += nrows) {
+        const size_t n = height - y < nrows ? height - y : nrows;
+        for (size_t i = 0; i < n; ++i)
+            convert(band + i * stride, y + i, src);
+        iov[1] = (struct iovec){ band, n * stride };
+        ok = y == 0 ? write_all(fd, iov, 2) == 1
+                    : write_all(fd, iov + 1, 1) == 1;
+    }
+    free(band);
+    return ok ? 1 : -1;
+}
+
+/* row y of a struct image of gray or b, g, r samples, as bmp rows */
+static void
+convert_image(uint8_t *dest, size_t y, const void *src)
+{
+    const struct image *image = src;
+    const size_t rowbytes = image->width * 3;
+    if (image->channels == 1) {
+        const uint8_t *gray = image_row(image, 0, y);
+        for (size_t x = 0; x < image->width; ++x)
+            dest[3 * x] = dest[3 * x + 1] = dest[3 * x + 2] = gray[x];
+    } else {
+        /* planar b, g, r, interleaved ones are written as they are */
+        for (unsigned c = 0; c < 3; ++c) {
+            const uint8_t *plane = image_row(image, c, y);
+            for (size_t x = 0; x < image->width; ++x)
+                dest[3 * x + c] = plane[x];
+        }
+    }
+    memset(dest + rowbytes, 0, ((rowbytes + 3) & ~(size_t)3) - rowbytes);
+}
+
+/* row y of a packed image, swapped into file order, padding zeroed */
+static void
+convert_32(uint8_t *dest, size_t y, const void *src)
+{
+    const struct packed *s = src;
+    bmp_row_from32(dest, (const uint8_t *)s->image->buf + y * s->image->w,
+                   s->image->w, s->width);
+}
@@ -0,0 +1,724 @@
+/* convolve.c - separable blurs and gradients of images and frames */
+#include <errno.h> /* for errno */
+#include <math.h> /* for ceil, exp, lround */
+#include <stdatomic.h> /* for atomic_size_t, atomic_int */
+#include <stdint.h> /* for uint8_t, int16_t, uint32_t, uint64_t */
+#include <stdlib.h> /* for malloc, free */
+#include <string.h> /* for memcpy, memset */
+#include "../include/convolve.h"
+#include "../include/imageproc.h"
+#include "../include/workpool.h"
+
+#include "saru-bytebuf.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h> /* for SSE2 intrinsics */
+#define CONVOLVE_SSE2 1
+#endif
+
+extern int errno; /* these functions set errno on errors */
+
+/**
+ * Gaussian weights are Q12; the horizontal pass keeps Q7 samples in int16
+ * (at most 255 << 7) so both passes weigh pairs of taps with one pmaddwd
+ */
+#define WBITS 12
+#define MIDBITS 7
+#define HSHIFT (WBITS - MIDBITS)
+#define VSHIFT (WBITS + MIDBITS)
+
+/* box sums are divided by n as (sum + n / 2) * ceil(2^40 / n) >> 40 */
+#define BOXSHIFT 40
+
+enum op {
+    OP_BOX,
+    OP_GAUSS,
+    OP_SOBEL
+};
+
+/**
+ * rows of nbytes samples stride bytes apart, the samples of a channel step
+ * bytes apart (3 for packed pixels, 1 for frames)
+ */
+struct plane {
+    uint8_t *buf;
+    size_t stride;
+    size_t nbytes;
+    size_t h;
+    size_t step;
+};
+
+struct kernel {
+    enum op op;
+    size_t radius;
+    size_t ntaps;   /* 2 * radius + 1 rounded up to even, a zero at the end */
+    int16_t weights[2 * CONVOLVE_MAXRADIUS + 2];
+};
+
+/* a convolve call, shared by its tasks */
+struct run {
+    const struct kernel *k;
+    const struct plane *src;
+    const struct plane *dest;
+    size_t mstride;     /* int16 samples of an intermediate row */
+    size_t band;        /* output rows per band */
+    size_t nbands;
+    atomic_size_t next; /* next band to be claimed */
+    atomic_int failed;
+};
+
+/* the buffers of a task */
+struct scratch {
+    uint8_t *padded;    /* a source row with its edges repeated */
+    int16_t *mid;       /* intermediate rows of a band and its halo */
+    uint32_t *cols;     /* running column sums of the box filter */
+    const int16_t **rows;
+    int16_t *v, *d;     /* Sobel smoothing and difference, padded */
+};
+
+/* static function prototypes */
+static void kernel_box(struct kernel *k, size_t radius);
+static int kernel_gauss(struct kernel *k, double sigma);
+static int convolve(const struct plane *src, const struct plane *dest,
+                const struct kernel *k, struct workpool *pool);
+static int convolve32(struct image32_t *dest, const struct image32_t *src,
+                size_t width, const struct kernel *k, struct workpool *pool);
+static int convolve_frame(struct saru_bytemat *dest,
+                const struct saru_bytemat *src, const struct kernel *k,
+                struct workpool *pool);
+static void run_bands(void *arg, size_t task);
+static void pad_row(uint8_t *padded, const uint8_t *row, size_t nbytes,
+                size_t step, size_t left, size_t right);
+static void band_rows(const struct run *run, struct scratch *s, size_t y0,
+                size_t y1);
+static void gauss_hrow(int16_t *dest, const uint8_t *padded, size_t n,
+                size_t step, const struct kernel *k);
+static void gauss_vrow(uint8_t *dest, const int16_t *const *rows,
+                size_t nbytes, const struct kernel *k);
+static void box_hrow(int16_t *dest, const uint8_t *padded, size_t nbytes,
+                size_t step, size_t radius);
+static void box_band(const struct run *run, struct scratch *s, size_t y0,
+                size_t y1, size_t lo);
+static void sobel_row(uint8_t *dest, const uint8_t *a, const uint8_t *b,
+                const uint8_t *c, size_t nbytes, size_t step,
+                struct scratch *s);
+
+/**
+ * Blurs the packed image src, width pixels wide, into dest with the mean
+ * of the (2 radius + 1)^2 square around each pixel, the edge pixels
+ * repeated past the borders. A sliding window costs the same for any
+ * radius up to CONVOLVE_MAXRADIUS. dest has the size of src, and may be
+ * src. Bands of rows are spread over the threads of pool (NULL runs them
+ * on the calling thread).
+ * Returns 1 if successful, -1 otherwise.
+ */
+int
+box_blur32(struct image32_t *dest, const struct image32_t *src, size_t width,
+           size_t radius, struct workpool *pool)
+{
+    if (radius > CONVOLVE_MAXRADIUS) {
+        errno = EINVAL;
+        return -1;
+    }
+    struct kernel k;
+    kernel_box(&k, radius);
+    return convolve32(dest, src, width, &k, pool);
+}
+
+/**
+ * Blurs a packed image with a Gaussian of the given sigma, cut at 3 sigma
+ * (at most CONVOLVE_MAXRADIUS) and weighed in fixed point, as box_blur32.
+ * Returns 1 if successful, -1 otherwise.
+ */
+int
+gaussian_blur32(struct image32_t *dest, const struct image32_t *src,
+                size_t width, double sigma, struct workpool *pool)
+{
+    struct kernel k;
+    if (kernel_gauss(&k, sigma) < 0)
+        return -1;
+    return convolve32(dest, src, width, &k, pool);
+}
+
+/**
+ * Writes the Sobel gradient magnitude of each channel of a packed image,
+ * (|Gx| + |Gy|) / 8 so the steepest edge is 255, as box_blur32.
+ * Returns 1 if successful, -1 otherwise.
+ */
+int
+sobel32(struct image32_t *dest, const struct image32_t *src, size_t width,
+        struct workpool *pool)
+{
+    const struct kernel k = { .op = OP_SOBEL, .radius = 1 };
+    return convolve32(dest, src, width, &k, pool);
+}
+
+/**
+ * box_blur32 on a frame of the motion search; dest has the size of src
+ * and must not be src.
+ * Returns 1 if successful, -1 otherwise.
+ */
+int
+box_blur_frame(struct saru_bytemat *dest, const struct saru_bytemat *src,
+               size_t radius, struct workpool *pool)
+{
+    if (radius > CONVOLVE_MAXRADIUS) {
+        errno = EINVAL;
+        return -1;
+    }
+    struct kernel k;
+    kernel_box(&k, radius);
+    return convolve_frame(dest, src, &k, pool);
+}
+
+/**
+ * gaussian_blur32 on a frame, as box_blur_frame
+ * Returns 1 if successful, -1 otherwise.
+ */
+int
+gaussian_blur_frame(struct saru_bytemat *dest, const struct saru_bytemat *src,
+                    double sigma, struct workpool *pool)
+{
+    struct kernel k;
+    if (kernel_gauss(&k, sigma) < 0)
+        return -1;
+    return convolve_frame(dest, src, &k, pool);
+}
+
+/**
+ * sobel32 on a frame, as box_blur_frame
+ * Returns 1 if successful, -1 otherwise.
+ */
+int
+sobel_frame(struct saru_bytemat *dest, const struct saru_bytemat *src,
+            struct workpool *pool)
+{
+    const struct kernel k = { .op = OP_SOBEL, .radius = 1 };
+    return convolve_frame(dest, src, &k, pool);
+}
+
+/**
+ * box_blur32 of rows y0 .. y1 - 1 of the nsrc packed rows at src, stride
+ * bytes apart, a band stage of the pipeline of radius box->radius (arg):
+ * row y0 is written at dest, and the first and last rows of src repeat
+ * past its ends. Column sums of a chunk of the row at a time, on the
+ * stack, slide down the band, so a pixel costs the same for any radius.
+ */
+void
+box_blur_band(uint8_t *dest, const uint8_t *src, size_t nsrc, size_t y0,
+              size_t y1, size_t stride, void *arg)
+{
+    const struct box_rows *box = arg;
+    const size_t r = box->radius, width = box->width;
+    const uint64_t area = (uint64_t)(2 * r + 1) * (2 * r + 1);
+    const uint64_t mul = (((uint64_t)1 << BOXSHIFT) + area - 1) / area;
+    const uint32_t half = (uint32_t)(area / 2);
+    /* row yy - r of the band, clamped to src */
+#define SRCROW(yy) ( src + ((yy) < r ? 0 : (yy) - r < nsrc ? (yy) - r \
+                                                           : nsrc - 1) * stride )
+
+    /* column sums of a chunk of pixels and the r pixels each side */
+    enum { CHUNK = 256 };
+    uint32_t cols[(CHUNK + 2 * CONVOLVE_MAXRADIUS) * 3];
+    size_t offs[CHUNK + 2 * CONVOLVE_MAXRADIUS];
+    for (size_t x0 = 0; x0 < width; x0 += CHUNK) {
+        const size_t x1 = width - x0 < CHUNK ? width : x0 + CHUNK;
+        const size_t np = x1 - x0 + 2 * r;
+        for (size_t p = 0; p < np; ++p) {
+            /* pixel x0 - r + p, the edge pixels repeated */
+            size_t x = x0 + p < r ? 0 : x0 + p - r;
+            offs[p] = 3 * (x < width ? x : width - 1);
+            for (size_t c = 0; c < 3; ++c) {
+                uint32_t sum = 0;
+                for (size_t d = 0; d <= 2 * r; ++d) /* file byte j at j ^ 3 */
+                    sum += SRCROW(y0 + d)[(offs[p] + c) ^ 3];
+                cols[3 * p + c] = sum;
+            }
+        }
+
+        for (size_t y = y0; y < y1; ++y) {
+            uint8_t *row = dest + (y - y0) * stride;
+            for (size_t c = 0; c < 3; ++c) {
+                uint32_t sum = 0;
+                for (size_t p = 0; p <= 2 * r; ++p)
+                    sum += cols[3 * p + c];
+                for (size_t x = x0; x < x1; ++x) {
+                    const size_t p = x - x0;
+                    row[(3 * x + c) ^ 3] = (uint8_t)(((sum + half) * mul)
+                                                     >> BOXSHIFT);
+                    if (x + 1 < x1)
+                        sum += cols[3 * (p + 2 * r + 1) + c]
+                               - cols[3 * p + c];
+                }
+            }
+            if (y + 1 == y1)
+                break;
+            /* slide the columns a row down, from y - r .. to y + 1 - r .. */
+            const uint8_t *out = SRCROW(y), *in = SRCROW(y + 2 * r + 1);
+            for (size_t p = 0; p < np; ++p)
+                for (size_t c = 0; c < 3; ++c)
+                    cols[3 * p + c] += (uint32_t)in[(offs[p] + c) ^ 3]
+                                       - out[(offs[p] + c) ^ 3];
+        }
+    }
+    for (size_t y = y0; y < y1; ++y)
+        for (size_t j = 3 * width; j < stride; ++j)
+            dest[(y - y0) * stride + (j ^ 3)] = 0;
+#undef SRCROW
+}
+
+/**
+ * static functions start here
+ */
+
+static void
+kernel_box(struct kernel *k, size_t radius)
+{
+    memset(k, 0, sizeof(*k));
+    k->op = OP_BOX;
+    k->radius = radius;
+}
+
+/* Q12 weights of a Gaussian, rounded to sum to exactly 1 << WBITS */
+static int
+kernel_gauss(struct kernel *k, double sigma)
+{
+    if (!(sigma > 0) || ceil(3 * sigma) > CONVOLVE_MAXRADIUS) {
+        errno = EINVAL;
+        return -1;
+    }
+    memset(k, 0, sizeof(*k));
+    k->op = OP_GAUSS;
+    k->radius = (size_t)ceil(3 * sigma);
+    k->ntaps = 2 * k->radius + 2;
+
+    double w[2 * CONVOLVE_MAXRADIUS + 1], sum = 0;
+    for (size_t i = 0; i <= 2 * k->radius; ++i) {
+        double x = (double)i - (double)k->radius;
+        sum += w[i] = exp(-x * x / (2 * sigma * sigma));
+    }
+    int32_t total = 0;
+    for (size_t i = 0; i <= 2 * k->radius; ++i)
+        total += k->weights[i] = (int16_t)lround(w[i] / sum * (1 << WBITS));
+    k->weights[k->radius] = (int16_t)(k->weights[k->radius]
+                                      + (1 << WBITS) - total);
+    return 1;
+}
+
+/* runs k over src into dest in bands of rows */
+static int
+convolve(const struct plane *src, const struct plane *dest,
+         const struct kernel *k, struct workpool *pool)
+{
+    struct run run;
+    run.k = k;
+    run.src = src;
+    run.dest = dest;
+    run.mstride = (src->nbytes + 7) & ~(size_t)7;
+
+    /* a band of intermediate rows fills about a cache, the halo rows it
+     * recomputes costing at most half as much again */
+    size_t rows = k->op == OP_SOBEL ? CONVOLVE_BAND_BYTES / src->nbytes
+                                    : CONVOLVE_BAND_BYTES / (2 * run.mstride);
+    rows = rows > 4 * k->radius ? rows : 4 * k->radius;
+    run.band = rows > 8 ? rows : 8;
+    run.nbands = (src->h + run.band - 1) / run.band;
+    atomic_init(&run.next, 0);
+    atomic_init(&run.failed, 0);
+
+    size_t ntasks = workpool_size(pool);
+    ntasks = ntasks < run.nbands ? ntasks : run.nbands;
+    if (workpool_run(pool, ntasks, run_bands, &run) < 0)
+        return -1;
+    if (atomic_load(&run.failed)) {
+        errno = ENOMEM;
+        return -1;
+    }
+    return 1;
+}
+
+/**
+ * k over a packed image: its words are swapped into file order, where the
+ * samples of a channel are 3 bytes apart, and dest is swapped back after
+ */
+static int
+convolve32(struct image32_t *dest, const struct image32_t *src, size_t width,
+           const struct kernel *k, struct workpool *pool)
+{
+    if (!dest || !dest->buf || !src || !src->buf
+        || src->w != ((width * 3 + 3) & ~(size_t)3)
+        || dest->w != src->w || dest->h != src->h) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (!width || !src->h)
+        return 1;
+
+    const size_t nwords = src->w / 4 * src->h;
+    uint32_t *words = malloc(nwords * 4);
+    if (!words) {
+        errno = ENOMEM;
+        return -1;
+    }
+    for (size_t i = 0; i < nwords; ++i)
+        words[i] = __builtin_bswap32((uint32_t)src->buf[i]);
+
+    const struct plane sp = { (uint8_t *)words, src->w, 3 * width, src->h, 3 };
+    const struct plane dp = { (uint8_t *)dest->buf, dest->w, 3 * width,
+                              dest->h, 3 };
+    int res = convolve(&sp, &dp, k, pool);
+    free(words);
+    if (res < 0)
+        return -1;
+
+    uint32_t *out = (uint32_t *)dest->buf;
+    for (size_t y = 0; y < dest->h; ++y)
+        memset((uint8_t *)dest->buf + y * dest->w + 3 * width, 0,
+               dest->w - 3 * width);
+    for (size_t i = 0; i < nwords; ++i)
+        out[i] = __builtin_bswap32(out[i]);
+    return 1;
+}
+
+/* k over a frame, its bytes one channel */
+static int
+convolve_frame(struct saru_bytemat *dest, const struct saru_bytemat *src,
+               const struct kernel *k, struct workpool *pool)
+{
+    if (!dest || !dest->buf || !src || !src->buf || dest->buf == src->buf
+        || dest->wid != src->wid || dest->hgt != src->hgt) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (!src->wid || !src->hgt)
+        return 1;
+
+    const struct plane sp = { src->buf, src->wid, src->wid, src->hgt, 1 };
+    const struct plane dp = { dest->buf, dest->wid, dest->wid, dest->hgt, 1 };
+    return convolve(&sp, &dp, k, pool);
+}
+
+/* a task of convolve, with its own buffers, claims bands until none are left */
+static void
+run_bands(void *arg, size_t task)
+{
+    struct run *run = arg;
+    const size_t r = run->k->radius, step = run->src->step;
+    const size_t n = run->src->nbytes;
+    (void)task;
+
+    struct scratch s = { NULL, NULL, NULL, NULL, NULL, NULL };
+    int ok;
+    if (run->k->op == OP_SOBEL) {
+        /* a pixel of padding each side, and a vector past the end */
+        s.v = malloc((n + 2 * step + 8) * sizeof(*s.v));
+        s.d = malloc((n + 2 * step + 8) * sizeof(*s.d));
+        ok = s.v && s.d;
+    } else {
+        s.padded = malloc(n + (2 * r + 1) * step + 8);
+        s.mid = malloc((run->band + 2 * r) * run->mstride * sizeof(*s.mid));
+        s.cols = malloc(run->mstride * sizeof(*s.cols));
+        s.rows = malloc((run->k->ntaps + 1) * sizeof(*s.rows));
+        ok = s.padded && s.mid && s.cols && s.rows;
+    }
+
+    size_t b;
+    while (ok && (b = atomic_fetch_add(&run->next, 1)) < run->nbands) {
+        size_t y0 = b * run->band;
+        size_t y1 = run->src->h - y0 < run->band ? run->src->h
+                                                 : y0 + run->band;
+        band_rows(run, &s, y0, y1);
+    }
+    if (!ok)
+        atomic_store(&run->failed, 1);
+
+    free(s.padded);
+    free(s.mid);
+    free(s.cols);
+    free(s.rows);
+    free(s.v);
+    free(s.d);
+}
+
+/**
+ * copies a row of nbytes samples to padded after left samples, repeating
+ * the first pixel over those and the last one over the right samples
+ */
+static void
+pad_row(uint8_t *padded, const uint8_t *row, size_t nbytes, size_t step,
+        size_t left, size_t right)
+{
+    memcpy(padded + left, row, nbytes);
+    for (size_t i = 0; i < left; ++i)
+        padded[left - 1 - i] = row[step - 1 - i % step];
+    for (size_t i = 0; i < right; ++i)
+        padded[left + nbytes + i] = row[nbytes - step + i % step];
+}
+
+/* output rows y0 .. y1 - 1 of a run */
+static void
+band_rows(const struct run *run, struct scratch *s, size_t y0, size_t y1)
+{
+    const struct plane *src = run->src, *dest = run->dest;
+    const size_t r = run->k->radius, h = src->h, step = src->step;
+
+    if (run->k->op == OP_SOBEL) {
+        for (size_t y = y0; y < y1; ++y)
+            sobel_row(dest->buf + y * dest->stride,
+                      src->buf + (y ? y - 1 : 0) * src->stride,
+                      src->buf + y * src->stride,
+                      src->buf + (y + 1 < h ? y + 1 : y) * src->stride,
+                      src->nbytes, step, s);
+        return;
+    }
+
+    /* the horizontal pass over the band and its halo rows */
+    const size_t lo = y0 > r ? y0 - r : 0;
+    const size_t hi = h - y1 > r ? y1 + r : h;
+    for (size_t y = lo; y < hi; ++y) {
+        int16_t *mid = s->mid + (y - lo) * run->mstride;
+        if (run->k->op == OP_BOX) {
+            pad_row(s->padded, src->buf + y * src->stride, src->nbytes,
+                    step, r * step, r * step);
+            box_hrow(mid, s->padded, src->nbytes, step, r);
+        } else {
+            pad_row(s->padded, src->buf + y * src->stride, src->nbytes,
+                    step, r * step, (r + 1) * step + 8);
+            gauss_hrow(mid, s->padded, run->mstride, step, run->k);
+        }
+    }
+
+    if (run->k->op == OP_BOX) {
+        box_band(run, s, y0, y1, lo);
+        return;
+    }
+
+    /* the vertical pass, rows past the edges repeating the edge rows */
+    for (size_t y = y0; y < y1; ++y) {
+        for (size_t t = 0; t < run->k->ntaps; ++t) {
+            size_t ys = y + t < r ? 0 : y + t - r;
+            ys = ys < lo ? lo : ys < hi ? ys : hi - 1;
+            s->rows[t] = s->mid + (ys - lo) * run->mstride;
+        }
+        gauss_vrow(dest->buf + y * dest->stride, s->rows, src->nbytes,
+                   run->k);
+    }
+}
+
+/**
+ * the Q7 horizontal Gaussian of the n samples (a multiple of 8) of a
+ * padded row, whose sample i + t * step is tap t of output i
+ */
+static void
+gauss_hrow(int16_t *dest, const uint8_t *padded, size_t n, size_t step,
+           const struct kernel *k)
+{
+    const int16_t *w = k->weights;
+    size_t i = 0;
+#ifdef CONVOLVE_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i half = _mm_set1_epi32(1 << (HSHIFT - 1));
+    for (; i < n; i += 8) {
+        __m128i lo = half, hi = half;
+        for (size_t t = 0; t < k->ntaps; t += 2) {
+            const uint8_t *p = padded + i + t * step;
+            const __m128i ab = _mm_unpacklo_epi8(
+                _mm_loadl_epi64((const __m128i *)p),
+                _mm_loadl_epi64((const __m128i *)(p + step)));
+            const __m128i wp = _mm_set1_epi32((int32_t)((uint16_t)w[t]
+                                   | (uint32_t)(uint16_t)w[t + 1] << 16));
+            lo = _mm_add_epi32(lo, _mm_madd_epi16(
+                     _mm_unpacklo_epi8(ab, zero), wp));
+            hi = _mm_add_epi32(hi, _mm_madd_epi16(
+                     _mm_unpackhi_epi8(ab, zero), wp));
+        }
+        _mm_storeu_si128((__m128i *)(dest + i),
+                         _mm_packs_epi32(_mm_srai_epi32(lo, HSHIFT),
+                                         _mm_srai_epi32(hi, HSHIFT)));
+    }
+#endif
+    for (; i < n; ++i) {
+        int32_t acc = 1 << (HSHIFT - 1);
+        for (size_t t = 0; t < k->ntaps; ++t)
+            acc += w[t] * padded[i + t * step];
+        dest[i] = (int16_t)(acc >> HSHIFT);
+    }
+}
+
+/* the vertical Gaussian of nbytes samples from rows[0 .. ntaps - 1] */
+static void
+gauss_vrow(uint8_t *dest, const int16_t *const *rows, size_t nbytes,
+           const struct kernel *k)
+{
+    const int16_t *w = k->weights;
+    size_t i = 0;
+#ifdef CONVOLVE_SSE2
+    const __m128i half = _mm_set1_epi32(1 << (VSHIFT - 1));
+    for (; i + 8 <= nbytes; i += 8) {
+        __m128i lo = half, hi = half;
+        for (size_t t = 0; t < k->ntaps; t += 2) {
+            const __m128i a = _mm_loadu_si128((const __m128i *)(rows[t] + i));
+            const __m128i b = _mm_loadu_si128(
+                (const __m128i *)(rows[t + 1] + i));
+            const __m128i wp = _mm_set1_epi32((int32_t)((uint16_t)w[t]
+                                   | (uint32_t)(uint16_t)w[t + 1] << 16));
+            lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b),
+                                                  wp));
+            hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b),
+                                                  wp));
+        }
+        const __m128i words = _mm_packs_epi32(_mm_srai_epi32(lo, VSHIFT),
+                                              _mm_srai_epi32(hi, VSHIFT));
+        _mm_storel_epi64((__m128i *)(dest + i),
+                         _mm_packus_epi16(words, words));
+    }
+#endif
+    for (; i < nbytes; ++i) {
+        int32_t acc = 1 << (VSHIFT - 1);
+        for (size_t t = 0; t < k->ntaps; ++t)
+            acc += w[t] * rows[t][i];
+        acc >>= VSHIFT;
+        dest[i] = (uint8_t)(acc > 255 ? 255 : acc);
+    }
+}
+
+/**
+ * the horizontal box sums of a padded row, each from the one a pixel
+ * before: the sample entering the window and the one leaving it; the sums
+ * (at most 255 * 255) are kept as uint16 in the int16 rows
+ */
+static void
+box_hrow(int16_t *dest, const uint8_t *padded, size_t nbytes, size_t step,
+         size_t radius)
+{
+    uint16_t *sums = (uint16_t *)dest;
+    const size_t span = 2 * radius * step;
+    for (size_t c = 0; c < step; ++c) {
+        unsigned sum = 0;
+        for (size_t t = 0; t <= span; t += step)
+            sum += padded[c + t];
+        sums[c] = (uint16_t)sum;
+    }
+    for (size_t i = step; i < nbytes; ++i)
+        sums[i] = (uint16_t)(sums[i - step] + padded[i + span]
+                             - padded[i - step]);
+}
+
+/**
+ * the vertical pass of the box filter over rows y0 .. y1 - 1, the band's
+ * horizontal sums starting at row lo: running column sums gain the row
+ * entering the window and lose the one leaving it
+ */
+static void
+box_band(const struct run *run, struct scratch *s, size_t y0, size_t y1,
+         size_t lo)
+{
+    const size_t r = run->k->radius, h = run->src->h;
+    const size_t n = run->src->nbytes, ms = run->mstride;
+    const uint64_t area = (uint64_t)(2 * r + 1) * (2 * r + 1);
+    const uint64_t mul = (((uint64_t)1 << BOXSHIFT) + area - 1) / area;
+    const uint32_t half = (uint32_t)(area / 2);
+#define MIDROW(yy) ( (const uint16_t *)s->mid + ((yy) - lo) * ms )
+
+    memset(s->cols, 0, n * sizeof(*s->cols));
+    for (size_t t = 0; t <= 2 * r; ++t) {
+        size_t ys = y0 + t < r ? 0 : y0 + t - r;
+        const uint16_t *row = MIDROW(ys < h ? ys : h - 1);
+        for (size_t i = 0; i < n; ++i)
+            s->cols[i] += row[i];
+    }
+
+    for (size_t y = y0; y < y1; ++y) {
+        uint8_t *dest = run->dest->buf + y * run->dest->stride;
+        for (size_t i = 0; i < n; ++i)
+            dest[i] = (uint8_t)(((s->cols[i] + half) * mul) >> BOXSHIFT);
+        if (y + 1 == y1)
+            break;
+
+        const size_t in = y + 1 + r < h ? y + 1 + r : h - 1;
+        const uint16_t *add = MIDROW(in);
+        const uint16_t *sub = MIDROW(y >= r ? y - r : 0);
+        size_t i = 0;
+#ifdef CONVOLVE_SSE2
+        const __m128i zero = _mm_setzero_si128();
+        for (; i + 8 <= n; i += 8) {
+            const __m128i a = _mm_loadu_si128((const __m128i *)(add + i));
+            const __m128i b = _mm_loadu_si128((const __m128i *)(sub + i));
+            __m128i *c = (__m128i *)(s->cols + i);
+            __m128i c0 = _mm_loadu_si128(c), c1 = _mm_loadu_si128(c + 1);
+            c0 = _mm_sub_epi32(_mm_add_epi32(c0, _mm_unpacklo_epi16(a, zero)),
+                               _mm_unpacklo_epi16(b, zero));
+            c1 = _mm_sub_epi32(_mm_add_epi32(c1, _mm_unpackhi_epi16(a, zero)),
+                               _mm_unpackhi_epi16(b, zero));
+            _mm_storeu_si128(c, c0);
+            _mm_storeu_si128(c + 1, c1);
+        }
+#endif
+        for (; i < n; ++i)
+            s->cols[i] += (uint32_t)add[i] - sub[i];
+    }
+#undef MIDROW
+}
+
+/**
+ * the Sobel magnitude of the middle of rows a, b, c: v smooths them
+ * vertically and d differences them, then Gx differences v horizontally
+ * and Gy smooths d; v and d have a pixel of padding on each side
+ */
+static void
+sobel_row(uint8_t *dest, const uint8_t *a, const uint8_t *b,
+          const uint8_t *c, size_t nbytes, size_t step, struct scratch *s)
+{
+    int16_t *v = s->v + step, *d = s->d + step;
+    size_t i = 0;
+#ifdef CONVOLVE_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 8 <= nbytes; i += 8) {
+        const __m128i va = _mm_unpacklo_epi8(
+            _mm_loadl_epi64((const __m128i *)(a + i)), zero);
+        const __m128i vb = _mm_unpacklo_epi8(
+            _mm_loadl_epi64((const __m128i *)(b + i)), zero);
+        const __m128i vc = _mm_unpacklo_epi8(
+            _mm_loadl_epi64((const __m128i *)(c + i)), zero);
+        _mm_storeu_si128((__m128i *)(v + i), _mm_add_epi16(
+            _mm_add_epi16(va, vc), _mm_add_epi16(vb, vb)));
+        _mm_storeu_si128((__m128i *)(d + i), _mm_sub_epi16(vc, va));
+    }
+#endif
+    for (; i < nbytes; ++i) {
+        v[i] = (int16_t)(a[i] + 2 * b[i] + c[i]);
+        d[i] = (int16_t)(c[i] - a[i]);
+    }
+    for (size_t j = 0; j < step; ++j) {
+        v[-1 - (ptrdiff_t)j] = v[step - 1 - j];
+        d[-1 - (ptrdiff_t)j] = d[step - 1 - j];
+        v[nbytes + j] = v[nbytes - step + j];
+        d[nbytes + j] = d[nbytes - step + j];
+    }
+
+    i = 0;
+#ifdef CONVOLVE_SSE2
+    const __m128i round = _mm_set1_epi16(4);
+    for (; i + 8 <= nbytes; i += 8) {
+        const __m128i gx = _mm_sub_epi16(
+            _mm_loadu_si128((const __m128i *)(v + i + step)),
+            _mm_loadu_si128((const __m128i *)(v + i - step)));
+        const __m128i dm = _mm_loadu_si128((const __m128i *)(d + i));
+        const __m128i gy = _mm_add_epi16(_mm_add_epi16(
+            _mm_loadu_si128((const __m128i *)(d + i - step)),
+            _mm_loadu_si128((const __m128i *)(d + i + step))),
+            _mm_add_epi16(dm, dm));
+        const __m128i ax = _mm_max_epi16(gx, _mm_sub_epi16(zero, gx));
+        const __m128i ay = _mm_max_epi16(gy, _mm_sub_epi16(zero, gy));
+        const __m128i m = _mm_srli_epi16(
+            _mm_add_epi16(_mm_add_epi16(ax, ay), round), 3);
+        _mm_storel_epi64((__m128i *)(dest + i), _mm_packus_epi16(m, m));
+    }
+#endif
+    for (; i < nbytes; ++i) {
+        const int gx = v[i + step] - v[i - step];
+        const int gy = d[i - step] + 2 * d[i] + d[i + step];
+        dest[i] = (uint8_t)(((gx < 0 ? -gx : gx) + (gy < 0 ? -gy : gy) + 4)
+                            >> 3);
+    }
+}
@@ -0,0 +1,225 @@
+/* diffusion.c - error diffusion dithering */
+#include <assert.h> /* for assert */
+#include <errno.h> /* for errno */
+#include <sched.h> /* for sched_yield */
+#include <stdatomic.h> /* for atomic_size_t */
+#include <stdint.h> /* for uint8_t, int32_t */
+#include <stdlib.h> /* for calloc, free */
+#include <string.h> /* for memset */
+#include "../include/diffusion.h"
+#include "../include/dither.h"
+#include "../include/imageproc.h"
+#include "../include/palette.h"
+#include "../include/workpool.h"
+
+extern int errno; /* these functions set errno on errors */
+
+#define MAXTAPS 10
+#define REACH 2 /* no kernel spreads error further than 2 pixels sideways */
+#define CHUNK 32 /* pixels a pipelined row processes between progress updates */
+/**
+ * a pipelined row may work on pixel x once the row above has finished
+ * pixel x + LEAD - 1; by then every error reaching x is final and the two
+ * rows never add into the same error cells at the same time
+ */
+#define LEAD (2 * REACH)
+
+struct tap {
+    int dx, dy, weight;
+};
+
+struct kernel {
+    int32_t divisor;
+    size_t ntaps;
+    struct tap taps[MAXTAPS];
+};
+
+static const struct kernel kernels[] = {
+    [DIFFUSE_FLOYD_STEINBERG] = { 16, 4, {
+        { 1, 0, 7 }, { -1, 1, 3 }, { 0, 1, 5 }, { 1, 1, 1 }
+    } },
+    [DIFFUSE_ATKINSON] = { 8, 6, {
+        { 1, 0, 1 }, { 2, 0, 1 }, 
+        { -1, 1, 1 }, { 0, 1, 1 }, { 1, 1, 1 }, 
+        { 0, 2, 1 }
+    } },
+    [DIFFUSE_SIERRA] = { 32, 10, {
+        { 1, 0, 5 }, { 2, 0, 3 },
+        { -2, 1, 2 }, { -1, 1, 4 }, { 0, 1, 5 }, { 1, 1, 4 }, { 2, 1, 2 },
+        { -1, 2, 2 }, { 0, 2, 3 }, { 1, 2, 2 }
+    } }
+};
+
+/* shared state of one error_diffusion call */
+struct diffusion {
+    struct image32_t *image;
+    const struct kernel *kernel;
+    struct palette *pal;
+    unsigned step;         /* level spacing when no palette is given */
+    size_t width;          /* pixels per row */
+    size_t ntasks;         /* rows in flight at most, one per task */
+    size_t nrows;          /* rows in the error and progress rings */
+    size_t rowlen;         /* int32 per error row, 3 channels + margins */
+    int32_t *err;          /* weighted error sums, nrows x rowlen */
+    atomic_size_t *done;   /* per ring row: row * (width + 1) + pixels done */
+    atomic_size_t next;    /* next row to be claimed by a thread */
+};
+
+/* static function prototypes */
+static void diffuse_row(struct diffusion *d, size_t y);
+static void diffuse_rows(void *arg, size_t task);
+static int32_t *err_row(const struct diffusion *d, size_t y);
+static void wait_for(const struct diffusion *d, size_t y, size_t x);
+
+/**
+ * Dithers the first width pixels of each row of image in place by diffusing
+ * each pixel's quantisation error onto its unprocessed neighbours; the
+ * padding after them is left alone and takes no error. Pixels are quantised
+ * to pal when it is not NULL, otherwise to levels evenly spaced values per
+ * channel.
+ * On the threads of pool the rows are pipelined: row y + 1 runs on the
+ * next thread a few pixels behind row y. A NULL pool runs every row on the
+ * calling thread. The output is the same for any pool.
+ * Returns 1 if successful, -1 otherwise.
+ */
+int
+error_diffusion(struct image32_t *image, size_t width,
+                enum diffusion_kernel kernel, unsigned levels,
+                struct palette *pal, struct workpool *pool)
+{
+    if (!image || !image->buf || width > image->w / 3 ||
+            kernel > DIFFUSE_SIERRA || (!pal && !dither_levels_valid(levels))) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (pal && palette_prepare(pal) < 0)
+        return -1;
+
+    struct diffusion d = { 0 };
+    d.image = image;
+    d.kernel = &kernels[kernel];
+    d.pal = pal;
+    d.step = pal ? 0 : 255 / (levels - 1);
+    d.width = width;
+    d.ntasks = workpool_size(pool);
+    if (d.ntasks > image->h)
+        d.ntasks = image->h ? image->h : 1;
+    /* rows in flight, plus the two rows below the last one */
+    d.nrows = d.ntasks + 3;
+    d.rowlen = 3 * (d.width + 2 * REACH);
+
+    d.err = calloc(d.nrows * d.rowlen, sizeof(int32_t));
+    d.done = calloc(d.nrows, sizeof(atomic_size_t));
+    if (!d.err || !d.done) {
+        free(d.err);
+        free(d.done);
+        errno = ENOMEM;
+        return -1;
+    }
+    for (size_t r = 0; r < d.nrows; ++r)
+        atomic_init(&d.done[r], 0);
+    atomic_init(&d.next, 0);
+
+    /**
+     * rows are claimed in order by running tasks, so a row only waits on
+     * one already claimed, and tasks still queued for a busy thread only
+     * mean the others claim more rows
+     */
+    const int res = workpool_run(pool, d.ntasks, diffuse_rows, &d);
+
+    free(d.err);
+    free(d.done);
+    return res;
+}
+
+/**
+ * static functions start here
+ */
+
+/**
+ * a workpool task, claims rows until none are left
+ * rows finish in order and each task holds one at a time, so at most
+ * ntasks consecutive rows are in flight and they fit in the rings
+ */
+static void
+diffuse_rows(void *arg, size_t task)
+{
+    struct diffusion *d = arg;
+    size_t y;
+    (void)task;
+    while ((y = atomic_fetch_add(&d->next, 1)) < d->image->h)
+        diffuse_row(d, y);
+}
+
+/* the error row of image row y, REACH pixels of margin on either side */
+static int32_t *
+err_row(const struct diffusion *d, size_t y)
+{
+    return d->err + (y % d->nrows) * d->rowlen + 3 * REACH;
+}
+
+/* spins until row y has finished its first x pixels */
+static void
+wait_for(const struct diffusion *d, size_t y, size_t x)
+{
+    const atomic_size_t *done = &d->done[y % d->nrows];
+    const size_t target = y * (d->width + 1) + x;
+    while (atomic_load_explicit(done, memory_order_acquire) < target)
+        sched_yield();
+}
+
+static void
+diffuse_row(struct diffusion *d, size_t y)
+{
+    const struct kernel *k = d->kernel;
+    uint8_t *row = (uint8_t *)d->image->buf + y * d->image->w;
+    int32_t *below[3];
+    for (size_t r = 0; r < 3; ++r)
+        below[r] = err_row(d, y + r);
+
+    for (size_t x0 = 0; x0 < d->width; x0 += CHUNK) {
+        size_t x1 = x0 + CHUNK < d->width ? x0 + CHUNK : d->width;
+        if (y > 0) {
+            size_t need = x1 - 1 + LEAD;
+            wait_for(d, y - 1, need < d->width ? need : d->width);
+        }
+
+        for (size_t x = x0; x < x1; ++x) {
+            int32_t v[3], q[3];
+            for (size_t c = 0; c < 3; ++c) {
+                /* memory byte of file byte 3x + c in the packed words */
+                v[c] = row[(3 * x + c) ^ 3] + below[0][3 * x + c] / k->divisor;
+                v[c] = v[c] < 0 ? 0 : v[c] > 255 ? 255 : v[c];
+            }
+
+            if (d->pal) {
+                int32_t color = palette_closest(d->pal, 
+                        (v[0] << 16) | (v[1] << 8) | v[2]);
+                q[0] = (color >> 16) & 0xFF;
+                q[1] = (color >> 8) & 0xFF;
+                q[2] = color & 0xFF;
+            } else {
+                for (size_t c = 0; c < 3; ++c)
+                    q[c] = (v[c] + (int32_t)d->step / 2) / (int32_t)d->step * 
+                           (int32_t)d->step;
+            }
+
+            for (size_t c = 0; c < 3; ++c) {
+                int32_t e = v[c] - q[c];
+                row[(3 * x + c) ^ 3] = (uint8_t)q[c];
+                for (size_t t = 0; t < k->ntaps; ++t) {
+                    const struct tap *tp = &k->taps[t];
+                    below[tp->dy][3 * ((long)x + tp->dx) + (long)c] += 
+                        e * tp->weight;
+                }
+            }
+        }
+
+        /* this row's own error cells are spent, ready for row y + nrows */
+        if (x1 == d->width)
+            memset(below[0] - 3 * REACH, 0, d->rowlen * sizeof(int32_t));
+        atomic_store_explicit(&d->done[y % d->nrows], 
+                y * (d->width + 1) + x1, memory_order_release);
+    }
+}
@@ -0,0 +1,309 @@
+/* dither.c - vectorised ordered dithering of byte rows */
+#include <assert.h> /* for assert */
+#include <errno.h> /* for errno */
+#include <stdint.h> /* for uint8_t, uint16_t */
+#include "../include/bluenoise.h"
+#include "../include/dither.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h> /* for SSE2 intrinsics */
+#define DITHER_SSE2 1
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h> /* for AVX2 intrinsics */
+#define DITHER_AVX2 1
+#endif
+
+extern int errno; /* these functions set errno on errors */
+
+/**
+ * Bayer thresholds (M + 0.5) / n^2 in units of 1/65536, for n = 2, 4, 8, 16
+ * indexed by [log2(n) - 1][y % 16][x % 16]; every row is already repeated
+ * out to the 16 pixels of DITHER_PERIOD and the rows out to 16 as well
+ */
+#define THRESH(k, x, y) ( (uint16_t)(((2 * BAYER(k, x, y) + 1) << 15) >> (2 * (k))) )
+#define THRESH_ROW(k, y) { \
+    THRESH(k, 0, y), THRESH(k, 1, y), THRESH(k, 2, y), THRESH(k, 3, y), \
+    THRESH(k, 4, y), THRESH(k, 5, y), THRESH(k, 6, y), THRESH(k, 7, y), \
+    THRESH(k, 8, y), THRESH(k, 9, y), THRESH(k, 10, y), THRESH(k, 11, y), \
+    THRESH(k, 12, y), THRESH(k, 13, y), THRESH(k, 14, y), THRESH(k, 15, y) }
+#define THRESH_MAT(k) { \
+    THRESH_ROW(k, 0), THRESH_ROW(k, 1), THRESH_ROW(k, 2), THRESH_ROW(k, 3), \
+    THRESH_ROW(k, 4), THRESH_ROW(k, 5), THRESH_ROW(k, 6), THRESH_ROW(k, 7), \
+    THRESH_ROW(k, 8), THRESH_ROW(k, 9), THRESH_ROW(k, 10), THRESH_ROW(k, 11), \
+    THRESH_ROW(k, 12), THRESH_ROW(k, 13), THRESH_ROW(k, 14), THRESH_ROW(k, 15) }
+
+static const uint16_t bayer_thresholds[4][DITHER_MAXDIM][DITHER_MAXDIM] = {
+    THRESH_MAT(1), THRESH_MAT(2), THRESH_MAT(3), THRESH_MAT(4)
+};
+
+_Static_assert(DITHER_NOISEDIM == BLUENOISE_DIM, "one texture row per row");
+
+/* static function prototypes */
+static void row_scalar(uint8_t *row, size_t i, size_t nbytes,
+                const uint8_t *pattern, size_t period, unsigned step);
+#ifdef DITHER_SSE2
+static size_t row_sse2(uint8_t *row, size_t i, size_t nbytes,
+                const uint8_t *pattern, size_t period, unsigned step);
+#endif
+#ifdef DITHER_AVX2
+static size_t row_avx2(uint8_t *row, size_t i, size_t nbytes,
+                const uint8_t *pattern, size_t period, unsigned step);
+#endif
+
+/**
+ * returns 1 if every channel can be quantised to levels evenly spaced 
+ * values (the spacing must divide 255), 0 otherwise
+ */
+int
+dither_levels_valid(unsigned levels)
+{
+    return levels >= 2 && levels <= 256 && 255 % (levels - 1) == 0;
+}
+
+/**
+ * returns 1 if there is a dim x dim Bayer matrix, that is dim is 2, 4, 8
+ * or 16, 0 otherwise
+ */
+int
+dither_dim_valid(size_t dim)
+{
+    return dim == 2 || dim == 4 || dim == 8 || dim == 16;
+}
+
+/**
+ * Writes the DITHER_SPAN byte threshold pattern of row y of the dim x dim
+ * Bayer matrix into pattern, each threshold scaled to an offset in 
+ * [0, step) where step = 255 / (levels - 1).
+ * Returns 1 if successful, -1 otherwise (errno EINVAL if dim is not 2, 4,
+ * 8 or 16).
+ */
+int
+dither_pattern(uint8_t *pattern, size_t dim, size_t y, unsigned levels,
+               enum dither_order order)
+{
+    size_t k = 0;
+    while (k < 4 && ((size_t)2 << k) != dim)
+        ++k;
+
+    if (!pattern || !dither_dim_valid(dim) || !dither_levels_valid(levels)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    const uint32_t step = 255 / (levels - 1);
+    const uint16_t *thresh = bayer_thresholds[k][y % DITHER_MAXDIM];
+    for (size_t m = 0; m < DITHER_SPAN; ++m) {
+        /* the file byte stored at memory byte m */
+        size_t j = order == DITHER_PACKED32 ? m ^ 3 : m;
+        pattern[m] = (uint8_t)((thresh[(j / 3) % DITHER_MAXDIM] * step) >> 16);
+    }
+    return 1;
+}
+
+/**
+ * Writes the DITHER_NOISESPAN byte threshold pattern of row y of the blue
+ * noise texture into pattern, scaled like dither_pattern: a pixel of rank
+ * r gets the threshold (r + 0.5) / BLUENOISE_SIZE on all of its channels.
+ * Returns 1 if successful, -1 otherwise.
+ */
+int
+dither_noise_pattern(uint8_t *pattern, size_t y, unsigned levels,
+                     enum dither_order order)
+{
+    if (!pattern || !dither_levels_valid(levels)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    const uint32_t step = 255 / (levels - 1);
+    const uint16_t *ranks = bluenoise_texture() 
+                            + (y % BLUENOISE_DIM) * BLUENOISE_DIM;
+    for (size_t m = 0; m < DITHER_NOISESPAN; ++m) {
+        size_t j = order == DITHER_PACKED32 ? m ^ 3 : m;
+        /* (2r + 1) / (2 * BLUENOISE_SIZE) in units of 1/65536 */
+        uint32_t thresh = (2 * ranks[j / 3] + 1) * (32768 / BLUENOISE_SIZE);
+        pattern[m] = (uint8_t)((thresh * step) >> 16);
+    }
+    return 1;
+}
+
+/**
+ * Dithers nbytes channel bytes of row in place:
+ * c' = floor(sat(c + t) / step) * step, where t is the matching pattern byte.
+ * The first byte of row lines up with the first byte of pattern, which
+ * repeats every period bytes.
+ * NOTE: levels must pass dither_levels_valid, period must be a multiple
+ * of DITHER_SPAN
+ */
+void
+dither_row(uint8_t *row, size_t nbytes, const uint8_t *pattern, 
+           size_t period, unsigned levels)
+{
+    assert(row && pattern && "Is validated by the caller.");
+    assert(dither_levels_valid(levels) && "Is validated by the caller.");
+
+    const unsigned step = 255 / (levels - 1);
+    if (step == 1)
+        return; /* every byte value is already a level */
+
+    assert(period && period % DITHER_SPAN == 0 
+           && "Is validated by the caller.");
+
+    /* each kernel carries on where the last one stopped, at a multiple of
+     * its vector span, and finds its place in pattern from there */
+    size_t done = 0;
+#ifdef DITHER_AVX2
+    if (__builtin_cpu_supports("avx2"))
+        done = row_avx2(row, 0, nbytes, pattern, period, step);
+#endif
+#ifdef DITHER_SSE2
+    done = row_sse2(row, done, nbytes, pattern, period, step);
+#endif
+    row_scalar(row, done, nbytes, pattern, period, step);
+}
+
+/**
+ * Fills job with the threshold rows of a dim x dim Bayer matrix.
+ * Returns 1 if successful, -1 otherwise (errno EINVAL if dim is not 2, 4,
+ * 8 or 16, so job is never left with no rows to dither with).
+ */
+int
+dither_job_init(struct dither_job *job, size_t dim, unsigned levels,
+                enum dither_order order)
+{
+    if (!job || !dither_dim_valid(dim)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    job->dim = dim;
+    job->period = DITHER_SPAN;
+    job->levels = levels;
+    for (size_t y = 0; y < dim; ++y)
+        if (dither_pattern(job->patterns[y], dim, y, levels, order) < 0)
+            return -1;
+    return 1;
+}
+
+/**
+ * Fills job with the threshold rows of the blue noise texture, dithering
+ * with it costs the same as with a Bayer matrix.
+ * Returns 1 if successful, -1 otherwise.
+ */
+int
+dither_job_noise(struct dither_job *job, unsigned levels,
+                 enum dither_order order)
+{
+    if (!job) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    job->dim = DITHER_NOISEDIM;
+    job->period = DITHER_NOISESPAN;
+    job->levels = levels;
+    for (size_t y = 0; y < DITHER_NOISEDIM; ++y)
+        if (dither_noise_pattern(job->patterns[y], y, levels, order) < 0)
+            return -1;
+    return 1;
+}
+
+/**
+ * dithers nbytes bytes of row y with the struct dither_job arg, a tile
+ * function; x must be a multiple of the job's period to stay in phase
+ */
+void
+dither_span(uint8_t *span, size_t nbytes, size_t x, size_t y, void *arg)
+{
+    const struct dither_job *job = arg;
+    assert(x % job->period == 0 && "Is validated by the caller.");
+    (void)x;
+    dither_row(span, nbytes, job->patterns[y % job->dim], job->period, 
+               job->levels);
+}
+
+/**
+ * static functions start here
+ */
+
+static void
+row_scalar(uint8_t *row, size_t i, size_t nbytes, const uint8_t *pattern,
+           size_t period, unsigned step)
+{
+    for (; i < nbytes; ++i) {
+        unsigned v = row[i] + pattern[i % period];
+        if (v > 255)
+            v = 255;
+        row[i] = (uint8_t)(v / step * step);
+    }
+}
+
+#ifdef DITHER_SSE2
+/**
+ * 16 pixels per iteration: three 16 byte vectors against the pattern.
+ * floor(x / step) is a 16 bit multiply-high by ceil(65536 / step), 
+ * which is exact for every byte x and every valid step.
+ * Starts at byte i, a multiple of DITHER_PERIOD.
+ * returns the number of bytes processed, counting the first i
+ */
+static size_t
+row_sse2(uint8_t *row, size_t i, size_t nbytes, const uint8_t *pattern,
+         size_t period, unsigned step)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i magic = _mm_set1_epi16((short)((65536 + step - 1) / step));
+    const __m128i vstep = _mm_set1_epi16((short)step);
+
+    size_t phase = i % period;
+    for (; i + DITHER_PERIOD <= nbytes; i += DITHER_PERIOD) {
+        const uint8_t *t = pattern + phase;
+        phase = phase + DITHER_PERIOD == period ? 0 : phase + DITHER_PERIOD;
+        for (size_t k = 0; k < 3; ++k) {
+            __m128i *p = (__m128i *)(row + i + 16 * k);
+            __m128i v = _mm_adds_epu8(_mm_loadu_si128(p),
+                            _mm_loadu_si128((const __m128i *)(t + 16 * k)));
+            __m128i lo = _mm_unpacklo_epi8(v, zero);
+            __m128i hi = _mm_unpackhi_epi8(v, zero);
+            lo = _mm_mullo_epi16(_mm_mulhi_epu16(lo, magic), vstep);
+            hi = _mm_mullo_epi16(_mm_mulhi_epu16(hi, magic), vstep);
+            _mm_storeu_si128(p, _mm_packus_epi16(lo, hi));
+        }
+    }
+    return i;
+}
+#endif
+
+#ifdef DITHER_AVX2
+/**
+ * the same as row_sse2 with 32 byte vectors, 32 pixels per iteration,
+ * starting at a multiple of DITHER_SPAN
+ */
+__attribute__((target("avx2")))
+static size_t
+row_avx2(uint8_t *row, size_t i, size_t nbytes, const uint8_t *pattern,
+         size_t period, unsigned step)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i magic = _mm256_set1_epi16((short)((65536 + step - 1) / step));
+    const __m256i vstep = _mm256_set1_epi16((short)step);
+
+    size_t phase = i % period;
+    for (; i + DITHER_SPAN <= nbytes; i += DITHER_SPAN) {
+        const uint8_t *t = pattern + phase;
+        phase = phase + DITHER_SPAN == period ? 0 : phase + DITHER_SPAN;
+        for (size_t k = 0; k < 3; ++k) {
+            __m256i *p = (__m256i *)(row + i + 32 * k);
+            __m256i v = _mm256_adds_epu8(_mm256_loadu_si256(p),
+                            _mm256_loadu_si256((const __m256i *)(t + 32 * k)));
+            __m256i lo = _mm256_unpacklo_epi8(v, zero);
+            __m256i hi = _mm256_unpackhi_epi8(v, zero);
+            lo = _mm256_mullo_epi16(_mm256_mulhi_epu16(lo, magic), vstep);
+            hi = _mm256_mullo_epi16(_mm256_mulhi_epu16(hi, magic), vstep);
+            _mm256_storeu_si256(p, _mm256_packus_epi16(lo, hi));
+        }
+    }
+    return i;
+}
+#endif
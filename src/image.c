@@ -0,0 +1,286 @@
+/* image.c - strided, aligned image buffers, interleaved or planar */
+#include <assert.h> /* for assert */
+#include <errno.h> /* for errno */
+#include <stdint.h> /* for uint8_t, SIZE_MAX */
+#include <stdlib.h> /* for aligned_alloc, free */
+#include <string.h> /* for memcpy, memset */
+#include "../include/image.h"
+#include "../include/imageproc.h"
+
+extern int errno; /* these functions set errno on errors */
+
+/* static function prototypes */
+static void deinterleave_row(uint8_t *const *dest, const uint8_t *src,
+                size_t width, unsigned channels);
+static void interleave_row(uint8_t *dest, uint8_t *const *src,
+                size_t width, unsigned channels);
+
+/**
+ * Allocates a width x height image of channels 8 bit samples per pixel.
+ * Every row of every plane starts on an IMAGE_ALIGN byte boundary and is
+ * padded up to the next one, so kernels may load whole vectors past the
+ * last pixel of a row. The samples are not initialised.
+ * Returns 1 if successful, -1 otherwise.
+ */
+int
+image_create(struct image *image, size_t width, size_t height,
+             unsigned channels, enum image_layout layout)
+{
+    if (!image || !width || !height || !channels
+        || channels > IMAGE_MAXCHANNELS
+        || (layout != IMAGE_INTERLEAVED && layout != IMAGE_PLANAR)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    size_t nplanes = layout == IMAGE_INTERLEAVED ? 1 : channels;
+    size_t rowlen = layout == IMAGE_INTERLEAVED ? channels : 1;
+    if (width > (SIZE_MAX - IMAGE_ALIGN) / rowlen) {
+        errno = ENOMEM;
+        return -1;
+    }
+    rowlen *= width;
+    size_t stride = (rowlen + IMAGE_ALIGN - 1) & ~(size_t)(IMAGE_ALIGN - 1);
+    if (height > SIZE_MAX / nplanes / stride) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    /* a multiple of IMAGE_ALIGN, as aligned_alloc wants */
+    uint8_t *base = aligned_alloc(IMAGE_ALIGN, nplanes * height * stride);
+    if (!base) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    memset(image, 0, sizeof(*image));
+    for (size_t p = 0; p < nplanes; ++p)
+        image->planes[p] = base + p * height * stride;
+    image->width = width;
+    image->height = height;
+    image->stride = stride;
+    image->channels = channels;
+    image->layout = layout;
+    image->base = base;
+    return 1;
+}
+
+/**
+ * frees the samples of an image made by image_create, views of it must
+ * not be used afterwards; a view itself owns nothing and is only cleared
+ */
+void
+image_destroy(struct image *image)
+{
+    if (!image)
+        return;
+    free(image->base); /* free(NULL) is valid */
+    memset(image, 0, sizeof(*image));
+}
+
+/**
+ * Sets view to the width x height region of image whose top left pixel is
+ * (x, y), without copying. The view may itself be cut into further views
+ * and is written through like any image.
+ * Returns 1 if successful, -1 otherwise.
+ */
+int
+image_view(struct image *view, const struct image *image, size_t x,
+           size_t y, size_t width, size_t height)
+{
+    if (!view || !image || !image->planes[0] || !width || !height
+        || x > image->width || width > image->width - x
+        || y > image->height || height > image->height - y) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct image v = *image;
+    size_t step = image->layout == IMAGE_INTERLEAVED ? image->channels : 1;
+    for (unsigned p = 0; p < IMAGE_NPLANES(image); ++p)
+        v.planes[p] = image->planes[p] + y * image->stride + x * step;
+    v.width = width;
+    v.height = height;
+    v.base = NULL;
+    *view = v;
+    return 1;
+}
+
+/**
+ * Copies the samples of src into dest, which must have the same size and
+ * number of channels but may have either layout; either may be a view.
+ * Returns 1 if successful, -1 otherwise.
+ */
+int
+image_convert(struct image *dest, const struct image *src)
+{
+    if (!dest || !src || !dest->planes[0] || !src->planes[0]
+        || dest->width != src->width || dest->height != src->height
+        || dest->channels != src->channels) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (size_t y = 0; y < src->height; ++y) {
+        if (src->layout == dest->layout) {
+            for (unsigned p = 0; p < IMAGE_NPLANES(src); ++p)
+                memmove(image_row(dest, p, y), image_row(src, p, y),
+                        IMAGE_ROWLEN(src));
+            continue;
+        }
+
+        uint8_t *rows[IMAGE_MAXCHANNELS];
+        if (src->layout == IMAGE_INTERLEAVED) {
+            for (unsigned c = 0; c < dest->channels; ++c)
+                rows[c] = image_row(dest, c, y);
+            deinterleave_row(rows, image_row(src, 0, y), src->width,
+                             src->channels);
+        } else {
+            for (unsigned c = 0; c < src->channels; ++c)
+                rows[c] = image_row(src, c, y);
+            interleave_row(image_row(dest, 0, y), rows, src->width,
+                           src->channels);
+        }
+    }
+    return 1;
+}
+
+/**
+ * Allocates dest with the given layout and fills it from a packed image
+ * width pixels wide, whose w must be the padded row length 3 * width
+ * rounded up to 4 (it fits in the stride of dest).
+ * Channel c of a pixel is byte c of the pixel in the file.
+ * Returns 1 if successful, -1 otherwise.
+ */
+int
+image_from32(struct image *dest, const struct image32_t *src, size_t width,
+             enum image_layout layout)
+{
+    if (!dest || !src || !src->buf || !width
+        || src->w != ((width * 3 + 3) & ~(size_t)3)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (image_create(dest, width, src->h, 3, layout) == -1)
+        return -1;
+
+    const size_t nwords = src->w / 4;
+    uint8_t *scratch = NULL;
+    if (layout == IMAGE_PLANAR && !(scratch = malloc(src->w))) {
+        image_destroy(dest);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for (size_t y = 0; y < src->h; ++y) {
+        /* each word holds 4 file bytes, the first in its top byte */
+        const uint32_t *words = (const uint32_t *)src->buf + y * nwords;
+        uint8_t *row = layout == IMAGE_PLANAR ? scratch : image_row(dest, 0, y);
+        for (size_t i = 0; i < nwords; ++i) {
+            uint32_t word = __builtin_bswap32(words[i]);
+            memcpy(row + 4 * i, &word, 4);
+        }
+
+        if (layout == IMAGE_PLANAR) {
+            uint8_t *rows[3] = { image_row(dest, 0, y), image_row(dest, 1, y),
+                                 image_row(dest, 2, y) };
+            deinterleave_row(rows, scratch, width, 3);
+        }
+    }
+
+    free(scratch);
+    return 1;
+}
+
+/**
+ * Writes a 3 channel image back into the packed image dest, whose h must
+ * be src->height and whose w must be the padded row length of src; the
+ * padding bytes are zeroed.
+ * Returns 1 if successful, -1 otherwise.
+ */
+int
+image_to32(struct image32_t *dest, const struct image *src)
+{
+    if (!dest || !dest->buf || !src || !src->planes[0] || src->channels != 3
+        || dest->h != src->height
+        || dest->w != ((src->width * 3 + 3) & ~(size_t)3)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    const size_t nwords = dest->w / 4;
+    uint8_t *row = malloc(dest->w);
+    if (!row) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memset(row + src->width * 3, 0, dest->w - src->width * 3);
+
+    for (size_t y = 0; y < src->height; ++y) {
+        if (src->layout == IMAGE_PLANAR) {
+            uint8_t *rows[3] = { image_row(src, 0, y), image_row(src, 1, y),
+                                 image_row(src, 2, y) };
+            interleave_row(row, rows, src->width, 3);
+        } else {
+            memcpy(row, image_row(src, 0, y), src->width * 3);
+        }
+
+        uint32_t *words = (uint32_t *)dest->buf + y * nwords;
+        for (size_t i = 0; i < nwords; ++i) {
+            uint32_t word;
+            memcpy(&word, row + 4 * i, 4);
+            words[i] = __builtin_bswap32(word);
+        }
+    }
+
+    free(row);
+    return 1;
+}
+
+/**
+ * static functions start here
+ */
+
+/* splits a row of interleaved pixels into one row per channel */
+static void
+deinterleave_row(uint8_t *const *dest, const uint8_t *src, size_t width,
+                 unsigned channels)
+{
+    assert(dest && src && "Is validated by the caller.");
+
+    if (channels == 3) {
+        uint8_t *restrict d0 = dest[0], *restrict d1 = dest[1];
+        uint8_t *restrict d2 = dest[2];
+        for (size_t x = 0; x < width; ++x) {
+            d0[x] = src[3 * x];
+            d1[x] = src[3 * x + 1];
+            d2[x] = src[3 * x + 2];
+        }
+        return;
+    }
+    for (size_t x = 0; x < width; ++x)
+        for (unsigned c = 0; c < channels; ++c)
+            dest[c][x] = src[x * channels + c];
+}
+
+/* merges one row per channel into a row of interleaved pixels */
+static void
+interleave_row(uint8_t *dest, uint8_t *const *src, size_t width,
+               unsigned channels)
+{
+    assert(dest && src && "Is validated by the caller.");
+
+    if (channels == 3) {
+        const uint8_t *restrict s0 = src[0], *restrict s1 = src[1];
+        const uint8_t *restrict s2 = src[2];
+        for (size_t x = 0; x < width; ++x) {
+            dest[3 * x] = s0[x];
+            dest[3 * x + 1] = s1[x];
+            dest[3 * x + 2] = s2[x];
+        }
+        return;
+    }
+    for (size_t x = 0; x < width; ++x)
+        for (unsigned c = 0; c < channels; ++c)
+            dest[x * channels + c] = src[c][x];
+}
@@ -1,66 +1,219 @@
 /* imagehandler.c - main routine for image processing */
-#include <unistd.h> /* for EXIT_FAILURE, EXIT_SUCCESS */
+#define _POSIX_C_SOURCE 200809L /* for fileno, fdopen, isatty, dup, dup2 */
+#include <unistd.h> /* for EXIT_FAILURE, EXIT_SUCCESS, dup, dup2, isatty */
 #include <errno.h> /* for EINVAL */
 #include <stdio.h> /* for printf */
 #include <stdlib.h> /* for exit */
-#include <string.h> /* for strerror */
+#include <string.h> /* for strcmp, strerror */
 #include "../include/main.h"
+#include "../include/batch.h"
 #include "../include/bmp.h"
 #include "../include/imagehandler.h"
 #include "../include/imageio.h"
 #include "../include/imageproc.h"
+#include "../include/overlap.h"
+#include "../include/pipeline.h"
 #include "../include/sad-test.h"
+#include "../include/stream.h"
+#include "../include/workpool.h"
 
 extern int errno;
 
 /* static function prototypes */
 static int valid_options(options_t *options);
+static int isstdio(const char *path);
+static int divert_stdout(options_t *options);
+static struct pipeline *create_pipeline(const options_t *options);
+static int handle_batch(options_t *options);
 
 int 
 handle_image(options_t *options)
 {
     if (!valid_options(options))
-        return EXIT_FAILURE;
+        return 0;
+
+    /* no -i, or -i -, reads stdin and no -o, or -o -, writes stdout */
+    const int from_stdin = !options->batch && isstdio(options->src);
+    const int to_stdout = !options->batch && isstdio(options->dest);
+    if (to_stdout && divert_stdout(options) < 0) {
+        perror("divert_stdout");
+        return 0;
+    }
     
     sad_selftest();
     printf("Self test passed!\n");
+
+    if (options->batch)
+        return handle_batch(options);
     
-    /* parse the image into the char buffer */
-    struct image32_t image = { 0 };
+    /* the source is opened once, its headers serve the output too */
+    struct imagefile *file = from_stdin ? imagefile_fopen(options->input)
+                                        : imagefile_open(options->src);
+    if (!file) {
+        perror("imagefile_open");
+        return 0;
+    }
+
+    /* every stage runs over a band of rows before the next band is read */
+    struct pipeline *pipe = create_pipeline(options);
+    if (!pipe) {
+        imagefile_close(file);
+        return 0;
+    }
 
-    if (!get_image_size(options->src, &image.w, &image.h))
-        perror("get_image_size");
+    /* one worker per online CPU */
+    struct workpool *pool = workpool_create(0);
 
+    /* within a memory ceiling the image is never read whole, and rows of
+     * stdin and stdout are always run as they arrive */
+    const size_t memlimit = options->memlimit || !(from_stdin || to_stdout)
+                            ? options->memlimit : DEFAULT_MEMLIMIT;
+    if (memlimit) {
+        struct overlap_stats stats;
+        int res = to_stdout
+                  ? stream_file(pipe, file, options->output, memlimit, pool,
+                                &stats)
+                  : stream_image(pipe, file, options->dest, memlimit, pool,
+                                 &stats);
+        int err = errno;
+        if (res < 0)
+            perror("stream_image");
+        else if (options->verbose)
+            overlap_print_stats("stream", &stats);
+        if (to_stdout && fclose(options->output) != 0) {
+            err = errno;
+            res = -1;
+            perror("fclose");
+        }
+        workpool_destroy(pool);
+        pipeline_destroy(pipe);
+        imagefile_close(file);
+        errno = err;
+        return res >= 0;
+    }
+
+    /* parse the image into the char buffer */
+    struct image32_t image = { 0 };
+    imagefile_size(file, &image.w, &image.h);
     image.buf = allocate_image_buf(image.w * image.h);
 
-    if (!read_image(options->src, image.buf, image.w * image.h))
-        perror("read_image");
+    if (!image.buf || imagefile_read(file, &image) < 0) {
+        perror("imagefile_read");
+        free_image_buf(image.buf);
+        workpool_destroy(pool);
+        pipeline_destroy(pipe);
+        imagefile_close(file);
+        return 0;
+    }
 
-    ordered_dithering(&image);
+    int res = pipeline_run(pipe, &image, &image, pool);
+    int err = errno;
+    if (res < 0)
+        perror("pipeline_run");
+    workpool_destroy(pool);
+    pipeline_destroy(pipe);
     
-    if (!write_image(image.buf, options->src, options->dest, 
-                image.w * image.h))
-        perror("write_image");
+    /* a failed stage leaves no image to write */
+    if (res > 0 && imagefile_write(file, &image, options->dest) < 0) {
+        err = errno;
+        res = -1;
+        perror("imagefile_write");
+    }
 
+    imagefile_close(file);
     free_image_buf(image.buf);
     
-	return 1;
+    errno = err;
+	return res > 0;
 }
 
-/* validates options for filename */
+/* the stages run on every image, NULL on failure */
+static struct pipeline *
+create_pipeline(const options_t *options)
+{
+    struct pipeline *pipe = pipeline_create();
+    int added = options->flags & FLAG_BLUENOISE
+                ? pipeline_add_noise_dither(pipe, 2)
+                : pipeline_add_dither(pipe, 8, 2);
+    if (!pipe || added < 0) {
+        perror("pipeline");
+        pipeline_destroy(pipe);
+        return NULL;
+    }
+    return pipe;
+}
+
+/**
+ * runs the pipeline over every image of options->batch in this one
+ * process, writing to the directory options->dest, and prints the totals
+ */
+static int
+handle_batch(options_t *options)
+{
+    struct pipeline *pipe = create_pipeline(options);
+    if (!pipe)
+        return 0;
+
+    struct batch_stats stats = { 0 };
+    int res = batch_run(pipe, options->batch, options->dest, 0, 0, &stats);
+    if (res < 0)
+        perror("batch_run");
+    batch_print_stats(&stats);
+    pipeline_destroy(pipe);
+    return res == 1;
+}
+
+/**
+ * validates options for filename, stdin and stdout standing in for them
+ * only when they are not terminals
+ * Returns 1 if valid, 0 otherwise.
+ */
 static int
 valid_options(options_t *options)
 {
     if (!options) {
       errno = EINVAL;
-      return EXIT_FAILURE;
+      return 0;
     }
     
-    if (!options->src) {
+    if (!options->batch
+        && ((!options->src && isatty(fileno(options->input)))
+            || (!options->dest && isatty(fileno(options->output))))) {
       errno = ENOENT;
-      return EXIT_FAILURE;
+      return 0;
     }
 
     return 1;
 }
 
+/* 1 if path stands for stdin or stdout: none, or "-" */
+static int
+isstdio(const char *path)
+{
+    return !path || strcmp(path, "-") == 0;
+}
+
+/**
+ * takes stdout for the image, options->output becoming a stream of its
+ * own of the descriptor, and points the descriptor of stdout at stderr so
+ * whatever is printed cannot land in the image
+ */
+static int
+divert_stdout(options_t *options)
+{
+    fflush(stdout);
+    const int fd = dup(fileno(options->output));
+    if (fd < 0)
+        return -1;
+    FILE *out = fdopen(fd, "wb");
+    if (!out || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+        if (out)
+            fclose(out);
+        else
+            close(fd);
+        return -1;
+    }
+    options->output = out;
+    return 1;
+}
+
@@ -1,25 +1,381 @@
 /* imageio.c - functions to read and write image files */
 #include <assert.h> /* for assert */
 #include <errno.h> /* for errno */
+#include <limits.h> /* for INT_MAX, LONG_MAX */
 #include <stdio.h> /* for FILE, freas, fwrite */
-#include <stdint.h> /* for uint16_t */
+#include <stdint.h> /* for uint32_t */
 #include <stdlib.h> /* for malloc, exit */
 #include <string.h> /* for memset */
 #include "../include/imageio.h"
 #include "../include/imageproc.h"
 #include "../include/bmp.h"
+#include "../include/bmpmap.h"
+#include "../include/bmpwrite.h"
+#include "../include/mapfile.h"
+#include "../include/pnm.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h> /* for SSSE3 and AVX2 intrinsics */
+#define IMAGEIO_X86 1
+#endif
 
 extern int errno; /* these functions set errno on errors */
 
+/* bytes of rows converted and written at a time */
+#define WRITE_CHUNK (64 * 1024)
+
+/* bytes of headers a stream may have before its pixels */
+#define STREAM_HEADER_MAX 4096
+
+/* the formats an imagefile may hold, told apart by their magic */
+enum file_format {
+    FORMAT_BMP, /* "BM" */
+    FORMAT_PNM  /* "P5" or "P6", binary pgm or ppm */
+};
+
+/**
+ * The headers of an image file, parsed once when it is opened, and its
+ * pixels, mapped: the file is opened a single time however often its
+ * size, pixels and headers are asked for.
+ * An image read from a stream instead has its headers read into header
+ * and its rows read as they arrive, a row at a time into row.
+ */
+struct imagefile {
+    enum file_format format;
+    union {
+        struct bmp_map bmp;
+        struct pnm_map pnm;
+    } map;
+    FILE *in;       /* the stream, NULL for a mapped file */
+    size_t nread;   /* rows read from in so far */
+    uint8_t *row;   /* a row as in holds it */
+    uint8_t header[STREAM_HEADER_MAX];
+};
+
+#ifdef IMAGEIO_X86
+/* pshufb mask reversing the bytes of each int32 of a vector */
+static const int8_t bswap_mask[16] = {
+    3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12
+};
+#endif
+
 /* static function protoypes */
-static int isbmp(FILE *fp);
-static uint16_t read_ftype(FILE *fp);
-static int read_bmpheaders(FILE *fp, struct bmp_fheader *bfhead, 
-                                      struct bmp_iheader *bihead);
-static int create_bmp_file(FILE *fp, struct bmp_fheader *bfhead, 
-                                      struct bmp_iheader *bihead);
 static int swap_colorendian(int32_t *image, size_t size);
-static int write_bmp_buf(FILE *fp, const int8_t *image, size_t offset, size_t size);
+static void swap_words(uint8_t *dest, const uint8_t *src, size_t nwords);
+static void swap_scalar(uint8_t *dest, const uint8_t *src, size_t i,
+                size_t nwords);
+#ifdef IMAGEIO_X86
+static size_t swap_ssse3(uint8_t *dest, const uint8_t *src, size_t i,
+                size_t nwords);
+static size_t swap_avx2(uint8_t *dest, const uint8_t *src, size_t i,
+                size_t nwords);
+#endif
+static int file_format(const uint8_t *data, size_t size,
+                enum file_format *format);
+static size_t file_width(const struct imagefile *file);
+static size_t file_height(const struct imagefile *file);
+static size_t file_stride(const struct imagefile *file);
+static int read_next_rows(struct imagefile *file, size_t y,
+                struct image32_t *dest);
+static int bmp_headers(const struct bmp_map *map, int topdown,
+                uint8_t *made, const uint8_t **header, size_t *size);
+static int write_header(const struct imagefile *file, FILE *out);
+static int write_topfirst(const struct imagefile *file, FILE *out, size_t y,
+                const struct image32_t *image);
+
+/**
+ * Opens the image file src, a bmp or a binary pgm or ppm, parsing its
+ * headers.
+ * Returns the new handle if successful, NULL otherwise (errno EINVAL if
+ * the format is not one of those).
+ */
+struct imagefile *
+imagefile_open(const char *src)
+{
+    if (!src) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct imagefile *file = calloc(1, sizeof(*file));
+    if (!file) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    size_t size;
+    const uint8_t *data = mapfile_open(src, &size);
+    if (!data) {
+        free(file);
+        return NULL;
+    }
+
+    int res = file_format(data, size, &file->format);
+    if (res > 0 && file->format == FORMAT_BMP)
+        res = bmp_map_wrap(&file->map.bmp, data, size);
+    else if (res > 0)
+        res = pnm_map_wrap(&file->map.pnm, data, size);
+    if (res < 0) {
+        mapfile_close(data, size);
+        free(file);
+        errno = EINVAL;
+        return NULL;
+    }
+    return file;
+}
+
+/**
+ * Opens the image held by in, a bmp or a binary pgm or ppm, reading and
+ * parsing its headers and not a byte more, so in need not be seekable: a
+ * pipe or stdin will do. Its rows are then read in the order in holds
+ * them (see imagefile_read_rows); in stays open.
+ * Returns the new handle if successful, NULL otherwise (errno EINVAL if
+ * the format is not one of those).
+ */
+struct imagefile *
+imagefile_fopen(FILE *in)
+{
+    if (!in) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct imagefile *file = calloc(1, sizeof(*file));
+    if (!file) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    file->in = in;
+    int res = fread(file->header, 1, 2, in) == 2 ? 1 : -1;
+    if (res > 0)
+        res = file_format(file->header, 2, &file->format);
+    if (res > 0 && file->format == FORMAT_BMP)
+        res = bmp_map_read(&file->map.bmp, in, file->header, 2,
+                           sizeof(file->header));
+    else if (res > 0)
+        res = pnm_map_read(&file->map.pnm, in, file->header, 2,
+                           sizeof(file->header));
+    if (res < 0 || !(file->row = malloc(file_stride(file)))) {
+        errno = res < 0 ? EINVAL : ENOMEM;
+        free(file);
+        return NULL;
+    }
+    return file;
+}
+
+/**
+ * closes a handle of imagefile_open or imagefile_fopen, not the stream of
+ * the latter
+ */
+void
+imagefile_close(struct imagefile *file)
+{
+    if (!file)
+        return;
+    if (file->in)
+        free(file->row);
+    else if (file->format == FORMAT_BMP)
+        bmp_map_close(&file->map.bmp);
+    else
+        pnm_map_close(&file->map.pnm);
+    free(file);
+}
+
+/**
+ * Returns 1 if the rows of the output of file go top row first, as those
+ * of pgm and ppm files do and those of top-down bmp streams too, 0 if
+ * they go bottom row first. Rows of a stream arrive in the same order.
+ */
+int
+imagefile_topfirst(const struct imagefile *file)
+{
+    if (!file)
+        return 0;
+    return file->format == FORMAT_PNM || (file->in && file->map.bmp.topdown);
+}
+
+/**
+ * returns 1 if file is read from a stream, whose rows must be read in
+ * order, 0 if it is mapped
+ */
+int
+imagefile_sequential(const struct imagefile *file)
+{
+    return file && file->in;
+}
+
+/**
+ * Updates the variables pointed to by width and height with the
+ * dimensions of file, the width in bytes including the row padding, as
+ * the w and h of an image32_t of it.
+ * Returns 1 if successful, -1 otherwise.
+ */
+int
+imagefile_size(const struct imagefile *file, size_t *width, size_t *height)
+{
+    if (!file || !width || !height) {
+        errno = EINVAL;
+        return -1;
+    }
+    *width = (file_width(file) * 3 + 3) & ~(size_t)3;
+    *height = file_height(file);
+    return 1;
+}
+
+/**
+ * Copies the pixels of file into dest, whose size must be that given by
+ * imagefile_size; a stream must not have had any rows read yet.
+ * Returns 1 if successful, -1 otherwise.
+ */
+int
+imagefile_read(struct imagefile *file, struct image32_t *dest)
+{
+    if (!file) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (file->in)
+        return read_next_rows(file, 0, dest);
+    if (file->format == FORMAT_PNM)
+        return pnm_map_rows_to32(&file->map.pnm, 0, dest);
+    return bmp_map_to32(&file->map.bmp, dest);
+}
+
+/**
+ * Copies dest->h rows of file from row y, counting from the bottom, into
+ * dest, whose w must be that given by imagefile_size; only the pages of
+ * the file holding those rows are read. The rows of a stream must be the
+ * next it holds (see imagefile_topfirst), each is read once.
+ * Returns 1 if successful, -1 otherwise.
+ */
+int
+imagefile_read_rows(struct imagefile *file, size_t y, struct image32_t *dest)
+{
+    if (!file) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (file->in)
+        return read_next_rows(file, y, dest);
+    if (file->format == FORMAT_PNM)
+        return pnm_map_rows_to32(&file->map.pnm, y, dest);
+    return bmp_map_rows_to32(&file->map.bmp, y, dest);
+}
+
+/**
+ * Writes image to a new file at dest with the headers of file, which
+ * image must have the size of. Bmp files not already 24 bit and bottom up
+ * get a plain 24 bit header instead of their own; pgm and ppm files keep
+ * their channels, with samples up to 255. Bmp headers and rows go out
+ * together in a few writev calls (see bmp_write32).
+ * Returns 1 if successful, -1 otherwise.
+ */
+int
+imagefile_write(const struct imagefile *file, const struct image32_t *image,
+                const char *dest)
+{
+    if (!file || !image || image->h != file_height(file)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (file->format == FORMAT_BMP) {
+        uint8_t made[BMP_HEADER_SIZE];
+        const uint8_t *header;
+        size_t size;
+        if (bmp_headers(&file->map.bmp, 0, made, &header, &size) < 0)
+            return -1;
+        return bmp_write32(dest, header, size, image, file->map.bmp.width);
+    }
+
+    FILE *out = imagefile_create(file, dest);
+    if (!out)
+        return -1;
+    int ok = imagefile_write_rows(file, out, 0, image) == 1;
+    if (fclose(out) != 0 || !ok)
+        return -1;
+    return 1;
+}
+
+/**
+ * Creates the file dest and writes the headers of file to it, for the
+ * rows of imagefile_write_rows to follow.
+ * Returns the open stream if successful, NULL otherwise.
+ */
+FILE *
+imagefile_create(const struct imagefile *file, const char *dest)
+{
+    if (!file || !dest) {
+        errno = EINVAL;
+        return NULL;
+    }
+    FILE *out = fopen(dest, "wb");
+    if (!out)
+        return NULL;
+    if (imagefile_start(file, out) < 0) {
+        fclose(out);
+        return NULL;
+    }
+    return out;
+}
+
+/**
+ * Writes the headers of file to out, an open stream that need not be
+ * seekable, such as stdout, for the rows of imagefile_write_rows to
+ * follow.
+ * Returns 1 if successful, -1 otherwise.
+ */
+int
+imagefile_start(const struct imagefile *file, FILE *out)
+{
+    if (!file || !out) {
+        errno = EINVAL;
+        return -1;
+    }
+    return write_header(file, out);
+}
+
+/**
+ * Writes the rows of image, whose w must be that given by imagefile_size,
+ * to out, a stream of imagefile_create or imagefile_start, as rows y on
+ * of the output, counting from the bottom. Rows are appended in the order
+ * of imagefile_topfirst, so bands must come in that order, unless out is
+ * seekable and the output goes top row first: those bands are put in
+ * place and may come in any order.
+ * Returns 1 if successful, -1 otherwise.
+ */
+int
+imagefile_write_rows(const struct imagefile *file, FILE *out, size_t y,
+                     const struct image32_t *image)
+{
+    size_t w, h;
+    if (!file || !out || !image || !image->buf
+        || imagefile_size(file, &w, &h) < 0 || image->w != w
+        || y > h || image->h > h - y) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (imagefile_topfirst(file))
+        return write_topfirst(file, out, y, image);
+
+    const size_t rows = w < WRITE_CHUNK ? WRITE_CHUNK / w : 1;
+    uint8_t *chunk = malloc(rows * w);
+    if (!chunk) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    int ok = 1;
+    const uint8_t *src = (const uint8_t *)image->buf;
+    for (size_t i = 0; ok && i < image->h; i += rows) {
+        const size_t n = image->h - i < rows ? image->h - i : rows;
+        for (size_t j = 0; j < n; ++j)
+            bmp_row_from32(chunk + j * w, src + (i + j) * w, w,
+                           file->map.bmp.width);
+        ok = fwrite(chunk, w, n, out) == n;
+    }
+
+    free(chunk);
+    return ok ? 1 : -1;
+}
 
 /** 
  * Updates the variables pointed to by width and height
@@ -34,28 +390,18 @@ get_image_size(const char *src, size_t *width, size_t *height)
         return -1;
     }
     
-    FILE *fp = fopen(src, "rb");
-    if (!fp) {
+    struct imagefile *file = imagefile_open(src);
+    if (!file)
         return -1;
-    }
-
-    if (isbmp(fp)) {
-        struct bmp_fheader bfh;
-        struct bmp_iheader bih;
-        
-        read_bmpheaders(fp, &bfh, &bih);
 
-        print_bih(&bih);
-
-        *width = bmp_width(&bih) + bmp_padding((int)bmp_width(&bih));
-        *height = bih.imageHeight;
-
-        printf("bmp_width: %lu, padding: %d\n", bmp_width(&bih), bmp_padding(bmp_width(&bih)));
-        printf("width: %lu, height: %lu\n", *width, *height);
-    }
-    
-    fclose(fp);
+    if (file->format == FORMAT_BMP)
+        print_bih(&file->map.bmp.bih);
+    imagefile_size(file, width, height);
+    printf("bmp_width: %lu, padding: %lu\n", file_width(file) * 3,
+           *width - file_width(file) * 3);
+    printf("width: %lu, height: %lu\n", *width, *height);
 
+    imagefile_close(file);
     return *width * *height;
 }
 
@@ -73,6 +419,8 @@ allocate_image_buf(size_t size)
 /**
  * Reads size bytes from the file pointed to by src
  * and writes them to the image buffer pointed to by dest.
+ * The file is mapped rather than read, so its pixels are copied once,
+ * straight into dest.
  * Returns 1 if successful, -1 otherwise.
  **/
 int
@@ -83,31 +431,21 @@ read_image(const char *src, int32_t *dest, size_t size)
         return -1;
     }
 
-    FILE *fp = fopen(src, "rb");
-    if (!fp)
+    struct imagefile *file = imagefile_open(src);
+    if (!file)
         return -1;
+    if (file->format == FORMAT_BMP)
+        print_bfh(&file->map.bmp.bfh);
 
-    int8_t *tempbuf = malloc(size);
-
-    if (isbmp(fp)) {
-        /* parses bmp_headers to get the offset to the image data */
-        struct bmp_fheader bfh = {0};    
-        struct bmp_iheader bih = {0};    
-        read_bmpheaders(fp, &bfh, &bih);
-        print_bfh(&bfh);
-        const int offset = bfh.offset;
-
-        fseek(fp, offset, SEEK_SET);
-        fread(tempbuf, size, 1, fp);
-
-        pack(dest, tempbuf, size);
-    }
-    
-    free(tempbuf);
-    tempbuf = NULL;
-    
-    fclose(fp);
-    return 1;
+    struct image32_t image = { dest, 0, 0 };
+    imagefile_size(file, &image.w, &image.h);
+    int res = -1;
+    if (size != image.w * image.h)
+        errno = EINVAL;
+    else
+        res = imagefile_read(file, &image);
+    imagefile_close(file);
+    return res;
 }
 
 /**
@@ -124,28 +462,19 @@ write_image(int32_t *image, char *src, char *dest, size_t size)
         return -1;
     }
 
-    FILE *in = fopen(src, "rb");
-    FILE *out = fopen(dest, "wb");
-    if (!in || !out)
+    struct imagefile *file = imagefile_open(src);
+    if (!file)
         return -1;
-    
-    int8_t *tempbuf = malloc(size);
-
-    if (isbmp(in)) {
-        /* reads and then writes bmp_headers to the file at dest */
-        struct bmp_fheader bfh = {0};    
-        struct bmp_iheader bih = {0};    
-        read_bmpheaders(in, &bfh, &bih);
-        create_bmp_file(out, &bfh, &bih);
 
-        unpack(tempbuf, image, size);
-        write_bmp_buf(out, tempbuf, bfh.offset, size);
-    }
-
-    free(tempbuf);
-    fclose(in);
-    fclose(out);
-    return 1;
+    struct image32_t img = { image, 0, 0 };
+    imagefile_size(file, &img.w, &img.h);
+    int res = -1;
+    if (size != img.w * img.h)
+        errno = EINVAL;
+    else
+        res = imagefile_write(file, &img, dest);
+    imagefile_close(file);
+    return res;
 }
 
 /**
@@ -163,63 +492,195 @@ free_image_buf(int32_t *image)
  * static functions start here
  */
 
-/* it is a bmp if the first two bytes of the file are 0x4D42 */
+/* tells the format of a file from its magic, -1 if it is none known */
 static int
-isbmp(FILE *fp)
+file_format(const uint8_t *data, size_t size, enum file_format *format)
 {
-    return read_ftype(fp) == 0x4D42;
+    assert(data && format && "Is validated by the caller.");
+
+    if (size >= 2 && data[0] == 'B' && data[1] == 'M')
+        *format = FORMAT_BMP;
+    else if (size >= 2 && data[0] == 'P' && (data[1] == '5' || data[1] == '6'))
+        *format = FORMAT_PNM;
+    else
+        return -1;
+    return 1;
 }
 
-/** 
- * the first two bytes of an image header specifies its filetype
- * return it. 
- */
-static uint16_t
-read_ftype(FILE *fp)
+/* width of the image of file, in pixels */
+static size_t
+file_width(const struct imagefile *file)
 {
-    assert(fp && "Is validated by the caller.");
+    return file->format == FORMAT_BMP ? file->map.bmp.width
+                                      : file->map.pnm.width;
+}
 
-    uint16_t ftype = 0;
-    fread(&ftype, sizeof(ftype), 1, fp);
-    rewind(fp);
-    return ftype;
+/* height of the image of file, in rows */
+static size_t
+file_height(const struct imagefile *file)
+{
+    return file->format == FORMAT_BMP ? file->map.bmp.height
+                                      : file->map.pnm.height;
 }
 
-/* reads the bmp headers from the file pointed to by fp 
- * returns the fp to the beginning of the file when done
+/* bytes of a row as file holds it */
+static size_t
+file_stride(const struct imagefile *file)
+{
+    return file->format == FORMAT_BMP ? file->map.bmp.stride
+                                      : file->map.pnm.stride;
+}
+
+/**
+ * reads the next dest->h rows of the stream of file, which must be rows y
+ * on, counting from the bottom, a row at a time and each converted as it
+ * arrives, as the rows of a mapping are
  */
 static int
-read_bmpheaders(FILE *fp, struct bmp_fheader *bfhead, 
-                          struct bmp_iheader *bihead)
-{
-    assert(fp && "Is validated by the caller");
-
-    fread(&bfhead->ftype, sizeof(uint16_t), 1, fp);
-    fread(&bfhead->fsize, sizeof(uint32_t), 1, fp);
-    fread(&bfhead->reserved1, sizeof(uint16_t), 1, fp);
-    fread(&bfhead->reserved2, sizeof(uint16_t), 1, fp);
-    fread(&bfhead->offset, sizeof(uint32_t), 1, fp);
-    fread(bihead, sizeof(struct bmp_iheader), 1, fp);
-    rewind(fp);
+read_next_rows(struct imagefile *file, size_t y, struct image32_t *dest)
+{
+    assert(file && file->in && "Is validated by the caller.");
+
+    size_t w, h;
+    imagefile_size(file, &w, &h);
+    const int topfirst = imagefile_topfirst(file);
+    if (!dest || !dest->buf || dest->w != w || y > h || dest->h > h - y
+        || (topfirst ? h - y - dest->h : y) != file->nread) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* a map of the one row just read, so it converts as mapped rows do */
+    struct bmp_map bmp = file->map.bmp;
+    struct pnm_map pnm = file->map.pnm;
+    bmp.pixels = pnm.pixels = file->row;
+    bmp.height = pnm.height = 1;
+    bmp.topdown = 0;
+
+    const size_t stride = file_stride(file);
+    for (size_t i = 0; i < dest->h; ++i) {
+        if (fread(file->row, 1, stride, file->in) != stride) {
+            errno = EIO;
+            return -1;
+        }
+        file->nread++;
+        struct image32_t row = {
+            (int32_t *)((uint8_t *)dest->buf
+                        + (topfirst ? dest->h - 1 - i : i) * w), w, 1
+        };
+        if (file->format == FORMAT_BMP)
+            bmp_map_rows_to32(&bmp, 0, &row);
+        else
+            pnm_map_rows_to32(&pnm, 0, &row);
+    }
     return 1;
 }
 
-/* writes the headers into the file pointed to by fp */
+/**
+ * writes the headers of file to out, and whatever sits between them and
+ * the pixels, or headers of the same image as 24 bits bottom up if it is
+ * held otherwise; pgm and ppm files get a header of samples up to 255
+ */
+static int
+write_header(const struct imagefile *file, FILE *out)
+{
+    assert(file && out && "Is validated by the caller.");
+
+    if (file->format == FORMAT_PNM) {
+        char header[PNM_HEADER_MAX];
+        const struct pnm_map *pnm = &file->map.pnm;
+        const int len = pnm_header(header, pnm->channels, pnm->width,
+                                   pnm->height);
+        if (len < 0)
+            return -1;
+        return fwrite(header, 1, (size_t)len, out) == (size_t)len ? 1 : -1;
+    }
+
+    uint8_t made[BMP_HEADER_SIZE];
+    const uint8_t *header;
+    size_t size;
+    if (bmp_headers(&file->map.bmp, imagefile_topfirst(file), made, &header,
+                    &size) < 0)
+        return -1;
+    return fwrite(header, 1, size, out) == size ? 1 : -1;
+}
+
+/**
+ * points header at the headers of map and whatever sits between them and
+ * the pixels, size bytes, or at headers of the same image as 24 bits
+ * bottom up, or top-down if topdown, made in made, if it is held otherwise
+ */
 static int
-create_bmp_file(FILE *fp, struct bmp_fheader *bfhead, 
-                          struct bmp_iheader *bihead) 
+bmp_headers(const struct bmp_map *map, int topdown, uint8_t *made,
+            const uint8_t **header, size_t *size)
 {
-    assert(fp && "Is validated by the caller");
+    assert(map && made && header && size && "Is validated by the caller.");
 
-    fwrite(&bfhead->ftype, sizeof(uint16_t), 1, fp);
-    fwrite(&bfhead->fsize, sizeof(uint32_t), 1, fp);
-    fwrite(&bfhead->reserved1, sizeof(uint16_t), 1, fp);
-    fwrite(&bfhead->reserved2, sizeof(uint16_t), 1, fp);
-    fwrite(&bfhead->offset, sizeof(uint32_t), 1, fp);
-    fwrite(bihead, sizeof(struct bmp_iheader), 1, fp);
+    if (map->bpp == 24 && map->bih.compressionType == BMP_RGB
+        && map->topdown == topdown) {
+        *header = map->data;
+        *size = map->bfh.offset;
+        return 1;
+    }
+    if (bmp_header(made, map->width, map->height, topdown,
+                   map->bih.XpxlsPerMeter, map->bih.YPxlsPerMeter) < 0)
+        return -1;
+    *header = made;
+    *size = BMP_HEADER_SIZE;
     return 1;
 }
 
+/**
+ * writes the rows of image as rows y on of an output going top row first,
+ * counting from the bottom, so the top one of them first, after a single
+ * seek to where they go if out is seekable and not there already
+ */
+static int
+write_topfirst(const struct imagefile *file, FILE *out, size_t y,
+               const struct image32_t *image)
+{
+    assert(file && out && image && "Is validated by the caller.");
+
+    /* the rows go after the headers write_header wrote, whatever their
+     * size: those of the source are kept as they are where they can be */
+    const struct pnm_map *pnm = &file->map.pnm;
+    char header[PNM_HEADER_MAX];
+    uint8_t made[BMP_HEADER_SIZE];
+    const uint8_t *bmp;
+    size_t size;
+    const int len = file->format != FORMAT_BMP
+                    ? pnm_header(header, pnm->channels, pnm->width,
+                                 pnm->height)
+                    : bmp_headers(&file->map.bmp, imagefile_topfirst(file),
+                                  made, &bmp, &size) < 0 || size > INT_MAX
+                    ? -1 : (int)size;
+    const size_t stride = file->format == FORMAT_BMP ? image->w : pnm->stride;
+    uint8_t *row = malloc(stride);
+    if (len < 0 || !row) {
+        free(row);
+        errno = len < 0 ? EINVAL : ENOMEM;
+        return -1;
+    }
+
+    /* a pipe has no position, its bands come in order */
+    const size_t top = file_height(file) - y - image->h;
+    const size_t offset = (size_t)len + top * stride;
+    const long at = ftell(out);
+    int ok = at < 0 || (size_t)at == offset
+             || (offset <= LONG_MAX && fseek(out, (long)offset, SEEK_SET) == 0);
+    for (size_t i = image->h; ok && i-- > 0;) {
+        const uint8_t *src = (const uint8_t *)image->buf + i * image->w;
+        if (file->format == FORMAT_BMP)
+            bmp_row_from32(row, src, image->w, file->map.bmp.width);
+        else
+            pnm_row_from32(row, src, pnm->width, pnm->channels);
+        ok = fwrite(row, 1, stride, out) == stride;
+    }
+
+    free(row);
+    return ok ? 1 : -1;
+}
+
 /* swaps a BGR pixel to an RGB pixel, ignoring the leading unused byte */
 static int
 swap_colorendian(int32_t *image, size_t size)
@@ -235,22 +696,6 @@ swap_colorendian(int32_t *image, size_t size)
     return 1;
 }
 
-/** 
- * writes size bytes starting from the offset of the image buffer
- * pointed to by image into the stream pointed to by fp
- */
-static int
-write_bmp_buf(FILE *fp, const int8_t *image, size_t offset, size_t size)
-{
-    assert(fp && "Is validated by the caller.");
-    assert(image && "Is validated by the caller.");
-
-    fseek(fp, offset, SEEK_SET);
-    // fwrite(image, sizeof(image[0]), size / sizeof(image[0]), fp);
-    fwrite(image, size, 1, fp);
-    return 1;
-}
-
 /**
  * pack a byte array into a 4byte one creating a packed "pixel",
  * which follows the following pattern:
@@ -258,46 +703,123 @@ write_bmp_buf(FILE *fp, const int8_t *image, size_t offset, size_t size)
  * i1: 0xggrr)(bbgg,
  * i2: 0xrr)(bbggrr)
  * where the grouped bytes are RGB pixels and repeats indefinetely
+ * The bytes of each int32 are swapped with pshufb, 32 or 16 bytes at a
+ * time where AVX2 or SSSE3 is there (see swap_words).
+ * Returns the number of int32 written.
  * NOTE: src must have a size divisble by 4
  */
 int
-pack(int32_t *dest, int8_t *src, size_t size) {
-    size_t count = 0;
-    const size_t PACKSIZE = 4;
-    uint8_t b1 = 0, b2 = 0, b3 = 0, b4 = 0;
-    printf("pack: size = %ld\n", size);
-    
-    for (size_t i = 0; i < size; i += PACKSIZE) {
-        b1 = (uint8_t)(src[i] & 0xFF);
-        b2 = (uint8_t)(src[i+1] & 0xFF);
-        b3 = (uint8_t)(src[i+2] & 0xFF);
-        b4 = (uint8_t)(src[i+3] & 0xFF);
-        
-        dest[count++] = (b1 << 24) | (b2 << 16) | (b3 << 8) | b4;
-    }
-    printf("pack: dest_count = %d\n", count);
-    return count;
+pack(int32_t *dest, int8_t *src, size_t size)
+{
+    swap_words((uint8_t *)dest, (const uint8_t *)src, size / 4);
+    return (int)(size / 4);
 }
 
+/**
+ * unpacks the int32 of src into the size bytes at dest in file order, the
+ * inverse of pack.
+ * Returns the number of bytes written.
+ */
 int 
 unpack(int8_t *dest, int32_t *src, size_t size)
 {
-    size_t count = 0;
-    int8_t b1 = 0, b2 = 0, b3 = 0, b4 = 0;
-    printf("unpack: size = %ld\n", size);
-    
-    for (size_t i = 0; i < size/4; ++i) {
-        b4 = (int8_t)(src[i] & 0x000000FF);
-        b3 = (int8_t)((src[i] & 0x0000FF00) >> 8);
-        b2 = (int8_t)((src[i] & 0x00FF0000) >> 16);
-        b1 = (int8_t)((src[i] & 0xFF000000) >> 24);
-
-        dest[count++] = b1;
-        dest[count++] = b2;
-        dest[count++] = b3;
-        dest[count++] = b4;
+    swap_words((uint8_t *)dest, (const uint8_t *)src, size / 4);
+    return (int)(size / 4 * 4);
+}
+
+/**
+ * packs the size bytes of a file already read into buf where they are,
+ * as pack, so no second buffer of the image is needed.
+ * Returns the number of int32 packed.
+ */
+int
+pack_inplace(int32_t *buf, size_t size)
+{
+    swap_words((uint8_t *)buf, (const uint8_t *)buf, size / 4);
+    return (int)(size / 4);
+}
+
+/**
+ * unpacks the int32 of buf where they are into size bytes in file order,
+ * as unpack, ready to be written as they are.
+ * Returns the number of bytes unpacked.
+ */
+int
+unpack_inplace(int32_t *buf, size_t size)
+{
+    swap_words((uint8_t *)buf, (const uint8_t *)buf, size / 4);
+    return (int)(size / 4 * 4);
+}
+
+/**
+ * swaps the bytes of the nwords int32 at src into dest, which may be src:
+ * file order to the packed pixel format and back are the same swap. Each
+ * kernel carries on where the last one stopped.
+ */
+static void
+swap_words(uint8_t *dest, const uint8_t *src, size_t nwords)
+{
+    assert(((dest && src) || !nwords) && "Is validated by the caller.");
+
+    size_t done = 0;
+#ifdef IMAGEIO_X86
+    if (__builtin_cpu_supports("avx2"))
+        done = swap_avx2(dest, src, 0, nwords);
+    if (__builtin_cpu_supports("ssse3"))
+        done = swap_ssse3(dest, src, done, nwords);
+#endif
+    swap_scalar(dest, src, done, nwords);
+}
+
+/* swaps int32 i on, the pointers need not be aligned */
+static void
+swap_scalar(uint8_t *dest, const uint8_t *src, size_t i, size_t nwords)
+{
+    for (; i < nwords; ++i) {
+        uint32_t word;
+        memcpy(&word, src + 4 * i, 4);
+        word = __builtin_bswap32(word);
+        memcpy(dest + 4 * i, &word, 4);
+    }
+}
+
+#ifdef IMAGEIO_X86
+/**
+ * swaps 4 int32 at a time from int32 i on, returning the int32 it stopped
+ * at; each vector is loaded before it is stored, so dest may be src
+ */
+__attribute__((target("ssse3")))
+static size_t
+swap_ssse3(uint8_t *dest, const uint8_t *src, size_t i, size_t nwords)
+{
+    const __m128i mask = _mm_loadu_si128((const __m128i *)bswap_mask);
+    for (; i + 4 <= nwords; i += 4) {
+        const __m128i v = _mm_loadu_si128((const __m128i *)(src + 4 * i));
+        _mm_storeu_si128((__m128i *)(dest + 4 * i),
+                         _mm_shuffle_epi8(v, mask));
     }
-    printf("unpack: dest_count = %d\n", count);
-    return count;
+    return i;
 }
 
+/**
+ * swaps 16 int32 at a time, two vectors of 8 so loads and stores overlap,
+ * as swap_ssse3; pshufb stays in its lanes, and so do the int32
+ */
+__attribute__((target("avx2")))
+static size_t
+swap_avx2(uint8_t *dest, const uint8_t *src, size_t i, size_t nwords)
+{
+    const __m256i mask = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128((const __m128i *)bswap_mask));
+    for (; i + 16 <= nwords; i += 16) {
+        const __m256i a = _mm256_loadu_si256((const __m256i *)(src + 4 * i));
+        const __m256i b = _mm256_loadu_si256(
+            (const __m256i *)(src + 4 * i + 32));
+        _mm256_storeu_si256((__m256i *)(dest + 4 * i),
+                            _mm256_shuffle_epi8(a, mask));
+        _mm256_storeu_si256((__m256i *)(dest + 4 * i + 32),
+                            _mm256_shuffle_epi8(b, mask));
+    }
+    return i;
+}
+#endif
@@ -2,122 +2,110 @@
 #include <assert.h> /* for assert */
 #include <errno.h> /* for errno */
 #include <limits.h> /* for UINT_MAX */ 
-#include <math.h> /* for sqrt */
-#include <stdint.h> /* for uint16_t */
+#include <stdint.h> /* for uint8_t, uint16_t */
 #include <stdlib.h> /* for malloc, exit, abs */
 #include <stdio.h> /* for printf */
 #include "../include/imageproc.h"
+#include "../include/dither.h"
+#include "../include/tiles.h"
 #include "../include/bmp.h"
 
 extern int errno; /* these functions set errno on errors */
 
-static int apply_threshold(int32_t color, int32_t matval, int32_t offset,
-                int32_t *thresholds); 
-
 /**
- * ordered dithering with Bayer matrices
- * eq: c' = closestfrompal(c + r * (M(x%n, y%n) - 0.5))
- * r = 256 / N - 1 (N^3 evenly choosen colors in palette)
+ * ordered dithering with an 8x8 Bayer matrix and two levels per channel,
+ * 8 colours in all
+ * NOTE: the original pass looked each pixel up in an 18 colour palette
+ * (with 0x80 levels) but wrote back the thresholded colour, rounded to 0
+ * or 255 per channel, so its output held these same 8 colours; to map to
+ * a palette, follow this with palette_map
  */
 int ordered_dithering(struct image32_t *image)
 {
-    if (!image || !image->buf)
-        return -1;
-
-    int32_t pal[] = {
-        0x000000, 0x008000, 0x00FF00,
-        0x0000FF, 0x0080FF, 0x00FFFF,
-        0x800000, 0x808000, 0x80FF00,
-        0x8000FF, 0x8080FF, 0x80FFFF,
-        0xFF0000, 0xFF8000, 0xFFFF00,
-        0xFF00FF, 0xFF80FF, 0xFFFFFF
-    };
-    size_t npal = sizeof(pal) / sizeof(pal[0]);
-
-    /* using an 8x8 Bayer matrix */
-    const size_t dim = 4;
-    int32_t mat[] = {
-        0, 8, 2, 10,
-        12, 4, 14, 6,
-        3, 11, 1, 9,
-        15, 7, 13, 5
-    };
-    const size_t nmat = sizeof(mat) / sizeof(mat[0]);
-    int32_t thresholds[] = { 256/4, 256/4, 256/4 };
+    return ordered_dithering_n(image, 8, 2);
+}
 
-    int32_t offset = (dim * (dim / 2)) - 0.5;
-    // bayer_sqrmat(mat, dim);
+/**
+ * ordered dithering with Bayer matrices, in place on the packed buffer
+ * eq: c' = floor((c + s * (M(x%n, y%n) + 0.5) / n^2) / s) * s
+ * s = 255 / (N - 1) (N evenly spaced levels per channel)
+ * Returns 1 if successful, -1 otherwise (errno EINVAL unless dim is 2, 4, 8
+ * or 16 and 255 is a multiple of levels - 1).
+ */
+int
+ordered_dithering_n(struct image32_t *image, size_t dim, unsigned levels)
+{
+    return ordered_dithering_tiled(image, dim, levels, NULL);
+}
 
-    /* iterate over 3 packed pixels at a time, unpacking them into 4 */
-    int32_t packed[3];
-    int32_t factors[4];
-    int32_t unpacked[4];
-    int32_t processed[4];
-    int32_t closest[4];
-    int32_t nextclosest[4];
-    for (size_t i = 0; i < image->h * image->w / PXLSIZE; i += 3) {
-        factors[0] = mat[i % nmat];
-        factors[1] = mat[(i+1) % nmat];
-        factors[2] = mat[(i+2) % nmat];
-        // a hacky way of using the next pixel's factor rightnow
-        if (i+3 < image->h * image->w / PXLSIZE)
-            factors[3] = mat[(i+3) % nmat];
-        else
-            factors[3] = mat[(i+2) % nmat];
+/**
+ * ordered_dithering_n spread over the threads of pool in tiles,
+ * the output is the same as the serial one for any pool
+ */
+int
+ordered_dithering_tiled(struct image32_t *image, size_t dim, unsigned levels,
+                        struct workpool *pool)
+{
+    if (!image || !image->buf)
+        return -1;
 
-        packed[0] = image->buf[i];
-        packed[1] = image->buf[i+1];
-        packed[2] = image->buf[i+2];
-        unpackthree(unpacked, packed);
+    /* one threshold row per matrix row, already in packed byte order */
+    struct dither_job job;
+    if (dither_job_init(&job, dim, levels, DITHER_PACKED32) < 0)
+        return -1;
 
-        processed[0] = apply_threshold(unpacked[0], factors[0], offset, thresholds);
-        processed[1] = apply_threshold(unpacked[1], factors[1], offset, thresholds);
-        processed[2] = apply_threshold(unpacked[2], factors[2], offset, thresholds);
-        processed[3] = apply_threshold(unpacked[3], factors[3], offset, thresholds);
+    /* rows start on an int32 boundary as w is a multiple of 4 */
+    return tiles_run(image, dither_span, &job, pool);
+}
 
-        closest[0] = closestfrompal(processed[0], pal, npal);
-        closest[1] = closestfrompal(processed[1], pal, npal);
-        closest[2] = closestfrompal(processed[2], pal, npal);
-        closest[3] = closestfrompal(processed[3], pal, npal);
+/**
+ * ordered dithering with the blue noise texture instead of a Bayer matrix,
+ * which leaves no cross-hatching on gradients; tiled like
+ * ordered_dithering_tiled and just as fast once the texture is loaded
+ */
+int
+blue_noise_dithering(struct image32_t *image, unsigned levels,
+                     struct workpool *pool)
+{
+    if (!image || !image->buf)
+        return -1;
 
-        packthree(processed, packed);
+    struct dither_job job;
+    if (dither_job_noise(&job, levels, DITHER_PACKED32) < 0)
+        return -1;
+    return tiles_run(image, dither_span, &job, pool);
+}
 
-        image->buf[i] = packed[0];
-        image->buf[i+1] = packed[1];
-        image->buf[i+2] = packed[2];
-    }
-    return 1;
+/**
+ * inverts every channel byte of image, spread over the threads of pool
+ */
+int
+invert_image(struct image32_t *image, struct workpool *pool)
+{
+    return tiles_run(image, invert_span, NULL, pool);
 }
 
 /**
- * returns a Bayer matrix of X width and Y height
+ * returns a Bayer matrix of dim width and dim height
  * Algorithm for assigning slot (x, y):
  * 1. Take two values: the y coordinate and the XOR of the x and y coordinates,
  * 2. Interleave their bits in reverse order,
- * 3. Floating point divide the result by N (x * y)
+ * the dithering itself uses the precomputed tables in dither.c instead
+ * NOTE: dim must be a power of two no larger than 16
  */
 void
 bayer_sqrmat(int32_t *mat, size_t dim)
 {
-    printf(" X=%lu, Y=%lu:\n", dim, dim);
-    for (size_t y = 0; y < dim; ++y) {
-        printf("    ");
-        for (size_t x = 0; x < dim; ++x) {
-            uint32_t xc = x ^ y, yc = y;
-            uint32_t res = 0;
-            uint32_t mask = 2;
-            for(uint32_t bit = 0; bit < 6; --mask) {
-                res |= ((yc >> mask) & 1) << bit++;
-                res |= ((xc >> mask) & 1) << bit++;
-            }
-            mat[x + y * dim] = res;
-            printf("%4d", res);
-        }
-        printf(" |");
-        if (y == 0)
-            printf(" 1/%lu", dim * dim);
-        printf("\n");
-    }
+    assert(dim && dim <= DITHER_MAXDIM && !(dim & (dim - 1)) && 
+            "Is validated by the caller.");
+
+    size_t k = 0;
+    while (((size_t)1 << k) < dim)
+        ++k;
+
+    for (size_t y = 0; y < dim; ++y)
+        for (size_t x = 0; x < dim; ++x)
+            mat[x + y * dim] = BAYER(k, x, y);
 }
 
 int 
@@ -129,21 +117,19 @@ setpixel(struct image32_t *image, int32_t pixel, size_t x, size_t y)
 
 /**
  * ignores the two leftmost bytes (MSB + it's neighbor)
+ * NOTE: a linear scan, use palette_closest for per-pixel lookups
  */
 int32_t
 closestfrompal(int32_t color, int32_t *pal, size_t n)
 {
-    // use euclidean RGB distances to determine closeness
+    // use squared euclidean RGB distances to determine closeness
     int32_t d = INT32_MAX - 1, min = INT32_MAX, res = INT32_MAX;
     int32_t r = 0, g = 0, b = 0;
     for (size_t i = 0; i < n; ++i) {
-        b = (pal[i] & 0xFF0000) >> 16;
-        g = (pal[i] & 0x00FF00) >> 8;
-        r = pal[i] & 0x0000FF;
-        d = sqrt( pow(abs(b - ((color & 0xFF0000) >> 16)), 2) +
-                  pow(abs(g - ((color & 0x00FF00) >> 8)), 2) +
-                  pow(abs(r - (color & 0x0000FF)), 2)
-            );
+        b = ((pal[i] & 0xFF0000) >> 16) - ((color & 0xFF0000) >> 16);
+        g = ((pal[i] & 0x00FF00) >> 8) - ((color & 0x00FF00) >> 8);
+        r = (pal[i] & 0x0000FF) - (color & 0x0000FF);
+        d = b * b + g * g + r * r;
 
         if (d < min) {
            min = d;
@@ -153,30 +139,6 @@ closestfrompal(int32_t color, int32_t *pal, size_t n)
     return res;
 }
 
-/**
- * applies the following equation on the passed in color:
- * color = color + factor * threshold, on each BGR component
- * NOTE: threshold size must be 3
- */
-static int32_t
-apply_threshold(int32_t color, int32_t matval, int32_t offset,
-                int32_t *thresholds) 
-{
-    assert(thresholds && "Is validated by the caller.");
-
-    float r, g, b;
-    b = (((color & 0x00FF0000) >> 16) + thresholds[0] * (matval - offset));
-    g = (((color & 0x0000FF00) >> 8) + thresholds[1] * (matval - offset));
-    r = ((color & 0x000000FF) + thresholds[2] * (matval - offset));
-
-    r = round(r / 255) * 255;
-    g = round(g / 255) * 255;
-    b = round(b / 255) * 255;
-    
-
-    return 0 | ((uint8_t)(b) << 16) | ((uint8_t)g << 8) | (uint8_t)r;
-}
-
 /**
  * returns the ith pixel at the given x and y byte coordinate
  * on error, returns -1
@@ -278,3 +240,35 @@ packthree(const int32_t *unpacked, int32_t *packed)
     packed[2] = (b2[2] << 24) | (b3[0] << 16) | (b3[1] << 8) | b3[2];
     return 1;
 }
+
+/**
+ * inverts nbytes channel bytes, a tile function
+ */
+void
+invert_span(uint8_t *span, size_t nbytes, size_t x, size_t y, void *arg)
+{
+    (void)x;
+    (void)y;
+    (void)arg;
+    for (size_t i = 0; i < nbytes; ++i)
+        span[i] = (uint8_t)(255 - span[i]);
+}
+
+/**
+ * replaces the channels of every pixel of a packed row with its BT.601
+ * luma, (77 R + 150 G + 29 B + 128) / 256, a tile function; the span must
+ * start on a pixel and an int32 boundary
+ */
+void
+gray_span(uint8_t *span, size_t nbytes, size_t x, size_t y, void *arg)
+{
+    (void)x;
+    (void)y;
+    (void)arg;
+    for (size_t i = 0; i + 3 <= nbytes; i += 3) {
+        /* file bytes are B, G, R; memory byte of file byte j is j ^ 3 */
+        uint8_t *b = &span[i ^ 3], *g = &span[(i + 1) ^ 3],
+                *r = &span[(i + 2) ^ 3];
+        *b = *g = *r = (uint8_t)((77 * *r + 150 * *g + 29 * *b + 128) >> 8);
+    }
+}
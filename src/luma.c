@@ -0,0 +1,322 @@
+/* luma.c - vectorised RGB to luma (and chroma) planes for motion search */
+#include <assert.h> /* for assert */
+#include <errno.h> /* for errno */
+#include <stdint.h> /* for uint8_t, int8_t */
+#include "../include/imageproc.h"
+#include "../include/luma.h"
+#include "../include/workpool.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h> /* for SSSE3 and AVX2 intrinsics */
+#define LUMA_X86 1
+#endif
+
+extern int errno; /* these functions set errno on errors */
+
+/* weights in 1/256 of a matrix, each row of them sums to 256 or 0 */
+struct weights {
+    int16_t y[3];  /* R, G, B */
+    int16_t cb[3];
+    int16_t cr[3];
+};
+
+static const struct weights matrices[] = {
+    [LUMA_BT601] = { { 77, 150, 29 }, { -43, -85, 128 }, { 128, -107, -21 } },
+    [LUMA_BT709] = { { 54, 183, 19 }, { -29, -99, 128 }, { 128, -116, -12 } }
+};
+
+/* a luma_from32 call, shared by its tasks */
+struct job {
+    struct luma_plane *dest;
+    const struct image32_t *src;
+    size_t width;
+    enum luma_matrix matrix;
+    size_t rows; /* per task */
+};
+
+#ifdef LUMA_X86
+/**
+ * pshufb masks that gather channel c of 16 packed pixels from the 16 byte
+ * vector v of the 48 bytes they span, [c][v], c being B, G, R in file
+ * order; file byte j of a row is memory byte j ^ 3, -128 clears a lane
+ */
+static const int8_t gather[3][3][16] = {
+    { {   3,    0,    5,   10,   15,   12, -128, -128,
+       -128, -128, -128, -128, -128, -128, -128, -128 },
+      {-128, -128, -128, -128, -128, -128,    1,    6,
+         11,    8,   13, -128, -128, -128, -128, -128 },
+      {-128, -128, -128, -128, -128, -128, -128, -128,
+       -128, -128, -128,    2,    7,    4,    9,   14 } },
+    { {   2,    7,    4,    9,   14, -128, -128, -128,
+       -128, -128, -128, -128, -128, -128, -128, -128 },
+      {-128, -128, -128, -128, -128,    3,    0,    5,
+         10,   15,   12, -128, -128, -128, -128, -128 },
+      {-128, -128, -128, -128, -128, -128, -128, -128,
+       -128, -128, -128,    1,    6,   11,    8,   13 } },
+    { {   1,    6,   11,    8,   13, -128, -128, -128,
+       -128, -128, -128, -128, -128, -128, -128, -128 },
+      {-128, -128, -128, -128, -128,    2,    7,    4,
+          9,   14, -128, -128, -128, -128, -128, -128 },
+      {-128, -128, -128, -128, -128, -128, -128, -128,
+       -128, -128,    3,    0,    5,   10,   15,   12 } }
+};
+#endif
+
+/* static function prototypes */
+static void row_scalar(uint8_t *dest, const uint8_t *row, size_t x,
+                size_t width, const int16_t *k);
+#ifdef LUMA_X86
+static size_t row_ssse3(uint8_t *dest, const uint8_t *row, size_t x,
+                size_t width, const int16_t *k);
+static size_t row_avx2(uint8_t *dest, const uint8_t *row, size_t x,
+                size_t width, const int16_t *k);
+#endif
+static void run_rows(void *arg, size_t task);
+static uint8_t chroma(const int16_t *k, unsigned r, unsigned g, unsigned b);
+
+/**
+ * Writes the luma of the width pixels of a packed row (as in image32_t,
+ * file bytes B, G, R) to dest, (kr R + kg G + kb B + 128) / 256.
+ * NOTE: row must start on an int32 boundary
+ */
+void
+luma_row(uint8_t *dest, const uint8_t *row, size_t width,
+         enum luma_matrix matrix)
+{
+    assert(dest && row && "Is validated by the caller.");
+    assert((matrix == LUMA_BT601 || matrix == LUMA_BT709)
+           && "Is validated by the caller.");
+
+    const int16_t *k = matrices[matrix].y;
+    size_t done = 0;
+#ifdef LUMA_X86
+    if (__builtin_cpu_supports("avx2"))
+        done = row_avx2(dest, row, 0, width, k);
+    if (__builtin_cpu_supports("ssse3"))
+        done = row_ssse3(dest, row, done, width, k);
+#endif
+    row_scalar(dest, row, done, width, k);
+}
+
+/**
+ * Converts a packed image width pixels wide (its w the padded row length
+ * 3 * width rounded up to 4) into its luma plane, which must be width x
+ * src->h and may then be used as a saru_bytemat frame or template. Rows
+ * are spread over the threads of pool, NULL converts them on the calling
+ * thread.
+ * Returns 1 if successful, -1 otherwise.
+ */
+int
+luma_from32(struct luma_plane *dest, const struct image32_t *src,
+            size_t width, enum luma_matrix matrix, struct workpool *pool)
+{
+    if (!dest || !dest->buf || !src || !src->buf
+        || src->w != ((width * 3 + 3) & ~(size_t)3)
+        || dest->wid != width || dest->hgt != src->h
+        || (matrix != LUMA_BT601 && matrix != LUMA_BT709)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (!width || !src->h)
+        return 1;
+
+    size_t ntasks = workpool_size(pool);
+    if (ntasks > src->h)
+        ntasks = src->h;
+    struct job job = { .dest = dest, .src = src, .width = width,
+                       .matrix = matrix,
+                       .rows = (src->h + ntasks - 1) / ntasks };
+    return workpool_run(pool, ntasks, run_rows, &job);
+}
+
+/**
+ * Decimates the chroma of a packed image (as luma_from32) to 4:2:0: each
+ * sample of the Cb and Cr planes, LUMA_CHROMA_DIM(width) x
+ * LUMA_CHROMA_DIM(src->h), is that of the mean colour of a 2 x 2 block,
+ * the blocks on an odd last row or column averaging the pixels they have.
+ * Samples are full range, 128 for gray.
+ * Returns 1 if successful, -1 otherwise.
+ */
+int
+chroma_from32(struct luma_plane *cb, struct luma_plane *cr,
+              const struct image32_t *src, size_t width,
+              enum luma_matrix matrix)
+{
+    if (!cb || !cb->buf || !cr || !cr->buf || !src || !src->buf
+        || src->w != ((width * 3 + 3) & ~(size_t)3)
+        || cb->wid != LUMA_CHROMA_DIM(width)
+        || cb->hgt != LUMA_CHROMA_DIM(src->h)
+        || cr->wid != cb->wid || cr->hgt != cb->hgt
+        || (matrix != LUMA_BT601 && matrix != LUMA_BT709)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    const struct weights *k = &matrices[matrix];
+    for (size_t cy = 0; cy < cb->hgt; ++cy) {
+        const size_t y0 = 2 * cy, y1 = y0 + 1 < src->h ? y0 + 1 : y0;
+        const uint8_t *rows[2] = {
+            (const uint8_t *)src->buf + y0 * src->w,
+            (const uint8_t *)src->buf + y1 * src->w
+        };
+        for (size_t cx = 0; cx < cb->wid; ++cx) {
+            const size_t x0 = 2 * cx, x1 = x0 + 1 < width ? x0 + 1 : x0;
+            const size_t xs[2] = { x0, x1 };
+            unsigned sum[3] = { 0, 0, 0 }; /* B, G, R */
+            for (size_t i = 0; i < 2; ++i)
+                for (size_t j = 0; j < 2; ++j)
+                    for (size_t c = 0; c < 3; ++c)
+                        sum[c] += rows[i][(3 * xs[j] + c) ^ 3];
+
+            /* the edge blocks count their pixels twice, the mean holds */
+            const unsigned b = (sum[0] + 2) / 4, g = (sum[1] + 2) / 4,
+                           r = (sum[2] + 2) / 4;
+            cb->buf[cy * cb->wid + cx] = chroma(k->cb, r, g, b);
+            cr->buf[cy * cr->wid + cx] = chroma(k->cr, r, g, b);
+        }
+    }
+    return 1;
+}
+
+/**
+ * static functions start here
+ */
+
+/* pixels x .. width - 1 of luma_row, one at a time */
+static void
+row_scalar(uint8_t *dest, const uint8_t *row, size_t x, size_t width,
+           const int16_t *k)
+{
+    for (; x < width; ++x) {
+        const size_t i = 3 * x;
+        const unsigned b = row[i ^ 3], g = row[(i + 1) ^ 3],
+                       r = row[(i + 2) ^ 3];
+        dest[x] = (uint8_t)((k[0] * r + k[1] * g + k[2] * b + 128) >> 8);
+    }
+}
+
+#ifdef LUMA_X86
+/**
+ * luma_row on 16 pixels (48 bytes) at a time from pixel x, returns the
+ * pixel it stopped at; the weighted sums fit 16 bits as the weights sum
+ * to 256
+ */
+__attribute__((target("ssse3")))
+static size_t
+row_ssse3(uint8_t *dest, const uint8_t *row, size_t x, size_t width,
+          const int16_t *k)
+{
+    __m128i masks[3][3];
+    for (size_t c = 0; c < 3; ++c)
+        for (size_t v = 0; v < 3; ++v)
+            masks[c][v] = _mm_loadu_si128((const __m128i *)gather[c][v]);
+    const __m128i zero = _mm_setzero_si128(), half = _mm_set1_epi16(128);
+    const __m128i kr = _mm_set1_epi16(k[0]), kg = _mm_set1_epi16(k[1]),
+                  kb = _mm_set1_epi16(k[2]);
+
+    for (; x + 16 <= width; x += 16) {
+        const uint8_t *p = row + 3 * x;
+        const __m128i v[3] = {
+            _mm_loadu_si128((const __m128i *)p),
+            _mm_loadu_si128((const __m128i *)(p + 16)),
+            _mm_loadu_si128((const __m128i *)(p + 32))
+        };
+        __m128i ch[3]; /* B, G, R of the 16 pixels */
+        for (size_t c = 0; c < 3; ++c)
+            ch[c] = _mm_or_si128(_mm_or_si128(
+                        _mm_shuffle_epi8(v[0], masks[c][0]),
+                        _mm_shuffle_epi8(v[1], masks[c][1])),
+                        _mm_shuffle_epi8(v[2], masks[c][2]));
+
+        __m128i lo = _mm_add_epi16(_mm_add_epi16(
+            _mm_mullo_epi16(_mm_unpacklo_epi8(ch[2], zero), kr),
+            _mm_mullo_epi16(_mm_unpacklo_epi8(ch[1], zero), kg)),
+            _mm_add_epi16(
+            _mm_mullo_epi16(_mm_unpacklo_epi8(ch[0], zero), kb), half));
+        __m128i hi = _mm_add_epi16(_mm_add_epi16(
+            _mm_mullo_epi16(_mm_unpackhi_epi8(ch[2], zero), kr),
+            _mm_mullo_epi16(_mm_unpackhi_epi8(ch[1], zero), kg)),
+            _mm_add_epi16(
+            _mm_mullo_epi16(_mm_unpackhi_epi8(ch[0], zero), kb), half));
+        lo = _mm_srli_epi16(lo, 8);
+        hi = _mm_srli_epi16(hi, 8);
+        _mm_storeu_si128((__m128i *)(dest + x), _mm_packus_epi16(lo, hi));
+    }
+    return x;
+}
+
+/**
+ * luma_row on 32 pixels at a time from pixel x: each 128 bit lane gathers
+ * 16 of them with the masks of row_ssse3, the unpacks and the pack stay
+ * in their lanes so the pixels come out in order
+ */
+__attribute__((target("avx2")))
+static size_t
+row_avx2(uint8_t *dest, const uint8_t *row, size_t x, size_t width,
+         const int16_t *k)
+{
+    __m256i masks[3][3];
+    for (size_t c = 0; c < 3; ++c)
+        for (size_t v = 0; v < 3; ++v)
+            masks[c][v] = _mm256_broadcastsi128_si256(
+                _mm_loadu_si128((const __m128i *)gather[c][v]));
+    const __m256i zero = _mm256_setzero_si256(), half = _mm256_set1_epi16(128);
+    const __m256i kr = _mm256_set1_epi16(k[0]), kg = _mm256_set1_epi16(k[1]),
+                  kb = _mm256_set1_epi16(k[2]);
+
+    for (; x + 32 <= width; x += 32) {
+        const uint8_t *p = row + 3 * x;
+        __m256i v[3];
+        for (size_t i = 0; i < 3; ++i)
+            v[i] = _mm256_inserti128_si256(_mm256_castsi128_si256(
+                       _mm_loadu_si128((const __m128i *)(p + 16 * i))),
+                       _mm_loadu_si128((const __m128i *)(p + 48 + 16 * i)), 1);
+        __m256i ch[3];
+        for (size_t c = 0; c < 3; ++c)
+            ch[c] = _mm256_or_si256(_mm256_or_si256(
+                        _mm256_shuffle_epi8(v[0], masks[c][0]),
+                        _mm256_shuffle_epi8(v[1], masks[c][1])),
+                        _mm256_shuffle_epi8(v[2], masks[c][2]));
+
+        __m256i lo = _mm256_add_epi16(_mm256_add_epi16(
+            _mm256_mullo_epi16(_mm256_unpacklo_epi8(ch[2], zero), kr),
+            _mm256_mullo_epi16(_mm256_unpacklo_epi8(ch[1], zero), kg)),
+            _mm256_add_epi16(
+            _mm256_mullo_epi16(_mm256_unpacklo_epi8(ch[0], zero), kb), half));
+        __m256i hi = _mm256_add_epi16(_mm256_add_epi16(
+            _mm256_mullo_epi16(_mm256_unpackhi_epi8(ch[2], zero), kr),
+            _mm256_mullo_epi16(_mm256_unpackhi_epi8(ch[1], zero), kg)),
+            _mm256_add_epi16(
+            _mm256_mullo_epi16(_mm256_unpackhi_epi8(ch[0], zero), kb), half));
+        lo = _mm256_srli_epi16(lo, 8);
+        hi = _mm256_srli_epi16(hi, 8);
+        _mm256_storeu_si256((__m256i *)(dest + x),
+                            _mm256_packus_epi16(lo, hi));
+    }
+    return x;
+}
+#endif
+
+/* a task of luma_from32, a run of rows */
+static void
+run_rows(void *arg, size_t task)
+{
+    const struct job *job = arg;
+    const size_t h = job->src->h, y0 = task * job->rows;
+    if (y0 >= h)
+        return;
+    const size_t y1 = h - y0 < job->rows ? h : y0 + job->rows;
+    for (size_t y = y0; y < y1; ++y)
+        luma_row(job->dest->buf + y * job->width,
+                 (const uint8_t *)job->src->buf + y * job->src->w,
+                 job->width, job->matrix);
+}
+
+/* a chroma sample with weights k, offset to 128 and clamped */
+static uint8_t
+chroma(const int16_t *k, unsigned r, unsigned g, unsigned b)
+{
+    int v = (k[0] * (int)r + k[1] * (int)g + k[2] * (int)b + 128 * 256
+             + 128) >> 8;
+    return (uint8_t)(v > 255 ? 255 : v);
+}
@@ -16,7 +16,7 @@ static void usage(char *progname, int opt);
 
 int main(int argc, char *argv[]) {
     int opt;
-    options_t options = { 0, 0x0, argv[0], NULL, NULL, stdin, stdout };
+    options_t options = { 0, 0x0, argv[0], NULL, NULL, stdin, stdout, 0, NULL };
 
     opterr = 0;
 
@@ -34,6 +34,16 @@ int main(int argc, char *argv[]) {
               options.flags = (uint32_t ) strtoul(optarg, NULL, 16);
               break;
 
+           case 'm':
+              /* stream the image in bands within this many megabytes */
+              options.memlimit = (size_t) strtoul(optarg, NULL, 10) << 20;
+              break;
+
+           case 'b':
+              /* every image of a directory or manifest, -o the directory */
+              options.batch = optarg;
+              break;
+
            case 'v':
               options.verbose += 1;
               break;
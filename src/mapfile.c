@@ -0,0 +1,57 @@
+/* mapfile.c - whole files mapped read only */
+#define _POSIX_C_SOURCE 200809L /* for mmap, posix_madvise */
+#include <errno.h> /* for errno */
+#include <fcntl.h> /* for open */
+#include <stdint.h> /* for uint8_t */
+#include <sys/mman.h> /* for mmap, munmap, posix_madvise */
+#include <sys/stat.h> /* for fstat */
+#include <unistd.h> /* for close */
+#include "../include/mapfile.h"
+
+extern int errno; /* these functions set errno on errors */
+
+/**
+ * Maps the file at path read only, its size stored at size. The kernel
+ * is told the file is read in order, so it reads ahead and drops pages
+ * behind. Nothing is copied.
+ * Returns the mapping if successful, NULL otherwise (errno EINVAL for an
+ * empty file).
+ */
+const uint8_t *
+mapfile_open(const char *path, size_t *size)
+{
+    if (!path || !size) {
+        errno = EINVAL;
+        return NULL;
+    }
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return NULL;
+    }
+    if (st.st_size <= 0) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    /* the mapping outlives the descriptor */
+    void *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return NULL;
+    posix_madvise(data, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+    *size = (size_t)st.st_size;
+    return data;
+}
+
+/* unmaps a file of mapfile_open */
+void
+mapfile_close(const uint8_t *data, size_t size)
+{
+    if (data)
+        munmap((void *)data, size);
+}
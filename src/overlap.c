@@ -0,0 +1,331 @@
+/* overlap.c - read, compute and write stages overlapped on their own threads */
+#include <errno.h> /* for errno */
+#include <pthread.h> /* for pthread_create, pthread_join, pthread_mutex_t */
+#include <stdatomic.h> /* for atomic_size_t */
+#include <stdint.h> /* for int32_t */
+#include <stdio.h> /* for printf */
+#include <stdlib.h> /* for calloc, realloc, free */
+#include <time.h> /* for timespec_get */
+#include "../include/imageproc.h"
+#include "../include/overlap.h"
+#include "../include/queue.h"
+
+extern int errno; /* these functions set errno on errors */
+
+static const char *const stage_names[OVERLAP_NSTAGES] = {
+    "read", "compute", "write"
+};
+
+/**
+ * an overlap_run call, shared by its threads: frames go from free to the
+ * read stage, through queues[OVERLAP_READ] to the compute stage, through
+ * queues[OVERLAP_COMPUTE] to the write stage and back to free
+ */
+struct run {
+    const struct overlap *ov;
+    size_t nitems;
+    struct queue *free;
+    struct queue *queues[OVERLAP_NSTAGES - 1];
+    atomic_size_t next;                 /* next item to be read */
+    atomic_size_t left[OVERLAP_NSTAGES]; /* running threads of each stage */
+    atomic_size_t nitems_done;
+    atomic_size_t nfailed;
+    atomic_int stopped;                 /* an item failed, see ov->stop */
+    pthread_mutex_t lock;               /* for busy */
+    double busy[OVERLAP_NSTAGES];
+};
+
+/* a thread of a stage */
+struct worker {
+    struct run *run;
+    enum overlap_stage stage;
+};
+
+/* static function prototypes */
+static void *stage_thread(void *arg);
+static void run_stage(struct run *run, enum overlap_stage stage,
+                struct overlap_frame *frame, double *busy);
+static void stop_run(struct run *run);
+static double now(void);
+
+/**
+ * Runs items 0 .. nitems - 1 through the read, compute and write stages
+ * of ov, each on its own threads, so reading item n + 1 and writing item
+ * n - 1 overlap computing item n. Stages hand frames over through queues
+ * of at most ov->nframes frames, which bounds the memory of the run: a
+ * stage ahead of the next one waits for a frame to come back. With one
+ * thread a stage, items go through every stage in order.
+ * Returns 1 if every item went through, -1 otherwise (errno EIO if a
+ * stage failed on some item, and with ov->stop the items in flight after
+ * it are dropped); stats, if not NULL, are filled in either way.
+ */
+int
+overlap_run(const struct overlap *ov, size_t nitems,
+            struct overlap_stats *stats)
+{
+    if (!ov || !ov->fns[OVERLAP_READ] || !ov->fns[OVERLAP_COMPUTE]
+        || !ov->fns[OVERLAP_WRITE]) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    size_t nthreads[OVERLAP_NSTAGES], total = 0;
+    for (size_t s = 0; s < OVERLAP_NSTAGES; ++s)
+        total += nthreads[s] = ov->nthreads[s] ? ov->nthreads[s] : 1;
+    const size_t nframes = ov->nframes > total ? ov->nframes : total;
+
+    struct run run = { .ov = ov, .nitems = nitems };
+    struct overlap_frame *frames = calloc(nframes, sizeof(*frames));
+    struct image32_t *images = calloc(2 * nframes, sizeof(*images));
+    struct worker *workers = calloc(total, sizeof(*workers));
+    pthread_t *threads = calloc(total, sizeof(*threads));
+    run.free = queue_create(nframes);
+    for (size_t q = 0; q < OVERLAP_NSTAGES - 1; ++q)
+        run.queues[q] = queue_create(nframes);
+    int ok = frames && images && workers && threads && run.free
+             && run.queues[0] && run.queues[1];
+    for (size_t f = 0; ok && f < nframes; ++f) {
+        frames[f].in = &images[2 * f];
+        frames[f].out = &images[2 * f + 1];
+        queue_push(run.free, &frames[f]);
+    }
+
+    atomic_init(&run.next, 0);
+    atomic_init(&run.nitems_done, 0);
+    atomic_init(&run.nfailed, 0);
+    atomic_init(&run.stopped, 0);
+    for (size_t s = 0; s < OVERLAP_NSTAGES; ++s)
+        atomic_init(&run.left[s], nthreads[s]);
+    pthread_mutex_init(&run.lock, NULL);
+
+    const double start = now();
+    size_t nstarted = 0, started[OVERLAP_NSTAGES] = { 0 };
+    for (size_t s = 0; ok && s < OVERLAP_NSTAGES; ++s)
+        for (size_t t = 0; t < nthreads[s]; ++t) {
+            workers[nstarted].run = &run;
+            workers[nstarted].stage = (enum overlap_stage)s;
+            if (pthread_create(&threads[nstarted], NULL, stage_thread,
+                               &workers[nstarted]))
+                continue;
+            nstarted++;
+            started[s]++;
+        }
+
+    /* a stage short of threads could stall the others: stop them all */
+    int complete = ok;
+    for (size_t s = 0; s < OVERLAP_NSTAGES; ++s)
+        complete = complete && started[s] == nthreads[s];
+    if (ok && !complete)
+        stop_run(&run);
+    for (size_t t = 0; t < nstarted; ++t)
+        pthread_join(threads[t], NULL);
+
+    if (stats) {
+        stats->nitems = atomic_load(&run.nitems_done);
+        stats->nfailed = atomic_load(&run.nfailed);
+        stats->seconds = now() - start;
+        for (size_t s = 0; s < OVERLAP_NSTAGES; ++s) {
+            stats->busy[s] = run.busy[s];
+            stats->nthreads[s] = nthreads[s];
+        }
+    }
+    const int done = ok && atomic_load(&run.nitems_done) == nitems;
+
+    /* frames left behind by a stopped run still hold their items */
+    for (size_t f = 0; frames && f < nframes; ++f)
+        if (frames[f].data && ov->release)
+            ov->release(ov->arg, &frames[f]);
+    for (size_t i = 0; images && i < 2 * nframes; ++i)
+        free(images[i].buf);
+    pthread_mutex_destroy(&run.lock);
+    queue_destroy(run.free);
+    for (size_t q = 0; q < OVERLAP_NSTAGES - 1; ++q)
+        queue_destroy(run.queues[q]);
+    free(threads);
+    free(workers);
+    free(images);
+    free(frames);
+
+    if (!ok) {
+        errno = ENOMEM;
+        return -1;
+    }
+    if (!complete) {
+        errno = EAGAIN;
+        return -1;
+    }
+    if (!done) {
+        errno = EIO;
+        return -1;
+    }
+    return 1;
+}
+
+/**
+ * Makes image w bytes by h rows, growing its buffer of *cap bytes only
+ * if it is too small, so a recycled frame allocates once for items of
+ * the same size.
+ * Returns 1 if successful, -1 otherwise.
+ */
+int
+overlap_reserve(struct image32_t *image, size_t *cap, size_t w, size_t h)
+{
+    if (!image || !cap || (h && w > SIZE_MAX / h)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (w * h > *cap) {
+        int32_t *buf = realloc(image->buf, w * h);
+        if (!buf) {
+            errno = ENOMEM;
+            return -1;
+        }
+        image->buf = buf;
+        *cap = w * h;
+    }
+    image->w = w;
+    image->h = h;
+    return 1;
+}
+
+/**
+ * returns the share of the wall clock the threads of stage spent working
+ * rather than waiting, from 0 to 1: the stage closest to 1 is the one
+ * holding the others back
+ */
+double
+overlap_occupancy(const struct overlap_stats *stats, enum overlap_stage stage)
+{
+    if (!stats || stage >= OVERLAP_NSTAGES || stats->seconds <= 0
+        || !stats->nthreads[stage])
+        return 0;
+    return stats->busy[stage] / (stats->seconds * stats->nthreads[stage]);
+}
+
+/**
+ * prints the occupancy of each stage of a run to stdout, name first, and
+ * which of them is the bottleneck
+ */
+void
+overlap_print_stats(const char *name, const struct overlap_stats *stats)
+{
+    if (!stats)
+        return;
+    size_t worst = 0;
+    printf("%s:", name ? name : "overlap");
+    for (size_t s = 0; s < OVERLAP_NSTAGES; ++s) {
+        const double occ = overlap_occupancy(stats, (enum overlap_stage)s);
+        if (occ > overlap_occupancy(stats, (enum overlap_stage)worst))
+            worst = s;
+        printf("%s %s %.0f%% (%zu thread%s)", s ? "," : "", stage_names[s],
+               100 * occ, stats->nthreads[s],
+               stats->nthreads[s] == 1 ? "" : "s");
+    }
+    printf(", bound by %s\n", stage_names[worst]);
+}
+
+/**
+ * static functions start here
+ */
+
+/* a thread of a stage, moving frames from its queue to the next */
+static void *
+stage_thread(void *arg)
+{
+    const struct worker *worker = arg;
+    struct run *run = worker->run;
+    const enum overlap_stage stage = worker->stage;
+    double busy = 0;
+
+    if (stage == OVERLAP_READ) {
+        size_t i;
+        while ((i = atomic_fetch_add(&run->next, 1)) < run->nitems) {
+            struct overlap_frame *frame = queue_pop(run->free);
+            if (!frame)
+                break;
+            frame->index = i;
+            frame->failed = 0;
+            frame->data = NULL;
+            run_stage(run, stage, frame, &busy);
+            if (queue_push(run->queues[OVERLAP_READ], frame) < 0)
+                break;
+        }
+    } else {
+        struct overlap_frame *frame;
+        while ((frame = queue_pop(run->queues[stage - 1]))) {
+            run_stage(run, stage, frame, &busy);
+            if (stage == OVERLAP_WRITE)
+                queue_push(run->free, frame);
+            else if (queue_push(run->queues[stage], frame) < 0)
+                break;
+        }
+    }
+
+    pthread_mutex_lock(&run->lock);
+    run->busy[stage] += busy;
+    pthread_mutex_unlock(&run->lock);
+
+    /* the last thread of a stage ends the queue after it */
+    if (atomic_fetch_sub(&run->left[stage], 1) == 1
+        && stage < OVERLAP_NSTAGES - 1)
+        queue_close(run->queues[stage]);
+    return NULL;
+}
+
+/**
+ * runs a stage function on frame unless an earlier stage failed on it or
+ * the run is stopped, and after the write stage counts it and releases its
+ * data; a failure stops the run if ov->stop is set
+ */
+static void
+run_stage(struct run *run, enum overlap_stage stage,
+          struct overlap_frame *frame, double *busy)
+{
+    const struct overlap *ov = run->ov;
+    if (atomic_load(&run->stopped))
+        frame->failed = 1;
+    if (!frame->failed) {
+        const double t = now();
+        frame->failed = ov->fns[stage](ov->arg, frame) < 0;
+        *busy += now() - t;
+        /* before the write stage the queues close under it and it can't
+         * reach the count below, so it is counted here */
+        if (frame->failed && ov->stop) {
+            atomic_store(&run->stopped, 1);
+            stop_run(run);
+            if (stage != OVERLAP_WRITE) {
+                atomic_fetch_add(&run->nfailed, 1);
+                return;
+            }
+        }
+    }
+    if (stage != OVERLAP_WRITE)
+        return;
+
+    atomic_fetch_add(frame->failed ? &run->nfailed : &run->nitems_done, 1);
+    if (ov->release)
+        ov->release(ov->arg, frame);
+    frame->data = NULL;
+}
+
+/**
+ * ends a run: no more items are read and the queues are closed, so every
+ * thread drains what it is waiting on and returns
+ */
+static void
+stop_run(struct run *run)
+{
+    atomic_store(&run->next, run->nitems);
+    queue_close(run->free);
+    for (size_t q = 0; q < OVERLAP_NSTAGES - 1; ++q)
+        queue_close(run->queues[q]);
+}
+
+/* seconds of the wall clock */
+static double
+now(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
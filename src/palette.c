@@ -0,0 +1,763 @@
+/* palette.c - colour palettes with a cached nearest-colour table */
+#include <assert.h> /* for assert */
+#include <errno.h> /* for errno */
+#include <math.h> /* for pow, cbrt */
+#include <pthread.h> /* for pthread_once */
+#include <stdatomic.h> /* for atomic_uint */
+#include <stdint.h> /* for uint16_t, uint32_t */
+#include <stdlib.h> /* for malloc, free */
+#include <string.h> /* for memcpy */
+#include "../include/imageproc.h"
+#include "../include/palette.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h> /* for SSE2 intrinsics */
+#define PALETTE_SSE2 1
+#endif
+
+extern int errno; /* these functions set errno on errors */
+
+#define CELLSPAN (256 / PAL_LUTDIM) /* channel values covered by one cell */
+#define CACHESIZE 64 /* recent queries remembered per thread */
+#define FAR 1e18f /* channel value of the unused fcomps entries */
+
+/**
+ * the perceptual metrics work in 12 bit fixed point: sRGB bytes go through
+ * a 256 entry linearisation table, OKLab then mixes the linear channels
+ * into cone responses, takes their cube roots from a table and mixes those
+ * into L, a and b, all with Q12 matrices
+ */
+#define FIXBITS 12
+#define FIXMAX ((1 << FIXBITS) - 1)
+
+static const int32_t oklab_m1[3][3] = {
+    { 1688, 2197, 211 }, { 868, 2788, 440 }, { 362, 1154, 2580 }
+};
+static const int32_t oklab_m2[3][3] = {
+    { 862, 3251, -17 }, { 8102, -9948, 1846 }, { 106, 3206, -3312 }
+};
+
+/* a remembered palette_nearest query */
+struct cache_entry {
+    uint32_t id; /* palette id, 0 for an empty entry */
+    int32_t color;
+    uint16_t idx;
+};
+
+static atomic_uint next_id = 1;
+static _Thread_local struct cache_entry cache[CACHESIZE];
+
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+static int32_t srgb_linear[256];     /* FIXMAX * linear(sRGB byte / 255) */
+static int32_t cube_root[FIXMAX + 1]; /* FIXMAX * cbrt(i / FIXMAX) */
+
+/* static function prototypes */
+static void init_tables(void);
+static void to_coords(const struct palette *pal, int32_t color, int32_t *q);
+static void cell_box(const struct palette *pal, const int32_t *lo, 
+                const int32_t *hi, int32_t *boxlo, int32_t *boxhi);
+static void lms_box(const int32_t *lo, const int32_t *hi, int32_t *lmslo,
+                int32_t *lmshi);
+static void oklab_lms(const int32_t *lin, int32_t *lms);
+static void oklab_range(const int32_t *lmslo, const int32_t *lmshi,
+                int32_t *lo, int32_t *hi);
+static void set_coords(struct palette *pal);
+static int32_t sqrdist(const struct palette *pal, size_t i, const int32_t *q);
+static int32_t maxgain(const int32_t *p, const int32_t *q, const int32_t *lo,
+                const int32_t *hi);
+static int64_t maxgain_oklab(const int32_t *p, const int32_t *q,
+                const int32_t *lmslo, const int32_t *lmshi);
+static int build_lut(struct palette *pal);
+static size_t scan(const struct palette *pal, const uint16_t *idx, 
+                size_t n, const int32_t *q);
+static size_t scan_all(const struct palette *pal, int32_t color);
+#ifdef PALETTE_SSE2
+static size_t scan_sse2(const struct palette *pal, const int32_t *q);
+#endif
+static int16_t kd_build(struct palette *pal, uint8_t *idx, size_t n, 
+                int16_t *nnodes);
+static void kd_nearest(const struct palette *pal, int16_t node, 
+                const int32_t *q, size_t *best, int32_t *bestd);
+static size_t kd_range(const struct palette *pal, int16_t node, 
+                const int32_t *lo, const int32_t *hi, int32_t radius, 
+                uint16_t *out, size_t n);
+
+/**
+ * Creates a palette of the n colours pointed to by colors.
+ * The lookup table is not built until it is first needed.
+ * Returns the new palette if successful, NULL otherwise.
+ */
+struct palette *
+palette_create(const int32_t *colors, size_t n)
+{
+    if (!colors || n == 0 || n > PAL_MAXSIZE) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct palette *pal = calloc(1, sizeof(*pal));
+    if (!pal)
+        return NULL;
+
+    pal->n = n;
+    pal->id = atomic_fetch_add(&next_id, 1);
+    pal->metric = PAL_METRIC_RGB;
+    for (size_t i = 0; i < n; ++i)
+        pal->colors[i] = colors[i] & 0xFFFFFF;
+    set_coords(pal);
+    return pal;
+}
+
+/**
+ * frees the palette and its cached table
+ */
+void
+palette_destroy(struct palette *pal)
+{
+    if (!pal)
+        return;
+    free(pal->lut);
+    free(pal->cands);
+    free(pal);
+}
+
+/**
+ * Builds the lookup table if it does not exist yet.
+ * Must be called before a palette is shared between threads.
+ * Returns 1 if successful, -1 otherwise.
+ */
+int
+palette_prepare(struct palette *pal)
+{
+    if (!pal) {
+        errno = EINVAL;
+        return -1;
+    }
+    return pal->lut ? 1 : build_lut(pal);
+}
+
+/**
+ * Switches the distance colours are compared by, PAL_METRIC_RGB being the
+ * default. The palette side of the conversion is done once here, so a
+ * lookup only converts the colour looked up, and only when it misses the
+ * table; the table itself is rebuilt on the next lookup.
+ * Must not be called while other threads use the palette.
+ * Returns 1 if successful, -1 otherwise.
+ */
+int
+palette_set_metric(struct palette *pal, enum pal_metric metric)
+{
+    if (!pal || (metric != PAL_METRIC_RGB && metric != PAL_METRIC_LINEAR
+                 && metric != PAL_METRIC_OKLAB)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (metric == pal->metric)
+        return 1;
+
+    pthread_once(&tables_once, init_tables);
+    free(pal->lut);
+    free(pal->cands);
+    pal->lut = NULL;
+    pal->cands = NULL;
+    pal->ncands = 0;
+    pal->metric = metric;
+    pal->id = atomic_fetch_add(&next_id, 1); /* drops cached queries */
+    set_coords(pal);
+    return 1;
+}
+
+/**
+ * returns the index of the palette colour closest to color, 
+ * ties go to the lowest index (same result as closestfrompal)
+ */
+size_t
+palette_index(struct palette *pal, int32_t color)
+{
+    assert(pal && "Is validated by the caller.");
+
+    if (!pal->lut && build_lut(pal) < 0)
+        return palette_nearest(pal, color);
+
+    uint32_t e = pal->lut[PAL_CELL(color)];
+    if (!(e & PAL_AMBIGUOUS))
+        return e;
+
+    const uint16_t *c = pal->cands + (e & ~PAL_AMBIGUOUS);
+    if (c[0] <= PAL_SCANMAX) {
+        int32_t q[3];
+        to_coords(pal, color, q);
+        return scan(pal, c + 1, c[0], q);
+    }
+    return palette_nearest(pal, color);
+}
+
+/**
+ * returns the palette colour closest to color
+ */
+int32_t
+palette_closest(struct palette *pal, int32_t color)
+{
+    return pal->colors[palette_index(pal, color)];
+}
+
+/**
+ * returns the index of the palette colour closest to color without the
+ * lookup table: small palettes are scanned with vector compares, larger 
+ * ones are searched in the k-d tree behind a small per-thread cache
+ */
+size_t
+palette_nearest(const struct palette *pal, int32_t color)
+{
+    assert(pal && "Is validated by the caller.");
+
+    color &= 0xFFFFFF;
+    if (pal->n <= PAL_SCANMAX)
+        return scan_all(pal, color);
+
+    struct cache_entry *ce = &cache[((uint32_t)color * 2654435761u) >> 26];
+    if (ce->id == pal->id && ce->color == color)
+        return ce->idx;
+
+    int32_t q[3];
+    to_coords(pal, color, q);
+    size_t best = 0;
+    int32_t bestd = INT32_MAX;
+    kd_nearest(pal, pal->root, q, &best, &bestd);
+
+    ce->id = pal->id;
+    ce->color = color;
+    ce->idx = (uint16_t)best;
+    return best;
+}
+
+/**
+ * replaces every pixel of image with its closest palette colour
+ * returns 1 if successful, -1 otherwise
+ * NOTE: each row holds w / 3 pixels
+ */
+int
+palette_map(struct image32_t *image, struct palette *pal)
+{
+    if (!image || !image->buf || !pal) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    uint8_t *row = (uint8_t *)image->buf;
+    for (size_t y = 0; y < image->h; ++y, row += image->w)
+        palette_map_span(row, image->w, 0, y, pal);
+    return 1;
+}
+
+/**
+ * replaces every pixel of nbytes bytes of a packed row with its closest
+ * colour in the struct palette arg, a tile function; the span must start
+ * on a pixel and an int32 boundary and the palette must be prepared
+ */
+void
+palette_map_span(uint8_t *span, size_t nbytes, size_t x, size_t y, void *arg)
+{
+    struct palette *pal = arg;
+    (void)x;
+    (void)y;
+    for (size_t i = 0; i + 3 <= nbytes; i += 3) {
+        /* memory byte of file byte i + c in the packed words */
+        uint8_t *c0 = &span[i ^ 3], *c1 = &span[(i + 1) ^ 3],
+                *c2 = &span[(i + 2) ^ 3];
+        int32_t color = palette_closest(pal, (*c0 << 16) | (*c1 << 8) | *c2);
+        *c0 = (uint8_t)(color >> 16);
+        *c1 = (uint8_t)(color >> 8);
+        *c2 = (uint8_t)color;
+    }
+}
+
+/**
+ * static functions start here
+ */
+
+/* fills the tables of the perceptual metrics, once per process */
+static void
+init_tables(void)
+{
+    for (size_t i = 0; i < 256; ++i) {
+        double c = i / 255.0;
+        c = c <= 0.04045 ? c / 12.92 : pow((c + 0.055) / 1.055, 2.4);
+        srgb_linear[i] = (int32_t)(FIXMAX * c + 0.5);
+    }
+    for (size_t i = 0; i <= FIXMAX; ++i)
+        cube_root[i] = (int32_t)(FIXMAX * cbrt((double)i / FIXMAX) + 0.5);
+}
+
+/* the coordinates of color in the space of the palette's metric */
+static void
+to_coords(const struct palette *pal, int32_t color, int32_t *q)
+{
+    const int32_t rgb[3] = {
+        (color >> 16) & 0xFF, (color >> 8) & 0xFF, color & 0xFF
+    };
+    if (pal->metric != PAL_METRIC_OKLAB) {
+        cell_box(pal, rgb, rgb, q, q);
+        return;
+    }
+
+    int32_t lin[3], lms[3];
+    for (size_t c = 0; c < 3; ++c)
+        lin[c] = srgb_linear[rgb[c]];
+    oklab_lms(lin, lms);
+    oklab_range(lms, lms, q, q);
+}
+
+/**
+ * boxlo .. boxhi bounds the coordinates of every colour whose channels lie
+ * in lo .. hi; for lo == hi both are the coordinates of that colour
+ */
+static void
+cell_box(const struct palette *pal, const int32_t *lo, const int32_t *hi,
+         int32_t *boxlo, int32_t *boxhi)
+{
+    int32_t lmslo[3], lmshi[3];
+
+    switch (pal->metric) {
+    case PAL_METRIC_LINEAR:
+        for (size_t c = 0; c < 3; ++c) {
+            boxlo[c] = srgb_linear[lo[c]];
+            boxhi[c] = srgb_linear[hi[c]];
+        }
+        break;
+    case PAL_METRIC_OKLAB:
+        lms_box(lo, hi, lmslo, lmshi);
+        oklab_range(lmslo, lmshi, boxlo, boxhi);
+        break;
+    default:
+        for (size_t c = 0; c < 3; ++c) {
+            boxlo[c] = lo[c];
+            boxhi[c] = hi[c];
+        }
+    }
+}
+
+/**
+ * bounds the cube roots of the cone responses of the colours whose
+ * channels lie in lo .. hi; the responses only grow with each channel
+ */
+static void
+lms_box(const int32_t *lo, const int32_t *hi, int32_t *lmslo, int32_t *lmshi)
+{
+    int32_t linlo[3], linhi[3];
+    for (size_t c = 0; c < 3; ++c) {
+        linlo[c] = srgb_linear[lo[c]];
+        linhi[c] = srgb_linear[hi[c]];
+    }
+    oklab_lms(linlo, lmslo);
+    oklab_lms(linhi, lmshi);
+}
+
+/* cube roots of the cone responses of a linear colour, in FIXBITS */
+static void
+oklab_lms(const int32_t *lin, int32_t *lms)
+{
+    for (size_t i = 0; i < 3; ++i) {
+        int32_t v = (oklab_m1[i][0] * lin[0] + oklab_m1[i][1] * lin[1]
+                     + oklab_m1[i][2] * lin[2] + (1 << (FIXBITS - 1)))
+                    >> FIXBITS;
+        lms[i] = cube_root[v < FIXMAX ? v : FIXMAX];
+    }
+}
+
+/**
+ * bounds L, a and b over the cube roots lmslo .. lmshi, each row of the
+ * matrix takes the end of the range its coefficient's sign favours
+ */
+static void
+oklab_range(const int32_t *lmslo, const int32_t *lmshi, int32_t *lo,
+            int32_t *hi)
+{
+    for (size_t i = 0; i < 3; ++i) {
+        int32_t sumlo = 1 << (FIXBITS - 1), sumhi = 1 << (FIXBITS - 1);
+        for (size_t j = 0; j < 3; ++j) {
+            int32_t m = oklab_m2[i][j];
+            sumlo += m * (m > 0 ? lmslo[j] : lmshi[j]);
+            sumhi += m * (m > 0 ? lmshi[j] : lmslo[j]);
+        }
+        lo[i] = sumlo >> FIXBITS;
+        hi[i] = sumhi >> FIXBITS;
+    }
+}
+
+/* converts the colours to the metric's space and rebuilds the k-d tree */
+static void
+set_coords(struct palette *pal)
+{
+    for (size_t i = 0; i < PAL_MAXSIZE; ++i) {
+        int32_t q[3] = { 0, 0, 0 };
+        if (i < pal->n)
+            to_coords(pal, pal->colors[i], q);
+        for (size_t c = 0; c < 3; ++c) {
+            pal->comps[c][i] = q[c];
+            pal->fcomps[c][i] = i < pal->n ? (float)q[c] : FAR;
+        }
+    }
+
+    uint8_t idx[PAL_MAXSIZE];
+    for (size_t i = 0; i < pal->n; ++i)
+        idx[i] = (uint8_t)i;
+    int16_t nnodes = 0;
+    pal->root = kd_build(pal, idx, pal->n, &nnodes);
+}
+
+/* squared euclidean distance between palette colour i and q */
+static int32_t
+sqrdist(const struct palette *pal, size_t i, const int32_t *q)
+{
+    int32_t d0 = pal->comps[0][i] - q[0];
+    int32_t d1 = pal->comps[1][i] - q[1];
+    int32_t d2 = pal->comps[2][i] - q[2];
+    return d0 * d0 + d1 * d1 + d2 * d2;
+}
+
+/**
+ * returns the largest value of dist(x, p)^2 - dist(x, q)^2 over the box
+ * lo <= x <= hi; the difference is linear in x so a corner attains it
+ */
+static int32_t
+maxgain(const int32_t *p, const int32_t *q, const int32_t *lo,
+        const int32_t *hi)
+{
+    int32_t res = 0;
+    for (size_t c = 0; c < 3; ++c) {
+        int32_t slope = q[c] - p[c];
+        int32_t x = slope > 0 ? hi[c] : lo[c];
+        res += slope * (2 * x - p[c] - q[c]);
+    }
+    return res;
+}
+
+/**
+ * maxgain for OKLab, 2^FIXBITS times too large. L, a and b are a matrix 
+ * times the cube roots, so the difference is linear in the cube roots as
+ * well and their box bounds it far tighter than the box around L, a and b;
+ * the rounding of L, a and b adds at most one unit each
+ */
+static int64_t
+maxgain_oklab(const int32_t *p, const int32_t *q, const int32_t *lmslo,
+              const int32_t *lmshi)
+{
+    /* 2^FIXBITS * x_i = sum_j m2_ij * lms_j + 2^(FIXBITS-1) - r_i, with
+     * 0 <= r_i < 2^FIXBITS */
+    int64_t res = 0;
+    int64_t w[3] = { 0, 0, 0 };
+    for (size_t i = 0; i < 3; ++i) {
+        int64_t v = q[i] - p[i];
+        res += v > 0 ? v * (1 << FIXBITS) : -v * ((1 << FIXBITS) - 2);
+        res -= v * (p[i] + q[i]) * (1 << FIXBITS);
+        for (size_t j = 0; j < 3; ++j)
+            w[j] += v * oklab_m2[i][j];
+    }
+    for (size_t j = 0; j < 3; ++j)
+        res += 2 * w[j] * (w[j] > 0 ? lmshi[j] : lmslo[j]);
+    return res;
+}
+
+/**
+ * Fills in the lookup table. A cell gets the index of its nearest colour
+ * when that colour wins at every point of the cell; otherwise it gets the
+ * list of every colour that wins somewhere inside it, which keeps lookups
+ * exact at the cell boundaries. Only the colours the k-d tree finds within
+ * reach of the cell are tested.
+ */
+static int
+build_lut(struct palette *pal)
+{
+    uint32_t *lut = malloc(PAL_LUTSIZE * sizeof(uint32_t));
+    size_t cap = 4096, len = 0;
+    uint16_t *cands = malloc(cap * sizeof(uint16_t));
+    if (!lut || !cands) {
+        free(lut);
+        free(cands);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    uint16_t near[PAL_MAXSIZE], list[PAL_MAXSIZE];
+    for (size_t cell = 0; cell < PAL_LUTSIZE; ++cell) {
+        int32_t rgblo[3], rgbhi[3], lo[3], hi[3], mid[3], p[3];
+        int32_t lmslo[3], lmshi[3];
+        rgblo[0] = (int32_t)(cell >> (2 * PAL_LUTBITS)) * CELLSPAN;
+        rgblo[1] = (int32_t)((cell >> PAL_LUTBITS) & (PAL_LUTDIM - 1)) 
+                   * CELLSPAN;
+        rgblo[2] = (int32_t)(cell & (PAL_LUTDIM - 1)) * CELLSPAN;
+        for (size_t c = 0; c < 3; ++c)
+            rgbhi[c] = rgblo[c] + CELLSPAN - 1;
+
+        /* the box the cell's colours span in the metric's space, the tests
+         * below hold over all of it so they hold over the cell */
+        cell_box(pal, rgblo, rgbhi, lo, hi);
+        if (pal->metric == PAL_METRIC_OKLAB)
+            lms_box(rgblo, rgbhi, lmslo, lmshi);
+        to_coords(pal, (rgblo[0] + CELLSPAN / 2) << 16 
+                  | (rgblo[1] + CELLSPAN / 2) << 8 
+                  | (rgblo[2] + CELLSPAN / 2), mid);
+
+        /* the winner at the centre of the cell */
+        size_t best = 0;
+        int32_t bestd = INT32_MAX;
+        kd_nearest(pal, pal->root, mid, &best, &bestd);
+        for (size_t c = 0; c < 3; ++c)
+            p[c] = pal->comps[c][best];
+
+        /* a colour that wins somewhere is no further from the cell than p's
+         * furthest corner */
+        int32_t radius = 0;
+        for (size_t c = 0; c < 3; ++c) {
+            int32_t a = lo[c] - p[c], b = hi[c] - p[c];
+            radius += a * a > b * b ? a * a : b * b;
+        }
+        size_t nnear = kd_range(pal, pal->root, lo, hi, radius, near, 0);
+
+        /* ascending index order, so that scan breaks ties correctly */
+        for (size_t i = 1; i < nnear; ++i)
+            for (size_t j = i; j > 0 && near[j - 1] > near[j]; --j) {
+                uint16_t tmp = near[j];
+                near[j] = near[j - 1];
+                near[j - 1] = tmp;
+            }
+
+        /* every colour that beats p somewhere in the cell */
+        size_t n = 0;
+        int unique = 1;
+        for (size_t i = 0; i < nnear; ++i) {
+            size_t q = near[i];
+            if (q == best) {
+                list[n++] = (uint16_t)q;
+                continue;
+            }
+            const int32_t qc[3] = { 
+                pal->comps[0][q], pal->comps[1][q], pal->comps[2][q] 
+            };
+            int64_t gain = pal->metric == PAL_METRIC_OKLAB
+                           ? maxgain_oklab(p, qc, lmslo, lmshi)
+                           : maxgain(p, qc, lo, hi);
+            if (gain > 0 || (gain == 0 && q < best)) {
+                unique = 0;
+                list[n++] = (uint16_t)q;
+            }
+        }
+
+        if (unique) {
+            lut[cell] = (uint32_t)best;
+            continue;
+        }
+
+        if (len + n + 1 > cap) {
+            cap = 2 * (len + n + 1);
+            uint16_t *tmp = realloc(cands, cap * sizeof(uint16_t));
+            if (!tmp) {
+                free(lut);
+                free(cands);
+                errno = ENOMEM;
+                return -1;
+            }
+            cands = tmp;
+        }
+        lut[cell] = PAL_AMBIGUOUS | (uint32_t)len;
+        cands[len++] = (uint16_t)n;
+        memcpy(cands + len, list, n * sizeof(uint16_t));
+        len += n;
+    }
+
+    pal->lut = lut;
+    pal->cands = cands;
+    pal->ncands = len;
+    return 1;
+}
+
+/* linear search over the palette indices in idx, lowest index wins ties */
+static size_t
+scan(const struct palette *pal, const uint16_t *idx, size_t n, 
+     const int32_t *q)
+{
+    size_t res = idx[0];
+    int32_t min = sqrdist(pal, idx[0], q);
+    for (size_t i = 1; i < n; ++i) {
+        int32_t d = sqrdist(pal, idx[i], q);
+        if (d < min) {
+            min = d;
+            res = idx[i];
+        }
+    }
+    return res;
+}
+
+/**
+ * searches the whole palette, lowest index wins ties; RGB distances, at
+ * most 3 * 255^2, are exact as floats and are compared four colours at a
+ * time, those of the 12 bit metrics reach 5e7, past the 2^24 a float holds
+ * exactly, so they are compared as int32 like the table does
+ */
+static size_t
+scan_all(const struct palette *pal, int32_t color)
+{
+    int32_t q[3];
+    to_coords(pal, color, q);
+#ifdef PALETTE_SSE2
+    if (pal->metric == PAL_METRIC_RGB)
+        return scan_sse2(pal, q);
+#endif
+    uint16_t all[PAL_MAXSIZE];
+    for (size_t i = 0; i < pal->n; ++i)
+        all[i] = (uint16_t)i;
+    return scan(pal, all, pal->n, q);
+}
+
+#ifdef PALETTE_SSE2
+/**
+ * branch-free search of the whole palette at q, four colours per step;
+ * each lane keeps its own first minimum, then the lanes are merged
+ */
+static size_t
+scan_sse2(const struct palette *pal, const int32_t *q)
+{
+    const __m128 q0 = _mm_set1_ps((float)q[0]);
+    const __m128 q1 = _mm_set1_ps((float)q[1]);
+    const __m128 q2 = _mm_set1_ps((float)q[2]);
+    const __m128i four = _mm_set1_epi32(4);
+    __m128 best = _mm_set1_ps(3 * FAR * FAR);
+    __m128i bestidx = _mm_setzero_si128();
+    __m128i idx = _mm_setr_epi32(0, 1, 2, 3);
+
+    for (size_t i = 0; i < pal->n; i += 4) {
+        __m128 d0 = _mm_sub_ps(_mm_loadu_ps(pal->fcomps[0] + i), q0);
+        __m128 d1 = _mm_sub_ps(_mm_loadu_ps(pal->fcomps[1] + i), q1);
+        __m128 d2 = _mm_sub_ps(_mm_loadu_ps(pal->fcomps[2] + i), q2);
+        __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(d0, d0), 
+                        _mm_mul_ps(d1, d1)), _mm_mul_ps(d2, d2));
+        __m128i lt = _mm_castps_si128(_mm_cmplt_ps(d, best));
+        best = _mm_min_ps(d, best);
+        bestidx = _mm_or_si128(_mm_and_si128(lt, idx), 
+                        _mm_andnot_si128(lt, bestidx));
+        idx = _mm_add_epi32(idx, four);
+    }
+
+    float dist[4];
+    int32_t index[4];
+    _mm_storeu_ps(dist, best);
+    _mm_storeu_si128((__m128i *)index, bestidx);
+    size_t res = (size_t)index[0];
+    float min = dist[0];
+    for (size_t lane = 1; lane < 4; ++lane)
+        if (dist[lane] < min || 
+                (dist[lane] == min && (size_t)index[lane] < res)) {
+            min = dist[lane];
+            res = (size_t)index[lane];
+        }
+    return res;
+}
+#endif
+
+/**
+ * builds the k-d subtree of the n palette indices in idx, splitting at the
+ * median of the channel with the widest spread
+ * returns the subtree's root node, -1 if n is 0
+ */
+static int16_t
+kd_build(struct palette *pal, uint8_t *idx, size_t n, int16_t *nnodes)
+{
+    if (n == 0)
+        return -1;
+
+    uint8_t axis = 0;
+    int32_t spread = -1;
+    for (uint8_t c = 0; c < 3; ++c) {
+        int32_t lo = INT32_MAX, hi = INT32_MIN;
+        for (size_t i = 0; i < n; ++i) {
+            int32_t v = pal->comps[c][idx[i]];
+            lo = v < lo ? v : lo;
+            hi = v > hi ? v : hi;
+        }
+        if (hi - lo > spread) {
+            spread = hi - lo;
+            axis = c;
+        }
+    }
+
+    /* insertion sort along the axis, n is at most PAL_MAXSIZE */
+    const int32_t *key = pal->comps[axis];
+    for (size_t i = 1; i < n; ++i)
+        for (size_t j = i; j > 0 && key[idx[j - 1]] > key[idx[j]]; --j) {
+            uint8_t tmp = idx[j];
+            idx[j] = idx[j - 1];
+            idx[j - 1] = tmp;
+        }
+
+    size_t m = n / 2;
+    int16_t node = (*nnodes)++;
+    pal->tree[node].idx = idx[m];
+    pal->tree[node].axis = axis;
+    pal->tree[node].left = kd_build(pal, idx, m, nnodes);
+    pal->tree[node].right = kd_build(pal, idx + m + 1, n - m - 1, nnodes);
+    return node;
+}
+
+/**
+ * nearest neighbour search, best and bestd hold the closest colour so far
+ * the distance to a node's colour is abandoned once it exceeds bestd
+ */
+static void
+kd_nearest(const struct palette *pal, int16_t node, const int32_t *q,
+           size_t *best, int32_t *bestd)
+{
+    if (node < 0)
+        return;
+
+    const struct pal_kdnode *nd = &pal->tree[node];
+    int32_t d = 0;
+    for (size_t c = 0; c < 3 && d <= *bestd; ++c) {
+        int32_t diff = pal->comps[c][nd->idx] - q[c];
+        d += diff * diff;
+    }
+    if (d < *bestd || (d == *bestd && nd->idx < *best)) {
+        *bestd = d;
+        *best = nd->idx;
+    }
+
+    /* ties may hide on the far side, so it is only skipped when strictly
+     * further away */
+    int32_t diff = q[nd->axis] - pal->comps[nd->axis][nd->idx];
+    kd_nearest(pal, diff <= 0 ? nd->left : nd->right, q, best, bestd);
+    if (diff * diff <= *bestd)
+        kd_nearest(pal, diff <= 0 ? nd->right : nd->left, q, best, bestd);
+}
+
+/**
+ * appends every palette index whose squared distance to the box lo..hi 
+ * is at most radius to out, which already holds n indices
+ * returns the new number of indices in out
+ */
+static size_t
+kd_range(const struct palette *pal, int16_t node, const int32_t *lo, 
+         const int32_t *hi, int32_t radius, uint16_t *out, size_t n)
+{
+    if (node < 0)
+        return n;
+
+    const struct pal_kdnode *nd = &pal->tree[node];
+    int32_t d = 0;
+    for (size_t c = 0; c < 3; ++c) {
+        int32_t v = pal->comps[c][nd->idx];
+        int32_t out_by = v < lo[c] ? lo[c] - v : v > hi[c] ? v - hi[c] : 0;
+        d += out_by * out_by;
+    }
+    if (d <= radius)
+        out[n++] = nd->idx;
+
+    /* the left subtree lies at or below the split, the right at or above */
+    int32_t split = pal->comps[nd->axis][nd->idx];
+    int32_t below = lo[nd->axis] > split ? lo[nd->axis] - split : 0;
+    int32_t above = hi[nd->axis] < split ? split - hi[nd->axis] : 0;
+    if (below * below <= radius)
+        n = kd_range(pal, nd->left, lo, hi, radius, out, n);
+    if (above * above <= radius)
+        n = kd_range(pal, nd->right, lo, hi, radius, out, n);
+    return n;
+}
@@ -0,0 +1,468 @@
+/* palettegen.c - image adaptive palettes by median cut and k-means */
+#include <assert.h> /* for assert */
+#include <errno.h> /* for errno */
+#include <float.h> /* for FLT_MAX */
+#include <math.h> /* for sqrt */
+#include <stdint.h> /* for uint8_t, uint64_t */
+#include <stdlib.h> /* for malloc, calloc, qsort, free */
+#include "../include/imageproc.h"
+#include "../include/palette.h"
+#include "../include/workpool.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h> /* for SSE2 intrinsics */
+#define PALGEN_SSE2 1
+#endif
+
+extern int errno; /* these functions set errno on errors */
+
+#define HISTBITS 5 /* bits per channel of a histogram bin */
+#define HISTSIZE (1 << (3 * HISTBITS))
+#define MAXSAMPLES (1 << 22) /* pixels sampled into the histogram */
+#define MAXJOBS 64 /* shares of an assignment pass */
+#define FAR 1e18f /* coordinate of the padding centroids */
+
+/* a histogram bin: the mean colour of its pixels and their count */
+struct point {
+    int32_t c[3];
+    uint32_t w;
+};
+
+/* a median cut box, a range of the point array */
+struct box {
+    size_t begin, end;
+    int32_t lo[3], hi[3];
+    uint64_t w;
+};
+
+/* state shared by the k-means jobs */
+struct kmeans {
+    const struct point *pts;
+    size_t npts;
+    float *p[3];     /* point coordinates, one array per channel */
+    float *c[3];     /* centroids, padded to a multiple of 4 with FAR */
+    size_t k, kpad;
+    uint16_t *assign;
+};
+
+/* one job's share of an assignment pass */
+struct kjob {
+    struct kmeans *km;
+    size_t begin, end;
+    size_t changed;
+    uint64_t sums[PAL_MAXSIZE][4]; /* weighted channel sums, then weight */
+};
+
+/* static function prototypes */
+static struct point *histogram(const struct image32_t *image, size_t *npts);
+static size_t median_cut(struct point *pts, size_t npts, size_t n, 
+                int32_t *colors);
+static void box_bounds(struct box *b, const struct point *pts);
+static int cmp0(const void *a, const void *b);
+static int cmp1(const void *a, const void *b);
+static int cmp2(const void *a, const void *b);
+static size_t nearest(const struct kmeans *km, size_t i);
+static void assign_points(void *arg, size_t task);
+static void kmeans_free(struct kmeans *km, struct kjob *jobs, 
+                struct point *pts);
+
+/**
+ * Builds a palette of at most n colours for image by median cut over a 
+ * sub-sampled 15 bit colour histogram.
+ * Returns the new palette if successful, NULL otherwise.
+ */
+struct palette *
+palette_median_cut(const struct image32_t *image, size_t n)
+{
+    if (!image || !image->buf || n == 0 || n > PAL_MAXSIZE) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    size_t npts;
+    struct point *pts = histogram(image, &npts);
+    if (!pts)
+        return NULL;
+
+    int32_t colors[PAL_MAXSIZE];
+    size_t ncolors = median_cut(pts, npts, n, colors);
+    free(pts);
+    return palette_create(colors, ncolors);
+}
+
+/**
+ * Builds a palette of at most n colours for image by k-means clustering of
+ * its sub-sampled colour histogram, seeded by median cut. The assignment 
+ * step is vectorised over the centroids and split across the threads of
+ * pool, or run on the calling thread if pool is NULL; the result does not
+ * depend on pool.
+ * Returns the new palette if successful, NULL otherwise.
+ */
+struct palette *
+palette_kmeans(const struct image32_t *image, size_t n, size_t iterations,
+               struct workpool *pool)
+{
+    if (!image || !image->buf || n == 0 || n > PAL_MAXSIZE) {
+        errno = EINVAL;
+        return NULL;
+    }
+    const size_t njobs = workpool_size(pool) < MAXJOBS ? workpool_size(pool)
+                                                       : MAXJOBS;
+
+    size_t npts;
+    struct point *pts = histogram(image, &npts);
+    if (!pts)
+        return NULL;
+
+    int32_t colors[PAL_MAXSIZE];
+    struct kmeans km = { 0 };
+    km.pts = pts;
+    km.npts = npts;
+    km.k = median_cut(pts, npts, n, colors);
+    km.kpad = (km.k + 3) & ~(size_t)3;
+
+    km.assign = malloc((npts ? npts : 1) * sizeof(uint16_t));
+    struct kjob *jobs = malloc(njobs * sizeof(struct kjob));
+    int ok = km.assign && jobs;
+    for (size_t ch = 0; ch < 3; ++ch) {
+        km.p[ch] = malloc((npts ? npts : 1) * sizeof(float));
+        km.c[ch] = malloc(km.kpad * sizeof(float));
+        ok = ok && km.p[ch] && km.c[ch];
+    }
+    if (!ok) {
+        kmeans_free(&km, jobs, pts);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    for (size_t i = 0; i < npts; ++i) {
+        km.assign[i] = UINT16_MAX;
+        for (size_t ch = 0; ch < 3; ++ch)
+            km.p[ch][i] = (float)pts[i].c[ch];
+    }
+    for (size_t j = 0; j < km.kpad; ++j) {
+        km.c[0][j] = j < km.k ? (float)((colors[j] >> 16) & 0xFF) : FAR;
+        km.c[1][j] = j < km.k ? (float)((colors[j] >> 8) & 0xFF) : FAR;
+        km.c[2][j] = j < km.k ? (float)(colors[j] & 0xFF) : FAR;
+    }
+
+    for (size_t t = 0; t < njobs; ++t) {
+        jobs[t].km = &km;
+        jobs[t].begin = npts * t / njobs;
+        jobs[t].end = npts * (t + 1) / njobs;
+    }
+    for (size_t it = 0; it < iterations; ++it) {
+        /* assign every point to its nearest centroid, the pool's threads
+         * are reused by every iteration */
+        if (workpool_run(pool, njobs, assign_points, jobs) < 0) {
+            kmeans_free(&km, jobs, pts);
+            return NULL;
+        }
+
+        /* move each centroid to the mean of its points, in job order */
+        for (size_t j = 0; j < km.k; ++j) {
+            uint64_t s[4] = { 0 };
+            for (size_t t = 0; t < njobs; ++t)
+                for (size_t ch = 0; ch < 4; ++ch)
+                    s[ch] += jobs[t].sums[j][ch];
+            if (s[3] == 0)
+                continue; /* an empty cluster keeps its centroid */
+            for (size_t ch = 0; ch < 3; ++ch)
+                km.c[ch][j] = (float)((double)s[ch] / (double)s[3]);
+        }
+
+        size_t changed = 0;
+        for (size_t t = 0; t < njobs; ++t)
+            changed += jobs[t].changed;
+        if (changed == 0)
+            break;
+    }
+
+    for (size_t j = 0; j < km.k; ++j) {
+        int32_t c[3];
+        for (size_t ch = 0; ch < 3; ++ch) {
+            c[ch] = (int32_t)(km.c[ch][j] + 0.5f);
+            c[ch] = c[ch] < 0 ? 0 : c[ch] > 255 ? 255 : c[ch];
+        }
+        colors[j] = (c[0] << 16) | (c[1] << 8) | c[2];
+    }
+
+    kmeans_free(&km, jobs, pts);
+    return palette_create(colors, km.k);
+}
+
+/**
+ * static functions start here
+ */
+
+/**
+ * Counts every step-th pixel of every step-th row into 15 bit bins, step
+ * chosen so that at most MAXSAMPLES pixels are read.
+ * Returns the non-empty bins as points, NULL on error.
+ */
+static struct point *
+histogram(const struct image32_t *image, size_t *npts)
+{
+    uint64_t (*sums)[4] = calloc(HISTSIZE, sizeof(*sums));
+    if (!sums) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    const size_t width = image->w / 3;
+    size_t step = 1;
+    if (width * image->h > MAXSAMPLES)
+        step = (size_t)ceil(sqrt((double)(width * image->h) / MAXSAMPLES));
+
+    const int shift = 8 - HISTBITS;
+    for (size_t y = 0; y < image->h; y += step) {
+        const uint8_t *row = (const uint8_t *)image->buf + y * image->w;
+        for (size_t x = 0; x < width; x += step) {
+            /* memory byte of file byte 3x + c in the packed words */
+            uint32_t c0 = row[(3 * x) ^ 3], c1 = row[(3 * x + 1) ^ 3], 
+                     c2 = row[(3 * x + 2) ^ 3];
+            size_t bin = (c0 >> shift) << (2 * HISTBITS) | 
+                         (c1 >> shift) << HISTBITS | (c2 >> shift);
+            sums[bin][0] += c0;
+            sums[bin][1] += c1;
+            sums[bin][2] += c2;
+            sums[bin][3]++;
+        }
+    }
+
+    size_t n = 0;
+    for (size_t bin = 0; bin < HISTSIZE; ++bin)
+        n += sums[bin][3] != 0;
+
+    struct point *pts = malloc((n ? n : 1) * sizeof(struct point));
+    if (!pts) {
+        free(sums);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    n = 0;
+    for (size_t bin = 0; bin < HISTSIZE; ++bin) {
+        uint64_t w = sums[bin][3];
+        if (!w)
+            continue;
+        for (size_t ch = 0; ch < 3; ++ch)
+            pts[n].c[ch] = (int32_t)((sums[bin][ch] + w / 2) / w);
+        pts[n].w = (uint32_t)(w > UINT32_MAX ? UINT32_MAX : w);
+        n++;
+    }
+
+    free(sums);
+    *npts = n;
+    return pts;
+}
+
+/**
+ * Splits the points into at most n boxes, always splitting the box with 
+ * the largest weight times longest side at the weighted median of that side.
+ * Writes the weighted mean colour of each box to colors.
+ * Returns the number of colours written.
+ */
+static size_t
+median_cut(struct point *pts, size_t npts, size_t n, int32_t *colors)
+{
+    static int (*const cmps[3])(const void *, const void *) = { 
+        cmp0, cmp1, cmp2 
+    };
+    struct box boxes[PAL_MAXSIZE];
+    size_t nboxes = 0;
+
+    if (npts == 0) {
+        colors[0] = 0;
+        return 1;
+    }
+
+    boxes[nboxes].begin = 0;
+    boxes[nboxes].end = npts;
+    box_bounds(&boxes[nboxes++], pts);
+
+    while (nboxes < n) {
+        size_t best = nboxes, axis = 0;
+        uint64_t score = 0;
+        for (size_t i = 0; i < nboxes; ++i) {
+            if (boxes[i].end - boxes[i].begin < 2)
+                continue;
+            for (size_t ch = 0; ch < 3; ++ch) {
+                uint64_t s = (uint64_t)(boxes[i].hi[ch] - boxes[i].lo[ch] + 1) * 
+                             boxes[i].w;
+                if (s > score) {
+                    score = s;
+                    best = i;
+                    axis = ch;
+                }
+            }
+        }
+        if (best == nboxes)
+            break; /* every box holds a single colour */
+
+        struct box *b = &boxes[best];
+        qsort(pts + b->begin, b->end - b->begin, sizeof(struct point), 
+              cmps[axis]);
+
+        /* split after the weighted median, leaving both halves non-empty */
+        uint64_t acc = 0;
+        size_t split = b->begin;
+        while (split < b->end - 1 && 2 * (acc + pts[split].w) <= b->w)
+            acc += pts[split++].w;
+        if (split == b->begin)
+            split++;
+
+        boxes[nboxes].begin = split;
+        boxes[nboxes].end = b->end;
+        b->end = split;
+        box_bounds(b, pts);
+        box_bounds(&boxes[nboxes++], pts);
+    }
+
+    for (size_t i = 0; i < nboxes; ++i) {
+        uint64_t s[3] = { 0 };
+        for (size_t p = boxes[i].begin; p < boxes[i].end; ++p)
+            for (size_t ch = 0; ch < 3; ++ch)
+                s[ch] += (uint64_t)pts[p].c[ch] * pts[p].w;
+        int32_t c[3];
+        for (size_t ch = 0; ch < 3; ++ch)
+            c[ch] = (int32_t)((s[ch] + boxes[i].w / 2) / boxes[i].w);
+        colors[i] = (c[0] << 16) | (c[1] << 8) | c[2];
+    }
+    return nboxes;
+}
+
+/* recomputes the bounds and total weight of b's points */
+static void
+box_bounds(struct box *b, const struct point *pts)
+{
+    for (size_t ch = 0; ch < 3; ++ch) {
+        b->lo[ch] = 255;
+        b->hi[ch] = 0;
+    }
+    b->w = 0;
+    for (size_t p = b->begin; p < b->end; ++p) {
+        for (size_t ch = 0; ch < 3; ++ch) {
+            if (pts[p].c[ch] < b->lo[ch])
+                b->lo[ch] = pts[p].c[ch];
+            if (pts[p].c[ch] > b->hi[ch])
+                b->hi[ch] = pts[p].c[ch];
+        }
+        b->w += pts[p].w;
+    }
+}
+
+static int
+cmp0(const void *a, const void *b)
+{
+    return ((const struct point *)a)->c[0] - ((const struct point *)b)->c[0];
+}
+
+static int
+cmp1(const void *a, const void *b)
+{
+    return ((const struct point *)a)->c[1] - ((const struct point *)b)->c[1];
+}
+
+static int
+cmp2(const void *a, const void *b)
+{
+    return ((const struct point *)a)->c[2] - ((const struct point *)b)->c[2];
+}
+
+/**
+ * returns the index of the centroid closest to point i, 
+ * the lowest index wins ties
+ */
+static size_t
+nearest(const struct kmeans *km, size_t i)
+{
+#ifdef PALGEN_SSE2
+    /* four centroids per step, each lane keeps its own best index */
+    const __m128 p0 = _mm_set1_ps(km->p[0][i]);
+    const __m128 p1 = _mm_set1_ps(km->p[1][i]);
+    const __m128 p2 = _mm_set1_ps(km->p[2][i]);
+    const __m128i four = _mm_set1_epi32(4);
+    __m128 best = _mm_set1_ps(FLT_MAX);
+    __m128i bestidx = _mm_setzero_si128();
+    __m128i idx = _mm_setr_epi32(0, 1, 2, 3);
+
+    for (size_t j = 0; j < km->kpad; j += 4) {
+        __m128 d0 = _mm_sub_ps(_mm_loadu_ps(km->c[0] + j), p0);
+        __m128 d1 = _mm_sub_ps(_mm_loadu_ps(km->c[1] + j), p1);
+        __m128 d2 = _mm_sub_ps(_mm_loadu_ps(km->c[2] + j), p2);
+        __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(d0, d0), 
+                        _mm_mul_ps(d1, d1)), _mm_mul_ps(d2, d2));
+        __m128i lt = _mm_castps_si128(_mm_cmplt_ps(d, best));
+        best = _mm_min_ps(d, best);
+        bestidx = _mm_or_si128(_mm_and_si128(lt, idx), 
+                        _mm_andnot_si128(lt, bestidx));
+        idx = _mm_add_epi32(idx, four);
+    }
+
+    float dist[4];
+    int32_t index[4];
+    _mm_storeu_ps(dist, best);
+    _mm_storeu_si128((__m128i *)index, bestidx);
+    size_t res = (size_t)index[0];
+    float min = dist[0];
+    for (size_t lane = 1; lane < 4; ++lane)
+        if (dist[lane] < min || 
+                (dist[lane] == min && (size_t)index[lane] < res)) {
+            min = dist[lane];
+            res = (size_t)index[lane];
+        }
+    return res;
+#else
+    size_t res = 0;
+    float min = FLT_MAX;
+    for (size_t j = 0; j < km->k; ++j) {
+        float d0 = km->c[0][j] - km->p[0][i];
+        float d1 = km->c[1][j] - km->p[1][i];
+        float d2 = km->c[2][j] - km->p[2][i];
+        float d = d0 * d0 + d1 * d1 + d2 * d2;
+        if (d < min) {
+            min = d;
+            res = j;
+        }
+    }
+    return res;
+#endif
+}
+
+/* a workpool task, the assignment step for the range of points of job */
+static void
+assign_points(void *arg, size_t task)
+{
+    struct kjob *job = (struct kjob *)arg + task;
+    const struct kmeans *km = job->km;
+
+    job->changed = 0;
+    for (size_t j = 0; j < km->k; ++j)
+        for (size_t ch = 0; ch < 4; ++ch)
+            job->sums[j][ch] = 0;
+
+    for (size_t i = job->begin; i < job->end; ++i) {
+        size_t j = nearest(km, i);
+        if (km->assign[i] != j) {
+            km->assign[i] = (uint16_t)j;
+            job->changed++;
+        }
+        const struct point *p = &km->pts[i];
+        for (size_t ch = 0; ch < 3; ++ch)
+            job->sums[j][ch] += (uint64_t)p->c[ch] * p->w;
+        job->sums[j][3] += p->w;
+    }
+}
+
+static void
+kmeans_free(struct kmeans *km, struct kjob *jobs, struct point *pts)
+{
+    for (size_t ch = 0; ch < 3; ++ch) {
+        free(km->p[ch]);
+        free(km->c[ch]);
+    }
+    free(km->assign);
+    free(jobs);
+    free(pts);
+}
@@ -0,0 +1,493 @@
+/* pipeline.c - image stages fused into one pass over row bands */
+#include <assert.h> /* for assert */
+#include <errno.h> /* for errno */
+#include <stdatomic.h> /* for atomic_size_t, atomic_int */
+#include <stdint.h> /* for uint8_t */
+#include <stdlib.h> /* for calloc, malloc, free */
+#include <string.h> /* for memcpy */
+#include "../include/convolve.h"
+#include "../include/dither.h"
+#include "../include/imageproc.h"
+#include "../include/palette.h"
+#include "../include/pipeline.h"
+#include "../include/workpool.h"
+
+extern int errno; /* these functions set errno on errors */
+
+/**
+ * a neighbourhood stage run a band at a time, so it can carry sums from
+ * row to row, as box_blur_band
+ */
+typedef void (*stage_band_fn)(uint8_t *dest, const uint8_t *src,
+                size_t nsrc, size_t y0, size_t y1, size_t stride, void *arg);
+
+struct stage {
+    stage_point_fn point;   /* one of point, filter and band is set */
+    stage_filter_fn filter;
+    stage_band_fn band;
+    size_t radius;
+    void *arg;
+    void *owned;            /* freed with the pipeline */
+};
+
+struct pipeline {
+    struct stage stages[PIPELINE_MAXSTAGES];
+    size_t nstages;
+    size_t halo;            /* sum of the radii, rows a band reads around it */
+};
+
+/**
+ * a pipeline_run_rows call, shared by its tasks; rows are counted in the
+ * whole image, which src and dest are windows of
+ */
+struct run {
+    const struct pipeline *pipe;
+    const struct image32_t *src;
+    struct image32_t *dest;
+    size_t sy;              /* the image row of the first row of src */
+    size_t dy;              /* the image row of the first row of dest */
+    size_t h;               /* rows of the whole image */
+    size_t band;            /* rows per band */
+    size_t nbands;
+    atomic_size_t next;     /* next band to be claimed */
+    atomic_int failed;
+};
+
+/* static function prototypes */
+static int add_stage(struct pipeline *pipe, const struct stage *stage);
+static int add_dither(struct pipeline *pipe, struct dither_job *job);
+static size_t band_height(const struct pipeline *pipe, size_t w);
+static void run_bands(void *arg, size_t task);
+static void run_points(const struct run *run, size_t y0, size_t y1);
+static void run_band(const struct run *run, uint8_t **bufs, size_t y0,
+                size_t y1);
+
+/**
+ * Creates an empty pipeline, stages run in the order they are added.
+ * Returns the new pipeline if successful, NULL otherwise.
+ */
+struct pipeline *
+pipeline_create(void)
+{
+    struct pipeline *pipe = calloc(1, sizeof(*pipe));
+    if (!pipe)
+        errno = ENOMEM;
+    return pipe;
+}
+
+/**
+ * frees pipe and the state of its built in stages
+ */
+void
+pipeline_destroy(struct pipeline *pipe)
+{
+    if (!pipe)
+        return;
+    for (size_t i = 0; i < pipe->nstages; ++i)
+        free(pipe->stages[i].owned);
+    free(pipe);
+}
+
+/**
+ * Appends a point-wise stage, run as fn(row, nbytes, 0, y, arg) on every
+ * row. fn is called from several threads at once when run on a pool.
+ * Returns 1 if successful, -1 otherwise.
+ */
+int
+pipeline_add_point(struct pipeline *pipe, stage_point_fn fn, void *arg)
+{
+    if (!fn) {
+        errno = EINVAL;
+        return -1;
+    }
+    const struct stage stage = { .point = fn, .arg = arg };
+    return add_stage(pipe, &stage);
+}
+
+/**
+ * Appends a neighbourhood stage that reads radius rows above and below
+ * the row it writes, at most PIPELINE_MAXRADIUS.
+ * Returns 1 if successful, -1 otherwise.
+ */
+int
+pipeline_add_filter(struct pipeline *pipe, stage_filter_fn fn, size_t radius,
+                    void *arg)
+{
+    if (!fn || radius > PIPELINE_MAXRADIUS) {
+        errno = EINVAL;
+        return -1;
+    }
+    const struct stage stage = { .filter = fn, .radius = radius, .arg = arg };
+    return add_stage(pipe, &stage);
+}
+
+/**
+ * appends a conversion of every pixel to its luma, see gray_span
+ */
+int
+pipeline_add_gray(struct pipeline *pipe)
+{
+    return pipeline_add_point(pipe, gray_span, NULL);
+}
+
+/**
+ * appends an inversion of every channel byte, see invert_span
+ */
+int
+pipeline_add_invert(struct pipeline *pipe)
+{
+    return pipeline_add_point(pipe, invert_span, NULL);
+}
+
+/**
+ * Appends ordered dithering with a dim x dim Bayer matrix and levels
+ * levels per channel, as ordered_dithering_n.
+ * Returns 1 if successful, -1 otherwise (errno EINVAL if dim or levels
+ * have no matrix or spacing, checked here rather than in pipeline_run).
+ */
+int
+pipeline_add_dither(struct pipeline *pipe, size_t dim, unsigned levels)
+{
+    if (!pipe || !dither_dim_valid(dim) || !dither_levels_valid(levels)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct dither_job *job = malloc(sizeof(*job));
+    if (!job) {
+        errno = ENOMEM;
+        return -1;
+    }
+    if (dither_job_init(job, dim, levels, DITHER_PACKED32) < 0) {
+        free(job);
+        return -1;
+    }
+    return add_dither(pipe, job);
+}
+
+/**
+ * Appends ordered dithering with the blue noise texture, as 
+ * blue_noise_dithering.
+ * Returns 1 if successful, -1 otherwise.
+ */
+int
+pipeline_add_noise_dither(struct pipeline *pipe, unsigned levels)
+{
+    struct dither_job *job = malloc(sizeof(*job));
+    if (!job) {
+        errno = ENOMEM;
+        return -1;
+    }
+    if (dither_job_noise(job, levels, DITHER_PACKED32) < 0) {
+        free(job);
+        return -1;
+    }
+    return add_dither(pipe, job);
+}
+
+/**
+ * Appends a mapping of every pixel to its closest colour in pal, which
+ * must outlive the pipeline. Its lookup table is built here, so that the
+ * threads running the stage only read it.
+ * Returns 1 if successful, -1 otherwise.
+ */
+int
+pipeline_add_palette(struct pipeline *pipe, struct palette *pal)
+{
+    if (!pal) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (palette_prepare(pal) < 0)
+        return -1;
+    return pipeline_add_point(pipe, palette_map_span, pal);
+}
+
+/**
+ * Appends a box blur of the given radius, at most PIPELINE_MAXRADIUS, over
+ * rows of width pixels, as box_blur32.
+ * Returns 1 if successful, -1 otherwise.
+ */
+int
+pipeline_add_box_blur(struct pipeline *pipe, size_t width, size_t radius)
+{
+    if (!width || radius > PIPELINE_MAXRADIUS) {
+        errno = EINVAL;
+        return -1;
+    }
+    struct box_rows *box = malloc(sizeof(*box));
+    if (!box) {
+        errno = ENOMEM;
+        return -1;
+    }
+    box->width = width;
+    box->radius = radius;
+    const struct stage stage = { .band = box_blur_band, .radius = radius,
+                                 .arg = box, .owned = box };
+    if (add_stage(pipe, &stage) < 0) {
+        free(box);
+        return -1;
+    }
+    return 1;
+}
+
+/**
+ * returns the rows a band of output reads above and below it, the sum of
+ * the radii of the stages of pipe
+ */
+size_t
+pipeline_halo(const struct pipeline *pipe)
+{
+    return pipe ? pipe->halo : 0;
+}
+
+/**
+ * returns the bytes of band buffers a run of pipe over rows of w bytes
+ * allocates on each of nthreads threads at most, on top of its src and
+ * dest
+ */
+size_t
+pipeline_scratch(const struct pipeline *pipe, size_t w, size_t nthreads)
+{
+    if (!pipe || !pipe->halo)
+        return 0;
+    return nthreads * 2 * (band_height(pipe, w) + 2 * pipe->halo) * w;
+}
+
+/**
+ * Runs every stage of pipe over src, writing dest, one band of rows at a
+ * time so a band stays in cache from the first stage to the last. Bands
+ * are spread over the threads of pool (NULL runs them on the calling
+ * thread); a band with neighbourhood stages recomputes the halo rows it
+ * shares with the bands next to it, so the output never depends on pool.
+ * src and dest must have the same size, and may only be the same image
+ * if the pipeline has no neighbourhood stages.
+ * Returns 1 if successful, -1 otherwise.
+ */
+int
+pipeline_run(const struct pipeline *pipe, const struct image32_t *src,
+             struct image32_t *dest, struct workpool *pool)
+{
+    if (!src || !dest || src->h != dest->h) {
+        errno = EINVAL;
+        return -1;
+    }
+    return pipeline_run_rows(pipe, src, 0, dest, 0, src->h, pool);
+}
+
+/**
+ * Runs pipe over a window of an image of h rows, as pipeline_run: src
+ * holds its rows sy .. sy + src->h - 1 and dest is written with rows
+ * dy .. dy + dest->h - 1, so an image can be streamed through pipe a band
+ * at a time. src must hold the rows the output rows read, pipeline_halo
+ * rows above and below them but for the edges of the image, and stages
+ * see the rows of the whole image, so the output is the same as that of
+ * pipeline_run. src and dest may only be the same window if the pipeline
+ * has no neighbourhood stages.
+ * Returns 1 if successful, -1 otherwise.
+ */
+int
+pipeline_run_rows(const struct pipeline *pipe, const struct image32_t *src,
+                  size_t sy, struct image32_t *dest, size_t dy, size_t h,
+                  struct workpool *pool)
+{
+    if (!pipe || !src || !src->buf || !dest || !dest->buf
+        || src->w != dest->w || sy > h || src->h > h - sy
+        || dy > h || dest->h > h - dy
+        || (pipe->halo && src->buf == dest->buf)
+        || (src->buf == dest->buf && sy != dy)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (!src->w || !dest->h)
+        return 1;
+
+    /* the rows the output reads, clipped to the image */
+    const size_t lo = dy > pipe->halo ? dy - pipe->halo : 0;
+    const size_t hi = h - dy - dest->h > pipe->halo
+                      ? dy + dest->h + pipe->halo : h;
+    if (lo < sy || hi > sy + src->h) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct run run;
+    run.pipe = pipe;
+    run.src = src;
+    run.dest = dest;
+    run.sy = sy;
+    run.dy = dy;
+    run.h = h;
+    run.band = band_height(pipe, src->w);
+    run.nbands = (dest->h + run.band - 1) / run.band;
+    atomic_init(&run.next, 0);
+    atomic_init(&run.failed, 0);
+
+    /* one task per thread, each claims bands until none are left */
+    size_t ntasks = workpool_size(pool);
+    if (ntasks > run.nbands)
+        ntasks = run.nbands;
+    if (workpool_run(pool, ntasks, run_bands, &run) < 0)
+        return -1;
+
+    if (atomic_load(&run.failed)) {
+        errno = ENOMEM;
+        return -1;
+    }
+    return 1;
+}
+
+/**
+ * static functions start here
+ */
+
+static int
+add_stage(struct pipeline *pipe, const struct stage *stage)
+{
+    if (!pipe || pipe->nstages == PIPELINE_MAXSTAGES) {
+        errno = EINVAL;
+        return -1;
+    }
+    pipe->stages[pipe->nstages++] = *stage;
+    pipe->halo += stage->radius;
+    return 1;
+}
+
+/* appends a dither stage that owns job */
+static int
+add_dither(struct pipeline *pipe, struct dither_job *job)
+{
+    const struct stage stage = { .point = dither_span, .arg = job,
+                                 .owned = job };
+    if (add_stage(pipe, &stage) < 0) {
+        free(job);
+        return -1;
+    }
+    return 1;
+}
+
+/* rows per band, two buffers of band + 2 * halo rows when there are filters */
+static size_t
+band_height(const struct pipeline *pipe, size_t w)
+{
+    size_t rows = PIPELINE_BAND_BYTES / w;
+    if (pipe->halo) {
+        rows /= 2;
+        rows = rows > 4 * pipe->halo ? rows - 2 * pipe->halo : 2 * pipe->halo;
+    }
+    return rows ? rows : 1;
+}
+
+/* a task of pipeline_run_rows, with its own band buffers */
+static void
+run_bands(void *arg, size_t task)
+{
+    struct run *run = arg;
+    const size_t w = run->src->w;
+    (void)task;
+
+    uint8_t *bufs[2] = { NULL, NULL };
+    if (run->pipe->halo) {
+        size_t nbytes = (run->band + 2 * run->pipe->halo) * w;
+        bufs[0] = malloc(nbytes);
+        bufs[1] = malloc(nbytes);
+        if (!bufs[0] || !bufs[1]) {
+            atomic_store(&run->failed, 1);
+            free(bufs[0]);
+            free(bufs[1]);
+            return;
+        }
+    }
+
+    const size_t end = run->dy + run->dest->h;
+    size_t b;
+    while ((b = atomic_fetch_add(&run->next, 1)) < run->nbands) {
+        size_t y0 = run->dy + b * run->band;
+        size_t y1 = end - y0 < run->band ? end : y0 + run->band;
+        if (run->pipe->halo)
+            run_band(run, bufs, y0, y1);
+        else
+            run_points(run, y0, y1);
+    }
+
+    free(bufs[0]);
+    free(bufs[1]);
+}
+
+/* rows y0 .. y1 - 1 of a pipeline of point-wise stages, row by row */
+static void
+run_points(const struct run *run, size_t y0, size_t y1)
+{
+    const struct pipeline *pipe = run->pipe;
+    const size_t w = run->src->w;
+
+    for (size_t y = y0; y < y1; ++y) {
+        uint8_t *row = (uint8_t *)run->dest->buf + (y - run->dy) * w;
+        if (run->dest->buf != run->src->buf)
+            memcpy(row, (const uint8_t *)run->src->buf + (y - run->sy) * w,
+                   w);
+        for (size_t s = 0; s < pipe->nstages; ++s)
+            pipe->stages[s].point(row, w, 0, y, pipe->stages[s].arg);
+    }
+}
+
+/**
+ * rows y0 .. y1 - 1 of a pipeline with neighbourhood stages; bufs hold
+ * rows y0 - halo .. y1 + halo, row yy at (yy + halo - y0) * w, and each
+ * stage works out the rows the stages after it still read
+ */
+static void
+run_band(const struct run *run, uint8_t **bufs, size_t y0, size_t y1)
+{
+    const struct pipeline *pipe = run->pipe;
+    const size_t w = run->src->w, h = run->h, halo = pipe->halo;
+    uint8_t *cur = bufs[0], *next = bufs[1];
+#define BANDROW(buf, yy) ( (buf) + ((yy) + halo - y0) * w )
+
+    size_t lo = y0 > halo ? y0 - halo : 0;
+    size_t hi = h - y1 > halo ? y1 + halo : h;
+    memcpy(BANDROW(cur, lo),
+           (const uint8_t *)run->src->buf + (lo - run->sy) * w, (hi - lo) * w);
+
+    size_t after = halo; /* radii of the stages not yet run */
+    for (size_t s = 0; s < pipe->nstages; ++s) {
+        const struct stage *stage = &pipe->stages[s];
+        if (stage->point) {
+            for (size_t yy = lo; yy < hi; ++yy)
+                stage->point(BANDROW(cur, yy), w, 0, yy, stage->arg);
+            continue;
+        }
+
+        const size_t r = stage->radius;
+        after -= r;
+        size_t nlo = y0 > after ? y0 - after : 0;
+        size_t nhi = h - y1 > after ? y1 + after : h;
+        if (stage->band) {
+            /* rows lo .. hi - 1 end at the edges of the image or r rows
+             * past the ones read, so repeating them repeats the edges */
+            stage->band(BANDROW(next, nlo), BANDROW(cur, lo), hi - lo,
+                        nlo - lo, nhi - lo, w, stage->arg);
+        } else {
+            const uint8_t *rows[2 * PIPELINE_MAXRADIUS + 1];
+            for (size_t yy = nlo; yy < nhi; ++yy) {
+                for (size_t d = 0; d <= 2 * r; ++d) {
+                    size_t ys = yy + d < r ? 0 : yy + d - r;
+                    ys = ys < h ? ys : h - 1;
+                    assert(ys >= lo && ys < hi);
+                    rows[d] = BANDROW(cur, ys);
+                }
+                stage->filter(BANDROW(next, yy), rows, w, yy, stage->arg);
+            }
+        }
+
+        uint8_t *tmp = cur;
+        cur = next;
+        next = tmp;
+        lo = nlo;
+        hi = nhi;
+    }
+
+    memcpy((uint8_t *)run->dest->buf + (y0 - run->dy) * w, BANDROW(cur, y0),
+           (y1 - y0) * w);
+#undef BANDROW
+}
@@ -0,0 +1,383 @@
+/* pnm.c - memory mapped PGM (P5) and PPM (P6) files */
+#include <errno.h> /* for errno */
+#include <stdint.h> /* for uint8_t, uint32_t, INT32_MAX */
+#include <stdio.h> /* for FILE, fopen, fwrite, snprintf */
+#include <stdlib.h> /* for malloc, free */
+#include <string.h> /* for memset */
+#include "../include/image.h"
+#include "../include/imageproc.h"
+#include "../include/luma.h"
+#include "../include/mapfile.h"
+#include "../include/pnm.h"
+
+extern int errno; /* these functions set errno on errors */
+
+/* static function prototypes */
+static int parse_header(struct pnm_map *map, size_t *end);
+static int read_field(const uint8_t *data, size_t size, size_t *pos,
+                size_t *value);
+
+/**
+ * Maps the pgm or ppm file at path read only (see mapfile_open) and
+ * checks its header against the size of the file. Nothing is copied: the
+ * raster can be handed on as an image or a plane as it is.
+ * Returns 1 if successful, -1 otherwise (errno EINVAL if the file is not
+ * a binary pgm or ppm of 8 bit samples).
+ */
+int
+pnm_map_open(struct pnm_map *map, const char *path)
+{
+    if (!map || !path) {
+        errno = EINVAL;
+        return -1;
+    }
+    memset(map, 0, sizeof(*map));
+
+    size_t size;
+    const uint8_t *data = mapfile_open(path, &size);
+    if (!data)
+        return -1;
+    if (pnm_map_wrap(map, data, size) < 0) {
+        mapfile_close(data, size);
+        errno = EINVAL;
+        return -1;
+    }
+    return 1;
+}
+
+/**
+ * Parses the pnm file already mapped at data, of size bytes, as
+ * pnm_map_open; map owns the mapping if successful, else it is the
+ * caller's still.
+ * Returns 1 if successful, -1 otherwise (errno EINVAL).
+ */
+int
+pnm_map_wrap(struct pnm_map *map, const uint8_t *data, size_t size)
+{
+    if (!map || !data) {
+        errno = EINVAL;
+        return -1;
+    }
+    memset(map, 0, sizeof(*map));
+    map->data = data;
+    map->size = size;
+    size_t pos;
+    if (parse_header(map, &pos) < 0
+        || map->stride > (size - pos) / map->height) {
+        memset(map, 0, sizeof(*map));
+        errno = EINVAL;
+        return -1;
+    }
+    map->pixels = data + pos;
+    return 1;
+}
+
+/**
+ * Reads the header of a pgm or ppm from in, a stream that need not be
+ * seekable, into buf, which holds cap bytes and whose first have bytes
+ * (at least the magic) have been read already, a byte at a time so not a
+ * byte of the raster is taken, and parses it as pnm_map_open would. map
+ * views buf and has no pixels: the rows are still to be read from in,
+ * stride bytes each, the top row first.
+ * Returns 1 if successful, -1 otherwise (errno EINVAL if the header is
+ * not one pnm_map_open takes or does not fit in cap).
+ */
+int
+pnm_map_read(struct pnm_map *map, FILE *in, uint8_t *buf, size_t have,
+             size_t cap)
+{
+    if (!map || !in || !buf || have < 2 || have > cap) {
+        errno = EINVAL;
+        return -1;
+    }
+    memset(map, 0, sizeof(*map));
+
+    /* the header ends with the byte after the third field */
+    unsigned nfields = 0;
+    int comment = 0, digits = 0, c;
+    while (nfields < 3 && have < cap && (c = getc(in)) != EOF) {
+        buf[have++] = (uint8_t)c;
+        if (comment) {
+            comment = c != '\n' && c != '\r';
+        } else if (c >= '0' && c <= '9') {
+            digits = 1;
+        } else {
+            nfields += digits;
+            digits = 0;
+            comment = c == '#';
+        }
+    }
+
+    size_t pos;
+    map->data = buf;
+    map->size = have;
+    if (nfields < 3 || parse_header(map, &pos) < 0 || pos != have) {
+        memset(map, 0, sizeof(*map));
+        errno = EINVAL;
+        return -1;
+    }
+    return 1;
+}
+
+/**
+ * unmaps a file of pnm_map_open, views of it must not be used afterwards
+ */
+void
+pnm_map_close(struct pnm_map *map)
+{
+    if (!map)
+        return;
+    mapfile_close(map->data, map->size);
+    memset(map, 0, sizeof(*map));
+}
+
+/**
+ * Makes view an interleaved image of the raster of map, 1 channel of
+ * gray or 3 of r, g, b, its top row first, without copying it. The view
+ * is read only, as the mapping is, and lasts as long as map.
+ * Returns 1 if successful, -1 otherwise.
+ */
+int
+pnm_map_image(const struct pnm_map *map, struct image *view)
+{
+    if (!map || !map->data || !view) {
+        errno = EINVAL;
+        return -1;
+    }
+    memset(view, 0, sizeof(*view));
+    view->planes[0] = (uint8_t *)map->pixels;
+    view->width = map->width;
+    view->height = map->height;
+    view->stride = map->stride;
+    view->channels = map->channels;
+    view->layout = IMAGE_INTERLEAVED;
+    return 1;
+}
+
+/**
+ * Makes plane the raster of a pgm map, without copying it, so it can be
+ * wrapped as a saru_bytemat frame for the motion search (see luma.h). The
+ * plane is read only and lasts as long as map.
+ * Returns 1 if successful, -1 otherwise (errno EINVAL for a ppm).
+ */
+int
+pnm_map_plane(const struct pnm_map *map, struct luma_plane *plane)
+{
+    if (!map || !map->data || !plane || map->channels != 1) {
+        errno = EINVAL;
+        return -1;
+    }
+    plane->buf = (uint8_t *)map->pixels;
+    plane->wid = map->width;
+    plane->hgt = map->height;
+    return 1;
+}
+
+/**
+ * Converts dest->h rows of map from row y, counting from the bottom as
+ * in every image32_t, into the packed image dest, whose w must be 3 *
+ * width rounded up to 4: gray is spread over b, g and r, samples are
+ * scaled to 255 and the padding is zeroed.
+ * Returns 1 if successful, -1 otherwise.
+ */
+int
+pnm_map_rows_to32(const struct pnm_map *map, size_t y,
+                  struct image32_t *dest)
+{
+    if (!map || !map->data || !dest || !dest->buf
+        || dest->w != ((map->width * 3 + 3) & ~(size_t)3)
+        || y > map->height || dest->h > map->height - y) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    uint8_t scale[256];
+    for (unsigned v = 0; v < 256; ++v)
+        scale[v] = (uint8_t)(v >= map->maxval ? 255
+                             : (v * 255 + map->maxval / 2) / map->maxval);
+
+    /* b, g, r bytes in a row, then swapped in place while in cache */
+    const size_t nwords = dest->w / 4;
+    uint32_t *words = (uint32_t *)dest->buf;
+    for (size_t i = 0; i < dest->h; ++i) {
+        const uint8_t *src = pnm_map_row(map, map->height - 1 - (y + i));
+        uint8_t *row = (uint8_t *)(words + i * nwords);
+        if (map->channels == 1) {
+            for (size_t x = 0; x < map->width; ++x)
+                row[3 * x] = row[3 * x + 1] = row[3 * x + 2] = scale[src[x]];
+        } else {
+            for (size_t x = 0; x < map->width; ++x) {
+                row[3 * x] = scale[src[3 * x + 2]];
+                row[3 * x + 1] = scale[src[3 * x + 1]];
+                row[3 * x + 2] = scale[src[3 * x]];
+            }
+        }
+        memset(row + 3 * map->width, 0, dest->w - 3 * map->width);
+        for (size_t j = i * nwords; j < (i + 1) * nwords; ++j)
+            words[j] = __builtin_bswap32(words[j]);
+    }
+    return 1;
+}
+
+/**
+ * Writes the header of a pgm (1 channel) or ppm (3) of 8 bit samples to
+ * buf, of at least PNM_HEADER_MAX bytes.
+ * Returns its length if successful, -1 otherwise.
+ */
+int
+pnm_header(char *buf, unsigned channels, size_t width, size_t height)
+{
+    if (!buf || (channels != 1 && channels != 3)) {
+        errno = EINVAL;
+        return -1;
+    }
+    int len = snprintf(buf, PNM_HEADER_MAX, "P%c\n%zu %zu\n255\n",
+                       channels == 1 ? '5' : '6', width, height);
+    if (len < 0 || len >= PNM_HEADER_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+    return len;
+}
+
+/**
+ * converts a row of a packed image, width pixels, to a pnm row of r, g,
+ * b samples (3 channels) or of their BT.601 luma (1, see luma_row)
+ * NOTE: row must start on an int32 boundary
+ */
+void
+pnm_row_from32(uint8_t *dest, const uint8_t *row, size_t width,
+               unsigned channels)
+{
+    if (channels == 1) {
+        luma_row(dest, row, width, LUMA_BT601);
+        return;
+    }
+    /* file bytes are B, G, R; memory byte of file byte j is j ^ 3 */
+    for (size_t x = 0; x < width; ++x) {
+        dest[3 * x] = row[(3 * x + 2) ^ 3];
+        dest[3 * x + 1] = row[(3 * x + 1) ^ 3];
+        dest[3 * x + 2] = row[(3 * x) ^ 3];
+    }
+}
+
+/**
+ * Writes image, of 1 or 3 channels, to a new pgm or ppm at path, row 0
+ * at the top and the channels in order, as pnm_map_image views them:
+ * interleaved rows are written as they are, planar ones are interleaved
+ * a row at a time.
+ * Returns 1 if successful, -1 otherwise.
+ */
+int
+pnm_write(const char *path, const struct image *image)
+{
+    char header[PNM_HEADER_MAX];
+    if (!path || !image || !image->planes[0]) {
+        errno = EINVAL;
+        return -1;
+    }
+    const int len = pnm_header(header, image->channels, image->width,
+                               image->height);
+    if (len < 0)
+        return -1;
+
+    const size_t nbytes = image->width * image->channels;
+    uint8_t *row = NULL;
+    if (image->layout == IMAGE_PLANAR && !(row = malloc(nbytes))) {
+        errno = ENOMEM;
+        return -1;
+    }
+    FILE *fp = fopen(path, "wb");
+    if (!fp) {
+        free(row);
+        return -1;
+    }
+
+    int ok = fwrite(header, 1, (size_t)len, fp) == (size_t)len;
+    for (size_t y = 0; ok && y < image->height; ++y) {
+        const uint8_t *src = image_row(image, 0, y);
+        if (row) {
+            for (unsigned c = 0; c < image->channels; ++c) {
+                const uint8_t *plane = image_row(image, c, y);
+                for (size_t x = 0; x < image->width; ++x)
+                    row[x * image->channels + c] = plane[x];
+            }
+            src = row;
+        }
+        ok = fwrite(src, 1, nbytes, fp) == nbytes;
+    }
+
+    free(row);
+    if (fclose(fp) != 0 || !ok)
+        return -1;
+    return 1;
+}
+
+/**
+ * static functions start here
+ */
+
+/**
+ * fills in the header fields and end, the offset of the raster, -1 on a
+ * bad header
+ */
+static int
+parse_header(struct pnm_map *map, size_t *end)
+{
+    const uint8_t *p = map->data;
+    if (map->size < 3 || p[0] != 'P' || (p[1] != '5' && p[1] != '6'))
+        return -1;
+    map->channels = p[1] == '5' ? 1 : 3;
+
+    size_t pos = 2, width, height, maxval;
+    if (read_field(p, map->size, &pos, &width) < 0
+        || read_field(p, map->size, &pos, &height) < 0
+        || read_field(p, map->size, &pos, &maxval) < 0)
+        return -1;
+    /* a single whitespace byte ends the header */
+    if (pos >= map->size || !width || !height || !maxval || maxval > 255)
+        return -1;
+    pos++;
+
+    map->width = width;
+    map->height = height;
+    map->maxval = (unsigned)maxval;
+    map->stride = width * map->channels;
+    *end = pos;
+    return 1;
+}
+
+/**
+ * reads the decimal field after whitespace and comments from pos, which
+ * is left on the byte after it; -1 if there is none or it is too large
+ */
+static int
+read_field(const uint8_t *data, size_t size, size_t *pos, size_t *value)
+{
+    size_t i = *pos;
+    int spaced = 0;
+    while (i < size) {
+        if (data[i] == '#') {
+            while (i < size && data[i] != '\n')
+                i++;
+        } else if (data[i] == ' ' || data[i] == '\t' || data[i] == '\n'
+                   || data[i] == '\r' || data[i] == '\v' || data[i] == '\f') {
+            i++;
+            spaced = 1;
+        } else {
+            break;
+        }
+    }
+    if (!spaced || i >= size || data[i] < '0' || data[i] > '9')
+        return -1;
+
+    size_t v = 0;
+    for (; i < size && data[i] >= '0' && data[i] <= '9'; ++i) {
+        v = v * 10 + (size_t)(data[i] - '0');
+        if (v > INT32_MAX)
+            return -1;
+    }
+    *pos = i;
+    *value = v;
+    return 1;
+}
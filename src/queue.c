@@ -0,0 +1,118 @@
+/* queue.c - a bounded, blocking queue of pointers between threads */
+#include <errno.h> /* for errno */
+#include <pthread.h> /* for pthread_mutex_t, pthread_cond_t */
+#include <stdlib.h> /* for calloc, free */
+#include "../include/queue.h"
+
+extern int errno; /* these functions set errno on errors */
+
+/**
+ * a ring of capacity items: producers wait while it is full, so a fast
+ * stage can only run capacity items ahead of the one after it
+ */
+struct queue {
+    void **items;
+    size_t capacity;
+    size_t head;            /* the next item popped */
+    size_t count;
+    int closed;
+    pthread_mutex_t lock;
+    pthread_cond_t notfull;
+    pthread_cond_t notempty;
+};
+
+/**
+ * Creates an empty queue of at most capacity items.
+ * Returns the new queue if successful, NULL otherwise.
+ */
+struct queue *
+queue_create(size_t capacity)
+{
+    if (!capacity) {
+        errno = EINVAL;
+        return NULL;
+    }
+    struct queue *queue = calloc(1, sizeof(*queue));
+    if (!queue || !(queue->items = calloc(capacity, sizeof(void *)))) {
+        free(queue);
+        errno = ENOMEM;
+        return NULL;
+    }
+    queue->capacity = capacity;
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->notfull, NULL);
+    pthread_cond_init(&queue->notempty, NULL);
+    return queue;
+}
+
+/**
+ * frees queue, which no thread may be waiting on; items still in it are
+ * the caller's
+ */
+void
+queue_destroy(struct queue *queue)
+{
+    if (!queue)
+        return;
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->notfull);
+    pthread_cond_destroy(&queue->notempty);
+    free(queue->items);
+    free(queue);
+}
+
+/**
+ * Appends item, waiting while the queue is full.
+ * Returns 1 if successful, -1 if the queue is closed (errno EPIPE).
+ */
+int
+queue_push(struct queue *queue, void *item)
+{
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == queue->capacity && !queue->closed)
+        pthread_cond_wait(&queue->notfull, &queue->lock);
+    if (queue->closed) {
+        pthread_mutex_unlock(&queue->lock);
+        errno = EPIPE;
+        return -1;
+    }
+    queue->items[(queue->head + queue->count++) % queue->capacity] = item;
+    pthread_cond_signal(&queue->notempty);
+    pthread_mutex_unlock(&queue->lock);
+    return 1;
+}
+
+/**
+ * Removes the oldest item, waiting while the queue is empty and open.
+ * Returns the item, or NULL once the queue is closed and drained.
+ */
+void *
+queue_pop(struct queue *queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    while (!queue->count && !queue->closed)
+        pthread_cond_wait(&queue->notempty, &queue->lock);
+    void *item = NULL;
+    if (queue->count) {
+        item = queue->items[queue->head];
+        queue->head = (queue->head + 1) % queue->capacity;
+        queue->count--;
+        pthread_cond_signal(&queue->notfull);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return item;
+}
+
+/**
+ * ends the queue: pushes fail from now on, and pops return NULL once the
+ * items already in it are gone
+ */
+void
+queue_close(struct queue *queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    queue->closed = 1;
+    pthread_cond_broadcast(&queue->notfull);
+    pthread_cond_broadcast(&queue->notempty);
+    pthread_mutex_unlock(&queue->lock);
+}
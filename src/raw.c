@@ -0,0 +1,148 @@
+/* raw.c - memory mapped raw planar files */
+#include <errno.h> /* for errno */
+#include <stdio.h> /* for FILE, fopen, fwrite */
+#include <stdlib.h> /* for malloc, free */
+#include <string.h> /* for memset */
+#include "../include/image.h"
+#include "../include/luma.h"
+#include "../include/mapfile.h"
+#include "../include/raw.h"
+
+extern int errno; /* these functions set errno on errors */
+
+/**
+ * Maps the raw planar file at path read only (see mapfile_open), which
+ * must hold channels planes of width x height samples, no more, no less.
+ * Returns 1 if successful, -1 otherwise (errno EINVAL if the size of the
+ * file does not match).
+ */
+int
+raw_map_open(struct raw_map *map, const char *path, size_t width,
+             size_t height, unsigned channels)
+{
+    if (!map || !path || !width || !height || !channels
+        || channels > IMAGE_MAXCHANNELS
+        || height > (size_t)-1 / width / channels) {
+        errno = EINVAL;
+        return -1;
+    }
+    memset(map, 0, sizeof(*map));
+
+    size_t size;
+    const uint8_t *data = mapfile_open(path, &size);
+    if (!data)
+        return -1;
+    if (size != width * height * channels) {
+        mapfile_close(data, size);
+        errno = EINVAL;
+        return -1;
+    }
+    map->data = data;
+    map->size = size;
+    map->width = width;
+    map->height = height;
+    map->channels = channels;
+    return 1;
+}
+
+/**
+ * unmaps a file of raw_map_open, views of it must not be used afterwards
+ */
+void
+raw_map_close(struct raw_map *map)
+{
+    if (!map)
+        return;
+    mapfile_close(map->data, map->size);
+    memset(map, 0, sizeof(*map));
+}
+
+/**
+ * Makes view a planar image of the planes of map without copying them.
+ * The view is read only, as the mapping is, and lasts as long as map.
+ * Returns 1 if successful, -1 otherwise.
+ */
+int
+raw_map_image(const struct raw_map *map, struct image *view)
+{
+    if (!map || !map->data || !view) {
+        errno = EINVAL;
+        return -1;
+    }
+    memset(view, 0, sizeof(*view));
+    for (unsigned c = 0; c < map->channels; ++c)
+        view->planes[c] = (uint8_t *)map->data + c * map->width * map->height;
+    view->width = map->width;
+    view->height = map->height;
+    view->stride = map->width;
+    view->channels = map->channels;
+    view->layout = IMAGE_PLANAR;
+    return 1;
+}
+
+/**
+ * Makes plane the given channel of map, without copying it, so a luma or
+ * gray plane can be wrapped as a saru_bytemat frame (see luma.h). The
+ * plane is read only and lasts as long as map.
+ * Returns 1 if successful, -1 otherwise.
+ */
+int
+raw_map_plane(const struct raw_map *map, unsigned channel,
+              struct luma_plane *plane)
+{
+    if (!map || !map->data || !plane || channel >= map->channels) {
+        errno = EINVAL;
+        return -1;
+    }
+    plane->buf = (uint8_t *)map->data + channel * map->width * map->height;
+    plane->wid = map->width;
+    plane->hgt = map->height;
+    return 1;
+}
+
+/**
+ * Writes image to a new raw planar file at path, a plane per channel,
+ * row 0 first, as raw_map_image views it: planar rows are written as they
+ * are, interleaved ones are split a row at a time.
+ * Returns 1 if successful, -1 otherwise.
+ */
+int
+raw_write(const char *path, const struct image *image)
+{
+    if (!path || !image || !image->planes[0] || !image->channels) {
+        errno = EINVAL;
+        return -1;
+    }
+    uint8_t *row = NULL;
+    if (image->layout == IMAGE_INTERLEAVED
+        && !(row = malloc(image->width))) {
+        errno = ENOMEM;
+        return -1;
+    }
+    FILE *fp = fopen(path, "wb");
+    if (!fp) {
+        free(row);
+        return -1;
+    }
+
+    int ok = 1;
+    for (unsigned c = 0; ok && c < image->channels; ++c) {
+        for (size_t y = 0; ok && y < image->height; ++y) {
+            const uint8_t *src;
+            if (row) {
+                const uint8_t *pixels = image_row(image, 0, y);
+                for (size_t x = 0; x < image->width; ++x)
+                    row[x] = pixels[x * image->channels + c];
+                src = row;
+            } else {
+                src = image_row(image, c, y);
+            }
+            ok = fwrite(src, 1, image->width, fp) == image->width;
+        }
+    }
+
+    free(row);
+    if (fclose(fp) != 0 || !ok)
+        return -1;
+    return 1;
+}
@@ -0,0 +1,566 @@
+/* resample.c - separable image scaling with cached filter banks */
+#include <assert.h> /* for assert */
+#include <errno.h> /* for errno */
+#include <math.h> /* for floor, ceil, sin, fabs, lround */
+#include <pthread.h> /* for pthread_mutex_t */
+#include <stdatomic.h> /* for atomic_int */
+#include <stdint.h> /* for uint8_t, int16_t, int32_t, SIZE_MAX */
+#include <stdlib.h> /* for malloc, free */
+#include <string.h> /* for memset */
+#include "../include/imageproc.h"
+#include "../include/resample.h"
+#include "../include/workpool.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h> /* for SSE2 intrinsics */
+#define RESAMPLE_SSE2 1
+#endif
+
+extern int errno; /* these functions set errno on errors */
+
+#define PI 3.14159265358979323846
+#define ONE (1 << RESAMPLE_BITS)
+
+/* the weights of every output pixel along one axis */
+struct bank {
+    size_t srclen, dstlen;
+    enum resample_filter filter;
+    size_t ntaps;       /* weights per output pixel, even */
+    size_t *start;      /* first source pixel of each output pixel */
+    int16_t *weights;   /* dstlen rows of ntaps, zero past the last tap */
+    unsigned refs;      /* callers using it, it is not freed before 0 */
+    int cached;         /* in a slot of cache, or freed by the last user */
+    unsigned long used; /* clock of its last use, for eviction */
+};
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct bank *cache[RESAMPLE_CACHE_SLOTS];
+static unsigned long cache_clock;
+
+/* a resample32 call, shared by its tasks */
+struct run {
+    const struct image32_t *src;
+    struct image32_t *dest;
+    size_t swidth, dwidth;
+    const struct bank *hbank, *vbank;
+    uint8_t *mid;       /* src->h rows of dwidth pixels of 4 bytes */
+    size_t stride;      /* bytes of a row of mid, a multiple of 16 */
+    size_t rows;        /* per task, of the pass running */
+    atomic_int failed;
+};
+
+/* static function prototypes */
+static double filter_support(enum resample_filter filter);
+static double filter_eval(enum resample_filter filter, double x);
+static struct bank *bank_get(size_t srclen, size_t dstlen,
+                enum resample_filter filter);
+static void bank_put(struct bank *bank);
+static struct bank *bank_build(size_t srclen, size_t dstlen,
+                enum resample_filter filter);
+static void bank_free(struct bank *bank);
+static void run_horizontal(void *arg, size_t task);
+static void run_vertical(void *arg, size_t task);
+static void unpack_row(uint8_t *px, const uint8_t *row, size_t width);
+static void pack_row(uint8_t *row, const uint8_t *px, size_t width,
+                size_t nbytes);
+static size_t hrow_sse2(uint8_t *dest, const uint8_t *px,
+                const struct bank *bank);
+static void hrow_scalar(uint8_t *dest, const uint8_t *px,
+                const struct bank *bank, size_t x);
+static size_t vrow_sse2(uint8_t *dest, const uint8_t *const *rows,
+                const int16_t *w, size_t ntaps, size_t nbytes);
+static void vrow_scalar(uint8_t *dest, const uint8_t *const *rows,
+                const int16_t *w, size_t ntaps, size_t i, size_t nbytes);
+static uint8_t clamp_byte(int32_t v);
+
+/**
+ * Scales the packed image src, swidth pixels wide, into dest, dwidth pixels
+ * wide and dest->h rows high; both w must be the padded row length 3 *
+ * width rounded up to 4, dest->buf is allocated by the caller. Rows are
+ * filtered horizontally then vertically with RESAMPLE_BITS fixed point
+ * weights, whose banks are cached per (source, destination) size and
+ * filter, and both passes are spread over the threads of pool (NULL runs
+ * them on the calling thread). Scaling to the same size copies the image.
+ * Returns 1 if successful, -1 otherwise.
+ */
+int
+resample32(struct image32_t *dest, size_t dwidth, const struct image32_t *src,
+           size_t swidth, enum resample_filter filter, struct workpool *pool)
+{
+    if (!dest || !dest->buf || !src || !src->buf || !swidth || !dwidth
+        || !src->h || !dest->h
+        || src->w != ((swidth * 3 + 3) & ~(size_t)3)
+        || dest->w != ((dwidth * 3 + 3) & ~(size_t)3)
+        || (filter != RESAMPLE_BOX && filter != RESAMPLE_BILINEAR
+            && filter != RESAMPLE_LANCZOS3)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct run run;
+    run.src = src;
+    run.dest = dest;
+    run.swidth = swidth;
+    run.dwidth = dwidth;
+    run.stride = (dwidth * 4 + 15) & ~(size_t)15;
+    atomic_init(&run.failed, 0);
+    if (run.stride > SIZE_MAX / src->h) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    run.hbank = bank_get(swidth, dwidth, filter);
+    run.vbank = bank_get(src->h, dest->h, filter);
+    run.mid = malloc(run.stride * src->h);
+    int res = -1;
+    if (!run.hbank || !run.vbank || !run.mid) {
+        errno = ENOMEM;
+        goto done;
+    }
+
+    /* every source row horizontally, then every output row vertically */
+    size_t ntasks = workpool_size(pool);
+    ntasks = ntasks < src->h ? ntasks : src->h;
+    run.rows = (src->h + ntasks - 1) / ntasks;
+    if (workpool_run(pool, ntasks, run_horizontal, &run) < 0)
+        goto done;
+
+    ntasks = workpool_size(pool);
+    ntasks = ntasks < dest->h ? ntasks : dest->h;
+    run.rows = (dest->h + ntasks - 1) / ntasks;
+    if (!atomic_load(&run.failed)
+        && workpool_run(pool, ntasks, run_vertical, &run) < 0)
+        goto done;
+
+    if (atomic_load(&run.failed))
+        errno = ENOMEM;
+    else
+        res = 1;
+done:
+    free(run.mid);
+    bank_put((struct bank *)run.hbank);
+    bank_put((struct bank *)run.vbank);
+    return res;
+}
+
+/**
+ * frees the cached filter banks, those in use go once their resample32
+ * calls return
+ */
+void
+resample_cache_clear(void)
+{
+    pthread_mutex_lock(&cache_lock);
+    for (size_t s = 0; s < RESAMPLE_CACHE_SLOTS; ++s) {
+        struct bank *bank = cache[s];
+        cache[s] = NULL;
+        if (!bank)
+            continue;
+        bank->cached = 0;
+        if (!bank->refs)
+            bank_free(bank);
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/**
+ * static functions start here
+ */
+
+/* half the width of the kernel at scale 1 */
+static double
+filter_support(enum resample_filter filter)
+{
+    switch (filter) {
+    case RESAMPLE_BOX:
+        return 0.5;
+    case RESAMPLE_BILINEAR:
+        return 1.0;
+    default:
+        return 3.0;
+    }
+}
+
+/* the kernel at distance x, in source pixels at scale 1 */
+static double
+filter_eval(enum resample_filter filter, double x)
+{
+    switch (filter) {
+    case RESAMPLE_BOX:
+        return x >= -0.5 && x < 0.5 ? 1.0 : 0.0;
+    case RESAMPLE_BILINEAR:
+        x = fabs(x);
+        return x < 1.0 ? 1.0 - x : 0.0;
+    default:
+        x = fabs(x);
+        if (x < 1e-9)
+            return 1.0;
+        if (x >= 3.0)
+            return 0.0;
+        return 3.0 * sin(PI * x) * sin(PI * x / 3.0) / (PI * PI * x * x);
+    }
+}
+
+/**
+ * the bank for srclen -> dstlen, from the cache or built and cached,
+ * NULL if out of memory; bank_put releases it
+ */
+static struct bank *
+bank_get(size_t srclen, size_t dstlen, enum resample_filter filter)
+{
+#define MATCHES(b) ( (b) && (b)->srclen == srclen && (b)->dstlen == dstlen \
+                     && (b)->filter == filter )
+    pthread_mutex_lock(&cache_lock);
+    for (size_t s = 0; s < RESAMPLE_CACHE_SLOTS; ++s)
+        if (MATCHES(cache[s])) {
+            struct bank *bank = cache[s];
+            ++bank->refs;
+            bank->used = ++cache_clock;
+            pthread_mutex_unlock(&cache_lock);
+            return bank;
+        }
+    pthread_mutex_unlock(&cache_lock);
+
+    /* built unlocked, another thread may have cached the same meanwhile */
+    struct bank *bank = bank_build(srclen, dstlen, filter);
+    if (!bank)
+        return NULL;
+
+    pthread_mutex_lock(&cache_lock);
+    size_t victim = RESAMPLE_CACHE_SLOTS;
+    for (size_t s = 0; s < RESAMPLE_CACHE_SLOTS; ++s) {
+        if (MATCHES(cache[s])) {
+            bank_free(bank);
+            bank = cache[s];
+            ++bank->refs;
+            bank->used = ++cache_clock;
+            pthread_mutex_unlock(&cache_lock);
+            return bank;
+        }
+        if (!cache[s])
+            victim = s;
+        else if (!cache[s]->refs && (victim == RESAMPLE_CACHE_SLOTS
+                 || (cache[victim] && cache[s]->used < cache[victim]->used)))
+            victim = s;
+    }
+    bank->refs = 1;
+    bank->used = ++cache_clock;
+    if (victim < RESAMPLE_CACHE_SLOTS) {
+        bank_free(cache[victim]); /* bank_free(NULL) is valid */
+        cache[victim] = bank;
+        bank->cached = 1;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return bank;
+#undef MATCHES
+}
+
+/* releases a bank of bank_get, freeing it if it was not cached */
+static void
+bank_put(struct bank *bank)
+{
+    if (!bank)
+        return;
+    pthread_mutex_lock(&cache_lock);
+    if (!--bank->refs && !bank->cached)
+        bank_free(bank);
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/**
+ * Works out the weights of each of the dstlen output pixels over the
+ * srclen source pixels, centres mapped to centres. Shrinking widens the
+ * kernel by the scale so that every source pixel counts. The weights of a
+ * pixel are normalised and rounded to sum to exactly ONE, so flat areas
+ * stay flat.
+ */
+static struct bank *
+bank_build(size_t srclen, size_t dstlen, enum resample_filter filter)
+{
+    const double scale = (double)srclen / dstlen;
+    const double fscale = scale > 1.0 ? scale : 1.0;
+    const double support = filter_support(filter) * fscale;
+    size_t ntaps = (size_t)ceil(support) * 2 + 1;
+    ntaps += ntaps & 1;
+
+    struct bank *bank = calloc(1, sizeof(*bank));
+    double *w = malloc(ntaps * sizeof(*w));
+    if (!bank || !w || dstlen > SIZE_MAX / sizeof(int16_t) / ntaps) {
+        free(bank);
+        free(w);
+        return NULL;
+    }
+    bank->srclen = srclen;
+    bank->dstlen = dstlen;
+    bank->filter = filter;
+    bank->ntaps = ntaps;
+    bank->start = malloc(dstlen * sizeof(*bank->start));
+    bank->weights = calloc(dstlen * ntaps, sizeof(*bank->weights));
+    if (!bank->start || !bank->weights) {
+        bank_free(bank);
+        free(w);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < dstlen; ++i) {
+        const double center = (i + 0.5) * scale;
+        const double lo = floor(center - support + 0.5);
+        const double hi = floor(center + support + 0.5);
+        const size_t xmin = lo < 0 ? 0 : (size_t)lo;
+        const size_t xmax = hi > (double)srclen ? srclen : (size_t)hi;
+        const size_t count = xmax - xmin;
+        assert(count >= 1 && count <= ntaps);
+
+        double sum = 0;
+        for (size_t k = 0; k < count; ++k) {
+            w[k] = filter_eval(filter, (xmin + k - center + 0.5) / fscale);
+            sum += w[k];
+        }
+        if (sum == 0) { /* cannot happen for these kernels, but be safe */
+            w[count / 2] = sum = 1;
+        }
+
+        int16_t *q = bank->weights + i * ntaps;
+        int32_t total = 0;
+        size_t big = 0;
+        for (size_t k = 0; k < count; ++k) {
+            q[k] = (int16_t)lround(w[k] / sum * ONE);
+            total += q[k];
+            if (abs(q[k]) > abs(q[big]))
+                big = k;
+        }
+        q[big] = (int16_t)(q[big] + ONE - total);
+        bank->start[i] = xmin;
+    }
+
+    free(w);
+    return bank;
+}
+
+static void
+bank_free(struct bank *bank)
+{
+    if (!bank)
+        return;
+    free(bank->start);
+    free(bank->weights);
+    free(bank);
+}
+
+/* a task of resample32, the horizontal pass over a run of source rows */
+static void
+run_horizontal(void *arg, size_t task)
+{
+    struct run *run = arg;
+    const size_t h = run->src->h, y0 = task * run->rows;
+    if (y0 >= h)
+        return;
+    const size_t y1 = h - y0 < run->rows ? h : y0 + run->rows;
+
+    /* the kernels read up to ntaps pixels past the last one, all zero */
+    const size_t npx = run->swidth + run->hbank->ntaps;
+    uint8_t *px = malloc(npx * 4);
+    if (!px) {
+        atomic_store(&run->failed, 1);
+        return;
+    }
+    memset(px + run->swidth * 4, 0, run->hbank->ntaps * 4);
+
+    for (size_t y = y0; y < y1; ++y) {
+        unpack_row(px, (const uint8_t *)run->src->buf + y * run->src->w,
+                   run->swidth);
+        uint8_t *dest = run->mid + y * run->stride;
+        hrow_scalar(dest, px, run->hbank, hrow_sse2(dest, px, run->hbank));
+    }
+    free(px);
+}
+
+/* a task of resample32, the vertical pass over a run of output rows */
+static void
+run_vertical(void *arg, size_t task)
+{
+    struct run *run = arg;
+    const size_t h = run->dest->h, y0 = task * run->rows;
+    if (y0 >= h)
+        return;
+    const size_t y1 = h - y0 < run->rows ? h : y0 + run->rows;
+    const struct bank *bank = run->vbank;
+
+    uint8_t *px = malloc(run->stride);
+    const uint8_t **rows = malloc(bank->ntaps * sizeof(*rows));
+    if (!px || !rows) {
+        atomic_store(&run->failed, 1);
+        free(px);
+        free(rows);
+        return;
+    }
+
+    for (size_t y = y0; y < y1; ++y) {
+        /* taps past the last row have weight 0, any row will do */
+        for (size_t k = 0; k < bank->ntaps; ++k) {
+            size_t ys = bank->start[y] + k;
+            ys = ys < run->src->h ? ys : run->src->h - 1;
+            rows[k] = run->mid + ys * run->stride;
+        }
+        const int16_t *w = bank->weights + y * bank->ntaps;
+        size_t done = vrow_sse2(px, rows, w, bank->ntaps, run->stride);
+        vrow_scalar(px, rows, w, bank->ntaps, done, run->stride);
+        pack_row((uint8_t *)run->dest->buf + y * run->dest->w, px,
+                 run->dwidth, run->dest->w);
+    }
+    free(px);
+    free(rows);
+}
+
+/* the pixels of a packed row as 4 bytes each, file bytes B, G, R and 0 */
+static void
+unpack_row(uint8_t *px, const uint8_t *row, size_t width)
+{
+    for (size_t x = 0; x < width; ++x) {
+        const size_t i = 3 * x;
+        px[4 * x] = row[i ^ 3];
+        px[4 * x + 1] = row[(i + 1) ^ 3];
+        px[4 * x + 2] = row[(i + 2) ^ 3];
+        px[4 * x + 3] = 0;
+    }
+}
+
+/* the reverse of unpack_row, zeroing the padding of the nbytes row */
+static void
+pack_row(uint8_t *row, const uint8_t *px, size_t width, size_t nbytes)
+{
+    for (size_t x = 0; x < width; ++x) {
+        const size_t i = 3 * x;
+        row[i ^ 3] = px[4 * x];
+        row[(i + 1) ^ 3] = px[4 * x + 1];
+        row[(i + 2) ^ 3] = px[4 * x + 2];
+    }
+    for (size_t j = 3 * width; j < nbytes; ++j)
+        row[j ^ 3] = 0;
+}
+
+/**
+ * the horizontal pass on one row, all 4 channels of an output pixel in a
+ * vector: each step interleaves the bytes of two source pixels, so one
+ * pmaddwd weighs both; returns the pixel it stopped at
+ */
+static size_t
+hrow_sse2(uint8_t *dest, const uint8_t *px, const struct bank *bank)
+{
+#ifdef RESAMPLE_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i half = _mm_set1_epi32(ONE / 2);
+    for (size_t x = 0; x < bank->dstlen; ++x) {
+        const uint8_t *p = px + 4 * bank->start[x];
+        const int16_t *w = bank->weights + x * bank->ntaps;
+        __m128i acc = half;
+        for (size_t k = 0; k < bank->ntaps; k += 2) {
+            __m128i two = _mm_loadl_epi64((const __m128i *)(p + 4 * k));
+            two = _mm_unpacklo_epi8(two, _mm_srli_si128(two, 4));
+            two = _mm_unpacklo_epi8(two, zero);
+            const uint32_t pair = (uint16_t)w[k]
+                                  | (uint32_t)(uint16_t)w[k + 1] << 16;
+            acc = _mm_add_epi32(acc, _mm_madd_epi16(two,
+                                _mm_set1_epi32((int32_t)pair)));
+        }
+        acc = _mm_srai_epi32(acc, RESAMPLE_BITS);
+        acc = _mm_packs_epi32(acc, acc);
+        acc = _mm_packus_epi16(acc, acc);
+        const int32_t out = _mm_cvtsi128_si32(acc);
+        memcpy(dest + 4 * x, &out, 4);
+    }
+    return bank->dstlen;
+#else
+    (void)dest;
+    (void)px;
+    (void)bank;
+    return 0;
+#endif
+}
+
+/* output pixels x .. dstlen - 1 of the horizontal pass */
+static void
+hrow_scalar(uint8_t *dest, const uint8_t *px, const struct bank *bank,
+            size_t x)
+{
+    for (; x < bank->dstlen; ++x) {
+        const uint8_t *p = px + 4 * bank->start[x];
+        const int16_t *w = bank->weights + x * bank->ntaps;
+        for (size_t c = 0; c < 4; ++c) {
+            int32_t acc = ONE / 2;
+            for (size_t k = 0; k < bank->ntaps; ++k)
+                acc += w[k] * p[4 * k + c];
+            dest[4 * x + c] = clamp_byte(acc >> RESAMPLE_BITS);
+        }
+    }
+}
+
+/**
+ * the vertical pass on one row, 16 bytes at a time: the bytes of two
+ * source rows interleave so one pmaddwd weighs a pair of taps; returns
+ * the byte it stopped at
+ */
+static size_t
+vrow_sse2(uint8_t *dest, const uint8_t *const *rows, const int16_t *w,
+          size_t ntaps, size_t nbytes)
+{
+#ifdef RESAMPLE_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i half = _mm_set1_epi32(ONE / 2);
+    size_t i = 0;
+    for (; i + 16 <= nbytes; i += 16) {
+        __m128i acc[4] = { half, half, half, half };
+        for (size_t k = 0; k < ntaps; k += 2) {
+            const __m128i a = _mm_loadu_si128((const __m128i *)(rows[k] + i));
+            const __m128i b = _mm_loadu_si128(
+                (const __m128i *)(rows[k + 1] + i));
+            const uint32_t pair = (uint16_t)w[k]
+                                  | (uint32_t)(uint16_t)w[k + 1] << 16;
+            const __m128i wp = _mm_set1_epi32((int32_t)pair);
+            const __m128i lo = _mm_unpacklo_epi8(a, b);
+            const __m128i hi = _mm_unpackhi_epi8(a, b);
+            acc[0] = _mm_add_epi32(acc[0],
+                        _mm_madd_epi16(_mm_unpacklo_epi8(lo, zero), wp));
+            acc[1] = _mm_add_epi32(acc[1],
+                        _mm_madd_epi16(_mm_unpackhi_epi8(lo, zero), wp));
+            acc[2] = _mm_add_epi32(acc[2],
+                        _mm_madd_epi16(_mm_unpacklo_epi8(hi, zero), wp));
+            acc[3] = _mm_add_epi32(acc[3],
+                        _mm_madd_epi16(_mm_unpackhi_epi8(hi, zero), wp));
+        }
+        for (size_t j = 0; j < 4; ++j)
+            acc[j] = _mm_srai_epi32(acc[j], RESAMPLE_BITS);
+        const __m128i words = _mm_packs_epi32(acc[0], acc[1]);
+        const __m128i words2 = _mm_packs_epi32(acc[2], acc[3]);
+        _mm_storeu_si128((__m128i *)(dest + i),
+                         _mm_packus_epi16(words, words2));
+    }
+    return i;
+#else
+    (void)dest;
+    (void)rows;
+    (void)w;
+    (void)ntaps;
+    (void)nbytes;
+    return 0;
+#endif
+}
+
+/* bytes i .. nbytes - 1 of the vertical pass */
+static void
+vrow_scalar(uint8_t *dest, const uint8_t *const *rows, const int16_t *w,
+            size_t ntaps, size_t i, size_t nbytes)
+{
+    for (; i < nbytes; ++i) {
+        int32_t acc = ONE / 2;
+        for (size_t k = 0; k < ntaps; ++k)
+            acc += w[k] * rows[k][i];
+        dest[i] = clamp_byte(acc >> RESAMPLE_BITS);
+    }
+}
+
+static uint8_t
+clamp_byte(int32_t v)
+{
+    return (uint8_t)(v < 0 ? 0 : v > 255 ? 255 : v);
+}
@@ -0,0 +1,279 @@
+/* sad-hash.c - exact-match block search through a hash index */
+#include "../include/sad.h"
+#include <errno.h> /* for errno, ENOMEM, EINVAL */
+#include <limits.h> /* for INT_MAX */
+#include <stdint.h> /* for uint32_t, int32_t */
+#include <stdlib.h> /* for malloc, calloc, free */
+#include <string.h> /* for memcmp, memset */
+#include "saru-bytebuf.h"
+
+/* multipliers of the horizontal and vertical polynomial hashes (odd) */
+#define HASH_A 0x01000193u
+#define HASH_B 0x9E3779B1u
+
+/* static function prototypes */
+static uint32_t upow(uint32_t base, size_t exp);
+static uint32_t mix(uint32_t h);
+static void hash_row(const unsigned char *row, size_t bwid, uint32_t apow,
+                     size_t n, uint32_t *dest);
+static int block_equal(const unsigned char *a, size_t astride,
+                       const unsigned char *b, size_t bstride,
+                       size_t wid, size_t hgt);
+
+/**
+ * function: sad_hashidx_init, prepares an empty index of every bwid x bhgt
+ *           block position of a fwid x fhgt reference frame
+ * returns: 1 if successful, -1 otherwise (errno is set)
+ * notes: 1. rows are hashed as they are handed to sad_hashidx_addrows,
+ *           so the index can be filled while the frame is still being
+ *           decoded.
+ *        2. positions are int32_t, so a frame of more than INT32_MAX
+ *           block positions (or INT_MAX rows) is rejected with EINVAL.
+ */
+int
+sad_hashidx_init(struct sad_hashidx *idx, size_t fwid, size_t fhgt,
+                 size_t bwid, size_t bhgt)
+{
+  if (!idx || !bwid || !bhgt || bwid > fwid || bhgt > fhgt ||
+      fhgt > INT_MAX ||
+      fwid - bwid + 1 > INT32_MAX / (fhgt - bhgt + 1)) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  memset(idx, 0, sizeof(*idx));
+  idx->fwid = fwid;
+  idx->fhgt = fhgt;
+  idx->bwid = bwid;
+  idx->bhgt = bhgt;
+  idx->pwid = fwid - bwid + 1;
+  idx->phgt = fhgt - bhgt + 1;
+  idx->apow = upow(HASH_A, bwid);
+  idx->bpow = upow(HASH_B, bhgt);
+
+  /* at least twice as many buckets as positions keeps the chains short */
+  size_t npos = idx->pwid * idx->phgt;
+  idx->nbuckets = 1;
+  while (idx->nbuckets < 2 * npos)
+    idx->nbuckets <<= 1;
+
+  idx->hashes = malloc(npos * sizeof(uint32_t));
+  idx->next = malloc(npos * sizeof(int32_t));
+  idx->head = malloc(idx->nbuckets * sizeof(int32_t));
+  idx->tail = malloc(idx->nbuckets * sizeof(int32_t));
+  idx->rowhash = malloc(bhgt * idx->pwid * sizeof(uint32_t));
+  idx->colhash = calloc(idx->pwid, sizeof(uint32_t));
+  if (!idx->hashes || !idx->next || !idx->head || !idx->tail ||
+      !idx->rowhash || !idx->colhash) {
+    sad_hashidx_free(idx);
+    errno = ENOMEM;
+    return -1;
+  }
+  memset(idx->head, 0xFF, idx->nbuckets * sizeof(int32_t));
+  memset(idx->tail, 0xFF, idx->nbuckets * sizeof(int32_t));
+  return 1;
+}
+
+/**
+ * function: sad_hashidx_addrows, hashes the next nrows rows of the
+ *           reference frame (each fwid bytes long, stored back to back)
+ * returns: the number of rows hashed so far, -1 on error
+ * notes: every row costs O(fwid); each completed block position is
+ *        inserted with a rolling update of its column hash, at the tail
+ *        of its bucket so every chain runs in row-major order.
+ */
+int
+sad_hashidx_addrows(struct sad_hashidx *idx, const unsigned char *rows,
+                    size_t nrows)
+{
+  if (!idx || !idx->head || !rows || idx->rows + nrows > idx->fhgt) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  for (size_t r = 0; r < nrows; r++, rows += idx->fwid) {
+    /* the ring slot of the row that leaves the window is reused */
+    uint32_t *slot = idx->rowhash + (idx->rows % idx->bhgt) * idx->pwid;
+    int full = idx->rows >= idx->bhgt;
+
+    for (size_t c = 0; c < idx->pwid; c++) {
+      uint32_t old = full ? slot[c] : 0;
+      idx->colhash[c] = idx->colhash[c] * HASH_B - old * idx->bpow;
+    }
+    hash_row(rows, idx->bwid, idx->apow, idx->pwid, slot);
+    for (size_t c = 0; c < idx->pwid; c++)
+      idx->colhash[c] += slot[c];
+
+    idx->rows++;
+    if (idx->rows < idx->bhgt)
+      continue;
+
+    /* the block whose bottom row was just added is complete, positions
+     * only grow so linking at the tail keeps the chains ascending */
+    size_t prow = idx->rows - idx->bhgt;
+    for (size_t c = 0; c < idx->pwid; c++) {
+      int32_t pos = (int32_t)(prow * idx->pwid + c);
+      uint32_t h = mix(idx->colhash[c]);
+      size_t bucket = h & (idx->nbuckets - 1);
+      idx->hashes[pos] = h;
+      idx->next[pos] = -1;
+      if (idx->tail[bucket] < 0)
+        idx->head[bucket] = pos;
+      else
+        idx->next[idx->tail[bucket]] = pos;
+      idx->tail[bucket] = pos;
+    }
+  }
+  return (int)idx->rows;
+}
+
+/**
+ * function: sad_hashidx_build, hashes a whole reference frame at once
+ * returns: 1 if successful, -1 otherwise
+ */
+int
+sad_hashidx_build(struct sad_hashidx *idx, struct saru_bytemat *frame,
+                  size_t bwid, size_t bhgt)
+{
+  if (!frame || !frame->buf) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (sad_hashidx_init(idx, frame->wid, frame->hgt, bwid, bhgt) < 0)
+    return -1;
+  if (sad_hashidx_addrows(idx, frame->buf, frame->hgt) < 0)
+    return -1;
+  return 1;
+}
+
+/**
+ * frees the tables owned by idx, idx itself is left zeroed
+ */
+void
+sad_hashidx_free(struct sad_hashidx *idx)
+{
+  if (!idx)
+    return;
+  free(idx->hashes);
+  free(idx->next);
+  free(idx->head);
+  free(idx->tail);
+  free(idx->rowhash);
+  free(idx->colhash);
+  memset(idx, 0, sizeof(*idx));
+}
+
+/**
+ * function: hash_sad, looks template up in the hash index of frame
+ *           before doing any SAD calculation
+ * returns: the same result as c_sad; an exact match (sad of 0) is found
+ *          in O(1), otherwise c_sad runs as the fallback
+ * notes: 1. idx must have been built from a frame of frame's size with the
+ *           template's size, otherwise errno is set to EINVAL and c_sad
+ *           runs instead of the lookup.
+ *        2. of several exact matches the first in row-major order wins,
+ *           as with c_sad.
+ */
+struct sad_result
+hash_sad(struct saru_bytemat *template, struct saru_bytemat *frame,
+         const struct sad_hashidx *idx)
+{
+  if (!idx || !idx->head || !template || !frame || !template->buf ||
+      !frame->buf || idx->rows < idx->bhgt)
+    return c_sad(template, frame);
+  /* the positions of another frame would be read past its end */
+  if (idx->bwid != template->wid || idx->bhgt != template->hgt ||
+      idx->fwid != frame->wid || idx->fhgt != frame->hgt) {
+    errno = EINVAL;
+    return c_sad(template, frame);
+  }
+
+  /* hash the template exactly like a block of the frame */
+  uint32_t th = 0;
+  for (size_t r = 0; r < template->hgt; r++) {
+    uint32_t row;
+    hash_row(template->buf + r * template->wid, idx->bwid, idx->apow, 1, &row);
+    th = th * HASH_B + row;
+  }
+  th = mix(th);
+
+  /* positions that have not been hashed yet are not in the table; the
+   * chain is in row-major order, so the first verified match is the one */
+  int32_t best = -1;
+  for (int32_t pos = idx->head[th & (idx->nbuckets - 1)]; pos >= 0;
+       pos = idx->next[pos]) {
+    if (idx->hashes[pos] != th)
+      continue;
+    size_t frow = (size_t)pos / idx->pwid, fcol = (size_t)pos % idx->pwid;
+    if (block_equal(frame->buf + frow * frame->wid + fcol, frame->wid,
+                    template->buf, template->wid,
+                    template->wid, template->hgt)) {
+      best = pos;
+      break;
+    }
+  }
+
+  if (best < 0)
+    return c_sad(template, frame);
+
+  struct sad_result res;
+  res.sad = 0;
+  res.frow = (size_t)best / idx->pwid;
+  res.fcol = (size_t)best % idx->pwid;
+  return res;
+}
+
+/**
+ * static functions start here
+ */
+
+static uint32_t
+upow(uint32_t base, size_t exp)
+{
+  uint32_t res = 1;
+  while (exp--)
+    res *= base;
+  return res;
+}
+
+/* finalizer so the low bits used for the bucket depend on every byte */
+static uint32_t
+mix(uint32_t h)
+{
+  h ^= h >> 16;
+  h *= 0x85EBCA6Bu;
+  h ^= h >> 13;
+  h *= 0xC2B2AE35u;
+  h ^= h >> 16;
+  return h;
+}
+
+/**
+ * writes the rolling hash of the first n bwid wide windows of row into dest
+ * apow must be HASH_A to the power of bwid
+ */
+static void
+hash_row(const unsigned char *row, size_t bwid, uint32_t apow, size_t n,
+         uint32_t *dest)
+{
+  uint32_t h = 0;
+  for (size_t i = 0; i < bwid; i++)
+    h = h * HASH_A + row[i];
+  dest[0] = h;
+
+  for (size_t c = 1; c < n; c++) {
+    h = h * HASH_A - row[c - 1] * apow + row[c - 1 + bwid];
+    dest[c] = h;
+  }
+}
+
+static int
+block_equal(const unsigned char *a, size_t astride,
+            const unsigned char *b, size_t bstride, size_t wid, size_t hgt)
+{
+  for (size_t r = 0; r < hgt; r++, a += astride, b += bstride)
+    if (memcmp(a, b, wid))
+      return 0;
+  return 1;
+}
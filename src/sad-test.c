@@ -7,7 +7,7 @@
 #include <stdio.h> /* for printf */
 #include <stdlib.h> /* for free */
 #include <errno.h> /* for errno */
-#include <string.h> /* for memcpy */
+#include <string.h> /* for memcpy, memset */
 #include "../include/sad-test.h"
 #include "../include/bmp.h"
 #include "../include/sad.h"
@@ -140,9 +140,77 @@ int sad_selftest(void) {
      assert(0 == res.frow);
      assert(2 == res.fcol);
 
+     /* the template does not occur verbatim, so hash_sad falls back */
+     struct sad_hashidx idx;
+     assert(1 == sad_hashidx_build(&idx, frame, 3, 3));
+     res = hash_sad(template, frame, &idx);
+     assert(17 == res.sad);
+     assert(0 == res.frow);
+     assert(2 == res.fcol);
+     sad_hashidx_free(&idx);
+
      free(template);
      free(frame);
 
+     // testcase 2: exact match found through the hash index
+     unsigned char fb2[] = {
+         9, 9, 9, 9, 9, 9,
+         9, 1, 2, 9, 1, 2,
+         9, 3, 4, 9, 3, 4,
+         9, 9, 9, 9, 9, 9
+     };
+     unsigned char tb2[] = {
+         1, 2,
+         3, 4
+     };
+     SBM_WRAP(template2, tb2, 2, 2);
+     SBM_WRAP(frame2, fb2, 6, 4);
+
+     /* fed in two halves, as rows would arrive from a decoder */
+     assert(1 == sad_hashidx_init(&idx, 6, 4, 2, 2));
+     assert(2 == sad_hashidx_addrows(&idx, fb2, 2));
+     assert(4 == sad_hashidx_addrows(&idx, fb2 + 2 * 6, 2));
+     res = hash_sad(template2, frame2, &idx);
+     assert(0 == res.sad);
+     assert(1 == res.frow);
+     assert(1 == res.fcol);
+     sad_hashidx_free(&idx);
+
+     free(template2);
+     free(frame2);
+
+     // testcase 3: on flat content every position matches, the first wins
+     unsigned char fb3[8 * 8], tb3[3 * 3];
+     memset(fb3, 5, sizeof(fb3));
+     memset(tb3, 5, sizeof(tb3));
+     SBM_WRAP(template3, tb3, 3, 3);
+     SBM_WRAP(frame3, fb3, 8, 8);
+     assert(1 == sad_hashidx_build(&idx, frame3, 3, 3));
+     res = hash_sad(template3, frame3, &idx);
+     assert(0 == res.sad);
+     assert(0 == res.frow);
+     assert(0 == res.fcol);
+     sad_hashidx_free(&idx);
+
+     /* an index of a taller frame is not used on a shorter one */
+     assert(1 == sad_hashidx_build(&idx, frame3, 3, 3));
+     frame3->hgt = 4;
+     errno = 0;
+     res = hash_sad(template3, frame3, &idx);
+     assert(EINVAL == errno);
+     assert(0 == res.sad);
+     assert(0 == res.frow);
+     assert(0 == res.fcol);
+     frame3->hgt = 8;
+     sad_hashidx_free(&idx);
+
+     /* positions past INT32_MAX can't be linked */
+     assert(-1 == sad_hashidx_init(&idx, 65536, 65536, 1, 1));
+     assert(EINVAL == errno);
+
+     free(template3);
+     free(frame3);
+
 	 return 1;
 }
 
@@ -0,0 +1,244 @@
+/* stream.c - images run through a pipeline a band of rows at a time */
+#include <errno.h> /* for errno */
+#include <stdint.h> /* for int32_t, uint8_t */
+#include <stdio.h> /* for FILE, fopen, fclose */
+#include <stdlib.h> /* for malloc, free */
+#include <string.h> /* for memcpy */
+#include "../include/imageio.h"
+#include "../include/imageproc.h"
+#include "../include/overlap.h"
+#include "../include/pipeline.h"
+#include "../include/stream.h"
+#include "../include/workpool.h"
+
+extern int errno; /* these functions set errno on errors */
+
+/* a stream_file call, shared by its stages */
+struct stream {
+    const struct pipeline *pipe;
+    struct imagefile *file;
+    FILE *out;
+    struct workpool *pool;
+    size_t w, h;
+    size_t band;    /* rows of output a frame holds */
+    size_t halo;
+    int topfirst;   /* bands go top band first */
+    uint8_t *carry; /* rows of a stream read for a band and its next */
+    size_t carry_y; /* the first of them, counting from the bottom */
+    size_t ncarry;
+};
+
+/* static function prototypes */
+static void band_rows(const struct stream *st, size_t index, size_t *y0,
+                size_t *y1);
+static int read_stream(struct stream *st, size_t lo, size_t hi,
+                struct image32_t *in);
+static int read_band(void *arg, struct overlap_frame *frame);
+static int run_band(void *arg, struct overlap_frame *frame);
+static int write_band(void *arg, struct overlap_frame *frame);
+
+/**
+ * Returns the rows of output a band of stream_image holds when its rows
+ * are w bytes and its buffers, those of pipe included, may take ceiling
+ * bytes: each of the STREAM_FRAMES bands in flight is read with its halo
+ * rows into one buffer and, with neighbourhood stages, written from
+ * another, else it is worked on in place.
+ * Returns 0 if not even a row fits.
+ */
+size_t
+stream_band(const struct pipeline *pipe, size_t w, size_t ceiling,
+            struct workpool *pool)
+{
+    if (!pipe || !w)
+        return 0;
+    const size_t scratch = pipeline_scratch(pipe, w, workpool_size(pool));
+    const size_t halo = pipeline_halo(pipe);
+    if (ceiling <= scratch)
+        return 0;
+
+    const size_t rows = (ceiling - scratch) / STREAM_FRAMES / w;
+    if (!halo)
+        return rows;
+    return rows > 2 * halo + 1 ? (rows - 2 * halo) / 2 : 0;
+}
+
+/**
+ * Runs pipe over the image file and writes the result to dest a band of
+ * rows at a time, as stream_file does.
+ * Returns 1 if successful, -1 otherwise.
+ */
+int
+stream_image(const struct pipeline *pipe, struct imagefile *file,
+             const char *dest, size_t ceiling, struct workpool *pool,
+             struct overlap_stats *stats)
+{
+    if (!pipe || !file || !dest) {
+        errno = EINVAL;
+        return -1;
+    }
+    FILE *out = fopen(dest, "wb");
+    if (!out)
+        return -1;
+    int res = stream_file(pipe, file, out, ceiling, pool, stats);
+    if (fclose(out) != 0)
+        res = -1;
+    return res;
+}
+
+/**
+ * Runs pipe over the image file and writes the result, headers first, to
+ * out a band of rows at a time, so the pixels of the image are never all
+ * in memory. Reading, running and writing bands are overlapped on their
+ * own threads (see overlap_run): band n + 1 is read from file, with the
+ * halo rows its neighbourhood stages need, and band n - 1 written while
+ * band n runs on the threads of pool. Bands go in the order of
+ * imagefile_topfirst, so neither file nor out need be seekable: the rows
+ * of a stream are read as they arrive, those a band shares with the next
+ * kept over, and written in the order they arrived. Its buffers and those
+ * of pipe take at most ceiling bytes; the pages of a mapping already read
+ * are clean and the kernel drops them first. The output is that of
+ * pipeline_run over the whole image; stats, if not NULL, tell how busy
+ * each stage was.
+ * Returns 1 if successful, -1 otherwise (errno ENOMEM if a row and its
+ * halo do not fit in ceiling).
+ */
+int
+stream_file(const struct pipeline *pipe, struct imagefile *file, FILE *out,
+            size_t ceiling, struct workpool *pool, struct overlap_stats *stats)
+{
+    struct stream st = { .pipe = pipe, .file = file, .out = out,
+                         .pool = pool };
+    if (!pipe || !out || imagefile_size(file, &st.w, &st.h) < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    st.halo = pipeline_halo(pipe);
+    st.topfirst = imagefile_topfirst(file);
+    const size_t ncarry = imagefile_sequential(file) ? 2 * st.halo : 0;
+    if (ncarry && ceiling > ncarry * st.w)
+        ceiling -= ncarry * st.w;
+    st.band = stream_band(pipe, st.w, ceiling, pool);
+    if (!st.band) {
+        errno = ENOMEM;
+        return -1;
+    }
+    st.band = st.band < st.h ? st.band : st.h;
+    if (ncarry && !(st.carry = malloc(ncarry * st.w))) {
+        errno = ENOMEM;
+        return -1;
+    }
+    if (imagefile_start(file, out) < 0) {
+        free(st.carry);
+        return -1;
+    }
+
+    /* one thread a stage keeps the bands in order, and a band that fails
+     * stops the rest landing in the wrong rows */
+    const struct overlap ov = {
+        .fns = { read_band, run_band, write_band },
+        .nthreads = { 1, 1, 1 },
+        .nframes = STREAM_FRAMES,
+        .stop = 1,
+        .arg = &st
+    };
+    int res = overlap_run(&ov, (st.h + st.band - 1) / st.band, stats);
+    free(st.carry);
+    return res;
+}
+
+/**
+ * static functions start here
+ */
+
+/**
+ * the rows of band index, y0 to y1 counting from the bottom: from the
+ * bottom band up, or from the top band down if the bands go top first
+ */
+static void
+band_rows(const struct stream *st, size_t index, size_t *y0, size_t *y1)
+{
+    if (st->topfirst) {
+        *y1 = st->h - index * st->band;
+        *y0 = *y1 > st->band ? *y1 - st->band : 0;
+    } else {
+        *y0 = index * st->band;
+        *y1 = st->h - *y0 < st->band ? st->h : *y0 + st->band;
+    }
+}
+
+/**
+ * reads rows lo to hi of a stream into in: those read for the band before
+ * come from the carry, the others from the stream, and the rows the next
+ * band shares with this one are kept in the carry in turn
+ */
+static int
+read_stream(struct stream *st, size_t lo, size_t hi, struct image32_t *in)
+{
+    size_t a = lo, b = hi; /* the rows still to read */
+    if (st->ncarry && st->topfirst)
+        b = st->carry_y;
+    else if (st->ncarry)
+        a = st->carry_y + st->ncarry;
+
+    uint8_t *rows = (uint8_t *)in->buf;
+    for (size_t y = lo; y < hi; ++y)
+        if (y < a || y >= b)
+            memcpy(rows + (y - lo) * st->w,
+                   st->carry + (y - st->carry_y) * st->w, st->w);
+    struct image32_t fresh = { (int32_t *)(rows + (a - lo) * st->w), st->w,
+                               b - a };
+    if (b > a && imagefile_read_rows(st->file, a, &fresh) < 0)
+        return -1;
+
+    /* the next band reaches 2 halos back into this one */
+    st->ncarry = 2 * st->halo < hi - lo ? 2 * st->halo : hi - lo;
+    st->carry_y = st->topfirst ? lo : hi - st->ncarry;
+    memcpy(st->carry, rows + (st->carry_y - lo) * st->w,
+           st->ncarry * st->w);
+    return 1;
+}
+
+/* the rows of band frame->index and its halo */
+static int
+read_band(void *arg, struct overlap_frame *frame)
+{
+    struct stream *st = arg;
+    size_t y0, y1;
+    band_rows(st, frame->index, &y0, &y1);
+    const size_t lo = y0 > st->halo ? y0 - st->halo : 0;
+    const size_t hi = st->h - y1 > st->halo ? y1 + st->halo : st->h;
+    if (overlap_reserve(frame->in, &frame->incap, st->w, hi - lo) < 0)
+        return -1;
+    if (st->carry)
+        return read_stream(st, lo, hi, frame->in);
+    return imagefile_read_rows(st->file, lo, frame->in);
+}
+
+/* the pipeline over a band, in place without neighbourhood stages */
+static int
+run_band(void *arg, struct overlap_frame *frame)
+{
+    const struct stream *st = arg;
+    size_t y0, y1;
+    band_rows(st, frame->index, &y0, &y1);
+    const size_t lo = y0 > st->halo ? y0 - st->halo : 0;
+    if (!st->halo)
+        return pipeline_run_rows(st->pipe, frame->in, lo, frame->in, y0,
+                                 st->h, st->pool);
+    if (overlap_reserve(frame->out, &frame->outcap, st->w, y1 - y0) < 0)
+        return -1;
+    return pipeline_run_rows(st->pipe, frame->in, lo, frame->out, y0, st->h,
+                             st->pool);
+}
+
+/* writes the rows of a band to the output */
+static int
+write_band(void *arg, struct overlap_frame *frame)
+{
+    const struct stream *st = arg;
+    size_t y0, y1;
+    band_rows(st, frame->index, &y0, &y1);
+    return imagefile_write_rows(st->file, st->out, y0,
+                                st->halo ? frame->out : frame->in);
+}
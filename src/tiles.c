@@ -0,0 +1,63 @@
+/* tiles.c - cache sized tiles of an image, run on a worker pool */
+#include <errno.h> /* for errno */
+#include <stdint.h> /* for uint8_t */
+#include "../include/imageproc.h"
+#include "../include/tiles.h"
+#include "../include/workpool.h"
+
+extern int errno; /* these functions set errno on errors */
+
+/* a tiles_run call, shared by its tasks */
+struct tiling {
+    struct image32_t *image;
+    tile_fn fn;
+    void *arg;
+    size_t ntx; /* tiles per row of tiles */
+};
+
+/* static function prototypes */
+static void run_tile(void *arg, size_t task);
+
+/**
+ * Cuts image into TILE_WIDTH x TILE_HEIGHT tiles and calls fn on every row
+ * of each of them, the tiles spread over the threads of pool (NULL runs
+ * them on the calling thread). fn must only touch the bytes it is handed,
+ * then the result does not depend on the pool.
+ * Returns 1 if successful, -1 otherwise.
+ */
+int
+tiles_run(struct image32_t *image, tile_fn fn, void *arg, 
+          struct workpool *pool)
+{
+    if (!image || !image->buf || !fn) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct tiling tiling;
+    tiling.image = image;
+    tiling.fn = fn;
+    tiling.arg = arg;
+    tiling.ntx = (image->w + TILE_WIDTH - 1) / TILE_WIDTH;
+    size_t nty = (image->h + TILE_HEIGHT - 1) / TILE_HEIGHT;
+    return workpool_run(pool, tiling.ntx * nty, run_tile, &tiling);
+}
+
+/**
+ * static functions start here
+ */
+
+static void
+run_tile(void *arg, size_t task)
+{
+    const struct tiling *tiling = arg;
+    struct image32_t *image = tiling->image;
+    size_t x0 = (task % tiling->ntx) * TILE_WIDTH;
+    size_t y0 = (task / tiling->ntx) * TILE_HEIGHT;
+    size_t nbytes = image->w - x0 < TILE_WIDTH ? image->w - x0 : TILE_WIDTH;
+    size_t y1 = image->h - y0 < TILE_HEIGHT ? image->h : y0 + TILE_HEIGHT;
+
+    uint8_t *row = (uint8_t *)image->buf + y0 * image->w + x0;
+    for (size_t y = y0; y < y1; ++y, row += image->w)
+        tiling->fn(row, nbytes, x0, y, tiling->arg);
+}
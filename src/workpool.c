@@ -0,0 +1,175 @@
+/* workpool.c - a fixed pool of worker threads */
+#include <errno.h> /* for errno */
+#include <pthread.h> /* for pthread_create, pthread_mutex_t, pthread_cond_t */
+#include <stdatomic.h> /* for atomic_size_t */
+#include <stdlib.h> /* for calloc, free */
+#include <unistd.h> /* for sysconf */
+#include "../include/workpool.h"
+
+extern int errno; /* these functions set errno on errors */
+
+struct workpool {
+    pthread_t *threads;
+    size_t nthreads;      /* worker threads, the caller of run is one more */
+    pthread_mutex_t lock;
+    pthread_cond_t wake;  /* a new job was posted, or quit was set */
+    pthread_cond_t idle;  /* the last worker finished the current job */
+    unsigned long job;    /* bumped for every posted job */
+    size_t pending;       /* workers still busy with the current job */
+    int quit;
+
+    /* the current job */
+    workpool_fn fn;
+    void *arg;
+    size_t ntasks;
+    atomic_size_t next;   /* next task to be claimed */
+};
+
+/* static function prototypes */
+static void *worker(void *arg);
+static void run_tasks(struct workpool *pool);
+
+/**
+ * Starts a pool that runs jobs on nthreads threads, the thread calling 
+ * workpool_run being one of them. nthreads of 0 means one per online CPU.
+ * Returns the new pool if successful, NULL otherwise.
+ */
+struct workpool *
+workpool_create(size_t nthreads)
+{
+    if (nthreads == 0) {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = ncpu > 0 ? (size_t)ncpu : 1;
+    }
+
+    struct workpool *pool = calloc(1, sizeof(*pool));
+    if (!pool)
+        return NULL;
+    pool->threads = calloc(nthreads, sizeof(pthread_t));
+    if (!pool->threads) {
+        free(pool);
+        return NULL;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+    atomic_init(&pool->next, 0);
+
+    /* a thread that fails to start only makes the pool smaller */
+    for (size_t t = 0; t + 1 < nthreads; ++t)
+        if (!pthread_create(&pool->threads[pool->nthreads], NULL, worker, pool))
+            pool->nthreads++;
+    return pool;
+}
+
+/**
+ * stops and joins the worker threads, then frees the pool
+ */
+void
+workpool_destroy(struct workpool *pool)
+{
+    if (!pool)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = 1;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (size_t t = 0; t < pool->nthreads; ++t)
+        pthread_join(pool->threads[t], NULL);
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->wake);
+    pthread_cond_destroy(&pool->idle);
+    free(pool->threads);
+    free(pool);
+}
+
+/**
+ * returns the number of threads that run a job, including the caller
+ */
+size_t
+workpool_size(const struct workpool *pool)
+{
+    return pool ? pool->nthreads + 1 : 1;
+}
+
+/**
+ * Runs fn(arg, 0) .. fn(arg, ntasks - 1) on the pool and returns once all
+ * of them are done. A NULL pool runs them in order on the calling thread.
+ * Returns 1 if successful, -1 otherwise.
+ * NOTE: one job at a time, the pool must not be shared by several callers
+ */
+int
+workpool_run(struct workpool *pool, size_t ntasks, workpool_fn fn, void *arg)
+{
+    if (!fn) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (!pool || pool->nthreads == 0 || ntasks < 2) {
+        for (size_t t = 0; t < ntasks; ++t)
+            fn(arg, t);
+        return 1;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->fn = fn;
+    pool->arg = arg;
+    pool->ntasks = ntasks;
+    atomic_store(&pool->next, 0);
+    pool->pending = pool->nthreads;
+    pool->job++;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    run_tasks(pool);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->pending)
+        pthread_cond_wait(&pool->idle, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+    return 1;
+}
+
+/**
+ * static functions start here
+ */
+
+/* thread entry point, waits for jobs and helps with their tasks */
+static void *
+worker(void *arg)
+{
+    struct workpool *pool = arg;
+    unsigned long seen = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->quit && pool->job == seen)
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        if (pool->quit)
+            break;
+        seen = pool->job;
+        pthread_mutex_unlock(&pool->lock);
+
+        run_tasks(pool);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->pending == 0)
+            pthread_cond_signal(&pool->idle);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/* claims and runs tasks of the current job until none are left */
+static void
+run_tasks(struct workpool *pool)
+{
+    size_t t;
+    while ((t = atomic_fetch_add(&pool->next, 1)) < pool->ntasks)
+        pool->fn(pool->arg, t);
+}
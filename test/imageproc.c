@@ -1,15 +1,83 @@
 /* test/imageproc.c */
+#define _POSIX_C_SOURCE 200809L /* for mkdtemp, mkstemp, setenv, truncate */
 #include <unity.h>
 #include <stdint.h> /* for int32_t */
 #include <stdlib.h> /* for malloc */
+#include <string.h> /* for memcpy, memset */
+#include <stdio.h> /* for snprintf, fopen */
+#include <math.h> /* for exp */
+#include <errno.h> /* for errno */
+#include <unistd.h> /* for close, truncate */
+#include <stdatomic.h> /* for atomic_size_t */
 
 #include "../include/imageproc.h"
+#include "../include/image.h"
 #include "../include/imageio.h"
+#include "../include/bmp.h"
+#include "../include/bmpmap.h"
+#include "../include/bmpwrite.h"
+#include "../include/pnm.h"
+#include "../include/raw.h"
+#include "../include/palette.h"
+#include "../include/bluenoise.h"
+#include "../include/luma.h"
+#include "../include/resample.h"
+#include "../include/convolve.h"
+#include "../include/pipeline.h"
+#include "../include/stream.h"
+#include "../include/batch.h"
+#include "../include/overlap.h"
+#include "../include/diffusion.h"
+#include "../include/tiles.h"
+#include "../include/workpool.h"
+
+#include "saru-bytebuf.h"
+
+/* test helpers */
+static void vbox(uint8_t *dest, const uint8_t *const *rows, size_t nbytes,
+                size_t y, void *arg);
+static int write_bmp24(const char *path, size_t width, size_t height,
+                const uint8_t *pixels);
+static int seq_read(void *arg, struct overlap_frame *frame);
+static int seq_run(void *arg, struct overlap_frame *frame);
+static int seq_write(void *arg, struct overlap_frame *frame);
+static int write_file(const char *path, const char *header,
+                const uint8_t *data, size_t size);
+static int run_piped(const struct pipeline *pipe, const char *src,
+                const char *dest, size_t ceiling);
+static int same_files(const char *a, const char *b);
+static int write_bmp(const char *path, size_t width, int32_t height,
+                uint16_t bpp, uint32_t compression, uint32_t infosize,
+                const uint8_t *extra, size_t nextra, const uint8_t *rows,
+                size_t stride);
 
 /* test prototypes */
 void test_closestfrompal(void);
 void test_pixelat(void);
 void test_bayer_sqrmat(void);
+void test_palette_closest(void);
+void test_ordered_dithering(void);
+void test_ordered_dithering_sizes(void);
+void test_error_diffusion(void);
+void test_palette_generation(void);
+void test_tiled_operations(void);
+void test_image_layouts(void);
+void test_pipeline(void);
+void test_palette_metrics(void);
+void test_blue_noise(void);
+void test_luma_planes(void);
+void test_resample(void);
+void test_convolve(void);
+void test_bmp_map(void);
+void test_imagefile(void);
+void test_bmp_formats(void);
+void test_stream(void);
+void test_batch(void);
+void test_overlap(void);
+void test_pnm_raw(void);
+void test_bmp_write(void);
+void test_stdio(void);
+void test_pack(void);
 
 int main(void)
 {
@@ -17,6 +85,29 @@ int main(void)
     RUN_TEST(test_closestfrompal);
     RUN_TEST(test_pixelat);
     RUN_TEST(test_bayer_sqrmat);
+    RUN_TEST(test_palette_closest);
+    RUN_TEST(test_ordered_dithering);
+    RUN_TEST(test_ordered_dithering_sizes);
+    RUN_TEST(test_error_diffusion);
+    RUN_TEST(test_palette_generation);
+    RUN_TEST(test_tiled_operations);
+    RUN_TEST(test_image_layouts);
+    RUN_TEST(test_pipeline);
+    RUN_TEST(test_palette_metrics);
+    RUN_TEST(test_blue_noise);
+    RUN_TEST(test_luma_planes);
+    RUN_TEST(test_resample);
+    RUN_TEST(test_convolve);
+    RUN_TEST(test_bmp_map);
+    RUN_TEST(test_imagefile);
+    RUN_TEST(test_bmp_formats);
+    RUN_TEST(test_stream);
+    RUN_TEST(test_batch);
+    RUN_TEST(test_overlap);
+    RUN_TEST(test_pnm_raw);
+    RUN_TEST(test_bmp_write);
+    RUN_TEST(test_stdio);
+    RUN_TEST(test_pack);
 }
 
 void setUp(void)
@@ -132,3 +223,1829 @@ void test_bayer_sqrmat(void)
     TEST_ASSERT_EQUAL_INT32_ARRAY(ref, mat, sizeof(mat) / sizeof(mat[0]));
 }
 
+void test_palette_closest(void)
+{
+    int32_t colors[256];
+    size_t ncolors = sizeof(colors) / sizeof(colors[0]);
+    srand(1);
+    for (size_t i = 0; i < ncolors; ++i)
+        colors[i] = ((rand() & 0xFF) << 16) | ((rand() & 0xFF) << 8) | 
+                    (rand() & 0xFF);
+    /* a duplicate colour must never be returned over its first copy */
+    colors[200] = colors[3];
+
+    struct palette *pal = palette_create(colors, ncolors);
+    TEST_ASSERT_NOT_NULL(pal);
+
+    /* the table must agree with the linear scan everywhere */
+    for (int32_t c = 0; c < 0x1000000; c += 0x010101 + 4 * 0x10000 + 2) {
+        int32_t color = c & 0xFFFFFF;
+        TEST_ASSERT_EQUAL(closestfrompal(color, colors, ncolors),
+                          palette_closest(pal, color));
+    }
+    for (size_t i = 0; i < 20000; ++i) {
+        int32_t color = rand() & 0xFFFFFF;
+        TEST_ASSERT_EQUAL(closestfrompal(color, colors, ncolors),
+                          palette_closest(pal, color));
+    }
+    TEST_ASSERT_EQUAL(3, palette_index(pal, colors[3]));
+
+    /* the k-d tree search and the vector scan of a small palette, 
+     * both twice to go through the query cache */
+    struct palette *small = palette_create(colors, 11);
+    for (size_t i = 0; i < 20000; ++i) {
+        int32_t color = rand() & 0xFFFFFF;
+        for (int pass = 0; pass < 2; ++pass) {
+            TEST_ASSERT_EQUAL(closestfrompal(color, colors, ncolors),
+                              colors[palette_nearest(pal, color)]);
+            TEST_ASSERT_EQUAL(closestfrompal(color, colors, 11),
+                              colors[palette_nearest(small, color)]);
+        }
+    }
+    TEST_ASSERT_EQUAL(3, palette_nearest(pal, colors[200]));
+
+    palette_destroy(small);
+    palette_destroy(pal);
+}
+
+void test_ordered_dithering(void)
+{
+    /* 37 pixels + 1 byte of padding per row: not a multiple of any vector */
+    struct image32_t img = {0};
+    img.w = 37 * 3 + 1;
+    img.h = 9;
+    img.buf = malloc(img.w * img.h);
+    uint8_t *bytes = (uint8_t *)img.buf;
+    uint8_t ref[(37 * 3 + 1) * 9];
+    const int32_t mat[4][4] = {
+        { 0, 8, 2, 10 }, { 12, 4, 14, 6 }, { 3, 11, 1, 9 }, { 15, 7, 13, 5 }
+    };
+
+    srand(2);
+    for (size_t i = 0; i < img.w * img.h; ++i)
+        bytes[i] = (uint8_t)rand();
+
+    /* scalar reference, memory byte m holds file byte m ^ 3 of its row */
+    for (size_t y = 0; y < img.h; ++y)
+        for (size_t m = 0; m < img.w; ++m) {
+            size_t x = (m ^ 3) / 3;
+            unsigned t = ((2 * mat[y % 4][x % 4] + 1) * 255) / 32;
+            unsigned v = bytes[y * img.w + m] + t;
+            ref[y * img.w + m] = v >= 255 ? 255 : 0;
+        }
+
+    TEST_ASSERT_EQUAL(1, ordered_dithering_n(&img, 4, 2));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(ref, bytes, img.w * img.h);
+
+    free(img.buf);
+}
+
+void test_ordered_dithering_sizes(void)
+{
+    /* every matrix size and level count must match the (x, y) formula */
+    struct image32_t img = {0};
+    img.w = 40 * 3;
+    img.h = 40;
+    img.buf = malloc(img.w * img.h);
+    uint8_t *bytes = (uint8_t *)img.buf;
+    const unsigned levels[] = { 2, 4, 16 };
+
+    for (size_t dim = 2; dim <= 16; dim *= 2) {
+        int32_t mat[16 * 16];
+        bayer_sqrmat(mat, dim);
+        for (size_t l = 0; l < sizeof(levels) / sizeof(levels[0]); ++l) {
+            unsigned step = 255 / (levels[l] - 1);
+            for (size_t i = 0; i < img.w * img.h; ++i)
+                bytes[i] = (uint8_t)(100 + i % 7);
+
+            TEST_ASSERT_EQUAL(1, ordered_dithering_n(&img, dim, levels[l]));
+            for (size_t y = 0; y < img.h; ++y)
+                for (size_t m = 0; m < img.w; ++m) {
+                    size_t i = y * img.w + m;
+                    size_t x = (m ^ 3) / 3;
+                    unsigned t = ((2 * mat[(y % dim) * dim + x % dim] + 1) * 
+                            step) / (2 * dim * dim);
+                    unsigned v = 100 + i % 7 + t;
+                    TEST_ASSERT_EQUAL(v / step * step, bytes[i]);
+                }
+        }
+    }
+
+    /* unsupported sizes and level counts are rejected */
+    TEST_ASSERT_EQUAL(-1, ordered_dithering_n(&img, 0, 2));
+    TEST_ASSERT_EQUAL(EINVAL, errno);
+    TEST_ASSERT_EQUAL(-1, ordered_dithering_n(&img, 3, 2));
+    TEST_ASSERT_EQUAL(-1, ordered_dithering_n(&img, 32, 2));
+    TEST_ASSERT_EQUAL(-1, ordered_dithering_n(&img, 4, 3));
+
+    free(img.buf);
+}
+
+void test_error_diffusion(void)
+{
+    struct image32_t src = {0}, img = {0};
+    src.w = img.w = 101 * 3 + 1;
+    src.h = img.h = 23;
+    src.buf = malloc(src.w * src.h);
+    img.buf = malloc(img.w * img.h);
+    uint8_t *ref = malloc(src.w * src.h);
+    uint8_t *bytes = (uint8_t *)img.buf;
+    const int32_t colors[] = { 0x000000, 0x808080, 0xFFFFFF, 0xFF0000, 
+                               0x00FF00, 0x0000FF, 0x204060, 0xC0A080 };
+    struct palette *pal = palette_create(colors, 8);
+
+    struct workpool *pools[] = {
+        workpool_create(2), workpool_create(5), workpool_create(8)
+    };
+    srand(3);
+    for (size_t i = 0; i < src.w * src.h; ++i)
+        ((uint8_t *)src.buf)[i] = (uint8_t)(rand() % 256);
+
+    /* pipelined runs must match the serial run byte for byte */
+    for (int k = DIFFUSE_FLOYD_STEINBERG; k <= DIFFUSE_SIERRA; ++k)
+        for (int usepal = 0; usepal < 2; ++usepal) {
+            memcpy(img.buf, src.buf, src.w * src.h);
+            TEST_ASSERT_EQUAL(1, error_diffusion(&img, 101, k, 2, 
+                        usepal ? pal : NULL, NULL));
+            memcpy(ref, img.buf, img.w * img.h);
+
+            for (size_t p = 0; p < 3; ++p) {
+                memcpy(img.buf, src.buf, src.w * src.h);
+                TEST_ASSERT_EQUAL(1, error_diffusion(&img, 101, k, 2, 
+                            usepal ? pal : NULL, pools[p]));
+                TEST_ASSERT_EQUAL_UINT8_ARRAY(ref, bytes, img.w * img.h);
+            }
+        }
+
+    /* a flat mid grey keeps its average brightness */
+    memset(img.buf, 128, img.w * img.h);
+    TEST_ASSERT_EQUAL(1, error_diffusion(&img, 101, DIFFUSE_FLOYD_STEINBERG,
+                2, NULL, pools[1]));
+    size_t white = 0, total = 0;
+    for (size_t i = 0; i < img.w * img.h; ++i) {
+        if (((i % img.w) ^ 3) >= 101 * 3)
+            continue; /* row padding */
+        TEST_ASSERT_TRUE(bytes[i] == 0 || bytes[i] == 255);
+        white += bytes[i] == 255;
+        total++;
+    }
+    TEST_ASSERT_TRUE(white > total * 45 / 100);
+    TEST_ASSERT_TRUE(white < total * 55 / 100);
+
+    /* the padding is neither dithered nor spreads error into the pixels:
+     * rows of 99 pixels leave 7 bytes, room for two more pixels */
+    for (int fill = 0; fill < 2; ++fill) {
+        memcpy(img.buf, src.buf, src.w * src.h);
+        for (size_t y = 0; y < img.h; ++y)
+            for (size_t j = 99 * 3; j < img.w; ++j)
+                bytes[y * img.w + (j ^ 3)] = fill ? 255 : 0;
+        TEST_ASSERT_EQUAL(1, error_diffusion(&img, 99, DIFFUSE_SIERRA, 2,
+                    NULL, NULL));
+        for (size_t y = 0; y < img.h; ++y)
+            for (size_t j = 99 * 3; j < img.w; ++j)
+                TEST_ASSERT_EQUAL_UINT8(fill ? 255 : 0,
+                                        bytes[y * img.w + (j ^ 3)]);
+        if (!fill)
+            memcpy(ref, img.buf, img.w * img.h);
+        else
+            for (size_t y = 0; y < img.h; ++y)
+                for (size_t j = 0; j < 99 * 3; ++j)
+                    TEST_ASSERT_EQUAL_UINT8(ref[y * img.w + (j ^ 3)],
+                                            bytes[y * img.w + (j ^ 3)]);
+    }
+    TEST_ASSERT_EQUAL(-1, error_diffusion(&img, 102, DIFFUSE_SIERRA, 2,
+                NULL, NULL));
+
+    for (size_t p = 0; p < 3; ++p)
+        workpool_destroy(pools[p]);
+    palette_destroy(pal);
+    free(ref);
+    free(src.buf);
+    free(img.buf);
+}
+
+void test_palette_generation(void)
+{
+    /* four colour stripes, plus noise that must not add colours */
+    const int32_t stripes[] = { 0x102030, 0xF0E0D0, 0x20A040, 0x8080FF };
+    struct image32_t img = {0};
+    img.w = 64 * 3;
+    img.h = 64;
+    img.buf = malloc(img.w * img.h);
+    uint8_t *bytes = (uint8_t *)img.buf;
+    for (size_t y = 0; y < img.h; ++y)
+        for (size_t x = 0; x < img.w / 3; ++x) {
+            int32_t c = stripes[x / 16];
+            for (size_t ch = 0; ch < 3; ++ch)
+                bytes[y * img.w + ((3 * x + ch) ^ 3)] = 
+                    (uint8_t)(c >> (16 - 8 * ch));
+        }
+
+    struct palette *mc = palette_median_cut(&img, 4);
+    TEST_ASSERT_NOT_NULL(mc);
+    TEST_ASSERT_EQUAL(4, mc->n);
+    for (size_t i = 0; i < 4; ++i)
+        TEST_ASSERT_EQUAL(stripes[i], palette_closest(mc, stripes[i]));
+
+    /* more colours than the image has gives one entry per colour */
+    struct workpool *pool = workpool_create(4);
+    struct palette *km = palette_kmeans(&img, 16, 10, pool);
+    TEST_ASSERT_NOT_NULL(km);
+    TEST_ASSERT_EQUAL(4, km->n);
+    for (size_t i = 0; i < 4; ++i)
+        TEST_ASSERT_EQUAL(stripes[i], palette_closest(km, stripes[i]));
+    palette_destroy(km);
+
+    /* on a noisy image the k-means palette is the same for any pool */
+    srand(4);
+    for (size_t i = 0; i < img.w * img.h; ++i)
+        bytes[i] = (uint8_t)rand();
+    struct palette *k1 = palette_kmeans(&img, 32, 8, NULL);
+    struct palette *k4 = palette_kmeans(&img, 32, 8, pool);
+    TEST_ASSERT_EQUAL(32, k1->n);
+    TEST_ASSERT_EQUAL(k1->n, k4->n);
+    TEST_ASSERT_EQUAL_INT32_ARRAY(k1->colors, k4->colors, k1->n);
+
+    /* mapping leaves only palette colours behind */
+    TEST_ASSERT_EQUAL(1, palette_map(&img, k1));
+    for (size_t i = 0; i < img.w * img.h; i += 3) {
+        int32_t c = (bytes[i ^ 3] << 16) | (bytes[(i + 1) ^ 3] << 8) | 
+                    bytes[(i + 2) ^ 3];
+        TEST_ASSERT_EQUAL(c, palette_closest(k1, c));
+    }
+
+    palette_destroy(mc);
+    palette_destroy(k1);
+    palette_destroy(k4);
+    workpool_destroy(pool);
+    free(img.buf);
+}
+
+void test_tiled_operations(void)
+{
+    /* several tiles across and down, with partial tiles at the edges */
+    struct image32_t img = {0}, ref = {0};
+    img.w = ref.w = 2500 * 3 + 4;
+    img.h = ref.h = 37;
+    img.buf = malloc(img.w * img.h);
+    ref.buf = malloc(ref.w * ref.h);
+    uint8_t *bytes = (uint8_t *)img.buf, *refbytes = (uint8_t *)ref.buf;
+    struct workpool *pool = workpool_create(4);
+    TEST_ASSERT_NOT_NULL(pool);
+
+    srand(6);
+    for (size_t i = 0; i < img.w * img.h; ++i)
+        bytes[i] = refbytes[i] = (uint8_t)rand();
+
+    /* tiles keep the Bayer phase of the serial run */
+    TEST_ASSERT_EQUAL(1, ordered_dithering_n(&ref, 16, 4));
+    TEST_ASSERT_EQUAL(1, ordered_dithering_tiled(&img, 16, 4, pool));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(refbytes, bytes, img.w * img.h);
+
+    for (size_t i = 0; i < img.w * img.h; ++i)
+        refbytes[i] = (uint8_t)(255 - refbytes[i]);
+    TEST_ASSERT_EQUAL(1, invert_image(&img, pool));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(refbytes, bytes, img.w * img.h);
+
+    workpool_destroy(pool);
+    free(img.buf);
+    free(ref.buf);
+}
+
+void test_image_layouts(void)
+{
+    /* 5 pixels of 3 bytes and 1 byte of padding per row */
+    struct image32_t packed = {0}, back = {0};
+    packed.w = back.w = 16;
+    packed.h = back.h = 3;
+    packed.buf = malloc(packed.w * packed.h);
+    back.buf = malloc(back.w * back.h);
+    int8_t file[48];
+    for (size_t i = 0; i < sizeof(file); ++i)
+        file[i] = (i % 16) < 15 ? (int8_t)i : 0;
+    pack(packed.buf, file, sizeof(file));
+
+    struct image inter = {0}, planar = {0}, view = {0};
+    TEST_ASSERT_EQUAL(1, image_from32(&inter, &packed, 5, IMAGE_INTERLEAVED));
+    TEST_ASSERT_EQUAL(1, image_from32(&planar, &packed, 5, IMAGE_PLANAR));
+    TEST_ASSERT_EQUAL(-1, image_from32(&view, &packed, 4, IMAGE_PLANAR));
+
+    /* rows are aligned and padded, channel c is file byte c of a pixel */
+    TEST_ASSERT_EQUAL(64, inter.stride);
+    TEST_ASSERT_EQUAL(64, planar.stride);
+    for (size_t y = 0; y < 3; ++y) {
+        TEST_ASSERT_EQUAL(0, (uintptr_t)image_row(&inter, 0, y) % IMAGE_ALIGN);
+        for (unsigned c = 0; c < 3; ++c) {
+            TEST_ASSERT_EQUAL(0,
+                (uintptr_t)image_row(&planar, c, y) % IMAGE_ALIGN);
+            for (size_t x = 0; x < 5; ++x) {
+                TEST_ASSERT_EQUAL(y * 16 + x * 3 + c,
+                                  image_row(&inter, 0, y)[x * 3 + c]);
+                TEST_ASSERT_EQUAL(y * 16 + x * 3 + c,
+                                  image_row(&planar, c, y)[x]);
+            }
+        }
+    }
+
+    /* a view shares the samples of the image it is cut from */
+    TEST_ASSERT_EQUAL(-1, image_view(&view, &planar, 3, 1, 3, 1));
+    TEST_ASSERT_EQUAL(1, image_view(&view, &planar, 1, 1, 3, 2));
+    TEST_ASSERT_NULL(view.base);
+    TEST_ASSERT_EQUAL(16 + 3 + 2, image_row(&view, 2, 0)[0]);
+    image_row(&view, 1, 1)[2] = 0xAA;
+    TEST_ASSERT_EQUAL(0xAA, image_row(&planar, 1, 2)[3]);
+
+    /* layouts convert into each other, views included */
+    struct image sub = {0};
+    TEST_ASSERT_EQUAL(1, image_view(&sub, &inter, 1, 1, 3, 2));
+    TEST_ASSERT_EQUAL(1, image_convert(&sub, &view));
+    TEST_ASSERT_EQUAL(0xAA, image_row(&inter, 0, 2)[3 * 3 + 1]);
+    file[2 * 16 + 3 * 3 + 1] = (int8_t)0xAA;
+
+    TEST_ASSERT_EQUAL(1, image_to32(&back, &planar));
+    int8_t out[48];
+    unpack(out, back.buf, sizeof(out));
+    TEST_ASSERT_EQUAL_INT8_ARRAY(file, out, sizeof(out));
+    memset(back.buf, 0, back.w * back.h);
+    TEST_ASSERT_EQUAL(1, image_to32(&back, &inter));
+    unpack(out, back.buf, sizeof(out));
+    TEST_ASSERT_EQUAL_INT8_ARRAY(file, out, sizeof(out));
+
+    image_destroy(&view);
+    image_destroy(&inter);
+    image_destroy(&planar);
+    free(packed.buf);
+    free(back.buf);
+}
+
+/* rounded mean of a byte and the bytes above and below it */
+static void
+vbox(uint8_t *dest, const uint8_t *const *rows, size_t nbytes, size_t y,
+     void *arg)
+{
+    (void)y;
+    (void)arg;
+    for (size_t i = 0; i < nbytes; ++i)
+        dest[i] = (uint8_t)((rows[0][i] + rows[1][i] + rows[2][i] + 1) / 3);
+}
+
+void test_pipeline(void)
+{
+    /* enough rows for several bands, each a few hundred KiB */
+    struct image32_t img = {0}, ref = {0}, out = {0};
+    img.w = ref.w = out.w = 1333 * 3 + 1;
+    img.h = ref.h = out.h = 301;
+    size_t size = img.w * img.h;
+    img.buf = malloc(size);
+    ref.buf = malloc(size);
+    out.buf = malloc(size);
+    uint8_t *bytes = (uint8_t *)img.buf, *refbytes = (uint8_t *)ref.buf;
+    struct workpool *pool = workpool_create(4);
+    struct pipeline *pipe = pipeline_create();
+    TEST_ASSERT_NOT_NULL(pool);
+    TEST_ASSERT_NOT_NULL(pipe);
+
+    srand(7);
+    for (size_t i = 0; i < size; ++i)
+        bytes[i] = refbytes[i] = (uint8_t)rand();
+
+    /* point-wise stages fused in place match the full image passes */
+    int32_t colors[] = { 0x000000, 0x0000FF, 0x00FF00, 0xFF0000, 0xFFFFFF };
+    struct palette *pal = palette_create(colors, 5);
+    TEST_ASSERT_EQUAL(1, tiles_run(&ref, gray_span, NULL, NULL));
+    TEST_ASSERT_EQUAL(1, invert_image(&ref, NULL));
+    TEST_ASSERT_EQUAL(1, ordered_dithering_n(&ref, 4, 4));
+    TEST_ASSERT_EQUAL(1, palette_map(&ref, pal));
+
+    TEST_ASSERT_EQUAL(1, pipeline_add_gray(pipe));
+    TEST_ASSERT_EQUAL(1, pipeline_add_invert(pipe));
+    TEST_ASSERT_EQUAL(1, pipeline_add_dither(pipe, 4, 4));
+    TEST_ASSERT_EQUAL(1, pipeline_add_palette(pipe, pal));
+    TEST_ASSERT_EQUAL(1, pipeline_run(pipe, &img, &img, pool));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(refbytes, bytes, size);
+    pipeline_destroy(pipe);
+
+    /* neighbourhood stages recompute the halo of every band */
+    for (size_t i = 0; i < size; ++i)
+        bytes[i] = refbytes[i] = (uint8_t)rand();
+    pipe = pipeline_create();
+    TEST_ASSERT_EQUAL(1, pipeline_add_filter(pipe, vbox, 1, NULL));
+    TEST_ASSERT_EQUAL(1, pipeline_add_invert(pipe));
+    TEST_ASSERT_EQUAL(1, pipeline_add_filter(pipe, vbox, 1, NULL));
+    TEST_ASSERT_EQUAL(-1, pipeline_run(pipe, &img, &img, pool));
+
+    uint8_t *tmp = malloc(size);
+    for (int pass = 0; pass < 2; ++pass) {
+        memcpy(tmp, refbytes, size);
+        for (size_t y = 0; y < ref.h; ++y) {
+            const uint8_t *rows[3] = {
+                tmp + (y ? y - 1 : 0) * ref.w, tmp + y * ref.w,
+                tmp + (y + 1 < ref.h ? y + 1 : y) * ref.w
+            };
+            vbox(refbytes + y * ref.w, rows, ref.w, y, NULL);
+        }
+        if (pass == 0)
+            TEST_ASSERT_EQUAL(1, invert_image(&ref, NULL));
+    }
+
+    TEST_ASSERT_EQUAL(1, pipeline_run(pipe, &img, &out, pool));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(refbytes, out.buf, size);
+    memset(out.buf, 0, size);
+    TEST_ASSERT_EQUAL(1, pipeline_run(pipe, &img, &out, NULL));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(refbytes, out.buf, size);
+
+    /* a matrix that does not exist is refused when added, not when run */
+    TEST_ASSERT_EQUAL(-1, pipeline_add_dither(pipe, 0, 2));
+    TEST_ASSERT_EQUAL(EINVAL, errno);
+    TEST_ASSERT_EQUAL(-1, pipeline_add_dither(pipe, 32, 2));
+    TEST_ASSERT_EQUAL(EINVAL, errno);
+    TEST_ASSERT_EQUAL(-1, pipeline_add_dither(pipe, 4, 3));
+    memset(out.buf, 0, size);
+    TEST_ASSERT_EQUAL(1, pipeline_run(pipe, &img, &out, pool));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(refbytes, out.buf, size);
+
+    pipeline_destroy(pipe);
+    palette_destroy(pal);
+    workpool_destroy(pool);
+    free(tmp);
+    free(img.buf);
+    free(ref.buf);
+    free(out.buf);
+}
+
+void test_palette_metrics(void)
+{
+    /* mid greys: sRGB bytes, linear light and lightness disagree */
+    int32_t bw[] = { 0x000000, 0xFFFFFF };
+    struct palette *pal = palette_create(bw, 2);
+    TEST_ASSERT_EQUAL(0x000000, palette_closest(pal, 0x777777));
+    TEST_ASSERT_EQUAL(0xFFFFFF, palette_closest(pal, 0xA0A0A0));
+    TEST_ASSERT_EQUAL(1, palette_set_metric(pal, PAL_METRIC_LINEAR));
+    TEST_ASSERT_EQUAL(0x000000, palette_closest(pal, 0x777777));
+    TEST_ASSERT_EQUAL(0x000000, palette_closest(pal, 0xA0A0A0));
+    TEST_ASSERT_EQUAL(1, palette_set_metric(pal, PAL_METRIC_OKLAB));
+    TEST_ASSERT_EQUAL(0xFFFFFF, palette_closest(pal, 0x777777));
+    TEST_ASSERT_EQUAL(0xFFFFFF, palette_closest(pal, 0xA0A0A0));
+    TEST_ASSERT_EQUAL(-1, palette_set_metric(pal, (enum pal_metric)7));
+    palette_destroy(pal);
+
+    /* the table stays exact in every metric, for scanned and searched
+     * palettes alike */
+    const enum pal_metric metrics[] = { PAL_METRIC_LINEAR, PAL_METRIC_OKLAB };
+    const size_t sizes[] = { 12, 200 };
+    int32_t colors[200];
+    srand(8);
+    for (size_t m = 0; m < 2; ++m)
+        for (size_t s = 0; s < 2; ++s) {
+            for (size_t i = 0; i < sizes[s]; ++i)
+                colors[i] = rand() & 0xFFFFFF;
+            pal = palette_create(colors, sizes[s]);
+            TEST_ASSERT_EQUAL(1, palette_set_metric(pal, metrics[m]));
+            TEST_ASSERT_EQUAL(1, palette_prepare(pal));
+            for (size_t i = 0; i < 20000; ++i) {
+                int32_t color = rand() & 0xFFFFFF;
+                TEST_ASSERT_EQUAL(palette_nearest(pal, color),
+                                  palette_index(pal, color));
+            }
+            palette_destroy(pal);
+        }
+
+    /* scanned palettes pick the exact nearest even where the 12 bit
+     * distances are too big for a float to tell apart: from black the
+     * second colour is 2 closer in linear light, 16831475 to 16831477 */
+    const int32_t near[] = { 0xA0B3EA, 0xD7C8B4 };
+    pal = palette_create(near, 2);
+    TEST_ASSERT_EQUAL(1, palette_set_metric(pal, PAL_METRIC_LINEAR));
+    TEST_ASSERT_EQUAL(1, palette_nearest(pal, 0x000000));
+    TEST_ASSERT_EQUAL(1, palette_index(pal, 0x000000));
+    palette_destroy(pal);
+}
+
+void test_blue_noise(void)
+{
+    /* the first use writes the cache, which then loads back the same */
+    char dir[] = "/tmp/imp-test-XXXXXX", path[64];
+    TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+    setenv("XDG_CACHE_HOME", dir, 1);
+    const uint16_t *ranks = bluenoise_texture();
+    snprintf(path, sizeof(path), "%s/%s/%s", dir, BLUENOISE_CACHEDIR,
+             BLUENOISE_CACHE);
+    static uint16_t loaded[BLUENOISE_SIZE], fresh[BLUENOISE_SIZE];
+    TEST_ASSERT_EQUAL(1, bluenoise_load(path, loaded));
+    TEST_ASSERT_EQUAL_UINT16_ARRAY(ranks, loaded, BLUENOISE_SIZE);
+    bluenoise_generate(fresh);
+    TEST_ASSERT_EQUAL_UINT16_ARRAY(ranks, fresh, BLUENOISE_SIZE);
+
+    /* a damaged cache is refused */
+    fresh[0] = fresh[1];
+    TEST_ASSERT_EQUAL(1, bluenoise_save(path, fresh));
+    TEST_ASSERT_EQUAL(-1, bluenoise_load(path, loaded));
+    remove(path);
+    snprintf(path, sizeof(path), "%s/%s", dir, BLUENOISE_CACHEDIR);
+    remove(path);
+    remove(dir);
+
+    /* the lowest ranks are spread out: no two of the first 1/16 touch,
+     * wrapping around the edges */
+    for (size_t i = 0; i < BLUENOISE_SIZE; ++i) {
+        if (ranks[i] >= BLUENOISE_SIZE / 16)
+            continue;
+        for (int dy = -1; dy <= 1; ++dy)
+            for (int dx = -1; dx <= 1; ++dx) {
+                size_t y = (i / BLUENOISE_DIM + dy) & (BLUENOISE_DIM - 1);
+                size_t x = (i % BLUENOISE_DIM + dx) & (BLUENOISE_DIM - 1);
+                if (dx || dy)
+                    TEST_ASSERT_TRUE(ranks[y * BLUENOISE_DIM + x] 
+                                     >= BLUENOISE_SIZE / 16);
+            }
+    }
+
+    /* a flat grey dithers to its own share of white, tiles or not */
+    struct image32_t img = {0}, ref = {0};
+    img.w = ref.w = 2000 * 3;
+    img.h = ref.h = 128;
+    img.buf = malloc(img.w * img.h);
+    ref.buf = malloc(ref.w * ref.h);
+    memset(img.buf, 64, img.w * img.h);
+    memset(ref.buf, 64, ref.w * ref.h);
+    struct workpool *pool = workpool_create(4);
+    TEST_ASSERT_EQUAL(1, blue_noise_dithering(&ref, 2, NULL));
+    TEST_ASSERT_EQUAL(1, blue_noise_dithering(&img, 2, pool));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(ref.buf, img.buf, img.w * img.h);
+
+    size_t white = 0;
+    const uint8_t *bytes = (const uint8_t *)img.buf;
+    for (size_t i = 0; i < img.w * img.h; ++i) {
+        TEST_ASSERT_TRUE(bytes[i] == 0 || bytes[i] == 255);
+        white += bytes[i] == 255;
+    }
+    /* 64 / 255 of the 64x64 ranks, rounded */
+    TEST_ASSERT_UINT_WITHIN(img.w * img.h / 512, img.w * img.h * 64 / 255,
+                            white);
+
+    workpool_destroy(pool);
+    free(img.buf);
+    free(ref.buf);
+}
+
+void test_luma_planes(void)
+{
+    /* 61 pixels take 32 in AVX2, 16 in SSSE3 and 13 in the scalar tail */
+    const size_t width = 61, h = 9;
+    struct image32_t img = {0};
+    img.w = (width * 3 + 3) & ~(size_t)3;
+    img.h = h;
+    img.buf = malloc(img.w * img.h);
+    uint8_t *bytes = (uint8_t *)img.buf;
+    uint32_t seed = 7;
+    for (size_t i = 0; i < img.w * img.h; ++i) {
+        seed = seed * 1664525u + 1013904223u;
+        bytes[i] = (uint8_t)(seed >> 24);
+    }
+
+    static const unsigned weights[2][3] = { { 77, 150, 29 }, { 54, 183, 19 } };
+    uint8_t y8[61 * 9], ref[61 * 9];
+    struct luma_plane plane = { y8, width, h };
+    struct workpool *pool = workpool_create(4);
+    for (int m = LUMA_BT601; m <= LUMA_BT709; ++m) {
+        for (size_t y = 0; y < h; ++y)
+            for (size_t x = 0; x < width; ++x) {
+                /* file bytes B, G, R, file byte j at memory byte j ^ 3 */
+                const uint8_t *row = bytes + y * img.w;
+                unsigned b = row[(3 * x) ^ 3], g = row[(3 * x + 1) ^ 3],
+                         r = row[(3 * x + 2) ^ 3];
+                ref[y * width + x] = (uint8_t)((weights[m][0] * r
+                    + weights[m][1] * g + weights[m][2] * b + 128) >> 8);
+            }
+        memset(y8, 0, sizeof(y8));
+        TEST_ASSERT_EQUAL(1, luma_from32(&plane, &img, width, m, NULL));
+        TEST_ASSERT_EQUAL_UINT8_ARRAY(ref, y8, sizeof(y8));
+        memset(y8, 0, sizeof(y8));
+        TEST_ASSERT_EQUAL(1, luma_from32(&plane, &img, width, m, pool));
+        TEST_ASSERT_EQUAL_UINT8_ARRAY(ref, y8, sizeof(y8));
+    }
+    plane.wid = width + 1;
+    TEST_ASSERT_EQUAL(-1, luma_from32(&plane, &img, width, LUMA_BT601, NULL));
+
+    /* gray has neutral chroma, pure blue the largest Cb; odd edges too */
+    uint8_t cbuf[31 * 5], rbuf[31 * 5];
+    struct luma_plane cb = { cbuf, LUMA_CHROMA_DIM(width), LUMA_CHROMA_DIM(h) };
+    struct luma_plane cr = { rbuf, cb.wid, cb.hgt };
+    TEST_ASSERT_EQUAL(31, cb.wid);
+    TEST_ASSERT_EQUAL(5, cb.hgt);
+    memset(img.buf, 90, img.w * img.h);
+    TEST_ASSERT_EQUAL(1, chroma_from32(&cb, &cr, &img, width, LUMA_BT709));
+    for (size_t i = 0; i < sizeof(cbuf); ++i) {
+        TEST_ASSERT_EQUAL_UINT8(128, cbuf[i]);
+        TEST_ASSERT_EQUAL_UINT8(128, rbuf[i]);
+    }
+    memset(img.buf, 0, img.w * img.h);
+    for (size_t y = 0; y < h; ++y)
+        for (size_t x = 0; x < width; ++x)
+            bytes[y * img.w + ((3 * x) ^ 3)] = 255; /* file byte 0, blue */
+    TEST_ASSERT_EQUAL(1, chroma_from32(&cb, &cr, &img, width, LUMA_BT601));
+    for (size_t i = 0; i < sizeof(cbuf); ++i) {
+        TEST_ASSERT_EQUAL_UINT8(255, cbuf[i]);
+        TEST_ASSERT_EQUAL_UINT8(107, rbuf[i]);
+    }
+
+    workpool_destroy(pool);
+    free(img.buf);
+}
+
+void test_resample(void)
+{
+    const size_t sw = 50, sh = 36;
+    struct image32_t src = {0}, dest = {0}, ref = {0};
+    src.w = (sw * 3 + 3) & ~(size_t)3;
+    src.h = sh;
+    src.buf = malloc(src.w * src.h);
+    uint8_t *bytes = (uint8_t *)src.buf;
+    uint32_t seed = 11;
+    for (size_t i = 0; i < src.w * src.h; ++i) {
+        seed = seed * 1664525u + 1013904223u;
+        bytes[i] = (uint8_t)(seed >> 24);
+    }
+    for (size_t y = 0; y < sh; ++y) /* padding is zero, as in a bmp */
+        for (size_t j = sw * 3; j < src.w; ++j)
+            bytes[y * src.w + (j ^ 3)] = 0;
+    struct workpool *pool = workpool_create(3);
+
+    /* the same size copies, whatever the filter */
+    dest.w = src.w;
+    dest.h = sh;
+    dest.buf = malloc(dest.w * dest.h);
+    for (int f = RESAMPLE_BOX; f <= RESAMPLE_LANCZOS3; ++f) {
+        TEST_ASSERT_EQUAL(1, resample32(&dest, sw, &src, sw, f, pool));
+        TEST_ASSERT_EQUAL_UINT8_ARRAY(src.buf, dest.buf, src.w * src.h);
+    }
+    free(dest.buf);
+
+    /* halving with the box filter is the mean of 2 x 2 blocks, each pass
+     * rounding once */
+    dest.w = (25 * 3 + 3) & ~(size_t)3;
+    dest.h = 18;
+    dest.buf = malloc(dest.w * dest.h);
+    TEST_ASSERT_EQUAL(1, resample32(&dest, 25, &src, sw, RESAMPLE_BOX, NULL));
+    for (size_t y = 0; y < 18; ++y)
+        for (size_t j = 0; j < 25 * 3; ++j) {
+            const size_t x = j / 3, c = j % 3;
+            unsigned sum = 0;
+            for (size_t dy = 0; dy < 2; ++dy)
+                for (size_t dx = 0; dx < 2; ++dx)
+                    sum += bytes[(2 * y + dy) * src.w
+                                 + ((3 * (2 * x + dx) + c) ^ 3)];
+            TEST_ASSERT_UINT_WITHIN(1, (sum + 2) / 4,
+                    ((uint8_t *)dest.buf)[y * dest.w + (j ^ 3)]);
+        }
+
+    /* threads do not change the result, and the banks come from the cache
+     * the second time round */
+    ref.w = dest.w;
+    ref.h = dest.h;
+    ref.buf = malloc(ref.w * ref.h);
+    for (int f = RESAMPLE_BOX; f <= RESAMPLE_LANCZOS3; ++f) {
+        TEST_ASSERT_EQUAL(1, resample32(&ref, 25, &src, sw, f, NULL));
+        TEST_ASSERT_EQUAL(1, resample32(&dest, 25, &src, sw, f, pool));
+        TEST_ASSERT_EQUAL_UINT8_ARRAY(ref.buf, dest.buf, ref.w * ref.h);
+    }
+    resample_cache_clear();
+    TEST_ASSERT_EQUAL(1, resample32(&dest, 25, &src, sw,
+                                    RESAMPLE_LANCZOS3, pool));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(ref.buf, dest.buf, ref.w * ref.h);
+    free(dest.buf);
+    free(ref.buf);
+
+    /* a flat image stays flat, shrunk or enlarged */
+    memset(src.buf, 200, src.w * src.h);
+    const size_t sizes[2][2] = { { 7, 5 }, { 131, 90 } };
+    for (size_t s = 0; s < 2; ++s) {
+        dest.w = (sizes[s][0] * 3 + 3) & ~(size_t)3;
+        dest.h = sizes[s][1];
+        dest.buf = malloc(dest.w * dest.h);
+        for (int f = RESAMPLE_BOX; f <= RESAMPLE_LANCZOS3; ++f) {
+            TEST_ASSERT_EQUAL(1, resample32(&dest, sizes[s][0], &src, sw, f,
+                                            pool));
+            for (size_t y = 0; y < dest.h; ++y)
+                for (size_t j = 0; j < sizes[s][0] * 3; ++j)
+                    TEST_ASSERT_EQUAL_UINT8(200,
+                        ((uint8_t *)dest.buf)[y * dest.w + (j ^ 3)]);
+        }
+        free(dest.buf);
+    }
+
+    dest.buf = src.buf;
+    TEST_ASSERT_EQUAL(-1, resample32(&dest, 40, &src, sw, RESAMPLE_BOX,
+                                     NULL));
+    workpool_destroy(pool);
+    free(src.buf);
+}
+
+void test_convolve(void)
+{
+    /* a frame taller than a band, so bands meet inside it */
+    const size_t fw = 45, fh = 700;
+    uint8_t *fb = malloc(fw * fh), *ob = malloc(fw * fh), *rb = malloc(fw * fh);
+    uint32_t seed = 5;
+    for (size_t i = 0; i < fw * fh; ++i) {
+        seed = seed * 1664525u + 1013904223u;
+        fb[i] = (uint8_t)(seed >> 24);
+    }
+    SBM_WRAP(frame, fb, fw, fh);
+    SBM_WRAP(out, ob, fw, fh);
+    struct workpool *pool = workpool_create(4);
+#define AT(buf, x, y) ( (buf)[(size_t)((y) < 0 ? 0 : (y) >= (long)fh ? (long)fh - 1 : (y)) * fw \
+                              + (size_t)((x) < 0 ? 0 : (x) >= (long)fw ? (long)fw - 1 : (x))] )
+
+    /* the box is the rounded mean of the square, edges repeated */
+    const size_t radii[3] = { 0, 1, 9 };
+    for (size_t n = 0; n < 3; ++n) {
+        const long r = (long)radii[n], area = (2 * r + 1) * (2 * r + 1);
+        for (long y = 0; y < (long)fh; ++y)
+            for (long x = 0; x < (long)fw; ++x) {
+                long sum = 0;
+                for (long dy = -r; dy <= r; ++dy)
+                    for (long dx = -r; dx <= r; ++dx)
+                        sum += AT(fb, x + dx, y + dy);
+                rb[y * fw + x] = (uint8_t)((sum + area / 2) / area);
+            }
+        TEST_ASSERT_EQUAL(1, box_blur_frame(out, frame, radii[n], pool));
+        TEST_ASSERT_EQUAL_UINT8_ARRAY(rb, ob, fw * fh);
+    }
+
+    /* Sobel, exactly, and the Gaussian within rounding of the real one */
+    for (long y = 0; y < (long)fh; ++y)
+        for (long x = 0; x < (long)fw; ++x) {
+            long gx = 0, gy = 0;
+            for (long d = -1; d <= 1; ++d) {
+                long w = 2 - (d < 0 ? -d : d);
+                gx += w * (AT(fb, x + 1, y + d) - AT(fb, x - 1, y + d));
+                gy += w * (AT(fb, x + d, y + 1) - AT(fb, x + d, y - 1));
+            }
+            rb[y * fw + x] = (uint8_t)(((gx < 0 ? -gx : gx)
+                                        + (gy < 0 ? -gy : gy) + 4) >> 3);
+        }
+    TEST_ASSERT_EQUAL(1, sobel_frame(out, frame, pool));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(rb, ob, fw * fh);
+
+    double g[7], gsum = 0;
+    for (int i = 0; i < 7; ++i)
+        gsum += g[i] = exp(-(i - 3) * (i - 3) / 2.0);
+    TEST_ASSERT_EQUAL(1, gaussian_blur_frame(out, frame, 1.0, NULL));
+    memcpy(rb, ob, fw * fh);
+    for (long y = 0; y < (long)fh; y += 7)
+        for (long x = 0; x < (long)fw; ++x) {
+            double v = 0;
+            for (long dy = -3; dy <= 3; ++dy)
+                for (long dx = -3; dx <= 3; ++dx)
+                    v += g[dy + 3] * g[dx + 3] * AT(fb, x + dx, y + dy);
+            TEST_ASSERT_UINT_WITHIN(1, (unsigned)(v / (gsum * gsum) + 0.5),
+                                    ob[y * fw + x]);
+        }
+    TEST_ASSERT_EQUAL(1, gaussian_blur_frame(out, frame, 1.0, pool));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(rb, ob, fw * fh);
+    TEST_ASSERT_EQUAL(-1, gaussian_blur_frame(out, out, 1.0, NULL));
+    TEST_ASSERT_EQUAL(-1, box_blur_frame(out, frame, CONVOLVE_MAXRADIUS + 1,
+                                         NULL));
+#undef AT
+
+    /* packed images blur each channel alone, so a flat colour stays put
+     * and a black and white edge only grows gray in between */
+    struct image32_t img = {0};
+    const size_t iw = 21;
+    img.w = (iw * 3 + 3) & ~(size_t)3;
+    img.h = 30;
+    img.buf = calloc(img.w * img.h, 1);
+    uint8_t *bytes = (uint8_t *)img.buf;
+    for (size_t y = 0; y < img.h; ++y)
+        for (size_t x = 0; x < iw; ++x) {
+            bytes[y * img.w + ((3 * x) ^ 3)] = 10;
+            bytes[y * img.w + ((3 * x + 1) ^ 3)] = x < 10 ? 0 : 255;
+            bytes[y * img.w + ((3 * x + 2) ^ 3)] = 200;
+        }
+    TEST_ASSERT_EQUAL(1, gaussian_blur32(&img, &img, iw, 2.0, pool));
+    TEST_ASSERT_EQUAL(1, box_blur32(&img, &img, iw, 3, NULL));
+    for (size_t y = 0; y < img.h; ++y) {
+        for (size_t x = 0; x < iw; ++x) {
+            TEST_ASSERT_EQUAL_UINT8(10, bytes[y * img.w + ((3 * x) ^ 3)]);
+            TEST_ASSERT_EQUAL_UINT8(200, bytes[y * img.w + ((3 * x + 2) ^ 3)]);
+        }
+        TEST_ASSERT_EQUAL_UINT8(0, bytes[y * img.w + ((3 * 0 + 1) ^ 3)]);
+        TEST_ASSERT_EQUAL_UINT8(255, bytes[y * img.w + ((3 * 20 + 1) ^ 3)]);
+        TEST_ASSERT_TRUE(bytes[y * img.w + ((3 * 10 + 1) ^ 3)] > 0);
+        TEST_ASSERT_TRUE(bytes[y * img.w + ((3 * 10 + 1) ^ 3)] < 255);
+        TEST_ASSERT_EQUAL_UINT8(0, bytes[y * img.w + (63 ^ 3)]); /* padding */
+    }
+    TEST_ASSERT_EQUAL(1, sobel32(&img, &img, iw, pool));
+    for (size_t y = 0; y < img.h; ++y) {
+        TEST_ASSERT_EQUAL_UINT8(0, bytes[y * img.w + (0 ^ 3)]);
+        TEST_ASSERT_TRUE(bytes[y * img.w + ((3 * 10 + 1) ^ 3)] > 0);
+    }
+
+    workpool_destroy(pool);
+    free(img.buf);
+    free(frame);
+    free(out);
+    free(fb);
+    free(ob);
+    free(rb);
+}
+
+/* writes a 24 bit bmp of width x height pixels, 3 bytes each, rows of
+ * pixels given bottom row first and padded in the file */
+static int
+write_bmp24(const char *path, size_t width, size_t height,
+            const uint8_t *pixels)
+{
+    const size_t stride = (width * 3 + 3) & ~(size_t)3;
+    uint8_t *rows = calloc(stride * height + 1, 1);
+    if (!rows)
+        return -1;
+    for (size_t y = 0; y < height; ++y)
+        memcpy(rows + y * stride, pixels + y * width * 3, width * 3);
+    int res = write_bmp(path, width, (int32_t)height, 24, BMP_RGB, 40, NULL,
+                        0, rows, stride);
+    free(rows);
+    return res;
+}
+
+void test_bmp_map(void)
+{
+    char path[] = "/tmp/imp-map-XXXXXX";
+    int fd = mkstemp(path);
+    TEST_ASSERT_TRUE(fd >= 0);
+    close(fd);
+
+    /* 5 pixels is 15 bytes a row, padded to 16 in the file */
+    uint8_t pixels[5 * 3 * 3];
+    for (size_t i = 0; i < sizeof(pixels); ++i)
+        pixels[i] = (uint8_t)(i * 5 + 1);
+    TEST_ASSERT_EQUAL(1, write_bmp24(path, 5, 3, pixels));
+
+    struct bmp_map map;
+    TEST_ASSERT_EQUAL(1, bmp_map_open(&map, path));
+    TEST_ASSERT_EQUAL(5, map.width);
+    TEST_ASSERT_EQUAL(3, map.height);
+    TEST_ASSERT_EQUAL(15, map.rowbytes);
+    TEST_ASSERT_EQUAL(16, map.stride);
+    TEST_ASSERT_EQUAL(54, map.bfh.offset);
+    TEST_ASSERT_EQUAL(24, map.bih.bitsPerPxl);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(pixels + 15, bmp_map_row(&map, 1), 15);
+
+    /* one copy into the packed layout, the same as read_image gives */
+    struct image32_t img = {0};
+    img.w = map.stride32;
+    img.h = map.height;
+    img.buf = malloc(img.w * img.h);
+    int32_t *other = malloc(img.w * img.h);
+    TEST_ASSERT_EQUAL(1, bmp_map_to32(&map, &img));
+    TEST_ASSERT_EQUAL(1, read_image(path, other, img.w * img.h));
+    TEST_ASSERT_EQUAL_INT32_ARRAY(img.buf, other, img.w * img.h / 4);
+    for (size_t y = 0; y < 3; ++y)
+        for (size_t j = 0; j < 15; ++j)
+            TEST_ASSERT_EQUAL_UINT8(pixels[y * 15 + j],
+                ((uint8_t *)img.buf)[y * img.w + (j ^ 3)]);
+    bmp_map_close(&map);
+    TEST_ASSERT_NULL(map.data);
+
+    /* a file cut short is refused before any row is read */
+    TEST_ASSERT_EQUAL(0, truncate(path, 54 + 2 * 16));
+    TEST_ASSERT_EQUAL(-1, bmp_map_open(&map, path));
+    TEST_ASSERT_EQUAL(EINVAL, errno);
+    TEST_ASSERT_EQUAL(-1, bmp_map_open(&map, "/nonexistent/imp.bmp"));
+
+    remove(path);
+    free(img.buf);
+    free(other);
+}
+
+void test_imagefile(void)
+{
+    char src[] = "/tmp/imp-src-XXXXXX", dest[] = "/tmp/imp-dest-XXXXXX";
+    int fd = mkstemp(src);
+    TEST_ASSERT_TRUE(fd >= 0);
+    close(fd);
+    fd = mkstemp(dest);
+    TEST_ASSERT_TRUE(fd >= 0);
+    close(fd);
+
+    uint8_t pixels[7 * 4 * 3];
+    for (size_t i = 0; i < sizeof(pixels); ++i)
+        pixels[i] = (uint8_t)(i * 3);
+    TEST_ASSERT_EQUAL(1, write_bmp24(src, 7, 4, pixels));
+
+    /* size, pixels and headers all come from the one open file */
+    struct imagefile *file = imagefile_open(src);
+    TEST_ASSERT_NOT_NULL(file);
+    struct image32_t img = {0};
+    TEST_ASSERT_EQUAL(1, imagefile_size(file, &img.w, &img.h));
+    TEST_ASSERT_EQUAL(24, img.w);
+    TEST_ASSERT_EQUAL(4, img.h);
+    img.buf = malloc(img.w * img.h);
+    TEST_ASSERT_EQUAL(1, imagefile_read(file, &img));
+    TEST_ASSERT_EQUAL(1, invert_image(&img, NULL));
+    TEST_ASSERT_EQUAL(1, imagefile_write(file, &img, dest));
+    img.h = 3;
+    TEST_ASSERT_EQUAL(-1, imagefile_write(file, &img, dest));
+    imagefile_close(file);
+
+    /* the output is the source with every pixel byte inverted, the row
+     * padding zeros still */
+    FILE *a = fopen(src, "rb"), *b = fopen(dest, "rb");
+    TEST_ASSERT_NOT_NULL(a);
+    TEST_ASSERT_NOT_NULL(b);
+    uint8_t in[54 + 24 * 4], out[54 + 24 * 4 + 1];
+    TEST_ASSERT_EQUAL(sizeof(in), fread(in, 1, sizeof(in), a));
+    TEST_ASSERT_EQUAL(sizeof(in), fread(out, 1, sizeof(out), b));
+    fclose(a);
+    fclose(b);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(in, out, 54);
+    for (size_t i = 54; i < sizeof(in); ++i)
+        TEST_ASSERT_EQUAL_UINT8((i - 54) % 24 < 21 ? 255 - in[i] : 0, out[i]);
+
+    TEST_ASSERT_NULL(imagefile_open("/nonexistent/imp.bmp"));
+    remove(src);
+    remove(dest);
+    free(img.buf);
+}
+
+/* writes a bmp of the given info header size and pixel format: extra (a
+ * palette or masks) follows the first 40 bytes of the info header, the
+ * pixel array follows both, and rows are stride bytes in the file */
+static int
+write_bmp(const char *path, size_t width, int32_t height, uint16_t bpp,
+          uint32_t compression, uint32_t infosize, const uint8_t *extra,
+          size_t nextra, const uint8_t *rows, size_t stride)
+{
+    const size_t nrows = height < 0 ? (size_t)-height : (size_t)height;
+    const size_t offset = 54 + nextra > 14 + infosize ? 54 + nextra
+                                                      : 14 + infosize;
+    const uint32_t fields[] = {
+        (uint32_t)(offset + stride * nrows), 0, (uint32_t)offset,
+        infosize, (uint32_t)width, (uint32_t)height, 1 | (uint32_t)bpp << 16,
+        compression, (uint32_t)(stride * nrows), 2835, 2835,
+        bpp == 8 ? (uint32_t)nextra / 4 : 0, 0
+    };
+    uint8_t *header = calloc(offset, 1);
+    if (!header)
+        return -1;
+    header[0] = 'B';
+    header[1] = 'M';
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); ++i)
+        for (size_t b = 0; b < 4; ++b)
+            header[2 + 4 * i + b] = (uint8_t)(fields[i] >> (8 * b));
+    if (nextra)
+        memcpy(header + 54, extra, nextra);
+
+    FILE *fp = fopen(path, "wb");
+    int ok = fp && fwrite(header, 1, offset, fp) == offset
+             && fwrite(rows, 1, stride * nrows, fp) == stride * nrows;
+    free(header);
+    return fp && fclose(fp) == 0 && ok ? 1 : -1;
+}
+
+void test_bmp_formats(void)
+{
+    enum { W = 5, H = 3 };
+    char path[] = "/tmp/imp-fmt-XXXXXX", out[] = "/tmp/imp-fmtout-XXXXXX";
+    int fd = mkstemp(path);
+    TEST_ASSERT_TRUE(fd >= 0);
+    close(fd);
+    fd = mkstemp(out);
+    TEST_ASSERT_TRUE(fd >= 0);
+    close(fd);
+
+    /* every file below holds these b, g, r pixels, bottom row first */
+    uint8_t palette[16 * 4], index[H][W], ref[H][W * 3];
+    for (size_t i = 0; i < 16; ++i) {
+        palette[4 * i] = (uint8_t)(i * 16);
+        palette[4 * i + 1] = (uint8_t)(255 - i * 8);
+        palette[4 * i + 2] = (uint8_t)(i * 5 + 3);
+        palette[4 * i + 3] = 0;
+    }
+    for (size_t y = 0; y < H; ++y)
+        for (size_t x = 0; x < W; ++x) {
+            index[y][x] = (uint8_t)((x * 7 + y * 3) % 16);
+            memcpy(&ref[y][x * 3], &palette[4 * index[y][x]], 3);
+        }
+    TEST_ASSERT_EQUAL(1, write_bmp24(path, W, H, &ref[0][0]));
+    struct bmp_map map;
+    struct image32_t want = { malloc(16 * H), 16, H };
+    struct image32_t got = { malloc(16 * H), 16, H };
+    TEST_ASSERT_EQUAL(1, bmp_map_open(&map, path));
+    TEST_ASSERT_EQUAL(1, bmp_map_to32(&map, &want));
+    bmp_map_close(&map);
+
+    /* 8 bit palettised, rows of 5 bytes padded to 8 */
+    uint8_t rows8[H][8] = {{0}};
+    for (size_t y = 0; y < H; ++y)
+        memcpy(rows8[y], index[y], W);
+    TEST_ASSERT_EQUAL(1, write_bmp(path, W, H, 8, BMP_RGB, 40, palette,
+                                   sizeof(palette), &rows8[0][0], 8));
+
+    TEST_ASSERT_EQUAL(1, bmp_map_open(&map, path));
+    TEST_ASSERT_EQUAL(8, map.bpp);
+    TEST_ASSERT_EQUAL(8, map.stride);
+    TEST_ASSERT_EQUAL(16, map.stride32);
+    memset(got.buf, 0xA5, 16 * H);
+    TEST_ASSERT_EQUAL(1, bmp_map_to32(&map, &got));
+    TEST_ASSERT_EQUAL_INT32_ARRAY(want.buf, got.buf, 4 * H);
+
+    /* the decoded image holds no padding and its rows are aligned */
+    struct image img;
+    TEST_ASSERT_EQUAL(1, bmp_map_decode(&map, &img));
+    TEST_ASSERT_EQUAL(W, img.width);
+    TEST_ASSERT_EQUAL(3, img.channels);
+    for (size_t y = 0; y < H; ++y) {
+        TEST_ASSERT_EQUAL(0, (uintptr_t)image_row(&img, 0, y) % IMAGE_ALIGN);
+        TEST_ASSERT_EQUAL_UINT8_ARRAY(ref[y], image_row(&img, 0, y), W * 3);
+    }
+    image_destroy(&img);
+    bmp_map_close(&map);
+
+    /* 32 bit top-down, the top row first in the file */
+    uint8_t rows32[H][W * 4];
+    for (size_t y = 0; y < H; ++y)
+        for (size_t x = 0; x < W; ++x) {
+            memcpy(&rows32[H - 1 - y][4 * x], &ref[y][3 * x], 3);
+            rows32[H - 1 - y][4 * x + 3] = 0xFF;
+        }
+    TEST_ASSERT_EQUAL(1, write_bmp(path, W, -H, 32, BMP_RGB, 40, NULL, 0,
+                                   &rows32[0][0], W * 4));
+    TEST_ASSERT_EQUAL(1, bmp_map_open(&map, path));
+    TEST_ASSERT_TRUE(map.topdown);
+    TEST_ASSERT_EQUAL(H, map.height);
+    TEST_ASSERT_EQUAL(1, bmp_map_to32(&map, &got));
+    TEST_ASSERT_EQUAL_INT32_ARRAY(want.buf, got.buf, 4 * H);
+    bmp_map_close(&map);
+
+    /* 32 bit bitfields in a V5 header, r, g, b in the top three bytes */
+    const uint8_t masks[] = { 0, 0, 0, 0xFF, 0, 0, 0xFF, 0, 0, 0xFF, 0, 0 };
+    for (size_t y = 0; y < H; ++y)
+        for (size_t x = 0; x < W; ++x) {
+            rows32[y][4 * x] = 0;
+            rows32[y][4 * x + 1] = ref[y][3 * x];
+            rows32[y][4 * x + 2] = ref[y][3 * x + 1];
+            rows32[y][4 * x + 3] = ref[y][3 * x + 2];
+        }
+    TEST_ASSERT_EQUAL(1, write_bmp(path, W, H, 32, BMP_BITFIELDS, 124, masks,
+                                   sizeof(masks), &rows32[0][0], W * 4));
+    TEST_ASSERT_EQUAL(1, bmp_map_open(&map, path));
+    TEST_ASSERT_EQUAL(124, map.bih.size);
+    TEST_ASSERT_EQUAL(1, bmp_map_to32(&map, &got));
+    TEST_ASSERT_EQUAL_INT32_ARRAY(want.buf, got.buf, 4 * H);
+
+    /* written back as a plain 24 bit file */
+    struct imagefile *file = imagefile_open(path);
+    TEST_ASSERT_NOT_NULL(file);
+    TEST_ASSERT_EQUAL(1, imagefile_write(file, &got, out));
+    imagefile_close(file);
+    bmp_map_close(&map);
+    TEST_ASSERT_EQUAL(1, bmp_map_open(&map, out));
+    TEST_ASSERT_EQUAL(24, map.bpp);
+    TEST_ASSERT_EQUAL(40, map.bih.size);
+    TEST_ASSERT_EQUAL(1, bmp_map_to32(&map, &got));
+    TEST_ASSERT_EQUAL_INT32_ARRAY(want.buf, got.buf, 4 * H);
+    bmp_map_close(&map);
+
+    /* 16 bit 5-6-5 bitfields, 5 and 6 bit fields stretched to 0..255 */
+    const uint8_t masks565[] = { 0, 0xF8, 0, 0, 0xE0, 0x07, 0, 0,
+                                 0x1F, 0, 0, 0 };
+    const uint8_t rows16[1][4] = { { 0x1F, 0xF8, 0xE0, 0x07 } };
+    TEST_ASSERT_EQUAL(1, write_bmp(path, 2, 1, 16, BMP_BITFIELDS, 40,
+                                   masks565, sizeof(masks565),
+                                   &rows16[0][0], 4));
+    TEST_ASSERT_EQUAL(1, bmp_map_open(&map, path));
+    uint8_t px[6];
+    bmp_map_decode_row(&map, 0, px);
+    const uint8_t px565[6] = { 255, 0, 255, 0, 255, 0 };
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(px565, px, 6);
+    bmp_map_close(&map);
+
+    /* run length compression is refused */
+    TEST_ASSERT_EQUAL(1, write_bmp(path, W, H, 8, 1, 40, palette,
+                                   sizeof(palette), &rows8[0][0], 8));
+    TEST_ASSERT_EQUAL(-1, bmp_map_open(&map, path));
+
+    remove(path);
+    remove(out);
+    free(want.buf);
+    free(got.buf);
+}
+
+void test_stream(void)
+{
+    enum { W = 37, H = 53 };
+    char src[] = "/tmp/imp-stsrc-XXXXXX", whole[] = "/tmp/imp-stall-XXXXXX",
+         band[] = "/tmp/imp-stband-XXXXXX";
+    char *paths[] = { src, whole, band };
+    for (size_t i = 0; i < 3; ++i) {
+        int fd = mkstemp(paths[i]);
+        TEST_ASSERT_TRUE(fd >= 0);
+        close(fd);
+    }
+    uint8_t pixels[W * H * 3];
+    for (size_t i = 0; i < sizeof(pixels); ++i)
+        pixels[i] = (uint8_t)((i * 37) ^ (i >> 5));
+    TEST_ASSERT_EQUAL(1, write_bmp24(src, W, H, pixels));
+
+    struct imagefile *file = imagefile_open(src);
+    TEST_ASSERT_NOT_NULL(file);
+    struct image32_t img = {0}, ref = {0};
+    TEST_ASSERT_EQUAL(1, imagefile_size(file, &img.w, &img.h));
+    img.buf = malloc(img.w * img.h);
+    ref.w = img.w;
+    ref.h = img.h;
+    ref.buf = malloc(img.w * img.h);
+    TEST_ASSERT_EQUAL(1, imagefile_read(file, &img));
+
+    /* the blur stage is box_blur32 */
+    struct pipeline *pipe = pipeline_create();
+    TEST_ASSERT_EQUAL(1, pipeline_add_box_blur(pipe, W, 3));
+    TEST_ASSERT_EQUAL(3, pipeline_halo(pipe));
+    TEST_ASSERT_EQUAL(1, pipeline_run(pipe, &img, &ref, NULL));
+    struct image32_t box = { malloc(img.w * img.h), img.w, img.h };
+    TEST_ASSERT_EQUAL(1, box_blur32(&box, &img, W, 3, NULL));
+    TEST_ASSERT_EQUAL_INT32_ARRAY(box.buf, ref.buf, img.w * img.h / 4);
+    pipeline_destroy(pipe);
+
+    /* bands of a few rows give the output of the whole image */
+    struct workpool *pool = workpool_create(2);
+    pipe = pipeline_create();
+    TEST_ASSERT_EQUAL(1, pipeline_add_invert(pipe));
+    TEST_ASSERT_EQUAL(1, pipeline_add_box_blur(pipe, W, 2));
+    TEST_ASSERT_EQUAL(1, pipeline_add_dither(pipe, 8, 2));
+    TEST_ASSERT_EQUAL(1, pipeline_add_box_blur(pipe, W, 1));
+    TEST_ASSERT_EQUAL(1, pipeline_run(pipe, &img, &ref, pool));
+    TEST_ASSERT_EQUAL(1, imagefile_write(file, &ref, whole));
+
+    const size_t ceiling = pipeline_scratch(pipe, img.w, workpool_size(pool))
+                           + STREAM_FRAMES * img.w * (2 * 3 + 2 * 4);
+    TEST_ASSERT_EQUAL(4, stream_band(pipe, img.w, ceiling, pool));
+    struct overlap_stats stats;
+    TEST_ASSERT_EQUAL(1, stream_image(pipe, file, band, ceiling, pool,
+                                      &stats));
+    TEST_ASSERT_EQUAL((H + 3) / 4, stats.nitems);
+    TEST_ASSERT_EQUAL(0, stats.nfailed);
+
+    FILE *a = fopen(whole, "rb"), *b = fopen(band, "rb");
+    TEST_ASSERT_NOT_NULL(a);
+    TEST_ASSERT_NOT_NULL(b);
+    uint8_t *abuf = malloc(54 + img.w * H + 1), *bbuf = malloc(54 + img.w * H + 1);
+    const size_t n = fread(abuf, 1, 54 + img.w * H + 1, a);
+    TEST_ASSERT_EQUAL(54 + img.w * H, n);
+    TEST_ASSERT_EQUAL(n, fread(bbuf, 1, 54 + img.w * H + 1, b));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(abuf, bbuf, n);
+    fclose(a);
+    fclose(b);
+
+    /* a ceiling too low for a row and its halo */
+    TEST_ASSERT_EQUAL(-1, stream_image(pipe, file, band, img.w * 4, pool,
+                                       NULL));
+    TEST_ASSERT_EQUAL(ENOMEM, errno);
+
+    pipeline_destroy(pipe);
+    workpool_destroy(pool);
+    imagefile_close(file);
+    for (size_t i = 0; i < 3; ++i)
+        remove(paths[i]);
+    free(abuf);
+    free(bbuf);
+    free(img.buf);
+    free(ref.buf);
+    free(box.buf);
+}
+
+void test_batch(void)
+{
+    char indir[] = "/tmp/imp-bin-XXXXXX", outdir[] = "/tmp/imp-bout-XXXXXX";
+    TEST_ASSERT_NOT_NULL(mkdtemp(indir));
+    TEST_ASSERT_NOT_NULL(mkdtemp(outdir));
+
+    /* five images of different sizes, a corrupt one and a text file */
+    enum { N = 5 };
+    char path[128], dest[128];
+    uint8_t pixels[9 * 7 * 3];
+    for (size_t i = 0; i < sizeof(pixels); ++i)
+        pixels[i] = (uint8_t)(i * 11 + 5);
+    for (size_t n = 0; n < N; ++n) {
+        snprintf(path, sizeof(path), "%s/img%zu.BMP", indir, n);
+        TEST_ASSERT_EQUAL(1, write_bmp24(path, 5 + n, 3 + n % 3, pixels));
+    }
+    snprintf(path, sizeof(path), "%s/bad.bmp", indir);
+    FILE *fp = fopen(path, "wb");
+    TEST_ASSERT_NOT_NULL(fp);
+    fputs("BM not really", fp);
+    fclose(fp);
+    snprintf(path, sizeof(path), "%s/notes.txt", indir);
+    fp = fopen(path, "wb");
+    TEST_ASSERT_NOT_NULL(fp);
+    fclose(fp);
+
+    struct pipeline *pipe = pipeline_create();
+    TEST_ASSERT_EQUAL(1, pipeline_add_invert(pipe));
+    struct batch_stats stats;
+    TEST_ASSERT_EQUAL(-1, batch_run(pipe, indir, outdir, 2, 3, &stats));
+    TEST_ASSERT_EQUAL(EIO, errno);
+    TEST_ASSERT_EQUAL(N, stats.nimages);
+    TEST_ASSERT_EQUAL(1, stats.nfailed);
+    TEST_ASSERT_TRUE(stats.seconds >= 0);
+    for (size_t s = 0; s < 3; ++s)
+        TEST_ASSERT_TRUE(stats.occupancy[s] >= 0 && stats.occupancy[s] <= 1);
+
+    /* every image written, inverted, under its own name */
+    size_t bytes = 0;
+    for (size_t n = 0; n < N; ++n) {
+        snprintf(path, sizeof(path), "%s/img%zu.BMP", indir, n);
+        snprintf(dest, sizeof(dest), "%s/img%zu.BMP", outdir, n);
+        struct bmp_map in, out;
+        TEST_ASSERT_EQUAL(1, bmp_map_open(&in, path));
+        TEST_ASSERT_EQUAL(1, bmp_map_open(&out, dest));
+        TEST_ASSERT_EQUAL(in.size, out.size);
+        for (size_t y = 0; y < in.height; ++y)
+            for (size_t j = 0; j < in.rowbytes; ++j)
+                TEST_ASSERT_EQUAL_UINT8(255 - bmp_map_row(&in, y)[j],
+                                        bmp_map_row(&out, y)[j]);
+        bytes += in.stride32 * in.height;
+        bmp_map_close(&in);
+        bmp_map_close(&out);
+        remove(path);
+    }
+    TEST_ASSERT_EQUAL(bytes, stats.bytes);
+
+    /* a manifest names its outputs, or leaves them to outdir */
+    char manifest[128];
+    snprintf(manifest, sizeof(manifest), "%s/list", indir);
+    snprintf(path, sizeof(path), "%s/a.bmp", indir);
+    TEST_ASSERT_EQUAL(1, write_bmp24(path, 4, 4, pixels));
+    fp = fopen(manifest, "w");
+    TEST_ASSERT_NOT_NULL(fp);
+    fprintf(fp, "# inputs\n\n%s %s/renamed.bmp\n%s\n", path, outdir, path);
+    fclose(fp);
+    TEST_ASSERT_EQUAL(1, batch_run(pipe, manifest, outdir, 1, 1, &stats));
+    TEST_ASSERT_EQUAL(2, stats.nimages);
+    TEST_ASSERT_EQUAL(0, stats.nfailed);
+    snprintf(dest, sizeof(dest), "%s/renamed.bmp", outdir);
+    TEST_ASSERT_EQUAL(0, remove(dest));
+    snprintf(dest, sizeof(dest), "%s/a.bmp", outdir);
+    TEST_ASSERT_EQUAL(0, remove(dest));
+
+    /* a directory needs somewhere to write */
+    TEST_ASSERT_EQUAL(-1, batch_run(pipe, indir, NULL, 0, 0, NULL));
+    TEST_ASSERT_EQUAL(EINVAL, errno);
+
+    /* an empty directory is no images, not an error */
+    char empty[] = "/tmp/imp-bnone-XXXXXX";
+    TEST_ASSERT_NOT_NULL(mkdtemp(empty));
+    TEST_ASSERT_EQUAL(1, batch_run(pipe, empty, outdir, 1, 1, &stats));
+    TEST_ASSERT_EQUAL(0, stats.nimages);
+    TEST_ASSERT_EQUAL(0, rmdir(empty));
+
+    pipeline_destroy(pipe);
+    remove(path);
+    remove(manifest);
+    snprintf(path, sizeof(path), "%s/bad.bmp", indir);
+    remove(path);
+    snprintf(path, sizeof(path), "%s/notes.txt", indir);
+    remove(path);
+    for (size_t n = 0; n < N; ++n) {
+        snprintf(dest, sizeof(dest), "%s/img%zu.BMP", outdir, n);
+        remove(dest);
+    }
+    TEST_ASSERT_EQUAL(0, rmdir(indir));
+    TEST_ASSERT_EQUAL(0, rmdir(outdir));
+}
+
+/* a sequence of one row images: item i is read as i, run to 3 i + 1 */
+struct seq {
+    size_t fail;            /* the item the run stage fails on */
+    size_t written[64];     /* in the order of the writes */
+    size_t nwritten;
+    atomic_size_t allocs;   /* of the read stage, once per frame */
+};
+
+static int
+seq_read(void *arg, struct overlap_frame *frame)
+{
+    struct seq *seq = arg;
+    size_t cap = frame->incap;
+    if (overlap_reserve(frame->in, &frame->incap, 4, 1) < 0)
+        return -1;
+    if (frame->incap != cap)
+        atomic_fetch_add(&seq->allocs, 1);
+    frame->in->buf[0] = (int32_t)frame->index;
+    return 1;
+}
+
+static int
+seq_run(void *arg, struct overlap_frame *frame)
+{
+    const struct seq *seq = arg;
+    frame->in->buf[0] = 3 * frame->in->buf[0] + 1;
+    return frame->index == seq->fail ? -1 : 1;
+}
+
+static int
+seq_write(void *arg, struct overlap_frame *frame)
+{
+    struct seq *seq = arg;
+    seq->written[seq->nwritten++] = (size_t)frame->in->buf[0];
+    return 1;
+}
+
+void test_overlap(void)
+{
+    /* one thread a stage keeps the items in order, frames are reused */
+    struct seq seq = { .fail = 40 };
+    struct overlap ov = {
+        .fns = { seq_read, seq_run, seq_write },
+        .nframes = 3,
+        .arg = &seq
+    };
+    struct overlap_stats stats;
+    TEST_ASSERT_EQUAL(1, overlap_run(&ov, 30, &stats));
+    TEST_ASSERT_EQUAL(30, stats.nitems);
+    TEST_ASSERT_EQUAL(0, stats.nfailed);
+    TEST_ASSERT_EQUAL(30, seq.nwritten);
+    for (size_t i = 0; i < 30; ++i)
+        TEST_ASSERT_EQUAL(3 * i + 1, seq.written[i]);
+    TEST_ASSERT_TRUE(atomic_load(&seq.allocs) <= 3);
+    for (size_t s = 0; s < OVERLAP_NSTAGES; ++s) {
+        TEST_ASSERT_EQUAL(1, stats.nthreads[s]);
+        const double occ = overlap_occupancy(&stats, (enum overlap_stage)s);
+        TEST_ASSERT_TRUE(occ >= 0 && occ <= 1);
+    }
+
+    /* a failed item skips the stages after it, the others go on */
+    seq = (struct seq){ .fail = 7 };
+    ov.nthreads[OVERLAP_READ] = 2;
+    ov.nthreads[OVERLAP_COMPUTE] = 3;
+    TEST_ASSERT_EQUAL(-1, overlap_run(&ov, 20, &stats));
+    TEST_ASSERT_EQUAL(EIO, errno);
+    TEST_ASSERT_EQUAL(19, stats.nitems);
+    TEST_ASSERT_EQUAL(1, stats.nfailed);
+    TEST_ASSERT_EQUAL(19, seq.nwritten);
+    size_t sum = 0;
+    for (size_t i = 0; i < seq.nwritten; ++i)
+        sum += seq.written[i];
+    TEST_ASSERT_EQUAL(3 * (190 - 7) + 19, sum);
+
+    /* or with stop, nothing after it is written */
+    seq = (struct seq){ .fail = 7 };
+    ov.nthreads[OVERLAP_READ] = ov.nthreads[OVERLAP_COMPUTE] = 1;
+    ov.stop = 1;
+    TEST_ASSERT_EQUAL(-1, overlap_run(&ov, 20, &stats));
+    TEST_ASSERT_EQUAL(EIO, errno);
+    TEST_ASSERT_TRUE(seq.nwritten <= 7);
+    TEST_ASSERT_EQUAL(seq.nwritten, stats.nitems);
+    TEST_ASSERT_TRUE(stats.nfailed >= 1);
+    for (size_t i = 0; i < seq.nwritten; ++i)
+        TEST_ASSERT_EQUAL(3 * i + 1, seq.written[i]);
+    ov.stop = 0;
+
+    TEST_ASSERT_EQUAL(1, overlap_run(&ov, 0, NULL));
+    ov.fns[OVERLAP_WRITE] = NULL;
+    TEST_ASSERT_EQUAL(-1, overlap_run(&ov, 5, NULL));
+}
+
+/* writes header, then size bytes of data, to a new file at path */
+static int
+write_file(const char *path, const char *header, const uint8_t *data,
+           size_t size)
+{
+    FILE *fp = fopen(path, "wb");
+    if (!fp)
+        return -1;
+    int ok = fputs(header, fp) >= 0 && fwrite(data, 1, size, fp) == size;
+    return fclose(fp) == 0 && ok ? 1 : -1;
+}
+
+void test_pnm_raw(void)
+{
+    enum { W = 5, H = 4 };
+    char ppm[] = "/tmp/imp-ppm-XXXXXX", pgm[] = "/tmp/imp-pgm-XXXXXX",
+         bmp[] = "/tmp/imp-pbmp-XXXXXX", out[] = "/tmp/imp-pout-XXXXXX",
+         raw[] = "/tmp/imp-raw-XXXXXX";
+    char *paths[] = { ppm, pgm, bmp, out, raw };
+    for (size_t i = 0; i < 5; ++i) {
+        int fd = mkstemp(paths[i]);
+        TEST_ASSERT_TRUE(fd >= 0);
+        close(fd);
+    }
+
+    /* r, g, b top row first, and the same as b, g, r bottom row first */
+    uint8_t rgb[W * H * 3], bgr[W * H * 3];
+    for (size_t i = 0; i < sizeof(rgb); ++i)
+        rgb[i] = (uint8_t)(i * 11 + 3);
+    for (size_t y = 0; y < H; ++y)
+        for (size_t x = 0; x < W; ++x)
+            for (size_t c = 0; c < 3; ++c)
+                bgr[(y * W + x) * 3 + c] = rgb[((H - 1 - y) * W + x) * 3 + 2 - c];
+    TEST_ASSERT_EQUAL(1, write_file(ppm, "P6\n# a comment\n5 4\n255\n", rgb,
+                                    sizeof(rgb)));
+    TEST_ASSERT_EQUAL(1, write_bmp24(bmp, W, H, bgr));
+
+    /* the views are the mapping itself */
+    struct pnm_map map;
+    struct image view;
+    TEST_ASSERT_EQUAL(1, pnm_map_open(&map, ppm));
+    TEST_ASSERT_EQUAL(W, map.width);
+    TEST_ASSERT_EQUAL(H, map.height);
+    TEST_ASSERT_EQUAL(3, map.channels);
+    TEST_ASSERT_EQUAL(255, map.maxval);
+    TEST_ASSERT_EQUAL(1, pnm_map_image(&map, &view));
+    TEST_ASSERT_TRUE(view.planes[0] == map.pixels);
+    TEST_ASSERT_EQUAL(W * 3, view.stride);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(rgb + 2 * W * 3, image_row(&view, 0, 2),
+                                  W * 3);
+    struct luma_plane plane;
+    TEST_ASSERT_EQUAL(-1, pnm_map_plane(&map, &plane));
+
+    /* a ppm reads as the bmp of the same image does */
+    struct bmp_map bmap;
+    TEST_ASSERT_EQUAL(1, bmp_map_open(&bmap, bmp));
+    struct image32_t img = { NULL, bmap.stride32, H };
+    struct image32_t ref = { malloc(img.w * H), img.w, H };
+    img.buf = malloc(img.w * H);
+    TEST_ASSERT_EQUAL(1, bmp_map_to32(&bmap, &ref));
+    TEST_ASSERT_EQUAL(1, pnm_map_rows_to32(&map, 0, &img));
+    TEST_ASSERT_EQUAL_INT32_ARRAY(ref.buf, img.buf, img.w * H / 4);
+    bmp_map_close(&bmap);
+
+    /* raw planes of the ppm, written and mapped back */
+    TEST_ASSERT_EQUAL(1, raw_write(raw, &view));
+    struct raw_map rmap;
+    TEST_ASSERT_EQUAL(-1, raw_map_open(&rmap, raw, W, H + 1, 3));
+    TEST_ASSERT_EQUAL(EINVAL, errno);
+    TEST_ASSERT_EQUAL(1, raw_map_open(&rmap, raw, W, H, 3));
+    struct image planar;
+    TEST_ASSERT_EQUAL(1, raw_map_image(&rmap, &planar));
+    TEST_ASSERT_EQUAL(IMAGE_PLANAR, planar.layout);
+    TEST_ASSERT_EQUAL(1, raw_map_plane(&rmap, 1, &plane));
+    TEST_ASSERT_TRUE(plane.buf == planar.planes[1]);
+    for (size_t y = 0; y < H; ++y)
+        for (size_t x = 0; x < W; ++x)
+            for (unsigned c = 0; c < 3; ++c)
+                TEST_ASSERT_EQUAL_UINT8(rgb[(y * W + x) * 3 + c],
+                                        image_row(&planar, c, y)[x]);
+    TEST_ASSERT_EQUAL(1, pnm_write(out, &planar));
+    raw_map_close(&rmap);
+    pnm_map_close(&map);
+    TEST_ASSERT_EQUAL(1, pnm_map_open(&map, out));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(rgb, map.pixels, sizeof(rgb));
+    pnm_map_close(&map);
+
+    /* through imagefile, a band of a row at a time lands in place */
+    struct imagefile *file = imagefile_open(ppm);
+    TEST_ASSERT_NOT_NULL(file);
+    size_t w, h;
+    TEST_ASSERT_EQUAL(1, imagefile_size(file, &w, &h));
+    TEST_ASSERT_EQUAL(img.w, w);
+    TEST_ASSERT_EQUAL(H, h);
+    struct pipeline *pipe = pipeline_create();
+    TEST_ASSERT_EQUAL(1, pipeline_add_invert(pipe));
+    const size_t ceiling = pipeline_scratch(pipe, w, 1) + STREAM_FRAMES * w;
+    TEST_ASSERT_EQUAL(1, stream_band(pipe, w, ceiling, NULL));
+    TEST_ASSERT_EQUAL(1, stream_image(pipe, file, out, ceiling, NULL, NULL));
+    pipeline_destroy(pipe);
+    imagefile_close(file);
+
+    const char header[] = "P6\n5 4\n255\n";
+    uint8_t got[sizeof(header) + sizeof(rgb)];
+    FILE *fp = fopen(out, "rb");
+    TEST_ASSERT_NOT_NULL(fp);
+    TEST_ASSERT_EQUAL(sizeof(got) - 1, fread(got, 1, sizeof(got), fp));
+    fclose(fp);
+    TEST_ASSERT_EQUAL_MEMORY(header, got, sizeof(header) - 1);
+    for (size_t i = 0; i < sizeof(rgb); ++i)
+        TEST_ASSERT_EQUAL_UINT8(255 - rgb[i], got[sizeof(header) - 1 + i]);
+
+    /* a pgm of 4 bit samples is scaled to 8 and spread over b, g, r */
+    uint8_t gray[W * H];
+    for (size_t i = 0; i < sizeof(gray); ++i)
+        gray[i] = (uint8_t)(i % 16);
+    TEST_ASSERT_EQUAL(1, write_file(pgm, "P5 5#w\n4 15\n", gray,
+                                    sizeof(gray)));
+    TEST_ASSERT_EQUAL(1, pnm_map_open(&map, pgm));
+    TEST_ASSERT_EQUAL(15, map.maxval);
+    TEST_ASSERT_EQUAL(1, pnm_map_plane(&map, &plane));
+    TEST_ASSERT_TRUE(plane.buf == map.pixels);
+    TEST_ASSERT_EQUAL(W, plane.wid);
+    TEST_ASSERT_EQUAL(H, plane.hgt);
+    img.h = 1;
+    TEST_ASSERT_EQUAL(1, pnm_map_rows_to32(&map, 0, &img));
+    for (size_t x = 0; x < W; ++x)
+        for (size_t c = 0; c < 3; ++c)
+            TEST_ASSERT_EQUAL_UINT8(gray[(H - 1) * W + x] * 17,
+                                    ((uint8_t *)img.buf)[(3 * x + c) ^ 3]);
+    img.h = 2;
+    TEST_ASSERT_EQUAL(-1, pnm_map_rows_to32(&map, H - 1, &img));
+    pnm_map_close(&map);
+
+    /* only binary pgm and ppm files of 8 bit samples are taken */
+    TEST_ASSERT_EQUAL(1, write_file(pgm, "P2\n5 4\n255\n", gray,
+                                    sizeof(gray)));
+    TEST_ASSERT_EQUAL(-1, pnm_map_open(&map, pgm));
+    TEST_ASSERT_EQUAL(EINVAL, errno);
+    TEST_ASSERT_NULL(imagefile_open(pgm));
+    TEST_ASSERT_EQUAL(1, write_file(pgm, "P5\n5 4\n256\n", gray,
+                                    sizeof(gray)));
+    TEST_ASSERT_EQUAL(-1, pnm_map_open(&map, pgm));
+    TEST_ASSERT_EQUAL(1, write_file(pgm, "P5\n5 4\n255\n", gray,
+                                    sizeof(gray) - 1));
+    TEST_ASSERT_EQUAL(-1, pnm_map_open(&map, pgm));
+
+    for (size_t i = 0; i < 5; ++i)
+        remove(paths[i]);
+    free(img.buf);
+    free(ref.buf);
+}
+
+void test_bmp_write(void)
+{
+    /* more rows than a writev takes iovecs, each row padded by a byte */
+    enum { W = 5, H = 600 };
+    char a[] = "/tmp/imp-bwa-XXXXXX", b[] = "/tmp/imp-bwb-XXXXXX";
+    char *paths[] = { a, b };
+    for (size_t i = 0; i < 2; ++i) {
+        int fd = mkstemp(paths[i]);
+        TEST_ASSERT_TRUE(fd >= 0);
+        close(fd);
+    }
+
+    struct image bgr, planar;
+    TEST_ASSERT_EQUAL(1, image_create(&bgr, W, H, 3, IMAGE_INTERLEAVED));
+    for (size_t y = 0; y < H; ++y)
+        for (size_t j = 0; j < W * 3; ++j)
+            image_row(&bgr, 0, y)[j] = (uint8_t)(y * 7 + j * 13);
+    TEST_ASSERT_EQUAL(1, bmp_write(a, &bgr));
+
+    /* headers made from the image alone, rows straight from it */
+    struct bmp_map map;
+    TEST_ASSERT_EQUAL(1, bmp_map_open(&map, a));
+    TEST_ASSERT_EQUAL(W, map.width);
+    TEST_ASSERT_EQUAL(H, map.height);
+    TEST_ASSERT_EQUAL(24, map.bpp);
+    TEST_ASSERT_EQUAL(BMP_HEADER_SIZE, map.bfh.offset);
+    TEST_ASSERT_EQUAL(BMP_HEADER_SIZE + 16 * H, map.size);
+    for (size_t y = 0; y < H; ++y) {
+        TEST_ASSERT_EQUAL_UINT8_ARRAY(image_row(&bgr, 0, y),
+                                      bmp_map_row(&map, y), W * 3);
+        TEST_ASSERT_EQUAL_UINT8(0, bmp_map_row(&map, y)[W * 3]);
+    }
+
+    /* planar images are converted to the same file */
+    TEST_ASSERT_EQUAL(1, image_create(&planar, W, H, 3, IMAGE_PLANAR));
+    TEST_ASSERT_EQUAL(1, image_convert(&planar, &bgr));
+    TEST_ASSERT_EQUAL(1, bmp_write(b, &planar));
+    struct bmp_map other;
+    TEST_ASSERT_EQUAL(1, bmp_map_open(&other, b));
+    TEST_ASSERT_EQUAL(map.size, other.size);
+    TEST_ASSERT_EQUAL_MEMORY(map.data, other.data, map.size);
+    bmp_map_close(&other);
+
+    /* a packed image needs no source file, whatever its padding holds */
+    struct image32_t img = { malloc(map.stride32 * H), map.stride32, H };
+    TEST_ASSERT_EQUAL(1, bmp_map_to32(&map, &img));
+    for (size_t y = 0; y < H; ++y)
+        ((uint8_t *)img.buf)[y * img.w + ((W * 3) ^ 3)] = 0xAA;
+    TEST_ASSERT_EQUAL(1, bmp_write32(b, NULL, 0, &img, W));
+    TEST_ASSERT_EQUAL(1, bmp_map_open(&other, b));
+    TEST_ASSERT_EQUAL_MEMORY(map.data, other.data, map.size);
+    bmp_map_close(&other);
+    bmp_map_close(&map);
+
+    /* gray is spread over b, g and r */
+    struct image gray;
+    TEST_ASSERT_EQUAL(1, image_create(&gray, W, 2, 1, IMAGE_INTERLEAVED));
+    for (size_t y = 0; y < 2; ++y)
+        for (size_t x = 0; x < W; ++x)
+            image_row(&gray, 0, y)[x] = (uint8_t)(y * 100 + x);
+    TEST_ASSERT_EQUAL(1, bmp_write(a, &gray));
+    TEST_ASSERT_EQUAL(1, bmp_map_open(&map, a));
+    for (size_t x = 0; x < W * 3; ++x)
+        TEST_ASSERT_EQUAL_UINT8(100 + x / 3, bmp_map_row(&map, 1)[x]);
+    bmp_map_close(&map);
+
+    img.w = 12;
+    TEST_ASSERT_EQUAL(-1, bmp_write32(b, NULL, 0, &img, W));
+    TEST_ASSERT_EQUAL(EINVAL, errno);
+    gray.channels = 2;
+    TEST_ASSERT_EQUAL(-1, bmp_write(a, &gray));
+    gray.channels = 1;
+
+    for (size_t i = 0; i < 2; ++i)
+        remove(paths[i]);
+    image_destroy(&bgr);
+    image_destroy(&planar);
+    image_destroy(&gray);
+    free(img.buf);
+}
+
+/* runs pipe over src through a pipe to dest through another, as stdin
+ * and stdout would be */
+static int
+run_piped(const struct pipeline *pipe, const char *src, const char *dest,
+          size_t ceiling)
+{
+    char cmd[64];
+    snprintf(cmd, sizeof(cmd), "cat %s", src);
+    FILE *in = popen(cmd, "r");
+    snprintf(cmd, sizeof(cmd), "cat > %s", dest);
+    FILE *out = popen(cmd, "w");
+    struct imagefile *file = in ? imagefile_fopen(in) : NULL;
+    int res = file && out
+              ? stream_file(pipe, file, out, ceiling, NULL, NULL) : -1;
+    imagefile_close(file);
+    if ((in && pclose(in) != 0) || (out && pclose(out) != 0))
+        res = -1;
+    return res;
+}
+
+/* 1 if the files at a and b hold the same bytes */
+static int
+same_files(const char *a, const char *b)
+{
+    FILE *fa = fopen(a, "rb"), *fb = fopen(b, "rb");
+    int same = fa && fb;
+    while (same) {
+        const int ca = getc(fa), cb = getc(fb);
+        same = ca == cb;
+        if (ca == EOF)
+            break;
+    }
+    if (fa)
+        fclose(fa);
+    if (fb)
+        fclose(fb);
+    return same;
+}
+
+void test_stdio(void)
+{
+    enum { W = 37, H = 53 };
+    char src[] = "/tmp/imp-iosrc-XXXXXX", whole[] = "/tmp/imp-ioall-XXXXXX",
+         piped[] = "/tmp/imp-iopipe-XXXXXX";
+    char *paths[] = { src, whole, piped };
+    for (size_t i = 0; i < 3; ++i) {
+        int fd = mkstemp(paths[i]);
+        TEST_ASSERT_TRUE(fd >= 0);
+        close(fd);
+    }
+
+    /* neighbourhood stages, so bands share rows read once from the pipe */
+    struct pipeline *pipe = pipeline_create();
+    TEST_ASSERT_EQUAL(1, pipeline_add_invert(pipe));
+    TEST_ASSERT_EQUAL(1, pipeline_add_box_blur(pipe, W, 2));
+    TEST_ASSERT_EQUAL(1, pipeline_add_dither(pipe, 8, 2));
+    TEST_ASSERT_EQUAL(1, pipeline_add_box_blur(pipe, W, 1));
+    const size_t w = (W * 3 + 3) & ~(size_t)3;
+    const size_t ceiling = pipeline_scratch(pipe, w, 1)
+                           + 2 * 3 * w + STREAM_FRAMES * w * (2 * 3 + 2 * 4);
+
+    /* a ppm, its rows top first, and a bmp, bottom first, give what the
+     * mapped files give */
+    uint8_t pixels[W * H * 4];
+    for (size_t i = 0; i < sizeof(pixels); ++i)
+        pixels[i] = (uint8_t)((i * 29) ^ (i >> 4));
+    for (int format = 0; format < 2; ++format) {
+        if (format == 0)
+            TEST_ASSERT_EQUAL(1, write_file(src, "P6\n37 53\n255\n", pixels,
+                                            W * H * 3));
+        else
+            TEST_ASSERT_EQUAL(1, write_bmp24(src, W, H, pixels));
+        struct imagefile *file = imagefile_open(src);
+        TEST_ASSERT_NOT_NULL(file);
+        struct image32_t img = { malloc(w * H), w, H };
+        struct image32_t res = { malloc(w * H), w, H };
+        TEST_ASSERT_EQUAL(1, imagefile_read(file, &img));
+        TEST_ASSERT_EQUAL(1, pipeline_run(pipe, &img, &res, NULL));
+        TEST_ASSERT_EQUAL(1, imagefile_write(file, &res, whole));
+        imagefile_close(file);
+        free(img.buf);
+        free(res.buf);
+
+        TEST_ASSERT_EQUAL(1, run_piped(pipe, src, piped, ceiling));
+        TEST_ASSERT_TRUE(same_files(whole, piped));
+    }
+
+    /* a top-down 32 bit bmp goes out top-down, rows in the order read */
+    TEST_ASSERT_EQUAL(1, write_bmp(src, W, -H, 32, BMP_RGB, 40, NULL, 0,
+                                   pixels, W * 4));
+    struct imagefile *file = imagefile_open(src);
+    struct image32_t ref = { malloc(w * H), w, H };
+    struct image32_t got = { malloc(w * H), w, H };
+    TEST_ASSERT_EQUAL(1, imagefile_read(file, &got));
+    TEST_ASSERT_EQUAL(1, pipeline_run(pipe, &got, &ref, NULL));
+    imagefile_close(file);
+    TEST_ASSERT_EQUAL(1, run_piped(pipe, src, piped, ceiling));
+    struct bmp_map map;
+    TEST_ASSERT_EQUAL(1, bmp_map_open(&map, piped));
+    TEST_ASSERT_EQUAL(1, map.topdown);
+    TEST_ASSERT_EQUAL(24, map.bpp);
+    TEST_ASSERT_EQUAL(1, bmp_map_to32(&map, &got));
+    for (size_t y = 0; y < H; ++y)
+        for (size_t j = 0; j < W * 3; ++j)
+            TEST_ASSERT_EQUAL_UINT8(((uint8_t *)ref.buf)[y * w + (j ^ 3)],
+                                    ((uint8_t *)got.buf)[y * w + (j ^ 3)]);
+    bmp_map_close(&map);
+
+    /* the rows of a stream are read once, in order */
+    FILE *in = fopen(src, "rb");
+    TEST_ASSERT_NOT_NULL(in);
+    file = imagefile_fopen(in);
+    TEST_ASSERT_NOT_NULL(file);
+    TEST_ASSERT_EQUAL(1, imagefile_sequential(file));
+    TEST_ASSERT_EQUAL(1, imagefile_topfirst(file));
+    got.h = 2;
+    TEST_ASSERT_EQUAL(-1, imagefile_read_rows(file, 0, &got));
+    TEST_ASSERT_EQUAL(EINVAL, errno);
+    TEST_ASSERT_EQUAL(1, imagefile_read_rows(file, H - 2, &got));
+    TEST_ASSERT_EQUAL(-1, imagefile_read_rows(file, H - 2, &got));
+    imagefile_close(file);
+    fclose(in);
+
+    /* a top-down 24 bit bmp with a V5 header keeps it, 138 bytes, and its
+     * rows go after it, into a seekable output as into a pipe */
+    TEST_ASSERT_EQUAL(1, write_bmp(src, W, -H, 24, BMP_RGB, 124, NULL, 0,
+                                   pixels, w));
+    got.h = H;
+    file = imagefile_open(src);
+    TEST_ASSERT_EQUAL(1, imagefile_read(file, &got));
+    TEST_ASSERT_EQUAL(1, pipeline_run(pipe, &got, &ref, NULL));
+    imagefile_close(file);
+    for (int seekable = 1; seekable >= 0; --seekable) {
+        if (seekable) {
+            in = fopen(src, "rb");
+            FILE *out = fopen(piped, "wb");
+            TEST_ASSERT_NOT_NULL(in);
+            TEST_ASSERT_NOT_NULL(out);
+            file = imagefile_fopen(in);
+            TEST_ASSERT_EQUAL(1, stream_file(pipe, file, out, ceiling, NULL,
+                                             NULL));
+            imagefile_close(file);
+            fclose(in);
+            const int closed = fclose(out);
+            TEST_ASSERT_EQUAL(0, closed);
+        } else {
+            TEST_ASSERT_EQUAL(1, run_piped(pipe, src, piped, ceiling));
+        }
+        struct bmp_map srcmap;
+        TEST_ASSERT_EQUAL(1, bmp_map_open(&map, piped));
+        TEST_ASSERT_EQUAL(1, bmp_map_open(&srcmap, src));
+        TEST_ASSERT_EQUAL(138 + w * H, map.size);
+        TEST_ASSERT_EQUAL_MEMORY(srcmap.data, map.data, 138);
+        TEST_ASSERT_EQUAL(1, bmp_map_to32(&map, &got));
+        TEST_ASSERT_EQUAL_MEMORY(ref.buf, got.buf, w * H);
+        bmp_map_close(&srcmap);
+        bmp_map_close(&map);
+    }
+
+    pipeline_destroy(pipe);
+    for (size_t i = 0; i < 3; ++i)
+        remove(paths[i]);
+    free(ref.buf);
+    free(got.buf);
+}
+
+void test_pack(void)
+{
+    /* lengths that end in each kernel, from odd offsets into the buffers */
+    enum { N = 4 * 67 };
+    uint8_t file[N + 3], ref[N], back[N + 3];
+    int32_t words[N / 4 + 1], inplace[N / 4];
+    for (size_t i = 0; i < sizeof(file); ++i)
+        file[i] = (uint8_t)(i * 37 + 11);
+
+    const size_t sizes[] = { 4, 12, 16, 28, 64, 68, 124, N };
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(*sizes); ++s) {
+        for (size_t off = 0; off < 4; ++off) {
+            const size_t size = sizes[s];
+            for (size_t j = 0; j < size; ++j)
+                ref[j] = file[off + (j ^ 3)];
+            int32_t *dest = (int32_t *)((uint8_t *)words + off);
+            TEST_ASSERT_EQUAL((int)(size / 4),
+                              pack(dest, (int8_t *)file + off, size));
+            TEST_ASSERT_EQUAL_MEMORY(ref, dest, size);
+
+            memset(back, 0, sizeof(back));
+            TEST_ASSERT_EQUAL((int)size, unpack((int8_t *)back + off, dest,
+                                                size));
+            TEST_ASSERT_EQUAL_MEMORY(file + off, back + off, size);
+
+            memcpy(inplace, file + off, size);
+            TEST_ASSERT_EQUAL((int)(size / 4), pack_inplace(inplace, size));
+            TEST_ASSERT_EQUAL_MEMORY(ref, inplace, size);
+            TEST_ASSERT_EQUAL((int)size, unpack_inplace(inplace, size));
+            TEST_ASSERT_EQUAL_MEMORY(file + off, inplace, size);
+        }
+    }
+
+    TEST_ASSERT_EQUAL(0, pack(words, (int8_t *)file, 0));
+    TEST_ASSERT_EQUAL(0, unpack_inplace(words, 0));
+
+    /* a packed word holds the file bytes high to low */
+    const int8_t bgr[4] = { 0x10, 0x20, 0x30, 0x40 };
+    TEST_ASSERT_EQUAL(1, pack(words, (int8_t *)bgr, 4));
+    TEST_ASSERT_EQUAL_HEX32(0x10203040, (uint32_t)words[0]);
+}